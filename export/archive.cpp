@@ -9,6 +9,7 @@
 #include "unzip.h"
 #include "filesys.h"
 #include "archive.h"
+#include "metrics.h"
 
 namespace external
 {
@@ -167,12 +168,15 @@ namespace external
 			{
 				return 0;
 			}
+			EXT_TIMER(start);
 			unzFile file = unzOpen(strpath.c_str());
 			unzGoToFilePos(file, &(i->second.pos));
 			unzOpenCurrentFile(file);
 			int result = unzReadCurrentFile(file, output, len);
 			unzCloseCurrentFile(file);
 			unzClose(file);
+			EXT_ELAPSED("archive.read.ns", start);
+			EXT_COUNT("archive.inflated.bytes", result <= 0 ? 0 : result);
 			return result <= 0 ? 0 : (size_t)result;
 		}
 	};
@@ -0,0 +1,705 @@
+#define UTIL_CORE
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "rapidjson/reader.h"
+#include "rapidjson/memorystream.h"
+#include "rapidjson/error/en.h"
+#include "xxhash.h"
+#include "archive.h"
+#include "datatable.h"
+
+using namespace rapidjson;
+
+namespace
+{
+	typedef unsigned int u32;
+
+	const char MAGIC[4] = {'L', 'D', 'T', 1};
+
+	struct DTValue
+	{
+		u32 type;
+		u32 len;
+		union
+		{
+			double number;
+			u32 offset;
+		};
+	};
+
+	struct DTKey
+	{
+		u32 hash;
+		u32 len;
+		u32 offset;
+		u32 reserved;
+	};
+
+	struct DTHeader
+	{
+		char magic[4];
+		u32 size;
+		u32 strings;
+		u32 reserved;
+		DTValue root;
+	};
+
+	inline u32 hashkey(const char *str, u32 len)
+	{
+		return XXH32(str, (int)len, 0);
+	}
+}
+
+namespace external
+{
+	class DataTableWriter
+	{
+	protected:
+		struct Node
+		{
+			int type;
+			double number;
+			std::string str;
+			std::vector<std::string> keys;
+			std::vector<size_t> children;
+		};
+		struct Entry
+		{
+			u32 hash;
+			const std::string *key;
+			size_t child;
+			size_t order;
+			bool operator < (const Entry &other) const
+			{
+				if (hash != other.hash)
+					return hash < other.hash;
+				int cmp = key->compare(*other.key);
+				if (cmp != 0)
+					return cmp < 0;
+				return order < other.order;
+			}
+		};
+
+		std::vector<Node> nodes;
+		std::vector<size_t> stack;
+		bool hasroot;
+		bool dirty;
+		std::vector<char> image;
+		std::map<std::string, u32> strings;
+
+	protected:
+		bool attach(int type)
+		{
+			if (stack.empty())
+			{
+				if (hasroot)
+					return false;
+				hasroot = true;
+			}
+			else
+			{
+				Node &parent = nodes[stack.back()];
+				if (parent.type == DT_OBJECT && parent.keys.size() != parent.children.size() + 1)
+					return false;
+				parent.children.push_back(nodes.size());
+			}
+			nodes.push_back(Node());
+			nodes.back().type = type;
+			nodes.back().number = 0;
+			dirty = true;
+			return true;
+		}
+
+		void addstring(const std::string &str)
+		{
+			if (strings.find(str) == strings.end())
+			{
+				strings[str] = (u32)image.size();
+				image.insert(image.end(), str.begin(), str.end());
+				image.push_back(0);
+			}
+		}
+
+		size_t reserve(size_t len)
+		{
+			size_t offset = (image.size() + 7) & ~(size_t)7;
+			image.resize(offset + len);
+			return offset;
+		}
+
+		void emit(size_t index, size_t at)
+		{
+			const Node &node = nodes[index];
+			DTValue value;
+			memset(&value, 0, sizeof(value));
+			value.type = (u32)node.type;
+			switch (node.type)
+			{
+			case DT_NUMBER:
+				value.number = node.number;
+				break;
+			case DT_STRING:
+				value.len = (u32)node.str.length();
+				value.offset = strings[node.str];
+				break;
+			case DT_ARRAY:
+				{
+					size_t count = node.children.size();
+					size_t body = reserve(count * sizeof(DTValue));
+					value.len = (u32)count;
+					value.offset = (u32)body;
+					for (size_t i = 0; i < count; ++i)
+					{
+						emit(node.children[i], body + i * sizeof(DTValue));
+					}
+				}
+				break;
+			case DT_OBJECT:
+				{
+					std::vector<Entry> entries(node.children.size());
+					for (size_t i = 0; i < entries.size(); ++i)
+					{
+						entries[i].key = &node.keys[i];
+						entries[i].hash = hashkey(node.keys[i].c_str(), (u32)node.keys[i].length());
+						entries[i].child = node.children[i];
+						entries[i].order = i;
+					}
+					std::sort(entries.begin(), entries.end());
+					size_t count = 0;
+					for (size_t i = 0; i < entries.size(); ++i)
+					{
+						if (i + 1 < entries.size() && *entries[i].key == *entries[i + 1].key)
+							continue;
+						entries[count++] = entries[i];
+					}
+					entries.resize(count);
+					size_t body = reserve(count * (sizeof(DTKey) + sizeof(DTValue)));
+					value.len = (u32)count;
+					value.offset = (u32)body;
+					for (size_t i = 0; i < count; ++i)
+					{
+						DTKey key;
+						key.hash = entries[i].hash;
+						key.len = (u32)entries[i].key->length();
+						key.offset = strings[*entries[i].key];
+						key.reserved = 0;
+						memcpy(&image[body + i * sizeof(DTKey)], &key, sizeof(key));
+					}
+					body += count * sizeof(DTKey);
+					for (size_t i = 0; i < count; ++i)
+					{
+						emit(entries[i].child, body + i * sizeof(DTValue));
+					}
+				}
+				break;
+			}
+			memcpy(&image[at], &value, sizeof(value));
+		}
+
+		void build()
+		{
+			dirty = false;
+			image.clear();
+			strings.clear();
+			if (!hasroot || !stack.empty())
+				return;
+			image.resize(sizeof(DTHeader));
+			for (size_t i = 0; i < nodes.size(); ++i)
+			{
+				const Node &node = nodes[i];
+				if (node.type == DT_STRING)
+					addstring(node.str);
+				for (size_t j = 0; j < node.keys.size(); ++j)
+					addstring(node.keys[j]);
+			}
+			emit(0, offsetof(DTHeader, root));
+			DTHeader *header = (DTHeader *)&image[0];
+			memcpy(header->magic, MAGIC, sizeof(MAGIC));
+			header->size = (u32)image.size();
+			header->strings = (u32)sizeof(DTHeader);
+			header->reserved = 0;
+		}
+
+	public:
+		DataTableWriter() : hasroot(false), dirty(false)
+		{
+		}
+		void reset()
+		{
+			nodes.clear();
+			stack.clear();
+			hasroot = false;
+			dirty = false;
+			image.clear();
+			strings.clear();
+		}
+		size_t length()
+		{
+			if (dirty)
+				build();
+			return image.size();
+		}
+		size_t flush(char *output, size_t len)
+		{
+			size_t size = length();
+			if (size > len)
+				size = len;
+			if (size != 0)
+				memcpy(output, &image[0], size);
+			return size;
+		}
+		bool write_null()
+		{
+			return attach(DT_NIL);
+		}
+		bool write_bool(bool b)
+		{
+			return attach(b ? DT_TRUE : DT_FALSE);
+		}
+		bool write_double(double d)
+		{
+			if (!attach(DT_NUMBER))
+				return false;
+			nodes.back().number = d;
+			return true;
+		}
+		bool write_string(const char *str, size_t len)
+		{
+			if (!attach(DT_STRING))
+				return false;
+			nodes.back().str.assign(str, len);
+			return true;
+		}
+		bool write_newobject()
+		{
+			if (!attach(DT_OBJECT))
+				return false;
+			stack.push_back(nodes.size() - 1);
+			return true;
+		}
+		bool write_key(const char *str, size_t len)
+		{
+			if (stack.empty())
+				return false;
+			Node &node = nodes[stack.back()];
+			if (node.type != DT_OBJECT || node.keys.size() != node.children.size())
+				return false;
+			node.keys.push_back(std::string(str, len));
+			return true;
+		}
+		bool write_closeobject()
+		{
+			if (stack.empty())
+				return false;
+			Node &node = nodes[stack.back()];
+			if (node.type != DT_OBJECT || node.keys.size() != node.children.size())
+				return false;
+			stack.pop_back();
+			return true;
+		}
+		bool write_newarray()
+		{
+			if (!attach(DT_ARRAY))
+				return false;
+			stack.push_back(nodes.size() - 1);
+			return true;
+		}
+		bool write_closearray()
+		{
+			if (stack.empty() || nodes[stack.back()].type != DT_ARRAY)
+				return false;
+			stack.pop_back();
+			return true;
+		}
+	};
+
+	class DataTable
+	{
+	public:
+		const char *base;
+		size_t size;
+
+	public:
+		DataTable() : base(NULL), size(0) {}
+		virtual ~DataTable() {}
+
+		bool valid() const
+		{
+			if (base == NULL || size < sizeof(DTHeader))
+				return false;
+			const DTHeader *header = (const DTHeader *)base;
+			return memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 && header->size == size;
+		}
+
+		const DTValue * value(u32 offset) const
+		{
+			if (offset < sizeof(DTHeader) - sizeof(DTValue) || (size_t)offset + sizeof(DTValue) > size)
+				return NULL;
+			return (const DTValue *)(base + offset);
+		}
+
+		bool body(const DTValue *value, size_t element) const
+		{
+			return (size_t)value->offset + (size_t)value->len * element <= size;
+		}
+	};
+
+	class BufferDataTable : public DataTable
+	{
+	public:
+		BufferDataTable(void *buffer, size_t len)
+		{
+			base = (const char *)buffer;
+			size = len;
+		}
+		virtual ~BufferDataTable()
+		{
+			free((void *)base);
+		}
+	};
+
+	class MappedDataTable : public DataTable
+	{
+	public:
+		MappedDataTable(const char *path)
+		{
+#if defined(WIN32)
+			_mapping = NULL;
+			_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (_file == INVALID_HANDLE_VALUE)
+				return;
+			DWORD high = 0;
+			DWORD low = GetFileSize(_file, &high);
+			if (high != 0 || low == 0)
+				return;
+			_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (_mapping == NULL)
+				return;
+			base = (const char *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+			size = base == NULL ? 0 : low;
+#else
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0)
+				return;
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+			{
+				void *ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+				if (ptr != MAP_FAILED)
+				{
+					base = (const char *)ptr;
+					size = (size_t)st.st_size;
+				}
+			}
+			::close(fd);
+#endif
+		}
+		virtual ~MappedDataTable()
+		{
+#if defined(WIN32)
+			if (base != NULL)
+				UnmapViewOfFile(base);
+			if (_mapping != NULL)
+				CloseHandle(_mapping);
+			if (_file != INVALID_HANDLE_VALUE)
+				CloseHandle(_file);
+#else
+			if (base != NULL)
+				munmap((void *)base, size);
+#endif
+		}
+
+#if defined(WIN32)
+	private:
+		HANDLE _file;
+		HANDLE _mapping;
+#endif
+	};
+}
+
+namespace
+{
+	class WriterHandle
+	{
+	protected:
+		DataTableWriter &_writer;
+		std::vector<bool> _objects;
+
+	public:
+		WriterHandle(DataTableWriter &writer) : _writer(writer) {}
+		bool Null()
+		{
+			return _writer.write_null();
+		}
+		bool Bool(bool b)
+		{
+			return _writer.write_bool(b);
+		}
+		bool Int(int i)
+		{
+			return _writer.write_double(i);
+		}
+		bool Uint(unsigned u)
+		{
+			return _writer.write_double(u);
+		}
+		bool Double(double d)
+		{
+			return _writer.write_double(d);
+		}
+		bool String(const char* str, SizeType length, bool copy)
+		{
+			return _writer.write_string(str, length);
+		}
+		bool StartObject()
+		{
+			return _writer.write_newobject();
+		}
+		bool Key(const char* str, SizeType length, bool copy)
+		{
+			return _writer.write_key(str, length);
+		}
+		bool EndObject(SizeType memberCount)
+		{
+			return _writer.write_closeobject();
+		}
+		bool StartArray()
+		{
+			return _writer.write_newarray();
+		}
+		bool EndArray(SizeType elementCount)
+		{
+			return _writer.write_closearray();
+		}
+	};
+
+	DataTable * checked(DataTable *table)
+	{
+		if (!table->valid())
+		{
+			delete table;
+			return NULL;
+		}
+		return table;
+	}
+}
+
+DataTableWriter * ext_datatable_writer()
+{
+	return new DataTableWriter();
+}
+
+void ext_datatable_writer_close(DataTableWriter *writer)
+{
+	delete writer;
+}
+
+void ext_datatable_writer_reset(DataTableWriter *writer)
+{
+	writer->reset();
+}
+
+unsigned int ext_datatable_writer_length(DataTableWriter *writer)
+{
+	return (unsigned int)writer->length();
+}
+
+unsigned int ext_datatable_writer_flush(DataTableWriter *writer, char *output, unsigned int len)
+{
+	return (unsigned int)writer->flush(output, (size_t)len);
+}
+
+int ext_datatable_write_null(DataTableWriter *writer)
+{
+	return writer->write_null() ? 1 : 0;
+}
+
+int ext_datatable_write_bool(DataTableWriter *writer, int b)
+{
+	return writer->write_bool(b != 0) ? 1 : 0;
+}
+
+int ext_datatable_write_double(DataTableWriter *writer, double d)
+{
+	return writer->write_double(d) ? 1 : 0;
+}
+
+int ext_datatable_write_string(DataTableWriter *writer, const char *str, unsigned int len)
+{
+	return writer->write_string(str, (size_t)len) ? 1 : 0;
+}
+
+int ext_datatable_write_newobject(DataTableWriter *writer)
+{
+	return writer->write_newobject() ? 1 : 0;
+}
+
+int ext_datatable_write_key(DataTableWriter *writer, const char *str, unsigned int len)
+{
+	return writer->write_key(str, (size_t)len) ? 1 : 0;
+}
+
+int ext_datatable_write_closeobject(DataTableWriter *writer)
+{
+	return writer->write_closeobject() ? 1 : 0;
+}
+
+int ext_datatable_write_newarray(DataTableWriter *writer)
+{
+	return writer->write_newarray() ? 1 : 0;
+}
+
+int ext_datatable_write_closearray(DataTableWriter *writer)
+{
+	return writer->write_closearray() ? 1 : 0;
+}
+
+int ext_datatable_write_json(DataTableWriter *writer, const char *content, unsigned int len, const char **error)
+{
+	MemoryStream mstream(content, len);
+	Reader reader;
+	WriterHandle handle(*writer);
+	reader.Parse(mstream, handle);
+	if (reader.HasParseError())
+	{
+		if (error != NULL)
+			*error = GetParseError_En(reader.GetParseErrorCode());
+		return 0;
+	}
+	return 1;
+}
+
+DataTable * ext_datatable_open(const char *path)
+{
+	return checked(new MappedDataTable(path));
+}
+
+DataTable * ext_datatable_load(const void *input, unsigned int len)
+{
+	void *buffer = malloc(len == 0 ? 1 : len);
+	memcpy(buffer, input, len);
+	return checked(new BufferDataTable(buffer, len));
+}
+
+DataTable * ext_datatable_archive(Archive *file, const char *path)
+{
+	unsigned int len = ext_archive_length(file, path);
+	if (len == 0)
+		return NULL;
+	void *buffer = malloc(len);
+	len = ext_archive_read(file, path, buffer, len);
+	return checked(new BufferDataTable(buffer, len));
+}
+
+void ext_datatable_close(DataTable *table)
+{
+	delete table;
+}
+
+unsigned int ext_datatable_root(DataTable *table)
+{
+	return (unsigned int)offsetof(DTHeader, root);
+}
+
+int ext_datatable_type(DataTable *table, unsigned int value)
+{
+	const DTValue *v = table->value(value);
+	return v == NULL ? DT_NIL : (int)v->type;
+}
+
+unsigned int ext_datatable_count(DataTable *table, unsigned int value)
+{
+	const DTValue *v = table->value(value);
+	if (v == NULL || (v->type != DT_ARRAY && v->type != DT_OBJECT))
+		return 0;
+	return v->len;
+}
+
+double ext_datatable_tonumber(DataTable *table, unsigned int value)
+{
+	const DTValue *v = table->value(value);
+	return v == NULL || v->type != DT_NUMBER ? 0.0 : v->number;
+}
+
+const char * ext_datatable_tostring(DataTable *table, unsigned int value, unsigned int *len)
+{
+	const DTValue *v = table->value(value);
+	if (v == NULL || v->type != DT_STRING || !table->body(v, 1))
+		return NULL;
+	if (len != NULL)
+		*len = v->len;
+	return table->base + v->offset;
+}
+
+unsigned int ext_datatable_index(DataTable *table, unsigned int value, unsigned int N)
+{
+	const DTValue *v = table->value(value);
+	if (v == NULL || N >= v->len)
+		return 0;
+	switch (v->type)
+	{
+	case DT_ARRAY:
+		if (!table->body(v, sizeof(DTValue)))
+			return 0;
+		return v->offset + N * (u32)sizeof(DTValue);
+	case DT_OBJECT:
+		if (!table->body(v, sizeof(DTKey) + sizeof(DTValue)))
+			return 0;
+		return v->offset + v->len * (u32)sizeof(DTKey) + N * (u32)sizeof(DTValue);
+	default:
+		return 0;
+	}
+}
+
+unsigned int ext_datatable_field(DataTable *table, unsigned int value, const char *key, unsigned int len)
+{
+	const DTValue *v = table->value(value);
+	if (v == NULL || v->type != DT_OBJECT || !table->body(v, sizeof(DTKey) + sizeof(DTValue)))
+		return 0;
+	const DTKey *keys = (const DTKey *)(table->base + v->offset);
+	u32 hash = hashkey(key, len);
+	u32 low = 0, high = v->len;
+	while (low < high)
+	{
+		u32 mid = low + ((high - low) >> 1);
+		if (keys[mid].hash < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for (; low < v->len && keys[low].hash == hash; ++low)
+	{
+		if (keys[low].len == len && (size_t)keys[low].offset + len <= table->size
+			&& memcmp(table->base + keys[low].offset, key, len) == 0)
+		{
+			return v->offset + v->len * (u32)sizeof(DTKey) + low * (u32)sizeof(DTValue);
+		}
+	}
+	return 0;
+}
+
+const char * ext_datatable_key(DataTable *table, unsigned int value, unsigned int N, unsigned int *len)
+{
+	const DTValue *v = table->value(value);
+	if (v == NULL || v->type != DT_OBJECT || N >= v->len || !table->body(v, sizeof(DTKey) + sizeof(DTValue)))
+		return NULL;
+	const DTKey *key = (const DTKey *)(table->base + v->offset) + N;
+	if ((size_t)key->offset + key->len > table->size)
+		return NULL;
+	if (len != NULL)
+		*len = key->len;
+	return table->base + key->offset;
+}
@@ -8,6 +8,7 @@
 #include "rapidjson/prettywriter.h"
 #include "rapidjson/error/en.h"
 #include "json.h"
+#include "metrics.h"
 
 using namespace rapidjson;
 
@@ -249,7 +250,10 @@ int ext_json_parse(const char *content, unsigned int len, void *ud, int (*Null)(
 	MemoryStream mstream(content, len);
 	Reader reader;
     ExternalHandle handle = ExternalHandle(ud, handles);
+	EXT_TIMER(start);
 	reader.Parse(mstream, handle);
+	EXT_ELAPSED("json.parse.ns", start);
+	EXT_COUNT("json.parse.bytes", len);
 	if (reader.HasParseError())
 	{
 		int row = 1, column = 1;
@@ -0,0 +1,277 @@
+#define UTIL_CORE
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include "metrics.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#if defined(_MSC_VER)
+#define atomic_add(p, n)		InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(n))
+#define atomic_cas(p, o, n)		(InterlockedCompareExchange64((volatile LONGLONG *)(p), (LONGLONG)(n), (LONGLONG)(o)) == (LONGLONG)(o))
+#define atomic_casptr(p, o, n)	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o)) == (o))
+#else
+#define atomic_add(p, n)		__sync_fetch_and_add((p), (n))
+#define atomic_cas(p, o, n)		__sync_bool_compare_and_swap((p), (o), (n))
+#define atomic_casptr(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#endif
+/* 64-bit loads are not atomic everywhere */
+#define atomic_load(p)			atomic_add((p), 0)
+
+/* a histogram bucket covers 1/SUBBUCKETS of a power of two */
+#define SUBBITS		4
+#define SUBBUCKETS	(1 << SUBBITS)
+#define NBUCKETS	((64 - SUBBITS + 1) * SUBBUCKETS)
+
+struct ext_metric
+{
+	ext_metric *next;
+	int kind;
+	volatile i64 value;
+	/* histograms only */
+	volatile u64 sum;
+	volatile u64 min;
+	volatile u64 max;
+	volatile u64 *buckets;
+	char name[1];
+};
+
+namespace external
+{
+	static ext_metric * volatile registry = NULL;
+
+	static int log2of(u64 value)
+	{
+		int n = 0;
+		if (value >> 32) { n += 32; value >>= 32; }
+		if (value >> 16) { n += 16; value >>= 16; }
+		if (value >> 8) { n += 8; value >>= 8; }
+		if (value >> 4) { n += 4; value >>= 4; }
+		if (value >> 2) { n += 2; value >>= 2; }
+		if (value >> 1) { n += 1; }
+		return n;
+	}
+
+	static int bucketof(u64 value)
+	{
+		if (value < 2 * SUBBUCKETS)
+		{
+			return (int)value;
+		}
+		int shift = log2of(value) - SUBBITS;
+		return (shift << SUBBITS) + (int)(value >> shift);
+	}
+
+	/* largest value that falls in bucket `index' */
+	static u64 bucketmax(int index)
+	{
+		if (index < 2 * SUBBUCKETS)
+		{
+			return (u64)index;
+		}
+		int shift = (index >> SUBBITS) - 1;
+		u64 low = (u64)((index & (SUBBUCKETS - 1)) + SUBBUCKETS) << shift;
+		return low + (((u64)1 << shift) - 1);
+	}
+
+	static ext_metric * newmetric(const char *name, int kind)
+	{
+		size_t len = strlen(name);
+		ext_metric *metric = (ext_metric *)malloc(offsetof(ext_metric, name) + len + 1);
+		if (metric == NULL)
+		{
+			return NULL;
+		}
+		metric->next = NULL;
+		metric->kind = kind;
+		metric->value = 0;
+		metric->sum = 0;
+		metric->min = ~(u64)0;
+		metric->max = 0;
+		metric->buckets = NULL;
+		if (kind == EXT_HISTOGRAM)
+		{
+			metric->buckets = (volatile u64 *)calloc(NBUCKETS, sizeof(u64));
+			if (metric->buckets == NULL)
+			{
+				free(metric);
+				return NULL;
+			}
+		}
+		memcpy(metric->name, name, len + 1);
+		return metric;
+	}
+
+	static void freemetric(ext_metric *metric)
+	{
+		if (metric != NULL)
+		{
+			free((void *)metric->buckets);
+			free(metric);
+		}
+	}
+}
+
+using namespace external;
+
+ext_metric * ext_metrics_get(const char *name, int kind)
+{
+	ext_metric *created = NULL;
+	for (;;)
+	{
+		ext_metric *head = registry;
+		for (ext_metric *metric = head; metric != NULL; metric = metric->next)
+		{
+			if (strcmp(metric->name, name) == 0)
+			{
+				freemetric(created);
+				return metric->kind == kind ? metric : NULL;
+			}
+		}
+		if (created == NULL)
+		{
+			created = newmetric(name, kind);
+			if (created == NULL)
+			{
+				return NULL;
+			}
+		}
+		/* nobody registered anything since the scan: the name is still new */
+		created->next = head;
+		if (atomic_casptr(&registry, head, created))
+		{
+			return created;
+		}
+	}
+}
+
+void ext_metrics_add(ext_metric *metric, i64 n)
+{
+	if (metric != NULL && metric->kind != EXT_HISTOGRAM)
+	{
+		atomic_add(&(metric->value), n);
+	}
+}
+
+void ext_metrics_set(ext_metric *metric, i64 value)
+{
+	if (metric != NULL && metric->kind == EXT_GAUGE)
+	{
+		i64 old;
+		do
+		{
+			old = metric->value;
+		} while (!atomic_cas(&(metric->value), old, value));
+	}
+}
+
+void ext_metrics_record(ext_metric *metric, u64 value)
+{
+	if (metric == NULL || metric->kind != EXT_HISTOGRAM)
+	{
+		return;
+	}
+	atomic_add(&(metric->buckets[bucketof(value)]), 1);
+	atomic_add(&(metric->sum), value);
+	atomic_add(&(metric->value), 1);
+	u64 old;
+	while (value < (old = metric->min) && !atomic_cas(&(metric->min), old, value))
+		;
+	while (value > (old = metric->max) && !atomic_cas(&(metric->max), old, value))
+		;
+}
+
+u64 ext_metrics_clock(void)
+{
+	unsigned long sec, nsec;
+	lua_clock(&sec, &nsec);
+	return (u64)sec * 1000000000 + (u64)nsec;
+}
+
+ext_metric * ext_metrics_next(ext_metric *metric)
+{
+	return metric == NULL ? registry : metric->next;
+}
+
+const char * ext_metrics_name(ext_metric *metric)
+{
+	return metric->name;
+}
+
+int ext_metrics_kind(ext_metric *metric)
+{
+	return metric->kind;
+}
+
+i64 ext_metrics_value(ext_metric *metric)
+{
+	return atomic_load(&(metric->value));
+}
+
+void ext_metrics_histogram(ext_metric *metric, ext_histogram *output)
+{
+	output->count = (u64)atomic_load(&(metric->value));
+	output->sum = output->count == 0 ? 0 : atomic_load(&(metric->sum));
+	output->min = output->count == 0 ? 0 : atomic_load(&(metric->min));
+	output->max = output->count == 0 ? 0 : atomic_load(&(metric->max));
+}
+
+u64 ext_metrics_percentile(ext_metric *metric, double p)
+{
+	if (metric->kind != EXT_HISTOGRAM)
+	{
+		return 0;
+	}
+	u64 counts[NBUCKETS];
+	u64 total = 0;
+	for (int i = 0; i < NBUCKETS; ++i)
+	{
+		counts[i] = atomic_load(&(metric->buckets[i]));
+		total += counts[i];
+	}
+	if (total == 0)
+	{
+		return 0;
+	}
+	double rank = p / 100 * (double)total;
+	u64 seen = 0;
+	int i = 0;
+	for (; i < NBUCKETS - 1; ++i)
+	{
+		seen += counts[i];
+		if (seen > 0 && (double)seen >= rank)
+			break;
+	}
+	u64 value = bucketmax(i);
+	u64 min = atomic_load(&(metric->min)), max = atomic_load(&(metric->max));
+	return value < min ? min : (value > max ? max : value);
+}
+
+void ext_metrics_reset(ext_metric *metric)
+{
+	if (metric == NULL)
+	{
+		for (metric = registry; metric != NULL; metric = metric->next)
+		{
+			ext_metrics_reset(metric);
+		}
+		return;
+	}
+	if (metric->kind == EXT_GAUGE)
+	{
+		return;
+	}
+	if (metric->kind == EXT_HISTOGRAM)
+	{
+		for (int i = 0; i < NBUCKETS; ++i)
+		{
+			metric->buckets[i] = 0;
+		}
+		metric->sum = 0;
+		metric->min = ~(u64)0;
+		metric->max = 0;
+	}
+	metric->value = 0;
+}
@@ -1,6 +1,8 @@
 #define UTIL_CORE
 #include "sqlite3.h"
 #include "sqlite.h"
+#include "metrics.h"
+#include "trace.h"
 #include <set>
 #include <vector>
 #include <string>
@@ -400,9 +402,14 @@ SQLiteRecord * ext_sqlite_step(SQLiteStmt *stmt)
 	{
 		return NULL;
 	}
+	EXT_TIMER(start);
+	EXT_SPAN("sqlite", "step");
 	int result = sqlite3_step(stmt->stmt);
+	EXT_SPAN_END("step");
+	EXT_ELAPSED("sqlite.step.ns", start);
 	if (result == SQLITE_ROW)
 	{
+		EXT_COUNT("sqlite.rows", 1);
 		return &(stmt->record);
 	}
 	if (result == SQLITE_OK || result == SQLITE_DONE)
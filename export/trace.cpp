@@ -0,0 +1,266 @@
+#define UTIL_CORE
+#include <cstdlib>
+#include <cstring>
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "metrics.h"
+#include "trace.h"
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#define THREADLOCAL				__declspec(thread)
+#define atomic_inc(p)			InterlockedIncrement((volatile LONG *)(p))
+#define atomic_casptr(p, o, n)	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o)) == (o))
+#else
+#define THREADLOCAL				__thread
+#define atomic_inc(p)			__sync_add_and_fetch((p), 1)
+#define atomic_casptr(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
+#define NAMELEN		48
+#define MAXDEPTH	64
+#define FLUSHSIZE	65536
+
+using namespace rapidjson;
+
+namespace external
+{
+	struct TraceSpan
+	{
+		const char *category;
+		char name[NAMELEN];
+		u64 start;
+		u64 duration;
+		bool aborted;
+	};
+
+	struct TraceThread
+	{
+		TraceThread *next;
+		void * volatile owner;	/* `self' of the thread using it; NULL if free */
+		int tid;
+		unsigned int session;
+		unsigned int capacity;
+		TraceSpan *spans;
+		u64 head;	/* spans recorded */
+		u64 tail;	/* spans flushed */
+		int depth;
+		TraceSpan open[MAXDEPTH];
+	};
+
+	static TraceThread * volatile threads = NULL;
+	static volatile int active = 0;
+	static volatile unsigned int session = 0;
+	static unsigned int capacity = 0;
+	static u64 origin = 0;
+	static volatile long nextid = 0;
+	static THREADLOCAL TraceThread *current = NULL;
+	static THREADLOCAL char self;	/* its address tells threads apart */
+
+	/* a free record, or a new one; records are never unlinked */
+	static TraceThread * claim()
+	{
+		TraceThread *thread;
+		for (thread = threads; thread != NULL; thread = thread->next)
+		{
+			if (thread->owner == NULL && atomic_casptr(&thread->owner, NULL, (void *)&self))
+			{
+				return thread;
+			}
+		}
+		thread = (TraceThread *)calloc(1, sizeof(TraceThread));
+		if (thread == NULL)
+		{
+			return NULL;
+		}
+		thread->owner = &self;
+		thread->tid = (int)atomic_inc(&nextid);
+		do
+		{
+			thread->next = threads;
+		} while (!atomic_casptr(&threads, thread->next, thread));
+		return thread;
+	}
+
+	/* ring of the calling thread, set up for the current session */
+	static TraceThread * thisthread()
+	{
+		TraceThread *thread = current;
+		if (thread == NULL || thread->owner != &self)
+		{
+			thread = claim();
+			if (thread == NULL)
+			{
+				return NULL;
+			}
+			current = thread;
+		}
+		if (thread->session != session)
+		{
+			if (thread->capacity != capacity)
+			{
+				free(thread->spans);
+				thread->spans = (TraceSpan *)malloc(capacity * sizeof(TraceSpan));
+				thread->capacity = thread->spans != NULL ? capacity : 0;
+			}
+			thread->head = thread->tail = 0;
+			thread->depth = 0;
+			thread->session = session;
+		}
+		return thread->capacity != 0 ? thread : NULL;
+	}
+}
+
+using namespace external;
+
+void ext_trace_start(unsigned int size)
+{
+	active = 0;
+	capacity = size != 0 ? size : 65536;
+	origin = ext_metrics_clock();
+	++session;
+	active = 1;
+}
+
+void ext_trace_stop(void)
+{
+	active = 0;
+}
+
+int ext_trace_active(void)
+{
+	return active;
+}
+
+void ext_trace_begin(const char *category, const char *name)
+{
+	if (!active)
+	{
+		return;
+	}
+	TraceThread *thread = thisthread();
+	if (thread == NULL)
+	{
+		return;
+	}
+	if (thread->depth == MAXDEPTH)
+	{
+		/* drop the outermost span, most likely one an error left open */
+		memmove(thread->open, thread->open + 1, (MAXDEPTH - 1) * sizeof(TraceSpan));
+		--thread->depth;
+	}
+	TraceSpan *span = &(thread->open[thread->depth++]);
+	span->category = category;
+	strncpy(span->name, name, NAMELEN - 1);
+	span->name[NAMELEN - 1] = 0;
+	span->aborted = false;
+	span->start = ext_metrics_clock();
+}
+
+void ext_trace_end(const char *name)
+{
+	if (!active)
+	{
+		return;
+	}
+	TraceThread *thread = thisthread();
+	if (thread == NULL || thread->depth == 0)
+	{
+		return;
+	}
+	int i = thread->depth - 1;
+	while (i >= 0 && strncmp(thread->open[i].name, name, NAMELEN - 1) != 0)
+	{
+		--i;
+	}
+	if (i < 0)
+	{
+		return;
+	}
+	/* close it, and the spans an error left open inside it */
+	u64 now = ext_metrics_clock();
+	while (thread->depth > i)
+	{
+		TraceSpan *span = &(thread->open[--thread->depth]);
+		span->duration = now - span->start;
+		span->aborted = thread->depth != i;
+		thread->spans[thread->head % thread->capacity] = *span;
+		++thread->head;
+	}
+}
+
+size_t ext_trace_flush(void (*write)(void *ud, const char *data, size_t len), void *ud)
+{
+	StringBuffer buffer;
+	Writer<StringBuffer> writer(buffer);
+	size_t count = 0;
+	writer.StartObject();
+	writer.Key("traceEvents");
+	writer.StartArray();
+	for (TraceThread *thread = threads; thread != NULL; thread = thread->next)
+	{
+		if (thread->session != session || thread->capacity == 0)
+		{
+			continue;
+		}
+		u64 head = thread->head;
+		u64 tail = thread->tail;
+		if (head - tail > thread->capacity)
+		{
+			tail = head - thread->capacity;
+		}
+		for (; tail < head; ++tail)
+		{
+			const TraceSpan &span = thread->spans[tail % thread->capacity];
+			writer.StartObject();
+			writer.Key("name");
+			writer.String(span.name);
+			writer.Key("cat");
+			writer.String(span.category);
+			writer.Key("ph");
+			writer.String("X");
+			writer.Key("ts");
+			writer.Double((double)(span.start - origin) / 1000);
+			writer.Key("dur");
+			writer.Double((double)span.duration / 1000);
+			writer.Key("pid");
+			writer.Int(1);
+			writer.Key("tid");
+			writer.Int(thread->tid);
+			if (span.aborted)
+			{
+				writer.Key("args");
+				writer.StartObject();
+				writer.Key("aborted");
+				writer.Bool(true);
+				writer.EndObject();
+			}
+			writer.EndObject();
+			++count;
+			if (buffer.GetSize() >= FLUSHSIZE)
+			{
+				write(ud, buffer.GetString(), buffer.GetSize());
+				buffer.Clear();
+			}
+		}
+		thread->tail = head;
+	}
+	writer.EndArray();
+	writer.Key("displayTimeUnit");
+	writer.String("ms");
+	writer.EndObject();
+	write(ud, buffer.GetString(), buffer.GetSize());
+	if (!active)
+	{
+		/* stopped and drained: free the rings and let any thread take the records */
+		for (TraceThread *thread = threads; thread != NULL; thread = thread->next)
+		{
+			free(thread->spans);
+			thread->spans = NULL;
+			thread->capacity = 0;
+			thread->session = 0;
+			thread->owner = NULL;
+		}
+	}
+	return count;
+}
@@ -1,6 +1,8 @@
 #define UTIL_CORE
 #include "handle.h"
 #include "rc4.h"
+#include "metrics.h"
+#include "trace.h"
 
 namespace external
 {
@@ -26,7 +28,9 @@ namespace external
 	{
 		if (_file == NULL)
 			return 0;
-		return fread(output, 1, len, _file);
+		len = fread(output, 1, len, _file);
+		EXT_COUNT("filesys.read.bytes", len);
+		return len;
 	}
 
 	CompressHandle::CompressHandle(FileHandle *handle)
@@ -47,6 +51,7 @@ namespace external
 
 	size_t CompressHandle::read(void *output, size_t len)
 	{
+		EXT_SPAN("io", "inflate");
 		size_t offset = 0;
 		while (offset != len)
 		{
@@ -67,6 +72,8 @@ namespace external
 				break;
 			}
 		}
+		EXT_COUNT("filesys.inflated.bytes", offset);
+		EXT_SPAN_END("inflate");
 		return offset;
 	}
 
@@ -89,6 +96,7 @@ namespace external
 	size_t ArchiveHandle::read(void *output, size_t len)
 	{
 		int result = unzReadCurrentFile(_file, output, len);
+		EXT_COUNT("archive.inflated.bytes", result <= 0 ? 0 : result);
 		return result <= 0 ? 0 : (size_t)result;
 	}
 
@@ -107,6 +115,7 @@ namespace external
 	{
 		len = _handle->read(output, len);
 		ext_rc4_encode(_key, output, output, (unsigned int)len);
+		EXT_COUNT("rc4.decrypted.bytes", len);
 		return len;
 	}
 }
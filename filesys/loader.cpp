@@ -5,6 +5,7 @@
 #include "handle.h"
 #include "filesys.h"
 #include "sstr.h"
+#include "trace.h"
 
 namespace external
 {
@@ -122,12 +123,19 @@ namespace external
 
 	FileHandle * ZipFileLoader::open(const char *path)
 	{
+		FileHandle *handle;
+		EXT_SPAN("zip", path);
 		std::map<unsigned int, FileInfo>::iterator i = files.find(ext_fnv(path));
 		if (i != files.end())
 		{
-			return new ArchiveHandle(strpath.c_str(), i->second.pos);
+			handle = new ArchiveHandle(strpath.c_str(), i->second.pos);
 		}
-		return new EmptyFileHandle();
+		else
+		{
+			handle = new EmptyFileHandle();
+		}
+		EXT_SPAN_END(path);
+		return handle;
 	}
 
 	sstr * ZipFileLoader::path(const char *str)
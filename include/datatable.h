@@ -0,0 +1,63 @@
+#ifndef __DATATABLE__
+#define __DATATABLE__
+
+#include "config.h"
+
+namespace external
+{
+	class Archive;
+	class DataTable;
+	class DataTableWriter;
+
+	enum
+	{
+		DT_NIL = 0,
+		DT_FALSE,
+		DT_TRUE,
+		DT_NUMBER,
+		DT_STRING,
+		DT_ARRAY,
+		DT_OBJECT,
+	};
+}
+
+using namespace external;
+
+/*
+	Binary read-only table image.
+
+	A DataTable is a single contiguous block (mapped file or owned buffer)
+	and every value inside it is addressed by its byte offset.  Nothing is
+	decoded on open; lookups binary search the sorted key hashes of an
+	object and strings are returned as pointers into the block.
+ */
+EXPORTS DataTableWriter *	ext_datatable_writer();
+EXPORTS void				ext_datatable_writer_close(DataTableWriter *writer);
+EXPORTS void				ext_datatable_writer_reset(DataTableWriter *writer);
+EXPORTS unsigned int		ext_datatable_writer_length(DataTableWriter *writer);
+EXPORTS unsigned int		ext_datatable_writer_flush(DataTableWriter *writer, char *output, unsigned int len);
+EXPORTS int					ext_datatable_write_null(DataTableWriter *writer);
+EXPORTS int					ext_datatable_write_bool(DataTableWriter *writer, int b);
+EXPORTS int					ext_datatable_write_double(DataTableWriter *writer, double d);
+EXPORTS int					ext_datatable_write_string(DataTableWriter *writer, const char *str, unsigned int len);
+EXPORTS int					ext_datatable_write_newobject(DataTableWriter *writer);
+EXPORTS int					ext_datatable_write_key(DataTableWriter *writer, const char *str, unsigned int len);
+EXPORTS int					ext_datatable_write_closeobject(DataTableWriter *writer);
+EXPORTS int					ext_datatable_write_newarray(DataTableWriter *writer);
+EXPORTS int					ext_datatable_write_closearray(DataTableWriter *writer);
+EXPORTS int					ext_datatable_write_json(DataTableWriter *writer, const char *content, unsigned int len, const char **error);
+
+EXPORTS DataTable *			ext_datatable_open(const char *path);
+EXPORTS DataTable *			ext_datatable_load(const void *input, unsigned int len);
+EXPORTS DataTable *			ext_datatable_archive(Archive *file, const char *path);
+EXPORTS void				ext_datatable_close(DataTable *table);
+EXPORTS unsigned int		ext_datatable_root(DataTable *table);
+EXPORTS int					ext_datatable_type(DataTable *table, unsigned int value);
+EXPORTS unsigned int		ext_datatable_count(DataTable *table, unsigned int value);
+EXPORTS double				ext_datatable_tonumber(DataTable *table, unsigned int value);
+EXPORTS const char *		ext_datatable_tostring(DataTable *table, unsigned int value, unsigned int *len);
+EXPORTS unsigned int		ext_datatable_index(DataTable *table, unsigned int value, unsigned int N);
+EXPORTS unsigned int		ext_datatable_field(DataTable *table, unsigned int value, const char *key, unsigned int len);
+EXPORTS const char *		ext_datatable_key(DataTable *table, unsigned int value, unsigned int N, unsigned int *len);
+
+#endif // __DATATABLE__
@@ -61,6 +61,14 @@ typedef int (*lua_Writer) (lua_State *L, const void* p, size_t sz, void* ud);
 typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 
 
+/*
+** prototype for allocation trackers: called with the type and size of
+** a sampled allocation, returns the number of bytes until the next one
+*/
+typedef size_t (*lua_AllocTrack) (lua_State *L, void *ud, int type,
+                                  size_t size);
+
+
 /*
 ** basic types
 */
@@ -104,12 +112,14 @@ typedef LUA_INTEGER lua_Integer;
 */
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
 LUA_API lua_State *(lua_host) (lua_State *L);
+LUA_API lua_State *(lua_current) (lua_State *L);
 LUA_API void      *(lua_getrefers) (lua_State *L);
 LUA_API void       (lua_setrefers) (lua_State *L, void *custom);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
 
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
+LUA_API int        (lua_setlazyparse) (lua_State *L, int on);
 
 
 /*
@@ -203,6 +213,12 @@ LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                                         const char *chunkname);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
+LUA_API int (lua_dumpx) (lua_State *L, lua_Writer writer, void *data,
+                                       int flags);
+
+/* flags for `lua_dumpx' */
+#define LUA_DUMPSTRIP		1	/* leave out debug information */
+#define LUA_DUMPOPTIMIZE	2	/* run the bytecode optimizer */
 
 
 /*
@@ -212,6 +228,17 @@ LUA_API int  (lua_yield) (lua_State *L, int nresults);
 LUA_API int  (lua_resume) (lua_State *L, int narg);
 LUA_API int  (lua_status) (lua_State *L);
 
+/*
+** execution budgets
+*/
+#define LUA_BUDGETERROR	0	/* raise an error when the budget runs out */
+#define LUA_BUDGETYIELD	1	/* yield (preempt the coroutine) instead */
+
+LUA_API void (lua_setbudget) (lua_State *L, lua_Number count,
+                                            lua_Number seconds, int mode);
+LUA_API int (lua_getbudget) (lua_State *L, lua_Number *count,
+                                           lua_Number *seconds);
+
 /*
 ** garbage-collection function and options
 */
@@ -224,6 +251,12 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSTEP		5
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
+#define LUA_GCSETDEFER		8
+#define LUA_GCFLUSH		9
+#define LUA_GCSETSOFTLIMIT	10
+#define LUA_GCSETHARDLIMIT	11
+#define LUA_GCSOFTHITS		12
+#define LUA_GCHARDHITS		13
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -235,11 +268,18 @@ LUA_API int (lua_gc) (lua_State *L, int what, int data);
 LUA_API int   (lua_error) (lua_State *L);
 
 LUA_API int   (lua_next) (lua_State *L, int idx);
+LUA_API int   (lua_nextindex) (lua_State *L, int idx, int i);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
 
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud);
+LUA_API lua_AllocTrack (lua_getalloctrack) (lua_State *L, void **ud);
+LUA_API void (lua_setalloctrack) (lua_State *L, lua_AllocTrack f, void *ud,
+                                  size_t first);
+LUA_API int (lua_heapsnapshot) (lua_State *L, lua_Writer writer, void *data);
+LUA_API int (lua_vmstats) (lua_State *L, int reset);
+LUA_API void (lua_clock) (unsigned long *sec, unsigned long *nsec);
 
 
 
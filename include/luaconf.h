@@ -215,6 +215,35 @@
 #endif
 
 
+/*
+@@ LUAI_VMSTATS makes the interpreter count the opcodes and opcode
+@* pairs it executes, the paths table accesses take and the kinds of
+@* functions called (see lua_vmstats).
+** CHANGE it (define it) only in builds made to measure the VM: it
+** slows down every instruction.
+*/
+// #define LUAI_VMSTATS
+
+
+/*
+@@ LUA_USE_METRICS makes the collector and the native modules feed
+@* the metrics registry (see metrics.h): sqlite, archive, json, rc4
+@* and file system throughput and latency, and collector work.
+** CHANGE it (define it) if the host scrapes those metrics; otherwise
+** the instrumentation compiles to nothing.
+*/
+// #define LUA_USE_METRICS
+
+
+/*
+@@ LUA_USE_TRACE places trace spans (see trace.h) around require,
+@* zip opens, inflates and sqlite steps.
+** CHANGE it (define it) to see those in timelines; until tracing is
+** started a span costs a call and a test, and none are compiled without it.
+*/
+// #define LUA_USE_TRACE
+
+
 /*
 @@ LUAI_BITSINT defines the number of bits in an int.
 ** CHANGE here if Lua cannot automatically detect the number of bits of
@@ -357,6 +386,21 @@
 #define LUAI_MAXNUMBER2STR	32 /* 16 digits, sign, point, and \0 */
 #define lua_str2number(s,p)	strtod((s), (p))
 
+/*
+@@ LUA_FASTNUMBER lets the core convert numbers with its own routines
+@* (Grisu2 for writing, Clinger's fast path for reading) before falling
+@* back to lua_number2str/lua_str2number.
+** The fast routines only handle the cases where their result is known
+** to be identical to the libc one, so LUA_NUMBER_FMT semantics are kept.
+** CHANGE it (undefine it) if your lua_Number is not an IEEE double or
+** your compiler evaluates doubles with extended precision.
+*/
+#if defined(LUA_NUMBER_DOUBLE) && !defined(LUA_ANSI) && \
+    (!(defined(__i386) || defined(_M_IX86) || defined(__i386__)) || \
+     defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LUA_FASTNUMBER
+#endif
+
 
 /*
 @@ The luai_num* macros define the primitive operations over numbers.
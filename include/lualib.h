@@ -31,15 +31,30 @@ LUALIB_API int (luaopen_string) (lua_State *L);
 #define LUA_MATHLIBNAME	"math"
 LUALIB_API int (luaopen_math) (lua_State *L);
 
+#define LUA_TEXTLIBNAME	"text"
+LUALIB_API int (luaopen_text) (lua_State *L);
+
 #define LUA_BITLIBNAME	"bit"
 LUALIB_API int (luaopen_bit) (lua_State *L);
 
 #define LUA_PEGLIBNAME	"peg"
 LUALIB_API int (luaopen_peg) (lua_State *L);
 
+#define LUA_TIMERLIBNAME	"timer"
+LUALIB_API int (luaopen_timer) (lua_State *L);
+
 #define LUA_DBLIBNAME	"debug"
 LUALIB_API int (luaopen_debug) (lua_State *L);
 
+#define LUA_PROFLIBNAME	"profile"
+LUALIB_API int (luaopen_profile) (lua_State *L);
+LUALIB_API int (luaL_profstart) (lua_State *L, int hz);
+LUALIB_API void (luaL_profstop) (lua_State *L);
+LUALIB_API void (luaL_profreset) (lua_State *L);
+LUALIB_API void (luaL_profdump) (lua_State *L);
+LUALIB_API int (luaL_allocstart) (lua_State *L, size_t rate);
+LUALIB_API void (luaL_allocstop) (lua_State *L);
+
 
 /* open all previous libraries */
 LUALIB_API void (luaL_initlibs) (lua_State *L);
@@ -0,0 +1,90 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+/**
+	@file
+	@brief		Process-wide counters, gauges and histograms
+
+	Metrics are registered by name on first use and live until the process
+	exits; updating one is lock-free and safe from any thread.  Histograms
+	keep log-linear buckets (16 per power of two, so about 6% precision)
+	over the whole range of non-negative 64-bit values.
+
+	Modules update metrics through the EXT_COUNT, EXT_GAUGE, EXT_RECORD and
+	EXT_TIMER/EXT_ELAPSED macros, which look the metric up once per call
+	site and compile to nothing unless LUA_USE_METRICS is defined.
+ */
+
+#include "lua.h"
+#include "config.h"
+
+typedef struct ext_metric ext_metric;
+
+enum
+{
+	EXT_COUNTER,
+	EXT_GAUGE,
+	EXT_HISTOGRAM
+};
+
+typedef struct ext_histogram
+{
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+} ext_histogram;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* find the metric called `name', registering it with `kind' if new; NULL if it has another kind */
+EXPORTS ext_metric *	ext_metrics_get(const char *name, int kind);
+EXPORTS void			ext_metrics_add(ext_metric *metric, i64 n);
+EXPORTS void			ext_metrics_set(ext_metric *metric, i64 value);
+EXPORTS void			ext_metrics_record(ext_metric *metric, u64 value);
+/* monotonic clock (lua_clock), in nanoseconds */
+EXPORTS u64				ext_metrics_clock(void);
+
+/* iterate over the registry: pass NULL for the first metric */
+EXPORTS ext_metric *	ext_metrics_next(ext_metric *metric);
+EXPORTS const char *	ext_metrics_name(ext_metric *metric);
+EXPORTS int				ext_metrics_kind(ext_metric *metric);
+/* value of a counter or gauge, or number of values of a histogram */
+EXPORTS i64				ext_metrics_value(ext_metric *metric);
+EXPORTS void			ext_metrics_histogram(ext_metric *metric, ext_histogram *output);
+/* smallest recorded value not exceeded by `p' percent of a histogram's values */
+EXPORTS u64				ext_metrics_percentile(ext_metric *metric, double p);
+/* zero a counter or histogram, or all of them if `metric' is NULL; gauges keep their value */
+EXPORTS void			ext_metrics_reset(ext_metric *metric);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(LUA_USE_METRICS)
+
+#define EXT_METRIC_(kind, name, update)	do { \
+	static ext_metric *metric_ = NULL; \
+	if (metric_ == NULL) metric_ = ext_metrics_get(name, kind); \
+	update; } while (0)
+
+#define EXT_COUNT(name, n)		EXT_METRIC_(EXT_COUNTER, name, ext_metrics_add(metric_, (i64)(n)))
+#define EXT_GAUGE(name, v)		EXT_METRIC_(EXT_GAUGE, name, ext_metrics_set(metric_, (i64)(v)))
+#define EXT_RECORD(name, v)		EXT_METRIC_(EXT_HISTOGRAM, name, ext_metrics_record(metric_, (u64)(v)))
+/* declare `t' holding the current time; EXT_ELAPSED records the nanoseconds since */
+#define EXT_TIMER(t)			u64 t = ext_metrics_clock()
+#define EXT_ELAPSED(name, t)	EXT_RECORD(name, ext_metrics_clock() - (t))
+
+#else
+
+#define EXT_COUNT(name, n)		((void)0)
+#define EXT_GAUGE(name, v)		((void)0)
+#define EXT_RECORD(name, v)		((void)0)
+#define EXT_TIMER(t)
+#define EXT_ELAPSED(name, t)	((void)0)
+
+#endif
+
+#endif // __METRICS__
@@ -0,0 +1,57 @@
+#ifndef __TRACE__
+#define __TRACE__
+
+/**
+	@file
+	@brief		Span recording in the Chrome trace-event format
+
+	While tracing is on, every thread records the spans it closes into a ring
+	buffer of its own, so recording takes no lock and a busy thread only
+	overwrites its own oldest spans.  ext_trace_flush writes what the rings
+	hold as trace-event JSON (chrome://tracing, Perfetto) and empties them;
+	call it while the traced threads are idle.
+
+	Each thread that records keeps a ring of `capacity' spans of about 80
+	bytes (5 MB at the default 65536) and a 5 KB record of its open spans,
+	even after it exits.  A flush after ext_trace_stop frees the rings and
+	hands the records to whichever threads record next, so threads that came
+	and went cost nothing more.
+
+	Spans close by name, so a span left open by an error is closed (and
+	marked aborted) when an enclosing span ends.  Only the 64 innermost open
+	spans are kept, so one left open with no enclosing span is eventually
+	dropped unrecorded.  Names are copied; categories must be static strings.
+	The EXT_SPAN/EXT_SPAN_END macros compile to nothing unless LUA_USE_TRACE
+	is defined.
+ */
+
+#include <stddef.h>
+#include "lua.h"
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* start recording, keeping the last `capacity' spans of each thread */
+EXPORTS void	ext_trace_start(unsigned int capacity);
+EXPORTS void	ext_trace_stop(void);
+EXPORTS int		ext_trace_active(void);
+EXPORTS void	ext_trace_begin(const char *category, const char *name);
+EXPORTS void	ext_trace_end(const char *name);
+/* write the recorded spans as JSON through `write' and drop them; returns how many were written */
+EXPORTS size_t	ext_trace_flush(void (*write)(void *ud, const char *data, size_t len), void *ud);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(LUA_USE_TRACE)
+#define EXT_SPAN(category, name)	ext_trace_begin(category, name)
+#define EXT_SPAN_END(name)			ext_trace_end(name)
+#else
+#define EXT_SPAN(category, name)	((void)0)
+#define EXT_SPAN_END(name)			((void)0)
+#endif
+
+#endif // __TRACE__
@@ -9,6 +9,13 @@
 #include <math.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
 
 #define lapi_c
 #define LUA_CORE
@@ -118,6 +125,20 @@ LUA_API void lua_setlevel (lua_State *from, lua_State *to) {
 }
 
 
+/*
+** with `on', chunks loaded afterwards only delimit their nested
+** functions and compile each body when it is first called
+*/
+LUA_API int lua_setlazyparse (lua_State *L, int on) {
+  int old;
+  lua_lock(L);
+  old = G(L)->lazyparse;
+  G(L)->lazyparse = cast_byte(on != 0);
+  lua_unlock(L);
+  return old;
+}
+
+
 LUA_API lua_CFunction lua_atpanic (lua_State *L, lua_CFunction panicf) {
   lua_CFunction old;
   lua_lock(L);
@@ -865,13 +886,18 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
 
 
 LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data) {
+  return lua_dumpx(L, writer, data, 0);
+}
+
+
+LUA_API int lua_dumpx (lua_State *L, lua_Writer writer, void *data, int flags) {
   int status;
   TValue *o;
   lua_lock(L);
   api_checknelems(L, 1);
   o = L->top - 1;
   if (isLfunction(o))
-    status = luaU_dump(L, clvalue(o)->l.p, writer, data, 0);
+    status = luaU_dump(L, clvalue(o)->l.p, writer, data, flags);
   else
     status = 1;
   lua_unlock(L);
@@ -940,6 +966,35 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->gcstepmul = data;
       break;
     }
+    case LUA_GCSETDEFER: {
+      res = cast_int(g->deferlimit >> 10);
+      g->deferlimit = cast(lu_mem, data > 0 ? data : 0) << 10;
+      if (g->deferbytes > g->deferlimit)
+        luaM_release(L, g->deferlimit);
+      break;
+    }
+    case LUA_GCFLUSH: {
+      res = cast_int(luaM_release(L, 0) >> 10);
+      break;
+    }
+    case LUA_GCSETSOFTLIMIT: {
+      res = cast_int(g->softlimit >> 10);
+      g->softlimit = cast(lu_mem, data > 0 ? data : 0) << 10;
+      break;
+    }
+    case LUA_GCSETHARDLIMIT: {
+      res = cast_int(g->hardlimit >> 10);
+      g->hardlimit = cast(lu_mem, data > 0 ? data : 0) << 10;
+      break;
+    }
+    case LUA_GCSOFTHITS: {
+      res = cast_int(g->softhits);
+      break;
+    }
+    case LUA_GCHARDHITS: {
+      res = cast_int(g->hardhits);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -979,6 +1034,28 @@ LUA_API int lua_next (lua_State *L, int idx) {
 }
 
 
+/*
+** pushes the key and value at traversal position `i' or after it, like
+** lua_next, and returns the position to resume from (0 at the end).
+** The caller must leave room for the two values it pushes.
+*/
+LUA_API int lua_nextindex (lua_State *L, int idx, int i) {
+  StkId t;
+  lua_lock(L);
+  t = index2adr(L, idx);
+  api_check(L, ttistable(t));
+  api_check(L, i >= 0);
+  api_check(L, L->top + 1 < L->ci->top);
+  i = luaH_nextindex(L, hvalue(t), i, L->top);
+  if (i) {
+    api_incr_top(L);
+    api_incr_top(L);
+  }
+  lua_unlock(L);
+  return i;
+}
+
+
 LUA_API void lua_concat (lua_State *L, int n) {
   lua_lock(L);
   api_checknelems(L, n);
@@ -1014,6 +1091,88 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 }
 
 
+LUA_API lua_AllocTrack lua_getalloctrack (lua_State *L, void **ud) {
+  lua_AllocTrack f;
+  lua_lock(L);
+  if (ud) *ud = G(L)->alloctrackud;
+  f = G(L)->alloctrack;
+  lua_unlock(L);
+  return f;
+}
+
+
+/*
+** call `f' after the first `first' bytes of objects allocated from now
+** on; NULL stops tracking
+*/
+LUA_API void lua_setalloctrack (lua_State *L, lua_AllocTrack f, void *ud,
+                                size_t first) {
+  lua_lock(L);
+  G(L)->alloctrack = f;
+  G(L)->alloctrackud = ud;
+  G(L)->allocleft = cast(l_mem, first);
+  lua_unlock(L);
+}
+
+
+/*
+** push the execution counters of a build with LUAI_VMSTATS, resetting
+** them if `reset'; returns 0 and pushes nothing in other builds
+*/
+LUA_API int lua_vmstats (lua_State *L, int reset) {
+#if defined(LUAI_VMSTATS)
+  lua_lock(L);
+  luaC_checkGC(L);
+  luaV_pushstats(L, reset);
+  lua_unlock(L);
+  return 1;
+#else
+  UNUSED(L); UNUSED(reset);
+  return 0;
+#endif
+}
+
+
+LUA_API int lua_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  int status;
+  lua_lock(L);
+  status = luaC_snapshot(L, writer, data);
+  lua_unlock(L);
+  return status;
+}
+
+
+/*
+** a monotonic clock, as seconds and nanoseconds from an arbitrary
+** origin; it needs no state, so timers and metrics share it
+*/
+LUA_API void lua_clock (unsigned long *sec, unsigned long *nsec) {
+#if defined(_WIN32)
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER c;
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&c);
+  *sec = (unsigned long)(c.QuadPart / freq.QuadPart);
+  *nsec = (unsigned long)((c.QuadPart % freq.QuadPart) * 1000000000 /
+                          freq.QuadPart);
+#elif defined(__APPLE__)
+  static mach_timebase_info_data_t timebase;
+  uint64_t ns;
+  if (timebase.denom == 0)
+    mach_timebase_info(&timebase);
+  ns = mach_absolute_time() * timebase.numer / timebase.denom;
+  *sec = (unsigned long)(ns / 1000000000);
+  *nsec = (unsigned long)(ns % 1000000000);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  *sec = (unsigned long)ts.tv_sec;
+  *nsec = (unsigned long)ts.tv_nsec;
+#endif
+}
+
+
 LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
   Udata *u;
   lua_lock(L);
@@ -1039,9 +1198,10 @@ static const char *aux_upvalue (StkId fi, int n, TValue **val) {
   }
   else {
     Proto *p = f->l.p;
-    if (!(1 <= n && n <= p->sizeupvalues)) return NULL;
+    if (!(1 <= n && n <= f->l.nupvalues)) return NULL;
     *val = f->l.upvals[n-1]->v;
-    return getstr(p->upvalues[n-1]);
+    /* a stripped dump keeps the upvalues but not their names */
+    return (n <= p->sizeupvalues) ? getstr(p->upvalues[n-1]) : "";
   }
 }
 
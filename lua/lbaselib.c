@@ -18,6 +18,7 @@
 
 #include "lauxlib.h"
 #include "lualib.h"
+#include "trace.h"
 
 static int luaB_tonumber (lua_State *L) {
   int base = luaL_optint(L, 2, 10);
@@ -111,9 +112,11 @@ static int luaB_rawset (lua_State *L) {
 
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
-    "count", "step", "setpause", "setstepmul", NULL};
+    "count", "step", "setpause", "setstepmul", "setdefer", "flush",
+    "softhits", "hardhits", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
-    LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL};
+    LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
+    LUA_GCSETDEFER, LUA_GCFLUSH, LUA_GCSOFTHITS, LUA_GCHARDHITS};
   int o = luaL_checkoption(L, 1, "collect", opts);
   int ex = luaL_optint(L, 2, 0);
   int res = lua_gc(L, optsnum[o], ex);
@@ -326,6 +329,41 @@ static int luaB_pcall (lua_State *L) {
 }
 
 
+/*
+** budgetcall(count, seconds, f, ...): pcall `f' with at most `count'
+** instructions and `seconds' of time (nil for no limit), cut to what
+** is left of the caller's own budget
+*/
+static int luaB_budgetcall (lua_State *L) {
+  lua_Number count = luaL_optnumber(L, 1, -1);
+  lua_Number seconds = luaL_optnumber(L, 2, -1);
+  lua_Number oldcount, oldseconds, leftcount, leftseconds;
+  int mode = lua_getbudget(L, &oldcount, &oldseconds);
+  int status;
+  luaL_checkany(L, 3);
+  if (mode >= 0) {  /* caller on a budget? */
+    if (oldcount >= 0 && (count < 0 || oldcount < count))
+      count = oldcount;
+    if (oldseconds >= 0 && (seconds < 0 || oldseconds < seconds))
+      seconds = oldseconds;
+  }
+  lua_remove(L, 1);
+  lua_remove(L, 1);
+  lua_setbudget(L, count, seconds, LUA_BUDGETERROR);
+  status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+  lua_getbudget(L, &leftcount, &leftseconds);
+  if (mode < 0)
+    lua_setbudget(L, -1, -1, LUA_BUDGETERROR);
+  else  /* charge the caller */
+    lua_setbudget(L, (oldcount < 0) ? -1 : oldcount - (count - leftcount),
+                  (oldseconds < 0) ? -1 : oldseconds - (seconds - leftseconds),
+                  mode);
+  lua_pushboolean(L, (status == 0));
+  lua_insert(L, 1);
+  return lua_gettop(L);  /* return status + all results */
+}
+
+
 static int luaB_xpcall (lua_State *L) {
   int status;
   luaL_checkany(L, 2);
@@ -438,6 +476,7 @@ static int luaB_stacktrace (lua_State *L) {
 
 static const luaL_Reg base_funcs[] = {
   {"assert", luaB_assert},
+  {"budgetcall", luaB_budgetcall},
   {"collectgarbage", luaB_collectgarbage},
   {"error", luaB_error},
   {"getmetatable", luaB_getmetatable},
@@ -502,6 +541,31 @@ static int luaB_costatus (lua_State *L) {
 }
 
 
+/*
+** budget(co): instructions and seconds `co' has left (nil for no
+** limit); budget(co, count, seconds): preempt it (it yields, with
+** nothing left) after running that much
+*/
+static int luaB_cobudget (lua_State *L) {
+  lua_State *co = lua_tothread(L, 1);
+  luaL_argcheck(L, co, 1, "coroutine expected");
+  if (lua_gettop(L) > 1) {
+    lua_setbudget(co, luaL_optnumber(L, 2, -1), luaL_optnumber(L, 3, -1),
+                  LUA_BUDGETYIELD);
+    return 0;
+  }
+  else {
+    lua_Number count, seconds;
+    lua_getbudget(co, &count, &seconds);
+    if (count < 0) lua_pushnil(L);
+    else lua_pushnumber(L, count);
+    if (seconds < 0) lua_pushnil(L);
+    else lua_pushnumber(L, seconds);
+    return 2;
+  }
+}
+
+
 static int auxresume (lua_State *L, lua_State *co, int narg) {
   int status = costatus(L, co);
   if (!lua_checkstack(co, narg))
@@ -590,6 +654,7 @@ static int luaB_corunning (lua_State *L) {
 
 
 static const luaL_Reg co_funcs[] = {
+  {"budget", luaB_cobudget},
   {"create", luaB_cocreate},
   {"resume", luaB_coresume},
   {"running", luaB_corunning},
@@ -660,6 +725,7 @@ static int ll_require (lua_State *L) {
     return 1;  /* module is already loaded */
   }
   /* else must load it; iterate over available loaders */
+  EXT_SPAN("require", name);
   do {
     lua_getfield(L, LUA_ENVIRONINDEX, "preload");
     if (lua_istable(L, -1)) {
@@ -715,6 +781,7 @@ static int ll_require (lua_State *L) {
     lua_pop(L, 1);
   lua_pushvalue(L, -1);
   lua_setfield(L, 2, name);  /* _LOADED[name] = returned value */
+  EXT_SPAN_END(name);
   return 1;
 }
 
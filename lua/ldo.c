@@ -274,6 +274,10 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
     CallInfo *ci;
     StkId st, base;
     Proto *p = cl->p;
+    if (p->lazy != NULL) {  /* body not compiled yet? */
+      luaD_compile(L, p);
+      func = restorestack(L, funcr);
+    }
     luaD_checkstack(L, p->maxstacksize);
     func = restorestack(L, funcr);
     if (!p->is_vararg) {  /* no varargs? */
@@ -415,8 +419,16 @@ static int resume_error (lua_State *L, const char *msg) {
 }
 
 
+static l_mem lendbudget (lua_State *from, lua_State *L, int *borrowed);
+static void chargebudget (lua_State *from, lua_State *L, l_mem start,
+                          int borrowed);
+
+
 LUA_API int lua_resume (lua_State *L, int nargs) {
   int status;
+  int borrowed;
+  l_mem start;
+  lua_State *from;
   lua_lock(L);
   if (L->status != LUA_YIELD && (L->status != 0 || L->ci != L->base_ci))
       return resume_error(L, "cannot resume non-suspended coroutine");
@@ -425,7 +437,13 @@ LUA_API int lua_resume (lua_State *L, int nargs) {
   luai_userstateresume(L, nargs);
   lua_assert(L->errfunc == 0);
   L->baseCcalls = ++L->nCcalls;
+  from = G(L)->running;
+  G(L)->running = L;
+  start = lendbudget(from, L, &borrowed);
   status = luaD_rawrunprotected(L, resume, L->top - nargs);
+  if (from->onbudget)
+    chargebudget(from, L, start, borrowed);
+  G(L)->running = from;
   if (status != 0) {  /* error? */
     L->status = cast_byte(status);  /* mark thread as `dead' */
     luaD_seterrorobj(L, status, L->top);
@@ -453,6 +471,191 @@ LUA_API int lua_yield (lua_State *L, int nresults) {
 }
 
 
+
+/*
+** {======================================================
+** Execution budgets
+** =======================================================
+*/
+
+/*
+** A thread on a budget has `onbudget' set, which the VM tests along
+** with the hook bits, so threads without a budget pay nothing for it.
+** It is a field of its own because lua_sethook may rewrite `hookmask'
+** from a signal handler at any time.  The VM counts `budgetcount' down and calls
+** luaD_budget when it reaches zero, at most BUDGETSLICE instructions
+** apart; that is also how often the deadline is checked.  Once a
+** budget is spent every instruction fails again, so the error cannot
+** be swallowed by a pcall inside the budgeted code.
+**
+** A coroutine resumed by a thread on a budget runs on that budget, or
+** keeps its own cut to the same deadline, and what it runs is charged
+** to the resumer: starting coroutines does not escape a budget.
+*/
+
+#define BUDGETSLICE	1000
+
+#define nocount(L)	((L)->budget == MAX_LMEM)
+
+
+/* seconds of the monotonic clock (see lua_clock) */
+static lua_Number budgetclock (void) {
+  unsigned long sec, nsec;
+  lua_clock(&sec, &nsec);
+  return cast_num(sec) + cast_num(nsec) / 1e9;
+}
+
+
+static void startslice (lua_State *L) {
+  l_mem n = (L->budget < BUDGETSLICE) ? L->budget : BUDGETSLICE;
+  L->budgetslice = L->budgetcount = (n > 0) ? cast_int(n) : 1;
+}
+
+
+/* charge the part of the slice already run */
+static void syncbudget (lua_State *L) {
+  if (!nocount(L)) {
+    L->budget -= L->budgetslice - L->budgetcount;
+    if (L->budget < 0) L->budget = 0;
+  }
+  L->budgetslice = L->budgetcount;
+}
+
+
+/*
+** called by the VM when `budgetcount' runs out; returns 1 if the
+** thread was preempted (it then has no budget left)
+*/
+int luaD_budget (lua_State *L) {
+  const char *msg = NULL;
+  if (!nocount(L)) {
+    L->budget -= L->budgetslice;
+    if (L->budget < 0) L->budget = 0;
+  }
+  if (L->deadline > 0 && budgetclock() >= L->deadline)
+    msg = "deadline exceeded";
+  else if (L->budget == 0)
+    msg = "instruction budget exceeded";
+  if (msg == NULL) {
+    startslice(L);
+    return 0;
+  }
+  L->budgetslice = L->budgetcount = 1;  /* check again on next instruction */
+  if (L->budgetmode == LUA_BUDGETYIELD) {
+    if (L->nCcalls > L->baseCcalls || L->top != L->ci->top)
+      return 0;  /* cannot yield here; try again later */
+    L->onbudget = 0;
+    L->base = L->top;  /* yield no values */
+    L->status = LUA_YIELD;
+    return 1;
+  }
+  luaG_runerror(L, msg);
+  return 0;
+}
+
+
+static l_mem lendbudget (lua_State *from, lua_State *L, int *borrowed) {
+  *borrowed = 0;
+  if (!from->onbudget)
+    return 0;
+  syncbudget(from);
+  if (!L->onbudget) {
+    L->budget = from->budget;
+    L->deadline = from->deadline;
+    L->budgetmode = from->budgetmode;
+    L->onbudget = 1;
+    *borrowed = 1;
+  }
+  else {
+    syncbudget(L);
+    if (from->deadline > 0 &&
+        (L->deadline == 0 || from->deadline < L->deadline))
+      L->deadline = from->deadline;
+  }
+  startslice(L);
+  return L->budget;
+}
+
+
+static void chargebudget (lua_State *from, lua_State *L, l_mem start,
+                          int borrowed) {
+  syncbudget(L);
+  if (!nocount(from) && !nocount(L)) {
+    from->budget -= start - L->budget;
+    if (from->budget < 0) from->budget = 0;
+  }
+  startslice(from);
+  if (borrowed) {
+    L->onbudget = 0;
+    L->budget = MAX_LMEM;
+    L->deadline = 0;
+  }
+}
+
+
+/*
+** run `L' on a budget of `count' instructions and `seconds' of time
+** from now; a negative value means no limit, and both negative remove
+** the budget
+*/
+LUA_API void lua_setbudget (lua_State *L, lua_Number count,
+                            lua_Number seconds, int mode) {
+  lua_lock(L);
+  if (count < 0 && seconds < 0) {
+    L->onbudget = 0;
+    L->budget = MAX_LMEM;
+    L->deadline = 0;
+  }
+  else {
+    if (count < 0)
+      L->budget = MAX_LMEM;
+    else
+      L->budget = (count < cast_num(MAX_LMEM)) ? cast(l_mem, count)
+                                               : MAX_LMEM - 1;
+    if (seconds < 0)
+      L->deadline = 0;
+    else {
+      L->deadline = budgetclock() + seconds;
+      if (L->deadline <= 0) L->deadline = 1e-9;  /* 0 means none */
+    }
+    L->budgetmode = cast_byte(mode);
+    startslice(L);
+    L->onbudget = 1;
+  }
+  lua_unlock(L);
+}
+
+
+/*
+** what is left of the budget of `L' (-1 for no limit); returns its
+** mode, or -1 if it has none (a preempted thread has none, and 0 of
+** something left)
+*/
+LUA_API int lua_getbudget (lua_State *L, lua_Number *count,
+                           lua_Number *seconds) {
+  int mode = -1;
+  lua_lock(L);
+  if (L->onbudget) {
+    syncbudget(L);
+    mode = L->budgetmode;
+  }
+  if (count)
+    *count = nocount(L) ? -1 : cast_num(L->budget);
+  if (seconds) {
+    if (L->deadline == 0)
+      *seconds = -1;
+    else {
+      lua_Number left = L->deadline - budgetclock();
+      *seconds = (left > 0) ? left : 0;
+    }
+  }
+  lua_unlock(L);
+  return mode;
+}
+
+/* }====================================================== */
+
+
 int luaD_pcall (lua_State *L, Pfunc func, void *u,
                 ptrdiff_t old_top, ptrdiff_t ef) {
   int status;
@@ -472,6 +675,8 @@ int luaD_pcall (lua_State *L, Pfunc func, void *u,
     L->savedpc = L->ci->savedpc;
     L->allowhook = old_allowhooks;
     restore_stack_limit(L);
+    if (status == LUA_ERRMEM && G(L)->gcemergency)
+      luaC_step(L);  /* state is consistent again: collect now */
   }
   L->errfunc = old_errfunc;
   return status;
@@ -485,6 +690,7 @@ int luaD_pcall (lua_State *L, Pfunc func, void *u,
 struct SParser {  /* data to `f_parser' */
   ZIO *z;
   Mbuffer buff;  /* buffer to be used by the scanner */
+  Mbuffer lazybuff;  /* buffer for bodies compiled on demand */
   const char *name;
 };
 
@@ -495,8 +701,11 @@ static void f_parser (lua_State *L, void *ud) {
   struct SParser *p = cast(struct SParser *, ud);
   int c = luaZ_lookahead(p->z);
   luaC_checkGC(L);
-  tf = ((c == LUA_SIGNATURE[0]) ? luaU_undump : luaY_parser)(L, p->z,
-                                                             &p->buff, p->name);
+  if (c == LUA_SIGNATURE[0])
+    tf = luaU_undump(L, p->z, &p->buff, p->name);
+  else
+    tf = luaY_parser(L, p->z, &p->buff,
+                     G(L)->lazyparse ? &p->lazybuff : NULL, p->name);
   cl = luaF_newLclosure(L, tf->nups, hvalue(gt(L)));
   cl->l.p = tf;
   for (i = 0; i < tf->nups; i++)  /* initialize eventual upvalues */
@@ -511,9 +720,59 @@ int luaD_protectedparser (lua_State *L, ZIO *z, const char *name) {
   int status;
   p.z = z; p.name = name;
   luaZ_initbuffer(L, &p.buff);
+  luaZ_initbuffer(L, &p.lazybuff);
   status = luaD_pcall(L, f_parser, &p, savestack(L, L->top), L->errfunc);
   luaZ_freebuffer(L, &p.buff);
+  luaZ_freebuffer(L, &p.lazybuff);
   return status;
 }
 
 
+struct SCompile {  /* data to `f_compile' */
+  Proto *f;
+  const char *source;  /* not read yet, or NULL */
+  ZIO z;
+  Mbuffer buff;
+  Mbuffer lazybuff;
+};
+
+
+static const char *getlazy (lua_State *L, void *ud, size_t *size) {
+  struct SCompile *c = cast(struct SCompile *, ud);
+  const char *source = c->source;
+  UNUSED(L);
+  if (source == NULL) return NULL;
+  c->source = NULL;
+  *size = c->f->sizelazy;
+  return source;
+}
+
+
+static void f_compile (lua_State *L, void *ud) {
+  struct SCompile *c = cast(struct SCompile *, ud);
+  luaY_compile(L, c->f, &c->z, &c->buff, &c->lazybuff);
+}
+
+
+/*
+** compile the body of a function skipped at load time; errors are
+** raised as if the call itself had failed
+*/
+void luaD_compile (lua_State *L, Proto *f) {
+  struct SCompile c;
+  int status;
+  c.f = f;
+  c.source = f->lazy;
+  luaZ_init(L, &c.z, getlazy, &c);
+  luaZ_initbuffer(L, &c.buff);
+  luaZ_initbuffer(L, &c.lazybuff);
+  status = luaD_pcall(L, f_compile, &c, savestack(L, L->top), L->errfunc);
+  luaZ_freebuffer(L, &c.buff);
+  luaZ_freebuffer(L, &c.lazybuff);
+  if (status == LUA_ERRMEM)
+    luaD_throw(L, status);
+  else if (status != 0)
+    luaG_errormsg(L);
+}
+
+
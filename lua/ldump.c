@@ -11,6 +11,7 @@
 
 #include "lua.h"
 
+#include "ldo.h"
 #include "lobject.h"
 #include "lstate.h"
 #include "lundump.h"
@@ -20,6 +21,7 @@ typedef struct {
  lua_Writer writer;
  void* data;
  int strip;
+ int optimize;
  int status;
 } DumpState;
 
@@ -126,7 +128,7 @@ static void DumpDebug(const Proto* f, DumpState* D)
  for (i=0; i<n; i++) DumpString(f->upvalues[i],D);
 }
 
-static void DumpFunction(const Proto* f, const TString* p, DumpState* D)
+static void DumpBody(const Proto* f, const TString* p, DumpState* D)
 {
  DumpString((f->source==p || D->strip) ? NULL : f->source,D);
  DumpInt(f->linedefined,D);
@@ -140,6 +142,39 @@ static void DumpFunction(const Proto* f, const TString* p, DumpState* D)
  DumpDebug(f,D);
 }
 
+typedef struct {
+ const Proto* f;
+ const TString* p;
+ DumpState* D;
+} DumpArgs;
+
+static void DumpProtected(lua_State* L, void* ud)
+{
+ DumpArgs* a=(DumpArgs*)ud;
+ UNUSED(L);
+ DumpBody(a->f,a->p,a->D);
+}
+
+static void DumpFunction(const Proto* f, const TString* p, DumpState* D)
+{
+ Proto o;
+ if (f->lazy!=NULL) luaD_compile(D->L,(Proto*)f);
+ if (D->optimize && luaU_optimize(D->L,f,&o))
+ {
+  /* the optimized copy is freed even when the writer raises an error */
+  DumpArgs a;
+  int status;
+  a.f=&o;
+  a.p=p;
+  a.D=D;
+  status=luaD_rawrunprotected(D->L,DumpProtected,&a);
+  luaU_freeopt(D->L,f,&o);
+  if (status!=0) luaD_throw(D->L,status);
+ }
+ else
+  DumpBody(f,p,D);
+}
+
 static void DumpHeader(DumpState* D)
 {
  char h[LUAC_HEADERSIZE];
@@ -150,13 +185,14 @@ static void DumpHeader(DumpState* D)
 /*
 ** dump Lua function as precompiled chunk
 */
-int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip)
+int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int flags)
 {
  DumpState D;
  D.L=L;
  D.writer=w;
  D.data=data;
- D.strip=strip;
+ D.strip=(flags & LUA_DUMPSTRIP)!=0;
+ D.optimize=(flags & LUA_DUMPOPTIMIZE)!=0;
  D.status=0;
  DumpHeader(&D);
  DumpFunction(f,NULL,&D);
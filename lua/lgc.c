@@ -21,12 +21,14 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "metrics.h"
 
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
 #define GCSWEEPCOST	10
 #define GCFINALIZECOST	100
+#define GCDEFERSTEP	(64*GCSTEPSIZE)
 
 
 #define maskmarks	cast_byte(~(bitmask(BLACKBIT)|WHITEBITS))
@@ -313,7 +315,8 @@ static l_mem propagatemark (global_State *g) {
                              sizeof(TValue) * p->sizek + 
                              sizeof(int) * p->sizelineinfo +
                              sizeof(LocVar) * p->sizelocvars +
-                             sizeof(TString *) * p->sizeupvalues;
+                             sizeof(TString *) * p->sizeupvalues +
+                             p->sizelazy;
     }
     default: lua_assert(0); return 0;
   }
@@ -388,11 +391,11 @@ static void freeobj (lua_State *L, GCObject *o) {
     }
     case LUA_TSTRING: {
       G(L)->strt.nuse--;
-      luaM_freemem(L, o, sizestring(gco2ts(o)));
+      luaM_defer_(L, o, sizestring(gco2ts(o)));
       break;
     }
     case LUA_TUSERDATA: {
-      luaM_freemem(L, o, sizeudata(gco2u(o)));
+      luaM_defer_(L, o, sizeudata(gco2u(o)));
       break;
     }
     default: lua_assert(0);
@@ -576,6 +579,7 @@ static l_mem singlestep (lua_State *L) {
         g->gcstate = GCSsweep;  /* end sweep-string phase */
       lua_assert(old >= g->totalbytes);
       g->estimate -= old - g->totalbytes;
+      EXT_COUNT("gc.freed.bytes", old - g->totalbytes);
       return GCSWEEPCOST;
     }
     case GCSsweep: {
@@ -587,6 +591,7 @@ static l_mem singlestep (lua_State *L) {
       }
       lua_assert(old >= g->totalbytes);
       g->estimate -= old - g->totalbytes;
+      EXT_COUNT("gc.freed.bytes", old - g->totalbytes);
       return GCSWEEPMAX*GCSWEEPCOST;
     }
     case GCSfinalize: {
@@ -599,6 +604,7 @@ static l_mem singlestep (lua_State *L) {
       else {
         g->gcstate = GCSpause;  /* end collection */
         g->gcdept = 0;
+        EXT_COUNT("gc.cycles", 1);
         return 0;
       }
     }
@@ -607,9 +613,32 @@ static l_mem singlestep (lua_State *L) {
 }
 
 
+/*
+** hand part of the deferred blocks back to the allocator: everything
+** over half the limit once the limit is passed, otherwise a bounded
+** amount per step, kept out of the sweep phases that produce them
+*/
+static void releasedeferred (lua_State *L) {
+  global_State *g = G(L);
+  if (g->deferbytes > g->deferlimit)
+    luaM_release(L, g->deferlimit/2);
+  else if (g->gcstate != GCSsweepstring && g->gcstate != GCSsweep)
+    luaM_release(L, g->deferbytes > GCDEFERSTEP ?
+                    g->deferbytes - GCDEFERSTEP : 0);
+}
+
+
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   l_mem lim = (GCSTEPSIZE/100) * g->gcstepmul;
+  EXT_TIMER(start);
+  if (g->gcemergency) {  /* soft memory limit crossed? */
+    g->gcemergency = 0;
+    g->softhits++;
+    luaC_fullgc(L);
+    luaM_release(L, 0);
+    return;
+  }
   if (lim == 0)
     lim = (MAX_LUMEM-1)/2;  /* no limit */
   g->gcdept += g->totalbytes - g->GCthreshold;
@@ -629,11 +658,16 @@ void luaC_step (lua_State *L) {
   else {
     setthreshold(g);
   }
+  if (g->deferred != NULL)
+    releasedeferred(L);
+  EXT_ELAPSED("gc.step.ns", start);
+  EXT_GAUGE("gc.heap.bytes", g->totalbytes);
 }
 
 
 void luaC_fullgc (lua_State *L) {
   global_State *g = G(L);
+  EXT_TIMER(start);
   if (g->gcstate <= GCSpropagate) {
     /* reset sweep marks to sweep all elements (returning them to white) */
     g->sweepstrgc = 0;
@@ -655,6 +689,10 @@ void luaC_fullgc (lua_State *L) {
     singlestep(L);
   }
   setthreshold(g);
+  if (g->deferbytes > g->deferlimit)
+    luaM_release(L, g->deferlimit/2);
+  EXT_ELAPSED("gc.full.ns", start);
+  EXT_GAUGE("gc.heap.bytes", g->totalbytes);
 }
 
 
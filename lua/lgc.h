@@ -106,5 +106,8 @@ LUAI_FUNC void luaC_linkupval (lua_State *L, UpVal *uv);
 LUAI_FUNC void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback (lua_State *L, Table *t);
 
+/* heap snapshots; from lheap.c */
+LUAI_FUNC int luaC_snapshot (lua_State *L, lua_Writer writer, void *data);
+
 
 #endif
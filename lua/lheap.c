@@ -0,0 +1,477 @@
+/*
+** $Id: lheap.c $
+** Heap snapshots
+** See Copyright Notice in lua.h
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#define lheap_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "ltm.h"
+
+
+/*
+** A snapshot visits every object reachable from the roots (globals,
+** registry, main thread, basic-type metatables) in breadth-first
+** order, using its own visited set so the collector's colors are left
+** alone.  Weak references are not followed: an object held only by
+** them is garbage already.  The collector is held off for the walk.
+**
+** Format (numbers are unsigned LEB128):
+**   snapshot = "\033LHS" version object* 0
+**   object   = type(byte) id size nedges edge*
+**   edge     = target label
+**   label    = index of a label already written; the next free index
+**              introduces a new label: index length bytes
+** The first object is the root set, of type SNAPROOT and id 0; other
+** ids are object addresses.  Upvalues are not objects here: a closure
+** points straight at their values.
+*/
+
+#define SNAPSIGNATURE	"\033LHS"
+#define SNAPVERSION	1
+#define SNAPROOT	0xFF
+
+#define SNAPFLUSH	(16*1024)	/* hand output to the writer at this size */
+#define LABELMAX	80
+
+
+typedef struct Buff {
+  char *p;
+  size_t n;
+  size_t size;
+} Buff;
+
+
+typedef struct Label {
+  unsigned int h;
+  size_t off;  /* position in `labels' */
+  size_t len;
+  size_t idx;
+} Label;
+
+
+typedef struct Snap {
+  lua_State *L;
+  lua_Writer writer;
+  void *data;
+  int status;
+  GCObject **seen;  /* open-addressing set of visited objects */
+  size_t sizeseen;
+  size_t nseen;
+  GCObject **queue;
+  size_t sizequeue;
+  size_t nqueue;
+  Buff out;  /* output not yet handed to the writer */
+  Buff edges;  /* edges of the object being written */
+  size_t nedges;
+  Buff labels;  /* text of every label */
+  Label *lab;  /* open-addressing set of labels */
+  size_t sizelab;
+  size_t nlab;
+} Snap;
+
+
+static void *grow (lua_State *L, void *block, size_t *size, size_t need,
+                   size_t e) {
+  size_t n = (*size) ? *size : 64;
+  while (n < need) n *= 2;
+  if (n != *size) {
+    block = luaM_reallocv(L, block, *size, n, e);
+    *size = n;
+  }
+  return block;
+}
+
+
+static void addbytes (Snap *S, Buff *b, const void *s, size_t l) {
+  b->p = cast(char *, grow(S->L, b->p, &b->size, b->n + l, 1));
+  memcpy(b->p + b->n, s, l);
+  b->n += l;
+}
+
+
+static void addnum (Snap *S, Buff *b, size_t x) {
+  unsigned char buff[sizeof(size_t) * 8 / 7 + 1];
+  int n = 0;
+  do {
+    unsigned char c = cast(unsigned char, x & 0x7F);
+    x >>= 7;
+    buff[n++] = x ? cast(unsigned char, c | 0x80) : c;
+  } while (x);
+  addbytes(S, b, buff, n);
+}
+
+
+static void flush (Snap *S) {
+  if (S->out.n > 0 && S->status == 0) {
+    lua_unlock(S->L);
+    S->status = (*S->writer)(S->L, S->out.p, S->out.n, S->data);
+    lua_lock(S->L);
+  }
+  S->out.n = 0;
+}
+
+
+static size_t hashobj (GCObject *o, size_t size) {
+  size_t h = cast(size_t, o);
+  return (h ^ (h >> 4) ^ (h >> 12)) & (size - 1);
+}
+
+
+/* mark `o' as visited; returns 0 if it was already */
+static int visit (Snap *S, GCObject *o) {
+  size_t i;
+  if (2 * (S->nseen + 1) > S->sizeseen) {  /* rehash */
+    size_t oldsize = S->sizeseen;
+    GCObject **old = S->seen;
+    size_t j;
+    S->sizeseen = (oldsize) ? 2 * oldsize : 1024;
+    S->seen = luaM_newvector(S->L, S->sizeseen, GCObject *);
+    memset(S->seen, 0, S->sizeseen * sizeof(GCObject *));
+    for (j = 0; j < oldsize; j++) {
+      if (old[j] != NULL) {
+        i = hashobj(old[j], S->sizeseen);
+        while (S->seen[i] != NULL) i = (i + 1) & (S->sizeseen - 1);
+        S->seen[i] = old[j];
+      }
+    }
+    luaM_freearray(S->L, old, oldsize, GCObject *);
+  }
+  i = hashobj(o, S->sizeseen);
+  while (S->seen[i] != NULL) {
+    if (S->seen[i] == o) return 0;
+    i = (i + 1) & (S->sizeseen - 1);
+  }
+  S->seen[i] = o;
+  S->nseen++;
+  return 1;
+}
+
+
+static size_t labelindex (Snap *S, const char *s, size_t l, int *isnew) {
+  unsigned int h = cast(unsigned int, l);
+  size_t i;
+  for (i = 0; i < l; i++)
+    h = h ^ ((h << 5) + (h >> 2) + cast(unsigned char, s[i]));
+  if (2 * (S->nlab + 1) > S->sizelab) {  /* rehash */
+    size_t oldsize = S->sizelab;
+    Label *old = S->lab;
+    size_t j;
+    S->sizelab = (oldsize) ? 2 * oldsize : 256;
+    S->lab = luaM_newvector(S->L, S->sizelab, Label);
+    for (j = 0; j < S->sizelab; j++) S->lab[j].len = (size_t)-1;
+    for (j = 0; j < oldsize; j++) {
+      if (old[j].len != (size_t)-1) {
+        i = old[j].h & (S->sizelab - 1);
+        while (S->lab[i].len != (size_t)-1) i = (i + 1) & (S->sizelab - 1);
+        S->lab[i] = old[j];
+      }
+    }
+    luaM_freearray(S->L, old, oldsize, Label);
+  }
+  i = h & (S->sizelab - 1);
+  while (S->lab[i].len != (size_t)-1) {
+    Label *lb = &S->lab[i];
+    if (lb->h == h && lb->len == l &&
+        memcmp(S->labels.p + lb->off, s, l) == 0) {
+      *isnew = 0;
+      return lb->idx;
+    }
+    i = (i + 1) & (S->sizelab - 1);
+  }
+  S->lab[i].h = h;
+  S->lab[i].len = l;
+  S->lab[i].off = S->labels.n;
+  S->lab[i].idx = S->nlab;
+  addbytes(S, &S->labels, s, l);
+  *isnew = 1;
+  return S->nlab++;
+}
+
+
+static void addedge (Snap *S, GCObject *o, const char *label, size_t l) {
+  int isnew;
+  size_t idx;
+  if (l > LABELMAX) l = LABELMAX;
+  idx = labelindex(S, label, l, &isnew);
+  addnum(S, &S->edges, cast(size_t, o));
+  addnum(S, &S->edges, idx);
+  if (isnew) {
+    addnum(S, &S->edges, l);
+    addbytes(S, &S->edges, label, l);
+  }
+  S->nedges++;
+  if (visit(S, o)) {
+    S->queue = cast(GCObject **, grow(S->L, S->queue, &S->sizequeue,
+                                      S->nqueue + 1, sizeof(GCObject *)));
+    S->queue[S->nqueue++] = o;
+  }
+}
+
+
+#define addlabel(S,o,s)		addedge(S, o, "" s, sizeof(s) - 1)
+
+static void addvalue (Snap *S, const TValue *v, const char *label) {
+  if (iscollectable(v))
+    addedge(S, gcvalue(v), label, strlen(label));
+}
+
+
+static void keylabel (const TValue *key, char *buff) {
+  switch (ttype(key)) {
+    case LUA_TSTRING: {
+      size_t l = tsvalue(key)->len;
+      if (l > LABELMAX) l = LABELMAX;
+      memcpy(buff, svalue(key), l);
+      buff[l] = '\0';
+      break;
+    }
+    case LUA_TNUMBER: {
+      buff[0] = '[';
+      lua_number2str(buff + 1, nvalue(key));
+      strcat(buff, "]");
+      break;
+    }
+    case LUA_TBOOLEAN:
+      strcpy(buff, bvalue(key) ? "[true]" : "[false]");
+      break;
+    default:
+      sprintf(buff, "[%s]", luaT_typenames[ttype(key)]);
+      break;
+  }
+}
+
+
+static void tableedges (Snap *S, Table *h) {
+  const TValue *mode = gfasttm(G(S->L), h->metatable, TM_MODE);
+  int weakkey = 0;
+  int weakvalue = 0;
+  char buff[LABELMAX + LUAI_MAXNUMBER2STR + 3];
+  int i;
+  if (h->metatable)
+    addlabel(S, obj2gco(h->metatable), "<metatable>");
+  if (mode && ttisstring(mode)) {
+    weakkey = (strchr(svalue(mode), 'k') != NULL);
+    weakvalue = (strchr(svalue(mode), 'v') != NULL);
+  }
+  if (!weakvalue) {
+    for (i = 0; i < h->sizearray; i++) {
+      if (iscollectable(&h->array[i])) {
+        sprintf(buff, "[%d]", i + 1);
+        addvalue(S, &h->array[i], buff);
+      }
+    }
+  }
+  for (i = sizenode(h) - 1; i >= 0; i--) {
+    Node *n = gnode(h, i);
+    if (ttisnil(gval(n))) continue;
+    if (!weakkey)
+      addvalue(S, key2tval(n), "<key>");
+    if (!weakvalue && iscollectable(gval(n))) {
+      keylabel(key2tval(n), buff);
+      addvalue(S, gval(n), buff);
+    }
+  }
+}
+
+
+static void closureedges (Snap *S, Closure *cl) {
+  char buff[LABELMAX + 16];
+  int i;
+  addlabel(S, obj2gco(cl->c.env), "<env>");
+  if (cl->c.isC) {
+    for (i = 0; i < cl->c.nupvalues; i++) {
+      sprintf(buff, "<upvalue %d>", i + 1);
+      addvalue(S, &cl->c.upvalue[i], buff);
+    }
+  }
+  else {
+    Proto *p = cl->l.p;
+    addlabel(S, obj2gco(p), "<proto>");
+    for (i = 0; i < cl->l.nupvalues; i++) {
+      UpVal *uv = cl->l.upvals[i];
+      if (uv == NULL) continue;
+      if (i < p->sizeupvalues && p->upvalues[i] != NULL)
+        sprintf(buff, "<upvalue %.*s>", LABELMAX, getstr(p->upvalues[i]));
+      else
+        sprintf(buff, "<upvalue %d>", i + 1);
+      addvalue(S, uv->v, buff);
+    }
+  }
+}
+
+
+static void threadedges (Snap *S, lua_State *th) {
+  char buff[LABELMAX + 16];
+  CallInfo *ci = th->base_ci;
+  StkId o;
+  addvalue(S, gt(th), "<env>");
+  for (o = th->stack; o < th->top; o++) {
+    const char *name = NULL;
+    while (ci < th->ci && o >= (ci + 1)->func) ci++;
+    if (!iscollectable(o)) continue;
+    if (o >= ci->base && ttisfunction(ci->func) && !clvalue(ci->func)->c.isC) {
+      Proto *p = clvalue(ci->func)->l.p;
+      const Instruction *pc = (ci == th->ci) ? th->savedpc : ci->savedpc;
+      if (pc != NULL)
+        name = luaF_getlocalname(p, cast_int(o - ci->base) + 1, pcRel(pc, p));
+    }
+    if (name)
+      sprintf(buff, "<local %.*s>", LABELMAX, name);
+    else
+      sprintf(buff, "<stack %d>", cast_int(o - th->stack));
+    addvalue(S, o, buff);
+  }
+}
+
+
+static void protoedges (Snap *S, Proto *p) {
+  int i;
+  for (i = 0; i < p->sizek; i++)
+    addvalue(S, &p->k[i], "<constant>");
+  for (i = 0; i < p->sizep; i++) {
+    if (p->p[i])
+      addlabel(S, obj2gco(p->p[i]), "<proto>");
+  }
+}
+
+
+static size_t objsize (GCObject *o) {
+  switch (o->gch.tt) {
+    case LUA_TSTRING:
+      return sizestring(gco2ts(o));
+    case LUA_TUSERDATA:
+      return sizeudata(gco2u(o));
+    case LUA_TTABLE: {
+      Table *h = gco2h(o);
+      return sizeof(Table) + sizeof(TValue) * h->sizearray +
+                             sizeof(Node) * sizenode(h);
+    }
+    case LUA_TFUNCTION: {
+      Closure *cl = gco2cl(o);
+      return (cl->c.isC) ? sizeCclosure(cl->c.nupvalues) :
+                           sizeLclosure(cl->l.nupvalues);
+    }
+    case LUA_TTHREAD: {
+      lua_State *th = gco2th(o);
+      return sizeof(lua_State) + sizeof(TValue) * th->stacksize +
+                                 sizeof(CallInfo) * th->size_ci;
+    }
+    case LUA_TPROTO: {
+      Proto *p = gco2p(o);
+      return sizeof(Proto) + sizeof(Instruction) * p->sizecode +
+                             sizeof(Proto *) * p->sizep +
+                             sizeof(TValue) * p->sizek +
+                             sizeof(int) * p->sizelineinfo +
+                             sizeof(LocVar) * p->sizelocvars +
+                             sizeof(TString *) * p->sizeupvalues +
+                             p->sizelazy;
+    }
+    default: return 0;
+  }
+}
+
+
+static void writeobject (Snap *S, int type, size_t id, size_t size) {
+  unsigned char t = cast(unsigned char, type);
+  addbytes(S, &S->out, &t, 1);
+  addnum(S, &S->out, id);
+  addnum(S, &S->out, size);
+  addnum(S, &S->out, S->nedges);
+  addbytes(S, &S->out, S->edges.p, S->edges.n);
+  S->edges.n = 0;
+  S->nedges = 0;
+  if (S->out.n >= SNAPFLUSH) flush(S);
+}
+
+
+static void roots (Snap *S) {
+  global_State *g = G(S->L);
+  char buff[LABELMAX];
+  int i;
+  addvalue(S, gt(g->mainthread), "globals");
+  addvalue(S, registry(S->L), "registry");
+  addlabel(S, obj2gco(g->mainthread), "mainthread");
+  for (i = 0; i < NUM_TAGS; i++) {
+    if (g->mt[i]) {
+      sprintf(buff, "<%s metatable>", luaT_typenames[i]);
+      addedge(S, obj2gco(g->mt[i]), buff, strlen(buff));
+    }
+  }
+  writeobject(S, SNAPROOT, 0, 0);
+}
+
+
+static void snapshot (lua_State *L, void *ud) {
+  Snap *S = cast(Snap *, ud);
+  size_t head = 0;
+  unsigned char v = SNAPVERSION;
+  addbytes(S, &S->out, SNAPSIGNATURE, sizeof(SNAPSIGNATURE) - 1);
+  addbytes(S, &S->out, &v, 1);
+  roots(S);
+  while (head < S->nqueue && S->status == 0) {
+    GCObject *o = S->queue[head++];
+    switch (o->gch.tt) {
+      case LUA_TTABLE: tableedges(S, gco2h(o)); break;
+      case LUA_TFUNCTION: closureedges(S, gco2cl(o)); break;
+      case LUA_TTHREAD: threadedges(S, gco2th(o)); break;
+      case LUA_TPROTO: protoedges(S, gco2p(o)); break;
+      case LUA_TUSERDATA: {
+        Table *mt = gco2u(o)->metatable;
+        if (mt)
+          addlabel(S, obj2gco(mt), "<metatable>");
+        addlabel(S, obj2gco(gco2u(o)->env), "<env>");
+        break;
+      }
+      default: break;
+    }
+    writeobject(S, o->gch.tt, cast(size_t, o), objsize(o));
+  }
+  v = 0;
+  addbytes(S, &S->out, &v, 1);
+  flush(S);
+  UNUSED(L);
+}
+
+
+/*
+** write a snapshot of the heap through `writer'; returns its status
+** (first nonzero result stops the walk)
+*/
+int luaC_snapshot (lua_State *L, lua_Writer writer, void *data) {
+  global_State *g = G(L);
+  lu_mem threshold = g->GCthreshold;
+  int status;
+  Snap S;
+  memset(&S, 0, sizeof(S));
+  S.L = L;
+  S.writer = writer;
+  S.data = data;
+  g->GCthreshold = MAX_LUMEM;  /* no collection while walking */
+  status = luaD_rawrunprotected(L, snapshot, &S);
+  g->GCthreshold = threshold;
+  luaM_freearray(L, S.seen, S.sizeseen, GCObject *);
+  luaM_freearray(L, S.queue, S.sizequeue, GCObject *);
+  luaM_freearray(L, S.lab, S.sizelab, Label);
+  luaM_freearray(L, S.out.p, S.out.size, char);
+  luaM_freearray(L, S.edges.p, S.edges.size, char);
+  luaM_freearray(L, S.labels.p, S.labels.size, char);
+  if (status != 0)
+    luaD_throw(L, status);
+  return S.status;
+}
@@ -19,14 +19,17 @@ static const luaL_Reg loadlibs[] = {
   {LUA_TABLIBNAME, luaopen_table},
   {LUA_OSLIBNAME, luaopen_os},
   {LUA_STRLIBNAME, luaopen_string},
+  {LUA_TEXTLIBNAME, luaopen_text},
   {LUA_MATHLIBNAME, luaopen_math},
   {LUA_BITLIBNAME,	luaopen_bit},
   {LUA_PEGLIBNAME,	luaopen_peg},
+  {LUA_TIMERLIBNAME, luaopen_timer},
   {NULL, NULL}
 };
 
 static const luaL_Reg preloadlibs[] = {
   {LUA_DBLIBNAME, luaopen_debug},
+  {LUA_PROFLIBNAME, luaopen_profile},
   {NULL, NULL}
 };
 
@@ -25,7 +25,13 @@
 
 
 
-#define next(ls) (ls->current = zgetc(ls->z))
+#define next(ls) \
+  (ls->current = zgetc(ls->z), \
+   (ls->capture != NULL && ls->current != EOZ) ? \
+     ((ls->capture->n < ls->capture->buffsize) ? \
+       (void)(ls->capture->buffer[ls->capture->n++] = cast(char, ls->current)) : \
+       capture(ls)) : \
+     (void)0)
 
 
 
@@ -48,6 +54,19 @@ const char *const luaX_tokens [] = {
 #define save_and_next(ls) (save(ls, ls->current), next(ls))
 
 
+static void capture (LexState *ls) {
+  Mbuffer *b = ls->capture;
+  if (b->n + 1 > b->buffsize) {
+    size_t newsize;
+    if (b->buffsize >= MAX_SIZET/2)
+      luaX_lexerror(ls, "function body too long", 0);
+    newsize = (b->buffsize < LUA_MINBUFFER) ? LUA_MINBUFFER : b->buffsize * 2;
+    luaZ_resizebuffer(ls->L, b, newsize);
+  }
+  b->buffer[b->n++] = cast(char, ls->current);
+}
+
+
 static void save (LexState *ls, int c) {
   Mbuffer *b = ls->buff;
   if (b->n + 1 > b->buffsize) {
@@ -146,11 +165,27 @@ void luaX_setinput (lua_State *L, LexState *ls, ZIO *z, TString *source) {
   ls->linenumber = 1;
   ls->lastline = 1;
   ls->source = source;
+  ls->lazybuff = NULL;
+  ls->capture = NULL;
+  ls->lazy = NULL;
   luaZ_resizebuffer(ls->L, ls->buff, LUA_MINBUFFER);  /* initialize buffer */
   next(ls);  /* read first char */
 }
 
 
+/*
+** start recording the source into `b' from the current character on
+** (the one after the current token); a NULL `b' stops recording
+*/
+void luaX_capture (LexState *ls, Mbuffer *b) {
+  ls->capture = b;
+  if (b != NULL) {
+    luaZ_resetbuffer(b);
+    if (ls->current != EOZ) capture(ls);
+  }
+}
+
+
 
 /*
 ** =======================================================
@@ -64,6 +64,9 @@ typedef struct LexState {
   Mbuffer *buff;  /* buffer for tokens */
   TString *source;  /* current source name */
   char decpoint;  /* locale decimal point */
+  Mbuffer *lazybuff;  /* buffer for bodies compiled on demand, or NULL */
+  Mbuffer *capture;  /* buffer recording the source read, or NULL */
+  struct Proto *lazy;  /* function being compiled on demand, or NULL */
 } LexState;
 
 
@@ -72,6 +75,7 @@ LUAI_FUNC void luaX_setinput (lua_State *L, LexState *ls, ZIO *z,
                               TString *source);
 LUAI_FUNC TString *luaX_newstring (LexState *ls, const char *str, size_t l);
 LUAI_FUNC void luaX_next (LexState *ls);
+LUAI_FUNC void luaX_capture (LexState *ls, Mbuffer *b);
 LUAI_FUNC void luaX_lookahead (LexState *ls);
 LUAI_FUNC void luaX_lexerror (LexState *ls, const char *msg, int token);
 LUAI_FUNC void luaX_syntaxerror (LexState *ls, const char *s);
@@ -31,6 +31,8 @@ typedef unsigned char lu_byte;
 
 #define MAX_LUMEM	((lu_mem)(~(lu_mem)0)-2)
 
+#define MAX_LMEM	((l_mem)(MAX_LUMEM >> 1))
+
 
 #define MAX_INT (INT_MAX-2)  /* maximum value of an int (-2 for safety) */
 
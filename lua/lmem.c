@@ -70,17 +70,131 @@ void *luaM_toobig (lua_State *L) {
 
 
 
+/*
+** Memory limits.
+** Crossing `softlimit' cannot collect on the spot: the block being
+** allocated may belong to a structure that is half built (a table
+** being rehashed, a prototype being parsed). It only schedules a full
+** collection for the next GC check, a safe point (see luaC_step).
+** Going past `hardlimit' is refused at once with a memory error,
+** which scripts can catch with pcall; the collection then runs as
+** the error leaves luaD_pcall. Deferred blocks count against the hard
+** limit and are given back first.
+*/
+static void checklimits (lua_State *L, size_t growth) {
+  global_State *g = G(L);
+  lu_mem total = g->totalbytes + growth;
+  if (g->softlimit != 0 && g->totalbytes <= g->softlimit &&
+      total > g->softlimit && g->GCthreshold != MAX_LUMEM) {
+    g->gcemergency = 1;
+    g->GCthreshold = 0;  /* collect at the next check */
+  }
+  if (g->hardlimit != 0 && total + g->deferbytes > g->hardlimit) {
+    luaM_release(L, 0);
+    if (total > g->hardlimit) {
+      g->hardhits++;
+      if (g->GCthreshold != MAX_LUMEM) {
+        g->gcemergency = 1;  /* the error unwinds to a safe point */
+        g->GCthreshold = 0;
+      }
+      luaD_throw(L, LUA_ERRMEM);
+    }
+  }
+}
+
+
+/*
+** Allocation tracking.
+** Tagged allocations (objects and the parts of tables) count down
+** `allocleft'; the one that reaches zero is passed to `alloctrack',
+** which returns the distance to the next call.  Untagged blocks
+** (stacks, CallInfo arrays, buffers) are not counted: while they move,
+** the call chain the tracker inspects is not valid.
+*/
+static void trackalloc (lua_State *L, int tag, size_t size) {
+  global_State *g = G(L);
+  lua_AllocTrack f = g->alloctrack;
+  g->alloctrack = NULL;  /* allocations of the tracker are not tracked */
+  g->allocleft = cast(l_mem, (*f)(L, g->alloctrackud, tag, size));
+  if (g->alloctrack == NULL)
+    g->alloctrack = f;
+}
+
+
 /*
 ** generic allocation routine.
 */
-void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
+void *luaM_realloct_ (lua_State *L, void *block, size_t osize, size_t nsize,
+                      int tag) {
   global_State *g = G(L);
+  void *newblock;
   lua_assert((osize == 0) == (block == NULL));
-  block = (*g->frealloc)(g->ud, block, osize, nsize);
-  if (block == NULL && nsize > 0)
+  if (nsize > osize && (g->softlimit | g->hardlimit) != 0)
+    checklimits(L, nsize - osize);
+  newblock = (*g->frealloc)(g->ud, block, osize, nsize);
+  if (newblock == NULL && nsize > 0 && g->deferred != NULL) {
+    luaM_release(L, 0);  /* give deferred blocks back and try again */
+    newblock = (*g->frealloc)(g->ud, block, osize, nsize);
+  }
+  if (newblock == NULL && nsize > 0)
     luaD_throw(L, LUA_ERRMEM);
-  lua_assert((nsize == 0) == (block == NULL));
+  lua_assert((nsize == 0) == (newblock == NULL));
   g->totalbytes = (g->totalbytes - osize) + nsize;
-  return block;
+  if (tag != 0 && g->alloctrack != NULL && nsize > osize &&
+      (g->allocleft -= cast(l_mem, nsize - osize)) <= 0)
+    trackalloc(L, tag, nsize - osize);
+  return newblock;
+}
+
+
+
+/*
+** Deferred frees.
+** While `deferlimit' is set, large blocks freed by the sweep are not
+** handed to `frealloc' at once: they are chained through their own
+** first bytes and released later in batches (see luaC_step and
+** LUA_GCFLUSH). `totalbytes' drops immediately, so the collector
+** paces itself exactly as if the blocks were already gone.
+*/
+
+#define DEFERMIN	4096  /* smaller blocks are cheap to free at once */
+
+typedef struct Deferred {
+  struct Deferred *next;
+  size_t size;
+} Deferred;
+
+
+void luaM_defer_ (lua_State *L, void *block, size_t size) {
+  global_State *g = G(L);
+  Deferred *d = cast(Deferred *, block);
+  if (g->deferlimit == 0 || size < DEFERMIN) {
+    luaM_freemem(L, block, size);
+    return;
+  }
+  d->next = cast(Deferred *, g->deferred);
+  d->size = size;
+  g->deferred = d;
+  g->deferbytes += size;
+  g->totalbytes -= size;
+}
+
+
+/*
+** release deferred blocks until at most `keep' bytes remain queued;
+** returns the number of bytes released
+*/
+lu_mem luaM_release (lua_State *L, lu_mem keep) {
+  global_State *g = G(L);
+  lu_mem released = 0;
+  while (g->deferred != NULL && g->deferbytes > keep) {
+    Deferred *d = cast(Deferred *, g->deferred);
+    size_t size = d->size;
+    g->deferred = d->next;
+    g->deferbytes -= size;
+    released += size;
+    (*g->frealloc)(g->ud, d, size, 0);
+  }
+  return released;
 }
 
@@ -16,17 +16,28 @@
 #define MEMERRMSG	"not enough memory"
 
 
+#define luaM_realloc_(L,b,os,s)	luaM_realloct_(L, (b), (os), (s), 0)
+
 #define luaM_reallocv(L,b,on,n,e) \
 	((cast(size_t, (n)+1) <= MAX_SIZET/(e)) ?  /* +1 to avoid warnings */ \
 		luaM_realloc_(L, (b), (on)*(e), (n)*(e)) : \
 		luaM_toobig(L))
 
+/* allocations tagged with the type of object they belong to */
+#define luaM_reallocvt(L,b,on,n,e,tag) \
+	((cast(size_t, (n)+1) <= MAX_SIZET/(e)) ?  /* +1 to avoid warnings */ \
+		luaM_realloct_(L, (b), (on)*(e), (n)*(e), (tag)) : \
+		luaM_toobig(L))
+
 #define luaM_freemem(L, b, s)	luaM_realloc_(L, (b), (s), 0)
 #define luaM_free(L, b)		luaM_realloc_(L, (b), sizeof(*(b)), 0)
 #define luaM_freearray(L, b, n, t)   luaM_reallocv(L, (b), n, 0, sizeof(t))
+#define luaM_deferarray(L, b, n, t) \
+	luaM_defer_(L, (b), cast(size_t, n)*sizeof(t))
 
 #define luaM_malloc(L,t)	luaM_realloc_(L, NULL, 0, (t))
 #define luaM_new(L,t)		cast(t *, luaM_malloc(L, sizeof(t)))
+#define luaM_newobject(L,tag,s)	luaM_realloct_(L, NULL, 0, (s), (tag))
 #define luaM_newvector(L,n,t) \
 		cast(t *, luaM_reallocv(L, NULL, 0, n, sizeof(t)))
 
@@ -38,9 +49,11 @@
    ((v)=cast(t *, luaM_reallocv(L, v, oldn, n, sizeof(t))))
 
 
-LUAI_FUNC void *luaM_realloc_ (lua_State *L, void *block, size_t oldsize,
-                                                          size_t size);
+LUAI_FUNC void *luaM_realloct_ (lua_State *L, void *block, size_t oldsize,
+                                                size_t size, int tag);
 LUAI_FUNC void *luaM_toobig (lua_State *L);
+LUAI_FUNC void luaM_defer_ (lua_State *L, void *block, size_t size);
+LUAI_FUNC lu_mem luaM_release (lua_State *L, lu_mem keep);
 LUAI_FUNC void *luaM_growaux_ (lua_State *L, void *block, int *size,
                                size_t size_elem, int limit,
                                const char *errormsg);
@@ -5,6 +5,7 @@
 */
 
 #include <ctype.h>
+#include <float.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -87,8 +88,400 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
 }
 
 
+/*
+** {======================================================
+** Number <-> string conversion
+** =======================================================
+*/
+
+#if defined(LUA_FASTNUMBER)
+
+typedef unsigned long long l_u64;
+
+typedef struct DiyFp {
+  l_u64 f;
+  int e;
+} DiyFp;
+
+
+#define DP_SIGNIFICAND	0x000FFFFFFFFFFFFFULL
+#define DP_HIDDENBIT	0x0010000000000000ULL
+#define DP_EXPONENT	0x7FF0000000000000ULL
+
+
+/* 10^k for k = -348, -340, ..., 340, normalized to 64-bit significands */
+static const DiyFp cachedpowers[] = {
+  {0xfa8fd5a0081c0288ULL, -1220}, {0xbaaee17fa23ebf76ULL, -1193}, {0x8b16fb203055ac76ULL, -1166},
+  {0xcf42894a5dce35eaULL, -1140}, {0x9a6bb0aa55653b2dULL, -1113}, {0xe61acf033d1a45dfULL, -1087},
+  {0xab70fe17c79ac6caULL, -1060}, {0xff77b1fcbebcdc4fULL, -1034}, {0xbe5691ef416bd60cULL, -1007},
+  {0x8dd01fad907ffc3cULL, -980}, {0xd3515c2831559a83ULL, -954}, {0x9d71ac8fada6c9b5ULL, -927},
+  {0xea9c227723ee8bcbULL, -901}, {0xaecc49914078536dULL, -874}, {0x823c12795db6ce57ULL, -847},
+  {0xc21094364dfb5637ULL, -821}, {0x9096ea6f3848984fULL, -794}, {0xd77485cb25823ac7ULL, -768},
+  {0xa086cfcd97bf97f4ULL, -741}, {0xef340a98172aace5ULL, -715}, {0xb23867fb2a35b28eULL, -688},
+  {0x84c8d4dfd2c63f3bULL, -661}, {0xc5dd44271ad3cdbaULL, -635}, {0x936b9fcebb25c996ULL, -608},
+  {0xdbac6c247d62a584ULL, -582}, {0xa3ab66580d5fdaf6ULL, -555}, {0xf3e2f893dec3f126ULL, -529},
+  {0xb5b5ada8aaff80b8ULL, -502}, {0x87625f056c7c4a8bULL, -475}, {0xc9bcff6034c13053ULL, -449},
+  {0x964e858c91ba2655ULL, -422}, {0xdff9772470297ebdULL, -396}, {0xa6dfbd9fb8e5b88fULL, -369},
+  {0xf8a95fcf88747d94ULL, -343}, {0xb94470938fa89bcfULL, -316}, {0x8a08f0f8bf0f156bULL, -289},
+  {0xcdb02555653131b6ULL, -263}, {0x993fe2c6d07b7facULL, -236}, {0xe45c10c42a2b3b06ULL, -210},
+  {0xaa242499697392d3ULL, -183}, {0xfd87b5f28300ca0eULL, -157}, {0xbce5086492111aebULL, -130},
+  {0x8cbccc096f5088ccULL, -103}, {0xd1b71758e219652cULL, -77}, {0x9c40000000000000ULL, -50},
+  {0xe8d4a51000000000ULL, -24}, {0xad78ebc5ac620000ULL, 3}, {0x813f3978f8940984ULL, 30},
+  {0xc097ce7bc90715b3ULL, 56}, {0x8f7e32ce7bea5c70ULL, 83}, {0xd5d238a4abe98068ULL, 109},
+  {0x9f4f2726179a2245ULL, 136}, {0xed63a231d4c4fb27ULL, 162}, {0xb0de65388cc8ada8ULL, 189},
+  {0x83c7088e1aab65dbULL, 216}, {0xc45d1df942711d9aULL, 242}, {0x924d692ca61be758ULL, 269},
+  {0xda01ee641a708deaULL, 295}, {0xa26da3999aef774aULL, 322}, {0xf209787bb47d6b85ULL, 348},
+  {0xb454e4a179dd1877ULL, 375}, {0x865b86925b9bc5c2ULL, 402}, {0xc83553c5c8965d3dULL, 428},
+  {0x952ab45cfa97a0b3ULL, 455}, {0xde469fbd99a05fe3ULL, 481}, {0xa59bc234db398c25ULL, 508},
+  {0xf6c69a72a3989f5cULL, 534}, {0xb7dcbf5354e9beceULL, 561}, {0x88fcf317f22241e2ULL, 588},
+  {0xcc20ce9bd35c78a5ULL, 614}, {0x98165af37b2153dfULL, 641}, {0xe2a0b5dc971f303aULL, 667},
+  {0xa8d9d1535ce3b396ULL, 694}, {0xfb9b7cd9a4a7443cULL, 720}, {0xbb764c4ca7a44410ULL, 747},
+  {0x8bab8eefb6409c1aULL, 774}, {0xd01fef10a657842cULL, 800}, {0x9b10a4e5e9913129ULL, 827},
+  {0xe7109bfba19c0c9dULL, 853}, {0xac2820d9623bf429ULL, 880}, {0x80444b5e7aa7cf85ULL, 907},
+  {0xbf21e44003acdd2dULL, 933}, {0x8e679c2f5e44ff8fULL, 960}, {0xd433179d9c8cb841ULL, 986},
+  {0x9e19db92b4e31ba9ULL, 1013}, {0xeb96bf6ebadf77d9ULL, 1039}, {0xaf87023b9bf0ee6bULL, 1066},
+};
+
+
+static const l_u64 pow10u[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+
+/* powers of 10 that are exact in a double */
+static const double pow10d[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+static DiyFp diy_mul (DiyFp x, DiyFp y) {
+  const l_u64 M32 = 0xFFFFFFFFULL;
+  l_u64 a = x.f >> 32, b = x.f & M32;
+  l_u64 c = y.f >> 32, d = y.f & M32;
+  l_u64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  l_u64 tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+  DiyFp r;
+  tmp += 1U << 31;  /* round */
+  r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+
+static DiyFp diy_normalize (DiyFp x) {
+  while (!(x.f & 0x8000000000000000ULL)) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+
+static void diy_boundaries (DiyFp v, DiyFp *minus, DiyFp *plus) {
+  DiyFp pl, mi;
+  pl.f = (v.f << 1) + 1;
+  pl.e = v.e - 1;
+  while (!(pl.f & (DP_HIDDENBIT << 1))) {
+    pl.f <<= 1;
+    pl.e--;
+  }
+  pl.f <<= 10;
+  pl.e -= 10;
+  if (v.f == DP_HIDDENBIT) {  /* lower boundary is closer */
+    mi.f = (v.f << 2) - 1;
+    mi.e = v.e - 2;
+  }
+  else {
+    mi.f = (v.f << 1) - 1;
+    mi.e = v.e - 1;
+  }
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  *minus = mi;
+  *plus = pl;
+}
+
+
+static DiyFp cachedpower (int e, int *K) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int k = cast_int(dk);
+  int index;
+  if (dk - k > 0.0) k++;
+  index = (k >> 3) + 1;
+  *K = -(-348 + index * 8);  /* decimal exponent of the cached power */
+  return cachedpowers[index];
+}
+
+
+static void grisuround (char *buff, int len, l_u64 delta, l_u64 rest,
+                        l_u64 tenkappa, l_u64 wpw) {
+  while (rest < wpw && delta - rest >= tenkappa &&
+         (rest + tenkappa < wpw || wpw - rest > rest + tenkappa - wpw)) {
+    buff[len - 1]--;
+    rest += tenkappa;
+  }
+}
+
+
+static int digitgen (DiyFp W, DiyFp Mp, l_u64 delta, char *buff, int *K) {
+  int shift = -Mp.e;
+  l_u64 one = 1ULL << shift;
+  l_u64 wpw = Mp.f - W.f;
+  unsigned int p1 = cast(unsigned int, Mp.f >> shift);
+  l_u64 p2 = Mp.f & (one - 1);
+  int kappa = 0;
+  int len = 0;
+  while (kappa < 10 && p1 >= pow10u[kappa]) kappa++;
+  while (kappa > 0) {
+    unsigned int d = cast(unsigned int, p1 / pow10u[kappa - 1]);
+    l_u64 tmp;
+    p1 = cast(unsigned int, p1 % pow10u[kappa - 1]);
+    if (d || len)
+      buff[len++] = cast(char, '0' + d);
+    kappa--;
+    tmp = (cast(l_u64, p1) << shift) + p2;
+    if (tmp <= delta) {
+      *K += kappa;
+      grisuround(buff, len, delta, tmp, pow10u[kappa] << shift, wpw);
+      return len;
+    }
+  }
+  for (;;) {  /* kappa <= 0 */
+    char d;
+    p2 *= 10;
+    delta *= 10;
+    d = cast(char, p2 >> shift);
+    if (d || len)
+      buff[len++] = cast(char, '0' + d);
+    p2 &= one - 1;
+    kappa--;
+    if (p2 < delta) {
+      *K += kappa;
+      grisuround(buff, len, delta, p2, one,
+                 (-kappa < 20) ? wpw * pow10u[-kappa] : 0);
+      return len;
+    }
+  }
+}
+
+
+static int grisu2 (double value, char *buff, int *K) {
+  union { double d; l_u64 u; } bits;
+  DiyFp v, wm, wp, cmk, W;
+  int biased;
+  bits.d = value;
+  biased = cast_int((bits.u & DP_EXPONENT) >> 52);
+  if (biased != 0) {
+    v.f = (bits.u & DP_SIGNIFICAND) + DP_HIDDENBIT;
+    v.e = biased - 0x433;
+  }
+  else {  /* subnormal */
+    v.f = bits.u & DP_SIGNIFICAND;
+    v.e = 1 - 0x433;
+  }
+  diy_boundaries(v, &wm, &wp);
+  cmk = cachedpower(wp.e, K);
+  W = diy_mul(diy_normalize(v), cmk);
+  wp = diy_mul(wp, cmk);
+  wm = diy_mul(wm, cmk);
+  wm.f++;
+  wp.f--;
+  return digitgen(W, wp, wp.f - wm.f, buff, K);
+}
+
+
+/*
+** round the shortest digits of a number to the 14 significant digits
+** of LUA_NUMBER_FMT; returns -1 when the digits are too close to a
+** rounding boundary to decide without the exact value
+*/
+static int round14 (char *buff, int len, int *K) {
+  int tail = 0, i;
+  if (len > 17) return -1;
+  for (i = 14; i < 17; i++)
+    tail = tail * 10 + (i < len ? buff[i] - '0' : 0);
+  if (tail >= 480 && tail <= 520) return -1;
+  *K += len - 14;
+  if (tail > 520) {
+    for (i = 13; i >= 0 && buff[i] == '9'; i--)
+      buff[i] = '0';
+    if (i < 0) {  /* carry out of the first digit */
+      buff[0] = '1';
+      *K += 14;
+      return 1;
+    }
+    buff[i]++;
+  }
+  return 14;
+}
+
+
+static int fmtnumber (char *s, lua_Number n) {
+  char buff[24];
+  char *p = s;
+  int len, K, X;
+  if (n < 0) {
+    *p++ = '-';
+    n = -n;
+  }
+  if (n < 1e14 && cast_num(cast(l_u64, n)) == n) {  /* integral value */
+    l_u64 u = cast(l_u64, n);
+    len = 0;
+    do {
+      buff[len++] = cast(char, '0' + cast_int(u % 10));
+      u /= 10;
+    } while (u != 0);
+    while (len > 0) *p++ = buff[--len];
+    *p = '\0';
+    return cast_int(p - s);
+  }
+  if (n < DBL_MIN)  /* subnormals carry fewer than 14 exact digits */
+    return -1;
+  K = 0;
+  len = grisu2(n, buff, &K);
+  if (len > 14 && (len = round14(buff, len, &K)) < 0)
+    return -1;
+  while (len > 1 && buff[len - 1] == '0') {  /* strip trailing zeros */
+    len--;
+    K++;
+  }
+  X = len + K - 1;  /* decimal exponent of the first digit */
+  if (X < -4 || X >= 14) {  /* `%e' style */
+    *p++ = buff[0];
+    if (len > 1) {
+      *p++ = '.';
+      memcpy(p, buff + 1, len - 1);
+      p += len - 1;
+    }
+    *p++ = 'e';
+    if (X < 0) {
+      *p++ = '-';
+      X = -X;
+    }
+    else *p++ = '+';
+    if (X >= 100) {
+      *p++ = cast(char, '0' + X / 100);
+      X %= 100;
+    }
+    *p++ = cast(char, '0' + X / 10);
+    *p++ = cast(char, '0' + X % 10);
+  }
+  else if (X >= 0) {  /* `%f' style with an integral part */
+    if (len <= X + 1) {
+      memcpy(p, buff, len);
+      p += len;
+      for (; len <= X; len++) *p++ = '0';
+    }
+    else {
+      memcpy(p, buff, X + 1);
+      p += X + 1;
+      *p++ = '.';
+      memcpy(p, buff + X + 1, len - X - 1);
+      p += len - X - 1;
+    }
+  }
+  else {  /* `%f' style below 1 */
+    *p++ = '0';
+    *p++ = '.';
+    for (; X < -1; X++) *p++ = '0';
+    memcpy(p, buff, len);
+    p += len;
+  }
+  *p = '\0';
+  return cast_int(p - s);
+}
+
+
+/*
+** Clinger's fast path: decimal strings whose significand fits in 53
+** bits and whose exponent is within the exact powers of 10 convert
+** with a single correctly rounded operation; returns 0 for anything
+** else (hexadecimal, inf/nan, long significands, syntax errors), which
+** is left to lua_str2number
+*/
+static int fastnumber (const char *s, lua_Number *result) {
+  l_u64 m = 0;
+  int digits = 0, exp = 0, neg = 0, any = 0;
+  lua_Number r;
+  while (isspace(cast(unsigned char, *s))) s++;
+  if (*s == '-') {
+    neg = 1;
+    s++;
+  }
+  else if (*s == '+') s++;
+  for (; *s >= '0' && *s <= '9'; s++) {
+    any = 1;
+    if (m == 0 && *s == '0') continue;  /* leading zeros */
+    if (++digits > 19) return 0;
+    m = m * 10 + (*s - '0');
+  }
+  if (*s == '.') {
+    for (s++; *s >= '0' && *s <= '9'; s++) {
+      any = 1;
+      exp--;
+      if (m == 0 && *s == '0') continue;
+      if (++digits > 19) return 0;
+      m = m * 10 + (*s - '0');
+    }
+  }
+  if (!any) return 0;
+  if (*s == 'e' || *s == 'E') {
+    int eneg = 0, e = 0;
+    s++;
+    if (*s == '-') {
+      eneg = 1;
+      s++;
+    }
+    else if (*s == '+') s++;
+    if (!(*s >= '0' && *s <= '9')) return 0;
+    for (; *s >= '0' && *s <= '9'; s++)
+      if (e < 10000) e = e * 10 + (*s - '0');
+    exp += eneg ? -e : e;
+  }
+  while (isspace(cast(unsigned char, *s))) s++;
+  if (*s != '\0') return 0;
+  if (m == 0) r = 0;
+  else if (m > (1ULL << 53) || exp < -22 || exp > 22) return 0;
+  else if (exp < 0) r = cast_num(m) / pow10d[-exp];
+  else r = cast_num(m) * pow10d[exp];
+  *result = neg ? -r : r;
+  return 1;
+}
+
+#endif
+
+
+int luaO_num2str (char *s, lua_Number n) {
+#if defined(LUA_FASTNUMBER)
+  if (n == n && n - n == 0) {  /* not nan or inf */
+    int len;
+    if (n == 0) {
+      s[0] = '0'; s[1] = '\0';
+      if (1 / n < 0) {  /* keep the sign of -0 */
+        s[0] = '-'; s[1] = '0'; s[2] = '\0';
+        return 2;
+      }
+      return 1;
+    }
+    len = fmtnumber(s, n);
+    if (len >= 0) return len;
+  }
+#endif
+  lua_number2str(s, n);
+  return cast_int(strlen(s));
+}
+
+
 int luaO_str2d (const char *s, lua_Number *result) {
   char *endptr;
+#if defined(LUA_FASTNUMBER)
+  if (fastnumber(s, result)) return 1;
+#endif
   *result = lua_str2number(s, &endptr);
   if (endptr == s) return 0;  /* conversion failed */
   if (*endptr == 'x' || *endptr == 'X')  /* maybe an hexadecimal constant? */
@@ -99,6 +492,8 @@ int luaO_str2d (const char *s, lua_Number *result) {
   return 1;
 }
 
+/* }====================================================== */
+
 
 
 static void pushstr (lua_State *L, const char *str) {
@@ -0,0 +1,877 @@
+/*
+** $Id: lopt.c $
+** Bytecode optimizer for precompiled chunks
+** See Copyright Notice in lua.h
+*/
+
+#include <string.h>
+
+#define lopt_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "lundump.h"
+
+
+/*
+** The optimizer never touches a live function: it works on a copy of
+** the code, line info, local variable ranges and (when folding needs
+** new numbers) constants, which ldump writes in place of the original.
+** Registers captured by closures are left alone everywhere, as any
+** call may change them through the upvalue.  Operands naming an active
+** local are not replaced either, so error messages still name it.
+*/
+
+
+/* what is known about a register in the forward pass */
+#define VUNKNOWN	0
+#define VCONST		1	/* `info' = constant index */
+#define VNIL		2
+#define VTRUE		3
+#define VFALSE		4
+#define VCOPY		5	/* same value as register `info' */
+
+/* instruction flags */
+#define FDATA		1	/* closure upvalue or setlist count, not code */
+#define FDEAD		2	/* removed from the output */
+#define FLEADER		4	/* starts a basic block */
+#define FREACH		8	/* reachable from the entry point */
+
+
+typedef struct RegInfo {
+  lu_byte kind;
+  int info;
+} RegInfo;
+
+
+typedef struct OptState {
+  lua_State *L;
+  const Proto *f;  /* original function */
+  Proto *o;  /* optimized copy */
+  int n;  /* original code size */
+  int pc;  /* instruction being propagated */
+  int ncode;  /* allocated sizes of the copied code and line info */
+  int nline;
+  int nk;  /* size of the copied constant array (0 = shared) */
+  int words;  /* bitset words per instruction */
+  lu_byte *flags;
+  int *work;  /* worklist and new positions */
+  lu_int32 *live;  /* live registers at entry of each instruction */
+  lu_byte esc[MAXSTACK];  /* registers captured by closures */
+  RegInfo reg[MAXSTACK];
+} OptState;
+
+
+#define isdead(s,pc)	((s)->flags[pc] & FDEAD)
+#define isdata(s,pc)	((s)->flags[pc] & FDATA)
+#define jumpto(i,pc)	((pc) + 1 + GETARG_sBx(i))
+
+#define setbit(v,r)	((v)[(r) >> 5] |= cast(lu_int32, 1) << ((r) & 31))
+#define testbit(v,r)	((v)[(r) >> 5] & (cast(lu_int32, 1) << ((r) & 31)))
+
+
+static int isjump (Instruction i) {
+  OpCode op = GET_OPCODE(i);
+  return (op == OP_JMP || op == OP_FORLOOP || op == OP_FORPREP);
+}
+
+
+/* does `i' skip over the next instruction? */
+static int skips (Instruction i) {
+  return testTMode(GET_OPCODE(i)) ||
+         (GET_OPCODE(i) == OP_LOADBOOL && GETARG_C(i) != 0);
+}
+
+
+/*
+** the instruction after a test (or a jumping LOADBOOL) is addressed
+** implicitly by it and must stay where it is
+*/
+static int fixed (OptState *s, int pc) {
+  return (pc > 0 && !(s->flags[pc - 1] & (FDATA|FDEAD)) &&
+          skips(s->o->code[pc - 1]));
+}
+
+
+static void drop (OptState *s, int pc) {
+  if (!fixed(s, pc)) s->flags[pc] |= FDEAD;
+}
+
+
+/*
+** {======================================================
+** Forward pass: constant and copy propagation
+** =======================================================
+*/
+
+
+/* registers `from' to `to' get values nothing is known about */
+static void forget (OptState *s, int from, int to) {
+  int r;
+  int top = s->o->maxstacksize;
+  if (to >= top) to = top - 1;
+  for (r = from; r <= to; r++)
+    s->reg[r].kind = VUNKNOWN;
+  for (r = 0; r < top; r++) {
+    if (s->reg[r].kind == VCOPY && s->reg[r].info >= from &&
+        s->reg[r].info <= to)
+      s->reg[r].kind = VUNKNOWN;
+  }
+}
+
+
+static void learn (OptState *s, int r, int kind, int info) {
+  forget(s, r, r);
+  if (!s->esc[r]) {
+    s->reg[r].kind = cast_byte(kind);
+    s->reg[r].info = info;
+  }
+}
+
+
+static int knows (OptState *s, int r, int kind, int info) {
+  return (s->reg[r].kind == kind &&
+          (kind != VCONST && kind != VCOPY ? 1 : s->reg[r].info == info));
+}
+
+
+/* is register `r' an active local variable? */
+static int named (OptState *s, int r) {
+  return (luaF_getlocalname(s->f, r + 1, s->pc) != NULL);
+}
+
+
+static int source (OptState *s, int r) {
+  return (s->reg[r].kind == VCOPY && !named(s, r)) ? s->reg[r].info : r;
+}
+
+
+/* RK operand: use a known constant or the original of a copy */
+static int rkoperand (OptState *s, int x) {
+  if (ISK(x) || named(s, x)) return x;
+  if (s->reg[x].kind == VCONST && s->reg[x].info <= MAXINDEXRK)
+    return RKASK(s->reg[x].info);
+  return source(s, x);
+}
+
+
+static const TValue *constant (OptState *s, int x) {
+  if (ISK(x)) return &s->o->k[INDEXK(x)];
+  if (s->reg[x].kind == VCONST) return &s->o->k[s->reg[x].info];
+  return NULL;
+}
+
+
+/* truth value of a register: 1, 0 or -1 when unknown */
+static int truth (OptState *s, int r) {
+  switch (s->reg[r].kind) {
+    case VNIL: case VFALSE: return 0;
+    case VTRUE: return 1;
+    case VCONST: return !l_isfalse(&s->o->k[s->reg[r].info]);
+    default: return -1;
+  }
+}
+
+
+static int numberK (OptState *s, lua_Number r) {
+  Proto *o = s->o;
+  int i;
+  for (i = 0; i < o->sizek; i++) {
+    if (ttisnumber(&o->k[i])) {
+      lua_Number v = nvalue(&o->k[i]);
+      if (memcmp(&v, &r, sizeof(r)) == 0) return i;  /* keeps 0 and -0 apart */
+    }
+  }
+  if (s->nk == 0) {  /* first new constant: copy the array */
+    TValue *k = luaM_newvector(s->L, o->sizek + s->n, TValue);
+    memcpy(k, o->k, o->sizek * sizeof(TValue));
+    o->k = k;
+    s->nk = o->sizek + s->n;
+  }
+  if (o->sizek >= s->nk || o->sizek > MAXARG_Bx) return -1;
+  setnvalue(&o->k[o->sizek], r);
+  return o->sizek++;
+}
+
+
+/* same rules as `constfolding' in lcode.c */
+static int fold (OpCode op, const TValue *b, const TValue *c, lua_Number *r) {
+  lua_Number v1, v2;
+  if (b == NULL || c == NULL || !ttisnumber(b) || !ttisnumber(c)) return 0;
+  v1 = nvalue(b);
+  v2 = nvalue(c);
+  switch (op) {
+    case OP_ADD: *r = luai_numadd(v1, v2); break;
+    case OP_SUB: *r = luai_numsub(v1, v2); break;
+    case OP_MUL: *r = luai_nummul(v1, v2); break;
+    case OP_DIV:
+      if (v2 == 0) return 0;
+      *r = luai_numdiv(v1, v2); break;
+    case OP_MOD:
+      if (v2 == 0) return 0;
+      *r = luai_nummod(v1, v2); break;
+    case OP_POW: *r = luai_numpow(v1, v2); break;
+    case OP_UNM: *r = luai_numunm(v1); break;
+    default: return 0;
+  }
+  return !luai_numisnan(*r);
+}
+
+
+/* R(A) := R(B), possibly already true or a known value */
+static void move (OptState *s, int pc, int a, int b) {
+  Instruction *i = &s->o->code[pc];
+  RegInfo v;
+  b = source(s, b);
+  v = s->reg[b];
+  if (a == b || knows(s, a, VCOPY, b) ||
+      (v.kind != VUNKNOWN && knows(s, a, v.kind, v.info))) {
+    drop(s, pc);
+    return;
+  }
+  switch (v.kind) {
+    case VCONST: *i = CREATE_ABx(OP_LOADK, a, v.info); break;
+    case VNIL: *i = CREATE_ABC(OP_LOADNIL, a, a, 0); break;
+    case VTRUE: *i = CREATE_ABC(OP_LOADBOOL, a, 1, 0); break;
+    case VFALSE: *i = CREATE_ABC(OP_LOADBOOL, a, 0, 0); break;
+    default: {
+      *i = CREATE_ABC(OP_MOVE, a, b, 0);
+      if (!s->esc[b]) {
+        learn(s, a, VCOPY, b);
+        return;
+      }
+      break;
+    }
+  }
+  learn(s, a, v.kind, v.info);
+}
+
+
+static void markleaders (OptState *s) {
+  const Instruction *code = s->o->code;
+  int pc;
+  for (pc = 0; pc < s->n; pc++) {
+    Instruction i = code[pc];
+    if (isdata(s, pc)) continue;
+    if (isjump(i))
+      s->flags[jumpto(i, pc)] |= FLEADER;
+    switch (GET_OPCODE(i)) {
+      case OP_JMP:
+        /* the jump after a test is also the way to skip it, so what
+           is known at the test holds after it; other jumps end blocks */
+        if (fixed(s, pc)) break;
+        /* FALLTHROUGH */
+      case OP_FORPREP: case OP_RETURN:
+        if (pc + 1 < s->n) s->flags[pc + 1] |= FLEADER;
+        break;
+      case OP_LOADBOOL:
+        if (GETARG_C(i) != 0) {
+          s->flags[pc + 1] |= FLEADER;
+          s->flags[pc + 2] |= FLEADER;
+        }
+        break;
+      default: break;
+    }
+  }
+}
+
+
+static void propagate (OptState *s) {
+  Proto *o = s->o;
+  int top = o->maxstacksize;
+  int pc, r;
+  markleaders(s);
+  for (pc = 0; pc < s->n; pc++) {
+    Instruction i = o->code[pc];
+    int a = GETARG_A(i);
+    int b = GETARG_B(i);
+    int c = GETARG_C(i);
+    if (isdata(s, pc)) continue;
+    s->pc = pc;
+    if (s->flags[pc] & FLEADER)
+      forget(s, 0, top - 1);
+    else if (pc == 0) {  /* entry: all registers after the parameters are nil */
+      int first = o->numparams + (o->is_vararg & VARARG_HASARG);
+      for (r = 0; r < top; r++)
+        s->reg[r].kind = cast_byte((r < first || s->esc[r]) ? VUNKNOWN : VNIL);
+    }
+    switch (GET_OPCODE(i)) {
+      case OP_MOVE: {
+        move(s, pc, a, b);
+        break;
+      }
+      case OP_LOADK: {
+        if (knows(s, a, VCONST, GETARG_Bx(i))) drop(s, pc);
+        else learn(s, a, VCONST, GETARG_Bx(i));
+        break;
+      }
+      case OP_LOADBOOL: {
+        if (c != 0) forget(s, a, a);
+        else if (knows(s, a, b ? VTRUE : VFALSE, 0)) drop(s, pc);
+        else learn(s, a, b ? VTRUE : VFALSE, 0);
+        break;
+      }
+      case OP_LOADNIL: {
+        for (r = a; r <= b && knows(s, r, VNIL, 0); r++) ;
+        if (r > b) drop(s, pc);
+        else {
+          for (r = a; r <= b; r++) learn(s, r, VNIL, 0);
+        }
+        break;
+      }
+      case OP_GETTABLE: {
+        o->code[pc] = CREATE_ABC(OP_GETTABLE, a, source(s, b), rkoperand(s, c));
+        forget(s, a, a);
+        break;
+      }
+      case OP_SELF: {
+        o->code[pc] = CREATE_ABC(OP_SELF, a, source(s, b), rkoperand(s, c));
+        forget(s, a, a + 1);
+        break;
+      }
+      case OP_SETGLOBAL: {
+        SETARG_A(o->code[pc], source(s, a));
+        break;
+      }
+      case OP_SETUPVAL: {
+        SETARG_A(o->code[pc], source(s, a));
+        break;
+      }
+      case OP_SETTABLE: {
+        o->code[pc] = CREATE_ABC(OP_SETTABLE, source(s, a),
+                                 rkoperand(s, b), rkoperand(s, c));
+        break;
+      }
+      case OP_ADD: case OP_SUB: case OP_MUL:
+      case OP_DIV: case OP_MOD: case OP_POW: {
+        lua_Number v;
+        int k;
+        b = rkoperand(s, b);
+        c = rkoperand(s, c);
+        if (fold(GET_OPCODE(i), constant(s, b), constant(s, c), &v) &&
+            (k = numberK(s, v)) >= 0) {
+          o->code[pc] = CREATE_ABx(OP_LOADK, a, k);
+          learn(s, a, VCONST, k);
+        }
+        else {
+          o->code[pc] = CREATE_ABC(GET_OPCODE(i), a, b, c);
+          forget(s, a, a);
+        }
+        break;
+      }
+      case OP_UNM: {
+        lua_Number v;
+        int k;
+        b = source(s, b);
+        if (fold(OP_UNM, constant(s, b), constant(s, b), &v) &&
+            (k = numberK(s, v)) >= 0) {
+          o->code[pc] = CREATE_ABx(OP_LOADK, a, k);
+          learn(s, a, VCONST, k);
+        }
+        else {
+          SETARG_B(o->code[pc], b);
+          forget(s, a, a);
+        }
+        break;
+      }
+      case OP_NOT: {
+        int t = truth(s, source(s, b));
+        if (t >= 0) {
+          o->code[pc] = CREATE_ABC(OP_LOADBOOL, a, !t, 0);
+          learn(s, a, t ? VFALSE : VTRUE, 0);
+        }
+        else {
+          SETARG_B(o->code[pc], source(s, b));
+          forget(s, a, a);
+        }
+        break;
+      }
+      case OP_LEN: {
+        SETARG_B(o->code[pc], source(s, b));
+        forget(s, a, a);
+        break;
+      }
+      case OP_CONCAT: {
+        forget(s, b, c);  /* concatenation works in place */
+        forget(s, a, a);
+        break;
+      }
+      case OP_EQ: case OP_LT: case OP_LE: {
+        o->code[pc] = CREATE_ABC(GET_OPCODE(i), a, rkoperand(s, b),
+                                 rkoperand(s, c));
+        break;
+      }
+      case OP_TEST: {
+        int t = truth(s, source(s, a));
+        if (t == c) drop(s, pc);  /* always takes the jump */
+        else if (t >= 0) o->code[pc] = CREATE_ABx(OP_JMP, 0, 1 + MAXARG_sBx);
+        else SETARG_A(o->code[pc], source(s, a));
+        break;
+      }
+      case OP_TESTSET: {
+        int t = truth(s, source(s, b));
+        if (t == c) move(s, pc, a, b);
+        else if (t >= 0) o->code[pc] = CREATE_ABx(OP_JMP, 0, 1 + MAXARG_sBx);
+        else {
+          SETARG_B(o->code[pc], source(s, b));
+          forget(s, a, a);
+        }
+        break;
+      }
+      case OP_CALL: case OP_TAILCALL: {
+        forget(s, a, top - 1);
+        break;
+      }
+      case OP_FORLOOP: {
+        forget(s, a, a);
+        forget(s, a + 3, a + 3);
+        break;
+      }
+      case OP_TFORLOOP: {
+        forget(s, a + 2, top - 1);
+        break;
+      }
+      case OP_VARARG: {
+        forget(s, a, b ? a + b - 2 : top - 1);
+        break;
+      }
+      case OP_GETUPVAL: case OP_GETGLOBAL: case OP_NEWTABLE:
+      case OP_FORPREP: case OP_CLOSURE: {
+        forget(s, a, a);
+        break;
+      }
+      default: break;
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Flow analysis
+** =======================================================
+*/
+
+
+static int successors (OptState *s, int pc, int *to) {
+  Instruction i = s->o->code[pc];
+  if (isdead(s, pc)) {
+    to[0] = pc + 1;
+    return 1;
+  }
+  switch (GET_OPCODE(i)) {
+    case OP_JMP: case OP_FORPREP:
+      to[0] = jumpto(i, pc);
+      return 1;
+    case OP_FORLOOP:
+      to[0] = pc + 1;
+      to[1] = jumpto(i, pc);
+      return 2;
+    case OP_RETURN:
+      return 0;
+    case OP_LOADBOOL:
+      to[0] = pc + (GETARG_C(i) ? 2 : 1);
+      return 1;
+    case OP_SETLIST:
+      to[0] = pc + (GETARG_C(i) ? 1 : 2);
+      return 1;
+    case OP_CLOSURE:
+      to[0] = pc + 1 + s->f->p[GETARG_Bx(i)]->nups;
+      return 1;
+    default:
+      to[0] = pc + 1;
+      if (testTMode(GET_OPCODE(i))) {
+        to[1] = pc + 2;
+        return 2;
+      }
+      return 1;
+  }
+}
+
+
+static int unreachable (OptState *s) {
+  int *stack = s->work;
+  int top = 0;
+  int pc, changed = 0;
+  for (pc = 0; pc < s->n; pc++)
+    s->flags[pc] &= ~FREACH;
+  s->flags[0] |= FREACH;
+  stack[top++] = 0;
+  while (top > 0) {
+    int to[2];
+    int k, nt;
+    pc = stack[--top];
+    nt = successors(s, pc, to);
+    for (k = pc + 1; !isdead(s, pc) && isdata(s, k); k++)
+      s->flags[k] |= FREACH;  /* pseudo-instructions go with their owner */
+    for (k = 0; k < nt; k++) {
+      if (!(s->flags[to[k]] & FREACH)) {
+        s->flags[to[k]] |= FREACH;
+        stack[top++] = to[k];
+      }
+    }
+  }
+  for (pc = 0; pc < s->n - 1; pc++) {  /* final return always stays */
+    if (!(s->flags[pc] & (FREACH|FDEAD)) && !fixed(s, pc)) {
+      s->flags[pc] |= FDEAD;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+
+static void setrange (lu_int32 *v, int from, int to) {
+  for (; from <= to; from++) setbit(v, from);
+}
+
+
+static void genrk (lu_int32 *v, int x) {
+  if (!ISK(x)) setbit(v, x);
+}
+
+
+/* registers read (`gen') and always written (`kill') by an instruction */
+static void genkill (OptState *s, int pc, lu_int32 *gen, lu_int32 *kill) {
+  Instruction i = s->o->code[pc];
+  int a = GETARG_A(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  int top = s->o->maxstacksize - 1;
+  memset(gen, 0, s->words * sizeof(lu_int32));
+  memset(kill, 0, s->words * sizeof(lu_int32));
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_UNM: case OP_NOT: case OP_LEN:
+      setbit(gen, b); setbit(kill, a); break;
+    case OP_LOADK: case OP_LOADBOOL: case OP_GETUPVAL:
+    case OP_GETGLOBAL: case OP_NEWTABLE:
+      setbit(kill, a); break;
+    case OP_LOADNIL:
+      setrange(kill, a, b); break;
+    case OP_GETTABLE:
+      setbit(gen, b); genrk(gen, c); setbit(kill, a); break;
+    case OP_SELF:
+      setbit(gen, b); genrk(gen, c); setrange(kill, a, a + 1); break;
+    case OP_SETGLOBAL: case OP_SETUPVAL: case OP_TEST:
+      setbit(gen, a); break;
+    case OP_SETTABLE:
+      setbit(gen, a); genrk(gen, b); genrk(gen, c); break;
+    case OP_CONCAT:
+      setrange(gen, b, c); setbit(kill, a); break;
+    case OP_ADD: case OP_SUB: case OP_MUL:
+    case OP_DIV: case OP_MOD: case OP_POW:
+      genrk(gen, b); genrk(gen, c); setbit(kill, a); break;
+    case OP_EQ: case OP_LT: case OP_LE:
+      genrk(gen, b); genrk(gen, c); break;
+    case OP_TESTSET:  /* `a' is only written when the test holds */
+      setbit(gen, b); break;
+    case OP_CALL: case OP_TAILCALL:
+      setrange(gen, a, b ? a + b - 1 : top);
+      if (c > 1) setrange(kill, a, a + c - 2);
+      break;
+    case OP_RETURN:
+      setrange(gen, a, b ? a + b - 2 : top); break;
+    case OP_FORLOOP: case OP_FORPREP:
+      setrange(gen, a, a + 2); break;
+    case OP_TFORLOOP:
+      setrange(gen, a, a + 2); setrange(kill, a + 3, a + 2 + c); break;
+    case OP_SETLIST:
+      setrange(gen, a, b ? a + b : top); break;
+    case OP_CLOSURE: {
+      int j, nup = s->f->p[GETARG_Bx(i)]->nups;
+      for (j = 1; j <= nup; j++) {
+        Instruction u = s->o->code[pc + j];
+        if (GET_OPCODE(u) == OP_MOVE) setbit(gen, GETARG_B(u));
+      }
+      setbit(kill, a);
+      break;
+    }
+    case OP_VARARG:
+      if (b > 1) setrange(kill, a, a + b - 2);
+      break;
+    default: break;
+  }
+}
+
+
+static void liveout (OptState *s, int pc, lu_int32 *out) {
+  int to[2];
+  int k, w;
+  int nt = successors(s, pc, to);
+  memset(out, 0, s->words * sizeof(lu_int32));
+  for (k = 0; k < nt; k++) {
+    const lu_int32 *in = s->live + to[k] * s->words;
+    for (w = 0; w < s->words; w++) out[w] |= in[w];
+  }
+  if (!isdead(s, pc) && GET_OPCODE(s->o->code[pc]) == OP_FORLOOP) {
+    /* the loop variable is set on the way back into the body */
+    int r = GETARG_A(s->o->code[pc]) + 3;
+    const lu_int32 *exit = s->live + (pc + 1) * s->words;
+    if (!testbit(exit, r))
+      out[r >> 5] &= ~(cast(lu_int32, 1) << (r & 31));
+  }
+}
+
+
+static void liveness (OptState *s) {
+  lu_int32 out[(MAXSTACK + 31) / 32];
+  lu_int32 gen[(MAXSTACK + 31) / 32];
+  lu_int32 kill[(MAXSTACK + 31) / 32];
+  int changed, pc, w;
+  memset(s->live, 0, s->n * s->words * sizeof(lu_int32));
+  do {
+    changed = 0;
+    for (pc = s->n - 1; pc >= 0; pc--) {
+      lu_int32 *in = s->live + pc * s->words;
+      if (isdata(s, pc) || !(s->flags[pc] & FREACH)) continue;
+      liveout(s, pc, out);
+      if (isdead(s, pc)) {
+        memset(gen, 0, s->words * sizeof(lu_int32));
+        memset(kill, 0, s->words * sizeof(lu_int32));
+      }
+      else
+        genkill(s, pc, gen, kill);
+      for (w = 0; w < s->words; w++) {
+        lu_int32 v = gen[w] | (out[w] & ~kill[w]);
+        if (v != in[w]) {
+          in[w] = v;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+}
+
+
+/* remove writes to registers nobody reads afterwards */
+static int deadstores (OptState *s) {
+  lu_int32 out[(MAXSTACK + 31) / 32];
+  int pc, r, changed = 0;
+  liveness(s);
+  for (pc = 0; pc < s->n - 1; pc++) {
+    Instruction i = s->o->code[pc];
+    int a = GETARG_A(i);
+    int last = a;
+    if ((s->flags[pc] & (FDATA|FDEAD)) || !(s->flags[pc] & FREACH) ||
+        fixed(s, pc))
+      continue;
+    switch (GET_OPCODE(i)) {
+      case OP_MOVE: case OP_LOADK: case OP_GETUPVAL:
+      case OP_NOT: case OP_NEWTABLE:
+        break;
+      case OP_LOADBOOL:
+        if (GETARG_C(i) != 0) continue;
+        break;
+      case OP_LOADNIL:
+        last = GETARG_B(i);
+        break;
+      default:
+        continue;
+    }
+    liveout(s, pc, out);
+    for (r = a; r <= last && !s->esc[r] && !testbit(out, r); r++) ;
+    if (r > last) {
+      s->flags[pc] |= FDEAD;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+
+/* remove jumps to the next surviving instruction */
+static int nextjumps (OptState *s) {
+  int pc, k, changed = 0;
+  for (pc = 0; pc < s->n; pc++) {
+    Instruction i = s->o->code[pc];
+    int t;
+    if ((s->flags[pc] & (FDATA|FDEAD)) || GET_OPCODE(i) != OP_JMP ||
+        fixed(s, pc))
+      continue;
+    t = jumpto(i, pc);
+    if (t <= pc) continue;
+    for (k = pc + 1; k < t && isdead(s, k); k++) ;
+    if (k == t) {
+      s->flags[pc] |= FDEAD;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+
+static void threadjumps (OptState *s) {
+  Instruction *code = s->o->code;
+  int pc;
+  for (pc = 0; pc < s->n; pc++) {
+    int t, steps;
+    if (isdata(s, pc) || GET_OPCODE(code[pc]) != OP_JMP) continue;
+    t = jumpto(code[pc], pc);
+    for (steps = 0; steps < 16 && t != pc && !isdata(s, t) &&
+                    GET_OPCODE(code[t]) == OP_JMP; steps++)
+      t = jumpto(code[t], t);
+    if (t - (pc + 1) <= MAXARG_sBx && (pc + 1) - t <= MAXARG_sBx)
+      SETARG_sBx(code[pc], t - (pc + 1));
+  }
+}
+
+/* }====================================================== */
+
+
+static void scan (OptState *s) {
+  const Instruction *code = s->o->code;
+  int pc, j;
+  for (pc = 0; pc < s->n; pc++) {
+    Instruction i = code[pc];
+    if (GET_OPCODE(i) == OP_CLOSURE) {
+      int nup = s->f->p[GETARG_Bx(i)]->nups;
+      for (j = 1; j <= nup; j++) {
+        s->flags[pc + j] |= FDATA;
+        if (GET_OPCODE(code[pc + j]) == OP_MOVE)
+          s->esc[GETARG_B(code[pc + j])] = 1;
+      }
+      pc += nup;
+    }
+    else if (GET_OPCODE(i) == OP_SETLIST && GETARG_C(i) == 0)
+      s->flags[++pc] |= FDATA;
+  }
+}
+
+
+static void compact (OptState *s) {
+  Proto *o = s->o;
+  int *newpc = s->work;
+  int pc, j;
+  for (pc = 0, j = 0; pc < s->n; pc++) {
+    newpc[pc] = j;
+    if (!isdead(s, pc)) j++;
+  }
+  newpc[s->n] = j;
+  for (pc = 0, j = 0; pc < s->n; pc++) {
+    Instruction i = o->code[pc];
+    if (isdead(s, pc)) continue;
+    if (!isdata(s, pc) && isjump(i))
+      SETARG_sBx(i, newpc[jumpto(i, pc)] - (j + 1));
+    o->code[j] = i;
+    if (o->sizelineinfo > 0) o->lineinfo[j] = o->lineinfo[pc];
+    j++;
+  }
+  o->sizecode = j;
+  if (o->sizelineinfo > 0) o->sizelineinfo = j;
+  for (j = 0; j < o->sizelocvars; j++) {
+    o->locvars[j].startpc = newpc[o->locvars[j].startpc];
+    o->locvars[j].endpc = newpc[o->locvars[j].endpc];
+  }
+}
+
+
+void luaU_freeopt (lua_State* L, const Proto* f, Proto* o) {
+  luaM_freearray(L, o->code, o->sizecode, Instruction);
+  if (o->lineinfo != f->lineinfo)
+    luaM_freearray(L, o->lineinfo, o->sizelineinfo, int);
+  if (o->locvars != f->locvars)
+    luaM_freearray(L, o->locvars, o->sizelocvars, LocVar);
+  if (o->k != f->k) luaM_freearray(L, o->k, o->sizek, TValue);
+}
+
+
+static void optimize (lua_State *L, void *ud) {
+  OptState *s = cast(OptState *, ud);
+  const Proto *f = s->f;
+  Proto *o = s->o;
+  size_t n = cast(unsigned int, s->n);  /* sizes are never negative */
+  o->code = luaM_newvector(L, n, Instruction);
+  s->ncode = s->n;
+  memcpy(o->code, f->code, n * sizeof(Instruction));
+  if (f->sizelineinfo > 0) {
+    o->lineinfo = luaM_newvector(L, n, int);
+    s->nline = s->n;
+    memcpy(o->lineinfo, f->lineinfo, n * sizeof(int));
+  }
+  if (f->sizelocvars > 0) {
+    o->locvars = luaM_newvector(L, f->sizelocvars, LocVar);
+    memcpy(o->locvars, f->locvars, f->sizelocvars * sizeof(LocVar));
+  }
+  s->flags = luaM_newvector(L, n, lu_byte);
+  s->work = luaM_newvector(L, n + 1, int);
+  s->live = luaM_newvector(L, n * s->words, lu_int32);
+  memset(s->flags, 0, n);
+  scan(s);
+  threadjumps(s);
+  propagate(s);
+  while (unreachable(s) | deadstores(s) | nextjumps(s)) ;
+  compact(s);
+  /* give back what compaction freed */
+  luaM_reallocvector(L, o->code, s->ncode, o->sizecode, Instruction);
+  s->ncode = o->sizecode;
+  if (f->sizelineinfo > 0) {
+    luaM_reallocvector(L, o->lineinfo, s->nline, o->sizelineinfo, int);
+    s->nline = o->sizelineinfo;
+  }
+  if (s->nk > 0) {
+    luaM_reallocvector(L, o->k, s->nk, o->sizek, TValue);
+    s->nk = o->sizek;
+  }
+}
+
+
+/* free the copies and scratch space of an optimization that failed */
+static void release (OptState *s) {
+  lua_State *L = s->L;
+  const Proto *f = s->f;
+  Proto *o = s->o;
+  if (o->code != f->code) luaM_freearray(L, o->code, s->ncode, Instruction);
+  if (o->lineinfo != f->lineinfo)
+    luaM_freearray(L, o->lineinfo, s->nline, int);
+  if (o->locvars != f->locvars)
+    luaM_freearray(L, o->locvars, f->sizelocvars, LocVar);
+  if (s->nk > 0) luaM_freearray(L, o->k, s->nk, TValue);
+}
+
+
+/*
+** optimize a copy of `f' into `o'; returns 0 (and leaves nothing to
+** free) when the result does not pass the undump verifier.  Errors
+** (out of memory) are raised again once the copies are freed.
+*/
+int luaU_optimize (lua_State* L, const Proto* f, Proto* o) {
+  OptState s;
+  int status;
+  *o = *f;
+  s.L = L;
+  s.f = f;
+  s.o = o;
+  s.n = f->sizecode;
+  s.pc = 0;
+  s.ncode = s.nline = 0;
+  s.nk = 0;
+  s.words = (f->maxstacksize + 31) / 32 + 1;
+  s.flags = NULL;
+  s.work = NULL;
+  s.live = NULL;
+  memset(s.esc, 0, sizeof(s.esc));
+  memset(s.reg, 0, sizeof(s.reg));
+  status = luaD_rawrunprotected(L, optimize, &s);
+  if (s.flags) luaM_freearray(L, s.flags, s.n, lu_byte);
+  if (s.work) luaM_freearray(L, s.work, s.n + 1, int);
+  if (s.live) luaM_freearray(L, s.live, s.n * s.words, lu_int32);
+  if (status != 0) {
+    release(&s);
+    luaD_throw(L, status);
+  }
+  if (!luaG_checkcode(o)) {
+    luaU_freeopt(L, f, o);
+    return 0;
+  }
+  return 1;
+}
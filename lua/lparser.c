@@ -222,6 +222,24 @@ static void markupval (FuncState *fs, int level) {
 }
 
 
+/*
+** a body compiled on demand cannot see the enclosing functions any
+** more; its free names are either the upvalues chosen when it was
+** skipped or globals
+*/
+static int lazyvar (FuncState *fs, TString *n, expdesc *var) {
+  int i;
+  for (i=0; i<fs->f->nups; i++) {
+    if (fs->f->upvalues[i] == n) {
+      init_exp(var, VUPVAL, i);
+      return VUPVAL;
+    }
+  }
+  init_exp(var, VGLOBAL, NO_REG);
+  return VGLOBAL;
+}
+
+
 static int singlevaraux (FuncState *fs, TString *n, expdesc *var, int base) {
   if (fs == NULL) {  /* no more levels? */
     init_exp(var, VGLOBAL, NO_REG);  /* default is global variable */
@@ -235,6 +253,8 @@ static int singlevaraux (FuncState *fs, TString *n, expdesc *var, int base) {
         markupval(fs, v);  /* local will be used as an upval */
       return VLOCAL;
     }
+    else if (fs->prev == NULL && fs->ls->lazy != NULL)
+      return lazyvar(fs, n, var);
     else {  /* not found at current level; try upper one */
       if (singlevaraux(fs->prev, n, var, 0) == VGLOBAL)
         return VGLOBAL;
@@ -382,11 +402,13 @@ static void close_func (LexState *ls) {
 }
 
 
-Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff, const char *name) {
+Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff, Mbuffer *lazybuff,
+                    const char *name) {
   struct LexState lexstate;
   struct FuncState funcstate;
   lexstate.buff = buff;
   luaX_setinput(L, &lexstate, z, luaS_new(L, name));
+  lexstate.lazybuff = lazybuff;
   open_func(&lexstate, &funcstate);
   funcstate.f->is_vararg = VARARG_ISVARARG;  /* main func. is always vararg */
   luaX_next(&lexstate);  /* read first token */
@@ -575,22 +597,198 @@ static void parlist (LexState *ls) {
 }
 
 
-static void body (LexState *ls, expdesc *e, int needself, int line) {
-  /* body ->  `(' parlist `)' chunk END */
-  FuncState new_fs;
-  open_func(ls, &new_fs);
-  new_fs.f->linedefined = line;
+/*
+** {======================================================================
+** Bodies compiled on demand
+** =======================================================================
+*/
+
+
+/*
+** skip `(' parlist `)' chunk END keeping only its source. Every name
+** in the body that is visible as an enclosing local becomes an
+** upvalue, since the body's own declarations are not known yet; an
+** unneeded upvalue only keeps that local alive a little longer.
+** Field names (after `.', `:', or before `=' directly inside `{}')
+** are not variables and are left alone, as the parser does.
+*/
+static void lazybody (LexState *ls, int needself, int line) {
+  FuncState *fs = ls->fs;
+  Mbuffer *b = ls->lazybuff;
+  int paren = ls->linenumber;  /* line of `(' */
+  int depth = 0;  /* nested blocks closed by END */
+  int last = 0;  /* previous token */
+  char nest[LUAI_MAXCCALLS];  /* open brackets and blocks, '{' or 0 */
+  int nnest = 0;
+  int hasparams;
+  const char *self;
+  size_t n, extra;
+  char *p;
+  luaX_capture(ls, b);
   checknext(ls, '(');
+  hasparams = (ls->t.token != ')');
   if (needself) {
     new_localvarliteral(ls, "self", 0);
     adjustlocalvars(ls, 1);
   }
   parlist(ls);
   checknext(ls, ')');
-  chunk(ls);
-  new_fs.f->lastlinedefined = ls->linenumber;
+  while (depth > 0 || ls->t.token != TK_END) {
+    switch (ls->t.token) {
+      case TK_FUNCTION: case TK_DO: case TK_IF: {
+        depth++;
+        if (nnest < LUAI_MAXCCALLS) nest[nnest] = 0;
+        nnest++;
+        break;
+      }
+      case '{': case '(': case '[': {
+        if (nnest < LUAI_MAXCCALLS) nest[nnest] = (ls->t.token == '{') ? '{' : 0;
+        nnest++;
+        break;
+      }
+      case TK_END: depth--;  /* FALLTHROUGH */
+      case '}': case ')': case ']': {
+        if (nnest > 0) nnest--;
+        break;
+      }
+      case TK_NAME: {
+        if (last == '.' || last == ':')  /* field name? */
+          break;
+        if (nnest > 0 && nnest <= LUAI_MAXCCALLS && nest[nnest - 1] == '{') {
+          luaX_lookahead(ls);
+          if (ls->lookahead.token == '=')  /* constructor key? */
+            break;
+        }
+        {
+          expdesc v;
+          singlevaraux(fs, ls->t.seminfo.ts, &v, 1);
+        }
+        break;
+      }
+      case TK_EOS: check_match(ls, TK_END, TK_FUNCTION, line); break;
+      default: break;
+    }
+    last = ls->t.token;
+    luaX_next(ls);
+  }
+  fs->f->lastlinedefined = ls->linenumber;
+  luaX_capture(ls, NULL);
+  /* prefix the source with the lines before `(', `(' and `self' */
+  self = needself ? (hasparams ? "self," : "self") : "";
+  extra = (paren - line) + 1 + strlen(self);
+  n = luaZ_bufflen(b);
+  /* kept out of the string table: bodies often differ in few characters */
+  p = luaM_newvector(ls->L, n + extra, char);
+  memset(p, '\n', paren - line);
+  p[paren - line] = '(';
+  memcpy(p + paren - line + 1, self, strlen(self));
+  memcpy(p + extra, luaZ_buffer(b), n);
+  fs->f->lazy = p;
+  fs->f->sizelazy = cast_int(n + extra);
   check_match(ls, TK_END, TK_FUNCTION, line);
-  close_func(ls);
+}
+
+
+static void close_lazy (LexState *ls) {
+  lua_State *L = ls->L;
+  FuncState *fs = ls->fs;
+  Proto *f = fs->f;
+  removevars(ls, 0);
+  luaM_freearray(L, f->locvars, f->sizelocvars, LocVar);
+  f->locvars = NULL;
+  f->sizelocvars = 0;
+  luaM_reallocvector(L, f->upvalues, f->sizeupvalues, f->nups, TString *);
+  f->sizeupvalues = f->nups;
+  ls->fs = fs->prev;
+  anchor_token(ls);
+  L->top -= 2;  /* remove table and prototype from the stack */
+}
+
+
+/* move the code compiled into `tf' to the skipped function `f' */
+static void lazymove (lua_State *L, Proto *f, Proto *tf) {
+  int i;
+#define swapfield(a,b,t)	{ t tmp_ = (a); (a) = (b); (b) = tmp_; }
+  swapfield(f->k, tf->k, TValue *);
+  swapfield(f->sizek, tf->sizek, int);
+  swapfield(f->code, tf->code, Instruction *);
+  swapfield(f->sizecode, tf->sizecode, int);
+  swapfield(f->p, tf->p, Proto **);
+  swapfield(f->sizep, tf->sizep, int);
+  swapfield(f->lineinfo, tf->lineinfo, int *);
+  swapfield(f->sizelineinfo, tf->sizelineinfo, int);
+  swapfield(f->locvars, tf->locvars, LocVar *);
+  swapfield(f->sizelocvars, tf->sizelocvars, int);
+#undef swapfield
+  f->numparams = tf->numparams;
+  f->is_vararg = tf->is_vararg;
+  f->maxstacksize = tf->maxstacksize;
+  luaM_freearray(L, f->lazy, f->sizelazy, char);
+  f->lazy = NULL;
+  f->sizelazy = 0;
+  /* `f' may be black already */
+  for (i=0; i<f->sizek; i++)
+    luaC_barrier(L, f, &f->k[i]);
+  for (i=0; i<f->sizep; i++)
+    luaC_objbarrier(L, f, f->p[i]);
+  for (i=0; i<f->sizelocvars; i++)
+    luaC_objbarrier(L, f, f->locvars[i].varname);
+}
+
+
+void luaY_compile (lua_State *L, Proto *f, ZIO *z, Mbuffer *buff,
+                   Mbuffer *lazybuff) {
+  struct LexState lexstate;
+  struct FuncState funcstate;
+  Proto *tf;
+  int i;
+  lexstate.buff = buff;
+  luaX_setinput(L, &lexstate, z, f->source);
+  lexstate.lazybuff = lazybuff;
+  lexstate.lazy = f;
+  lexstate.linenumber = lexstate.lastline = f->linedefined;
+  open_func(&lexstate, &funcstate);
+  tf = funcstate.f;
+  tf->linedefined = f->linedefined;
+  tf->upvalues = luaM_newvector(L, f->nups, TString *);
+  for (i=0; i<f->nups; i++)
+    tf->upvalues[i] = f->upvalues[i];
+  tf->sizeupvalues = tf->nups = f->nups;
+  luaX_next(&lexstate);  /* read first token */
+  checknext(&lexstate, '(');
+  parlist(&lexstate);
+  checknext(&lexstate, ')');
+  chunk(&lexstate);
+  check_match(&lexstate, TK_END, TK_FUNCTION, f->linedefined);
+  close_func(&lexstate);
+  lazymove(L, f, tf);
+}
+
+/* }====================================================================== */
+
+
+static void body (LexState *ls, expdesc *e, int needself, int line) {
+  /* body ->  `(' parlist `)' chunk END */
+  FuncState new_fs;
+  open_func(ls, &new_fs);
+  new_fs.f->linedefined = line;
+  if (ls->lazybuff != NULL) {  /* compile it on its first call */
+    lazybody(ls, needself, line);
+    close_lazy(ls);
+  }
+  else {
+    checknext(ls, '(');
+    if (needself) {
+      new_localvarliteral(ls, "self", 0);
+      adjustlocalvars(ls, 1);
+    }
+    parlist(ls);
+    checknext(ls, ')');
+    chunk(ls);
+    new_fs.f->lastlinedefined = ls->linenumber;
+    check_match(ls, TK_END, TK_FUNCTION, line);
+    close_func(ls);
+  }
   pushclosure(ls, &new_fs, e);
 }
 
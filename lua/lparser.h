@@ -76,7 +76,9 @@ typedef struct FuncState {
 
 
 LUAI_FUNC Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
-                                            const char *name);
+                              Mbuffer *lazybuff, const char *name);
+LUAI_FUNC void luaY_compile (lua_State *L, Proto *f, ZIO *z, Mbuffer *buff,
+                             Mbuffer *lazybuff);
 
 
 #endif
@@ -106,6 +106,15 @@ typedef struct Charset {
 /* size (in elements) for a ISet instruction */
 #define CHARSETINSTSIZE		instsize(CHARSETSIZE)
 
+/*
+** an ISpan instruction is followed by its charset and by up to
+** MAXSPANRANGES byte ranges [lo, hi] describing the same set (or its
+** complement, with SPANNEG) for the vectorized scan
+*/
+#define MAXSPANRANGES	4
+#define SPANNEG		8
+#define SPANINSTSIZE	(CHARSETINSTSIZE + instsize(2 * MAXSPANRANGES) - 1)
+
 /* size (in elements) for a IFunc instruction */
 #define funcinstsize(p)		((p)->i.aux + 2)
 
@@ -113,6 +122,13 @@ typedef struct Charset {
 
 #define testchar(st,c)	(((int)(st)[((c) >> 3)] & (1 << ((c) & 7))))
 
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPANBLOCK	16
+#endif
+
 /* initial size for call/backtrack stack */
 #if !defined(INITBACK)
 #define INITBACK	100
@@ -155,7 +171,7 @@ typedef enum Opcode {
   ITestAny,  /* in no char, jump to 'offset' */
   ITestChar,  /* if char != aux, jump to 'offset' */
   ITestSet,  /* if char not in buff, jump to 'offset' */
-  ISpan,  /* read a span of chars in buff */
+  ISpan,  /* read a span of chars in buff (with ranges after it) */
   IBehind,  /* walk back 'aux' characters (fail if not possible) */
   IRet,  /* return from a rule */
   IEnd,  /* end of pattern */
@@ -193,7 +209,7 @@ static const Instruction giveup = {{IGiveup, 0, 0}};
 
 
 static const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop);
+                   Instruction *op, Capture *capture, int ptop, int *hitend);
 
 /*
 ** types of trees
@@ -889,6 +905,28 @@ static int cs_disjoint (const Charset *cs1, const Charset *cs2) {
 /*
 ** Convert a 'char' pattern (TSet, TChar, TAny) to a charset
 */
+/*
+** Describe charset 'cs' as at most MAXSPANRANGES byte ranges in 'r';
+** return the number of ranges, or -1 if more are needed
+*/
+static int cs_ranges (const byte *cs, byte *r) {
+  int n = 0;
+  int c = 0;
+  while (c <= UCHAR_MAX) {
+    int lo;
+    while (c <= UCHAR_MAX && !testchar(cs, c)) c++;
+    if (c > UCHAR_MAX) break;
+    lo = c;
+    while (c <= UCHAR_MAX && testchar(cs, c)) c++;
+    if (n == MAXSPANRANGES) return -1;
+    r[2 * n] = (byte)lo;
+    r[2 * n + 1] = (byte)(c - 1);
+    n++;
+  }
+  return n;
+}
+
+
 static int tocharset (TTree *tree, Charset *cs) {
   switch (tree->tag) {
     case TSet: {  /* copy set */
@@ -1187,7 +1225,8 @@ static int needfollow (TTree *tree) {
 */
 static int sizei (const Instruction *i) {
   switch((Opcode)i->i.code) {
-    case ISet: case ISpan: return CHARSETINSTSIZE;
+    case ISet: return CHARSETINSTSIZE;
+    case ISpan: return SPANINSTSIZE;
     case ITestSet: return CHARSETINSTSIZE + 1;
     case ITestChar: case ITestAny: case IChoice: case IJmp: 
     case ICall: case IOpenCall: case ICommit: case IPartialCommit:
@@ -1500,9 +1539,53 @@ static void coderuntime (CompileState *compst, TTree *tree, int tt) {
 }
 
 
+/*
+** Remove from 'cs' the chars that may start 'tree' (where 'tree' cannot
+** match, '-tree' holds without reading anything). Return true if any
+** char is left.
+*/
+static int cs_skipfirst (TTree *tree, Charset *cs) {
+  Charset first;
+  int c;
+  if (getfirst(tree, fullset, &first))
+    return 0;  /* 'tree' may match the empty string */
+  loopset(i, cs->cs[i] &= ~first.cs[i]);
+  return charsettype(cs->cs, &c) != IFail;
+}
+
+
+/*
+** Code an ISpan for charset 'cs'. If the set (or its complement) is
+** a few byte ranges, record them so that the VM can scan the subject
+** a block at a time.
+*/
+static void codespan (CompileState *compst, const byte *cs) {
+  byte r[2 * MAXSPANRANGES];
+  Charset cmp;
+  int i = addinstruction(compst, ISpan, 0);
+  int n = cs_ranges(cs, r);
+  int j;
+  if (n < 0) {
+    loopset(k, cmp.cs[k] = ~cs[k]);
+    n = cs_ranges(cmp.cs, r);
+    n = (n > 0) ? (n | SPANNEG) : 0;
+  }
+  addcharset(compst, cs);
+  for (j = CHARSETINSTSIZE; j < (int)SPANINSTSIZE; j++)
+    nextinstruction(compst);  /* space for ranges */
+  getinstr(compst, i).i.aux = n;
+  memset(getinstr(compst, i + CHARSETINSTSIZE).buff, 0, sizeof(r));
+  memcpy(getinstr(compst, i + CHARSETINSTSIZE).buff, r,
+         2 * (n & ~SPANNEG) * sizeof(byte));
+}
+
+
 /*
 ** Repetion; optimizations:
 ** When pattern is a charset, can use special instruction ISpan.
+** When pattern is '(p - q)' with 'p' a charset (e.g., '(1 - "]]")^0'),
+** a span over the chars in 'p' that cannot start 'q' skips most of the
+** subject before each full iteration.
 ** When pattern is head fail, or if it starts with characters that
 ** are disjoint from what follows the repetions, a simple test
 ** is enough (a fail inside the repetition would backtrack to fail
@@ -1514,8 +1597,20 @@ static void coderep (CompileState *compst, TTree *tree, int opt,
                      const Charset *fl) {
   Charset st;
   if (tocharset(tree, &st)) {
-    addinstruction(compst, ISpan, 0);
-    addcharset(compst, st.cs);
+    codespan(compst, st.cs);
+  }
+  else if (tree->tag == TSeq && sib1(tree)->tag == TNot &&
+           tocharset(sib2(tree), &st) && !hascaptures(sib1(tree)) &&
+           cs_skipfirst(sib1(sib1(tree)), &st)) {
+    /* L1: span(p - first(q)); choice L2; <p - q>; commit L1; L2: */
+    int l1 = gethere(compst);
+    int choice, commit;
+    codespan(compst, st.cs);
+    choice = addoffsetinst(compst, IChoice);
+    codegen(compst, tree, 0, NOINST, fullset);
+    commit = addoffsetinst(compst, ICommit);
+    jumptothere(compst, commit, l1);
+    jumptohere(compst, choice);
   }
   else {
     int e1 = getfirst(tree, fullset, &st);
@@ -1821,6 +1916,13 @@ static void printinst (const Instruction *op, const Instruction *p) {
     }
     case ISpan: {
       printcharset((p+1)->buff);
+      if (p->i.aux != 0) {
+        const byte *r = (p + CHARSETINSTSIZE)->buff;
+        int i;
+        printf(p->i.aux & SPANNEG ? " not" : "");
+        for (i = 0; i < (p->i.aux & ~SPANNEG); i++)
+          printf(" %02x-%02x", r[2 * i], r[2 * i + 1]);
+      }
       break;
     }
     case IOpenCall: {
@@ -2070,8 +2172,44 @@ static int removedyncap (lua_State *L, Capture *capture,
 /*
 ** Opcode interpreter
 */
+#if defined(SPANBLOCK)
+
+/*
+** Skip whole blocks of the subject whose bytes all fall in (or, with
+** SPANNEG, all fall outside) the instruction's ranges. Stops at the
+** first block with a byte that ends the span; the byte loop in ISpan
+** finishes from there.
+*/
+static const char *spanranges (const char *s, const char *e, const byte *r,
+                               int aux) {
+  __m128i lo[MAXSPANRANGES], wd[MAXSPANRANGES];
+  int n = aux & ~SPANNEG;
+  unsigned int neg = (aux & SPANNEG) ? 0xFFFFu : 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    lo[i] = _mm_set1_epi8((char)r[2 * i]);
+    wd[i] = _mm_set1_epi8((char)(r[2 * i + 1] - r[2 * i]));
+  }
+  while (e - s >= SPANBLOCK) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i in = _mm_setzero_si128();
+    unsigned int mask;
+    for (i = 0; i < n; i++) {  /* v - lo <= hi - lo, unsigned */
+      __m128i d = _mm_sub_epi8(v, lo[i]);
+      in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(d, wd[i]), d));
+    }
+    mask = ((unsigned int)_mm_movemask_epi8(in)) ^ neg;
+    if (mask != 0xFFFFu) break;
+    s += SPANBLOCK;
+  }
+  return s;
+}
+
+#endif
+
+
 static const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop) {
+                   Instruction *op, Capture *capture, int ptop, int *hitend) {
   Stack stackbase[INITBACK];
   Stack *stacklimit = stackbase + INITBACK;
   Stack *stack = stackbase;  /* point to first empty slot in stack */
@@ -2079,6 +2217,7 @@ static const char *match (lua_State *L, const char *o, const char *s, const char
   int captop = 0;  /* point to first empty slot in captures */
   int ndyncap = 0;  /* number of dynamic captures (in Lua stack) */
   const Instruction *p = op;  /* current instruction */
+  int atend = 0;  /* some instruction looked at the end of the subject */
   stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
   lua_pushlightuserdata(L, stackbase);
   for (;;) {
@@ -2088,10 +2227,12 @@ static const char *match (lua_State *L, const char *o, const char *s, const char
         assert(stack == getstackbase(L, ptop) + 1);
         capture[captop].kind = Cclose;
         capture[captop].s = NULL;
+        *hitend = atend;
         return s;
       }
       case IGiveup: {
         assert(stack == getstackbase(L, ptop));
+        *hitend = atend;
         return NULL;
       }
       case IRet: {
@@ -2099,38 +2240,37 @@ static const char *match (lua_State *L, const char *o, const char *s, const char
         p = (--stack)->p;
         continue;
       }
+      /* subjects may be native buffers: never read the byte at 'e' */
       case IAny: {
         if (s < e) { p++; s++; }
-        else goto fail;
+        else { atend = 1; goto fail; }
         continue;
       }
       case ITestAny: {
         if (s < e) p += 2;
-        else p += getoffset(p);
+        else { atend = 1; p += getoffset(p); }
         continue;
       }
       case IChar: {
-        if ((byte)*s == p->i.aux && s < e) { p++; s++; }
-        else goto fail;
+        if (s < e && (byte)*s == p->i.aux) { p++; s++; }
+        else { atend |= (s >= e); goto fail; }
         continue;
       }
       case ITestChar: {
-        if ((byte)*s == p->i.aux && s < e) p += 2;
-        else p += getoffset(p);
+        if (s < e && (byte)*s == p->i.aux) p += 2;
+        else { atend |= (s >= e); p += getoffset(p); }
         continue;
       }
       case ISet: {
-        int c = (byte)*s;
-        if (testchar((p+1)->buff, c) && s < e)
+        if (s < e && testchar((p+1)->buff, (byte)*s))
           { p += CHARSETINSTSIZE; s++; }
-        else goto fail;
+        else { atend |= (s >= e); goto fail; }
         continue;
       }
       case ITestSet: {
-        int c = (byte)*s;
-        if (testchar((p + 2)->buff, c) && s < e)
+        if (s < e && testchar((p + 2)->buff, (byte)*s))
           p += 1 + CHARSETINSTSIZE;
-        else p += getoffset(p);
+        else { atend |= (s >= e); p += getoffset(p); }
         continue;
       }
       case IBehind: {
@@ -2140,11 +2280,16 @@ static const char *match (lua_State *L, const char *o, const char *s, const char
         continue;
       }
       case ISpan: {
+#if defined(SPANBLOCK)
+        if (p->i.aux != 0)
+          s = spanranges(s, e, (p + CHARSETINSTSIZE)->buff, p->i.aux);
+#endif
         for (; s < e; s++) {
           int c = (byte)*s;
           if (!testchar((p+1)->buff, c)) break;
         }
-        p += CHARSETINSTSIZE;
+        atend |= (s >= e);
+        p += SPANINSTSIZE;
         continue;
       }
       case IJmp: {
@@ -3322,6 +3467,52 @@ static size_t initposition (lua_State *L, size_t len) {
 }
 
 
+/*
+** Get the subject at 'idx': a string, or a userdata whose metatable
+** has a '__bytes' function returning its contents as a light userdata
+** and a length (e.g., buffers of the native modules). Such contents
+** are matched in place, unless the pattern calls Lua (see 'callslua').
+*/
+static const char *getsubject (lua_State *L, int idx, size_t *len) {
+  if (lua_type(L, idx) == LUA_TUSERDATA &&
+      luaL_getmetafield(L, idx, "__bytes")) {
+    const char *s;
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 2);
+    s = (const char *)lua_touserdata(L, -2);
+    *len = (size_t)lua_tonumber(L, -1);
+    lua_pop(L, 2);
+    if (s == NULL && *len > 0)
+      luaL_error(L, "invalid subject contents");
+    return (s != NULL) ? s : "";
+  }
+  return luaL_checklstring(L, idx, len);
+}
+
+
+/*
+** Can the code call Lua functions while matching or building its
+** captures? Such a function could change a '__bytes' subject under
+** the matcher.
+*/
+static int callslua (Pattern *p) {
+  int i;
+  for (i = 0; i < p->codesize; i += sizei(&p->code[i])) {
+    switch ((Opcode)p->code[i].i.code) {
+      case ICloseRunTime: return 1;
+      case IOpenCapture: case IFullCapture: {
+        int kind = getkind(&p->code[i]);
+        if (kind == Cfunction || kind == Cquery || kind == Cfold)
+          return 1;
+        break;
+      }
+      default: break;
+    }
+  }
+  return 0;
+}
+
+
 /*
 ** Main match function
 */
@@ -3329,15 +3520,23 @@ static int lp_match (lua_State *L) {
   Capture capture[INITCAPSIZE];
   const char *r;
   size_t l;
+  int hitend;
   Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
   Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
-  const char *s = luaL_checklstring(L, SUBJIDX, &l);
+  const char *s = getsubject(L, SUBJIDX, &l);
   size_t i = initposition(L, l);
-  int ptop = lua_gettop(L);
+  int ptop;
+  if (lua_type(L, SUBJIDX) == LUA_TUSERDATA && callslua(p)) {
+    /* match a copy, which is also what match-time captures get */
+    lua_pushlstring(L, s, l);
+    lua_replace(L, SUBJIDX);
+    s = lua_tostring(L, SUBJIDX);
+  }
+  ptop = lua_gettop(L);
   lua_pushnil(L);  /* initialize subscache */
   lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
   lua_getfenv(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
+  r = match(L, s, s + i, s + l, code, capture, ptop, &hitend);
   if (r == NULL) {
     lua_pushnil(L);
     return 1;
@@ -3347,6 +3546,584 @@ static int lp_match (lua_State *L) {
 
 
 
+/*
+** {======================================================
+** Matching over streams
+** =======================================================
+*/
+
+#define STREAM_T	"lpeg-stream"
+
+/* default limit for the input kept by a stream */
+#define STREAMMAX	(1 << 20)
+
+
+/*
+** A stream matches its pattern repeatedly over input read in chunks.
+** 'buff' keeps only the input not yet consumed by earlier matches;
+** a match is final once it did not look at the end of that input
+** (so more input could not change it) or the input is over.
+*/
+typedef struct Stream {
+  char *buff;  /* input not yet consumed */
+  size_t start;  /* where the next match starts in 'buff' */
+  size_t len;  /* bytes of input in 'buff' */
+  size_t size;  /* allocated size of 'buff' */
+  size_t max;  /* limit for the input of a single match */
+  size_t offset;  /* position of 'buff' in the whole input */
+  int eof;  /* no more chunks */
+  int runtime;  /* pattern has match-time captures */
+} Stream;
+
+
+/*
+** Read the next chunk of input into the stream, discarding what
+** earlier matches consumed
+*/
+static void readstream (lua_State *L, Stream *st) {
+  size_t l;
+  const char *chunk;
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_call(L, 0, 1);
+  if (lua_isnil(L, -1) || (chunk = getsubject(L, -1, &l), l == 0)) {
+    st->eof = 1;
+    lua_pop(L, 1);
+    return;
+  }
+  if (st->start > 0) {
+    memmove(st->buff, st->buff + st->start, st->len - st->start);
+    st->len -= st->start;
+    st->offset += st->start;
+    st->start = 0;
+  }
+  if (st->len >= st->max)
+    luaL_error(L, "stream match needs more than %d bytes of input",
+                  (int)st->max);
+  if (st->len + l > st->size) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    size_t nsize = (st->size > 0) ? st->size : LUAL_BUFFERSIZE;
+    void *nbuff;
+    while (nsize < st->len + l) nsize *= 2;
+    nbuff = f(ud, st->buff, st->size, nsize);
+    if (nbuff == NULL)
+      luaL_error(L, "not enough memory");
+    st->buff = (char *)nbuff;
+    st->size = nsize;
+  }
+  memcpy(st->buff + st->len, chunk, l);
+  st->len += l;
+  lua_pop(L, 1);
+}
+
+
+static int stream_iter (lua_State *L) {
+  Stream *st = (Stream *)lua_touserdata(L, lua_upvalueindex(3));
+  Pattern *p = (Pattern *)lua_touserdata(L, lua_upvalueindex(1));
+  for (;;) {
+    Capture capture[INITCAPSIZE];
+    const char *s = (st->buff != NULL) ? st->buff + st->start : "";
+    const char *r;
+    size_t l = st->len - st->start;
+    int hitend;
+    int ptop = FIXEDARGS;
+    if (l == 0 && st->eof)
+      return 0;  /* input is over */
+    lua_settop(L, 0);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    if (st->runtime)  /* match-time captures get the input read so far */
+      lua_pushlstring(L, s, l);
+    else
+      lua_pushvalue(L, lua_upvalueindex(3));
+    lua_pushnil(L);  /* no initial position */
+    lua_pushnil(L);  /* initialize subscache */
+    lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+    lua_getfenv(L, 1);  /* initialize penvidx */
+    r = match(L, s, s, s + l, p->code, capture, ptop, &hitend);
+    if (!hitend || st->eof) {  /* result is final? */
+      if (r == NULL)
+        return luaL_error(L, "stream does not match at byte %d",
+                             (int)(st->offset + st->start) + 1);
+      if (r == s)
+        return luaL_error(L, "stream pattern matched the empty string");
+      st->start += r - s;
+      return getcaptures(L, s, r, ptop);
+    }
+    lua_settop(L, 0);
+    readstream(L, st);
+  }
+}
+
+
+/*
+** lpeg.stream(p, read [, max]): iterator over the successive matches
+** of 'p' on the input returned chunk by chunk by 'read' (nil or an
+** empty chunk ends it). A match that needs more than 'max' bytes of
+** input raises an error, so at most 'max' plus one chunk are kept.
+** Positions are relative to the start of each match.
+*/
+static int lp_stream (lua_State *L) {
+  Stream *st;
+  int i;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  lua_Integer max = luaL_optinteger(L, 3, STREAMMAX);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  luaL_argcheck(L, max > 0, 3, "limit must be positive");
+  if (p->code == NULL)
+    prepcompile(L, p, 1);
+  lua_settop(L, 2);
+  st = (Stream *)lua_newuserdata(L, sizeof(Stream));
+  st->buff = NULL;
+  st->start = st->len = st->size = st->offset = 0;
+  st->max = (size_t)max;
+  st->eof = 0;
+  st->runtime = 0;
+  for (i = 0; i < p->codesize; i += sizei(&p->code[i])) {
+    if (p->code[i].i.code == ICloseRunTime)
+      st->runtime = 1;
+  }
+  luaL_getmetatable(L, STREAM_T);
+  lua_setmetatable(L, -2);
+  lua_pushcclosure(L, stream_iter, 3);
+  return 1;
+}
+
+
+static int stream_gc (lua_State *L) {
+  Stream *st = (Stream *)lua_touserdata(L, 1);
+  if (st->buff != NULL) {
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    f(ud, st->buff, st->size, 0);
+    st->buff = NULL;
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Dumping and loading compiled patterns
+** =======================================================
+*/
+
+#define DUMPSIGNATURE	"\033LPeg"
+#define DUMPFORMAT	2
+
+#define CACHEIDX	"lpeg-cache"
+
+
+typedef struct LoadState {
+  lua_State *L;
+  const char *s;  /* current position in the dump */
+  size_t n;  /* bytes left */
+} LoadState;
+
+
+static void dumpheader (luaL_Buffer *b) {
+  int one = 1;
+  luaL_addlstring(b, DUMPSIGNATURE, sizeof(DUMPSIGNATURE) - 1);
+  luaL_addchar(b, DUMPFORMAT);
+  luaL_addchar(b, sizeof(Instruction));
+  luaL_addchar(b, sizeof(TTree));
+  luaL_addchar(b, sizeof(lua_Number));
+  luaL_addlstring(b, (const char *)&one, sizeof(int));
+}
+
+
+static void dumpint (luaL_Buffer *b, int n) {
+  luaL_addlstring(b, (const char *)&n, sizeof(int));
+}
+
+
+/*
+** FNV-1a hash of a dump's contents, so that damaged dumps are
+** rejected before they are verified and run
+*/
+static unsigned int dumpsum (const char *s, size_t n) {
+  unsigned int h = 2166136261u;
+  size_t i;
+  for (i = 0; i < n; i++)
+    h = (h ^ (byte)s[i]) * 16777619u;
+  return h;
+}
+
+
+/*
+** Add string at the top of the stack with tag 't' and its length in
+** front. Buffer 'b' sees it as a single value, since nothing else may
+** be left on the stack between buffer operations.
+*/
+static void dumpstring (lua_State *L, luaL_Buffer *b, char t) {
+  char h[1 + sizeof(int)];
+  int n = (int)lua_objlen(L, -1);
+  h[0] = t;
+  memcpy(h + 1, &n, sizeof(int));
+  lua_pushlstring(L, h, sizeof(h));
+  lua_insert(L, -2);
+  lua_concat(L, 2);
+  luaL_addvalue(b);
+}
+
+
+/*
+** Dump each ktable value. Strings, numbers and booleans are stored
+** as they are; any other value must have a name in table 'names'
+** (at index 'names', or 0 for none) and is stored as that name.
+*/
+static void dumpktable (lua_State *L, luaL_Buffer *b, int ktable, int n,
+                        int names) {
+  int i;
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, ktable, i);
+    switch (lua_type(L, -1)) {
+      case LUA_TBOOLEAN: {
+        char v = (char)lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        luaL_addchar(b, 'b');
+        luaL_addchar(b, v);
+        break;
+      }
+      case LUA_TNUMBER: {
+        lua_Number v = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        luaL_addchar(b, 'n');
+        luaL_addlstring(b, (const char *)&v, sizeof(lua_Number));
+        break;
+      }
+      case LUA_TSTRING: {
+        dumpstring(L, b, 's');
+        break;
+      }
+      default: {
+        if (names != 0) {
+          lua_rawget(L, names);
+          if (lua_type(L, -1) == LUA_TSTRING) {
+            dumpstring(L, b, 'r');
+            break;
+          }
+          lua_pop(L, 1);
+          lua_rawgeti(L, ktable, i);
+        }
+        luaL_error(L, "cannot dump pattern with unnamed value %s",
+                      val2str(L, -1));
+      }
+    }
+  }
+}
+
+
+/*
+** lpeg.dump(p [, names]): serialize tree, code and ktable of 'p'
+** (compiling it first if needed). The result is only valid for
+** the same build of the library.
+*/
+static int lp_dump (lua_State *L) {
+  int names = lua_isnoneornil(L, 2) ? 0 : 2;
+  int len, nk;
+  luaL_Buffer b;
+  Pattern *p = (getpatt(L, 1, &len), getpattern(L, 1));
+  if (names != 0)
+    luaL_checktype(L, names, LUA_TTABLE);
+  if (p->code == NULL)
+    prepcompile(L, p, 1);
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);  /* ktable at index 3 */
+  nk = ktablelen(L, 3);
+  luaL_buffinit(L, &b);
+  dumpheader(&b);
+  dumpint(&b, len);
+  dumpint(&b, p->codesize);
+  dumpint(&b, nk);
+  luaL_addlstring(&b, (const char *)p->tree, len * sizeof(TTree));
+  luaL_addlstring(&b, (const char *)p->code,
+                      p->codesize * sizeof(Instruction));
+  dumpktable(L, &b, 3, nk, names);
+  luaL_pushresult(&b);
+  {
+    size_t l;
+    const char *d = lua_tolstring(L, -1, &l);
+    unsigned int h = dumpsum(d, l);
+    lua_pushlstring(L, (const char *)&h, sizeof(h));
+    lua_concat(L, 2);
+  }
+  return 1;
+}
+
+
+static const char *loadblock (LoadState *S, size_t size) {
+  const char *s = S->s;
+  if (size > S->n)
+    luaL_error(S->L, "truncated pattern dump");
+  S->s += size;
+  S->n -= size;
+  return s;
+}
+
+
+static int loadint (LoadState *S) {
+  int n;
+  memcpy(&n, loadblock(S, sizeof(int)), sizeof(int));
+  if (n < 0)
+    luaL_error(S->L, "corrupted pattern dump");
+  return n;
+}
+
+
+static void loadheader (LoadState *S) {
+  luaL_Buffer b;
+  const char *h;
+  size_t l;
+  luaL_buffinit(S->L, &b);
+  dumpheader(&b);
+  luaL_pushresult(&b);
+  h = lua_tolstring(S->L, -1, &l);
+  if (S->n < l || memcmp(S->s, h, l) != 0)
+    luaL_error(S->L, "not a pattern dump for this version of lpeg");
+  lua_pop(S->L, 1);
+  loadblock(S, l);
+}
+
+
+/*
+** Check that a loaded tree is well formed: known tags, siblings and
+** rule references inside the tree, keys inside the ktable. 'nrules'
+** is the number of rules of the enclosing grammar.
+*/
+static void verifytree (lua_State *L, TTree *tree, TTree *t, TTree *last,
+                        int nk, int nrules) {
+ tailcall:
+  if (t > last || t->tag > TRunTime || t->tag == TOpenCall)
+    luaL_error(L, "corrupted pattern dump");
+  switch (t->tag) {
+    case TCapture: case TRunTime: case TRule: case TCall:
+      if (t->key > nk)  /* only these nodes have keys */
+        luaL_error(L, "corrupted pattern dump");
+      break;
+    default: break;
+  }
+  switch (t->tag) {
+    case TSet:
+      if (last - t < (int)bytes2slots(CHARSETSIZE))
+        luaL_error(L, "corrupted pattern dump");
+      return;
+    case TCall:
+      if (t->u.ps < tree - t || t->u.ps > last - t ||
+          sib2(t)->tag != TRule || sib2(t)->cap >= nrules)
+        luaL_error(L, "corrupted pattern dump");
+      return;
+    case TGrammar: {
+      TTree *rule = sib1(t);
+      int n = 0;
+      while (rule <= last && rule->tag == TRule && rule->cap == n &&
+             rule->u.ps > 0 && rule->u.ps <= last - rule && n < MAXRULES) {
+        rule = sib2(rule);
+        n++;
+      }
+      if (n != t->u.n || rule > last || rule->tag != TTrue)
+        luaL_error(L, "corrupted pattern dump");
+      nrules = n;
+      break;
+    }
+    default: break;
+  }
+  switch (numsiblings[t->tag]) {
+    case 1:
+      t = sib1(t); goto tailcall;
+    case 2:
+      if (t->u.ps <= 0 || t->u.ps > last - t)
+        luaL_error(L, "corrupted pattern dump");
+      verifytree(L, tree, sib1(t), last, nk, nrules);
+      t = sib2(t); goto tailcall;
+    default: break;
+  }
+}
+
+
+/*
+** Check that loaded code is well formed: known opcodes, complete
+** instructions, jumps to instruction boundaries, keys inside the
+** ktable and a final IEnd. This catches damaged dumps, not hostile
+** ones: it does not prove that the code keeps the backtrack stack
+** balanced or terminates.
+*/
+static void verifycode (lua_State *L, Instruction *code, int n, int nk) {
+  char *start = (char *)lua_newuserdata(L, n + 1);
+  int i;
+  memset(start, 0, n + 1);
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    if (code[i].i.code > ICloseRunTime || code[i].i.code == IOpenCall ||
+        i + sizei(&code[i]) > n)
+      luaL_error(L, "corrupted pattern dump");
+    start[i] = 1;
+  }
+  if (n == 0 || i != n)
+    luaL_error(L, "corrupted pattern dump");
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    switch ((Opcode)code[i].i.code) {
+      case ITestChar: case ITestAny: case ITestSet: case IChoice:
+      case IJmp: case ICall: case ICommit: case IPartialCommit:
+      case IBackCommit: {
+        int t = code[i + 1].offset;
+        if (t < -i || t >= n - i || !start[i + t])
+          luaL_error(L, "corrupted pattern dump");
+        break;
+      }
+      case ISpan: {
+        if ((code[i].i.aux & ~SPANNEG) > MAXSPANRANGES)
+          luaL_error(L, "corrupted pattern dump");
+        break;
+      }
+      case IFullCapture: case IOpenCapture: case ICloseCapture:
+      case ICloseRunTime: {
+        if (code[i].i.key < 0 || code[i].i.key > nk || getkind(&code[i]) > Cgroup)
+          luaL_error(L, "corrupted pattern dump");
+        break;
+      }
+      default: break;
+    }
+    if (sizei(&code[i]) == 1 && code[i].i.code != IEnd &&
+        code[i].i.code != IRet && code[i].i.code != IFail &&
+        code[i].i.code != IFailTwice && code[i].i.code != IGiveup &&
+        i + 1 == n)
+      luaL_error(L, "corrupted pattern dump");  /* runs off the end */
+  }
+  lua_pop(L, 1);
+}
+
+
+/*
+** lpeg.load(s [, env]): rebuild a pattern from 'lpeg.dump' output
+** without compiling it again. Named values are looked up in 'env'.
+** Only load trusted dumps made by the same build: the checksum and
+** the verifiers reject accidental damage, but crafted code can still
+** loop forever or break the matcher's stack invariants.
+*/
+static int lp_load (lua_State *L) {
+  LoadState S;
+  int len, codesize, nk, i;
+  TTree *tree;
+  Pattern *p;
+  int env = lua_isnoneornil(L, 2) ? 0 : 2;
+  S.L = L;
+  S.s = luaL_checklstring(L, 1, &S.n);
+  if (env != 0)
+    luaL_checktype(L, env, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (S.n >= sizeof(unsigned int)) {
+    unsigned int h;
+    S.n -= sizeof(unsigned int);
+    memcpy(&h, S.s + S.n, sizeof(h));
+    if (h != dumpsum(S.s, S.n))
+      luaL_error(L, "corrupted pattern dump");
+  }
+  loadheader(&S);
+  len = loadint(&S);
+  codesize = loadint(&S);
+  nk = loadint(&S);
+  if (len == 0 || nk > USHRT_MAX || len > MAXPATTSIZE)
+    luaL_error(L, "corrupted pattern dump");
+  tree = newtree(L, len);  /* pattern at index 3 */
+  p = getpattern(L, 3);
+  memcpy(tree, loadblock(&S, len * sizeof(TTree)), len * sizeof(TTree));
+  verifytree(L, tree, tree, tree + len - 1, nk, 0);
+  reallocprog(L, p, codesize);
+  memcpy(p->code, loadblock(&S, codesize * sizeof(Instruction)),
+                  codesize * sizeof(Instruction));
+  verifycode(L, p->code, codesize, nk);
+  lua_createtable(L, nk, 0);
+  for (i = 1; i <= nk; i++) {
+    char t = *loadblock(&S, 1);
+    switch (t) {
+      case 'b':
+        lua_pushboolean(L, *loadblock(&S, 1));
+        break;
+      case 'n': {
+        lua_Number v;
+        memcpy(&v, loadblock(&S, sizeof(lua_Number)), sizeof(lua_Number));
+        lua_pushnumber(L, v);
+        break;
+      }
+      case 's': case 'r': {
+        size_t l = (size_t)loadint(&S);
+        lua_pushlstring(L, loadblock(&S, l), l);
+        if (t == 'r') {
+          lua_pushvalue(L, -1);  /* keep name for error message */
+          if (env != 0)
+            lua_rawget(L, env);
+          else {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+          }
+          if (lua_isnil(L, -1))
+            luaL_error(L, "no value for name '%s' in pattern dump",
+                          lua_tostring(L, -2));
+          lua_remove(L, -2);
+        }
+        break;
+      }
+      default:
+        luaL_error(L, "corrupted pattern dump");
+    }
+    lua_rawseti(L, -2, i);
+  }
+  if (S.n != 0)
+    luaL_error(L, "corrupted pattern dump");
+  lua_setfenv(L, 3);
+  return 1;
+}
+
+
+/*
+** lpeg.cache(key, source [, env]): return the pattern stored under
+** 'key' in this state, building it on a miss from 'source', which is
+** either a function returning the pattern or a dump for 'lpeg.load'
+** (which must be trusted, as for 'lpeg.load'). Cached patterns are
+** kept compiled.
+*/
+static int lp_cache (lua_State *L) {
+  luaL_checkstring(L, 1);
+  lua_settop(L, 3);
+  lua_getfield(L, LUA_REGISTRYINDEX, CACHEIDX);  /* cache at index 4 */
+  if (!lua_istable(L, 4)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, CACHEIDX);
+  }
+  lua_pushvalue(L, 1);
+  lua_rawget(L, 4);
+  if (!lua_isnil(L, -1))
+    return 1;
+  lua_pop(L, 1);
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    lua_pushcfunction(L, lp_load);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_call(L, 2, 1);
+  }
+  else {
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    lua_call(L, 0, 1);
+    getpatt(L, 5, NULL);
+  }
+  {
+    Pattern *p = getpattern(L, 5);
+    if (p->code == NULL)
+      prepcompile(L, p, 5);
+  }
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 5);
+  lua_rawset(L, 4);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** Library creation and functions not related to matching
@@ -3421,6 +4198,10 @@ static struct luaL_Reg pattreg[] = {
   {"ptree", lp_printtree},
   {"pcode", lp_printcode},
   {"match", lp_match},
+  {"stream", lp_stream},
+  {"dump", lp_dump},
+  {"load", lp_load},
+  {"cache", lp_cache},
   {"B", lp_behind},
   {"V", lp_V},
   {"C", lp_simplecapture},
@@ -3458,6 +4239,10 @@ static struct luaL_Reg metareg[] = {
 
 
 LUALIB_API int luaopen_peg (lua_State *L) {
+  luaL_newmetatable(L, STREAM_T);
+  lua_pushcfunction(L, stream_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
   luaL_newmetatable(L, PATTERN_T);
   lua_pushnumber(L, MAXBACK);  /* initialize maximum backtracking */
   lua_setfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
@@ -0,0 +1,1345 @@
+/*
+** $Id: lproflib.c $
+** Sampling and allocation profilers, heap snapshots
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define lproflib_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** With LUA_USE_POSIX a SIGPROF interval timer arms a one-shot count
+** hook on the running thread, and the hook walks its stack with
+** lua_getstack/lua_getinfo.  A thread with a hook of its own is left
+** alone, and its samples are counted as dropped.  The timer counts CPU time, so its real
+** rate is bounded by the kernel tick.  Elsewhere a count hook checks
+** clock() every few thousand instructions.  Samples that fall due
+** while C code runs are charged, with their full weight, to the Lua
+** stack that called it.
+**
+** Each sampled stack is reduced to a sequence of frame ids, one per
+** distinct function, and counted in a hash of those sequences.  The
+** result is written in the collapsed format read by flamegraph tools:
+** one line per stack, frames from the root down separated by `;',
+** followed by a space and the number of samples.
+**
+** There is one profiler per process, since the timer is.
+*/
+
+
+#define MAXDEPTH	64	/* deeper stacks keep their innermost frames */
+#define MAXLABEL	120
+
+#define PROF_T	"profile-running"
+
+
+typedef struct Frame {
+  const void *id;  /* function source (Lua) or address (C) */
+  int line;  /* line where it is defined */
+  int named;  /* label has the function name */
+  char *label;
+} Frame;
+
+
+typedef struct Stack {
+  unsigned int hash;
+  int start;  /* first frame id in `Profiler.ids' (root first) */
+  int depth;
+  unsigned long count;
+} Stack;
+
+
+typedef struct Profiler {
+  lua_State *L;  /* thread that started the profiler; NULL if stopped */
+  void *sentinel;  /* userdata of `L's state that stops it when closed */
+  lua_Alloc allocf;
+  void *ud;
+  lua_Hook oldhook;  /* hook of `L' before the polling hook took it */
+  int oldmask, oldcount;
+  int hz;
+  Frame *frames;
+  int nframes, sizeframes;
+  int *framehash;  /* open addressing, indices into `frames' + 1 */
+  int sizeframehash;
+  Stack *stacks;
+  int nstacks, sizestacks;  /* `sizestacks' is a power of 2 */
+  int *ids;
+  int nids, sizeids;
+  unsigned long samples, dropped;
+} Profiler;
+
+
+static Profiler prof;
+
+
+static void hook (lua_State *L, lua_Debug *ar);
+
+
+#if defined(LUA_USE_POSIX)
+
+#include <signal.h>
+#include <sys/time.h>
+
+static volatile sig_atomic_t pending = 0;
+static volatile sig_atomic_t skipped = 0;  /* signals on hooked threads */
+static lua_State *volatile target = NULL;
+static struct sigaction oldaction;
+
+/*
+** arm a one-shot hook on the thread running right now (lua_sethook
+** may be called asynchronously), so Lua code runs at full speed
+** between samples; the hook of a thread that has one is not ours to
+** replace, since nothing could give it back
+*/
+static void onsigprof (int sig) {
+  lua_State *L = target;
+  lua_Hook h;
+  (void)sig;
+  if (L == NULL) return;
+  L = lua_current(L);
+  h = lua_gethook(L);
+  if (h != NULL && h != hook)
+    skipped++;
+  else {
+    pending++;
+    lua_sethook(L, hook, LUA_MASKCOUNT, 1);
+  }
+}
+
+static int starttimer (lua_State *L, int hz) {
+  struct sigaction sa;
+  struct itimerval tv;
+  sa.sa_handler = onsigprof;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  target = L;
+  if (sigaction(SIGPROF, &sa, &oldaction) != 0) {
+    target = NULL;
+    return 0;
+  }
+  tv.it_interval.tv_sec = 0;
+  tv.it_interval.tv_usec = 1000000 / hz;
+  tv.it_value = tv.it_interval;
+  if (setitimer(ITIMER_PROF, &tv, NULL) != 0) {
+    sigaction(SIGPROF, &oldaction, NULL);
+    target = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static void stoptimer (void) {
+  struct itimerval tv;
+  target = NULL;
+  memset(&tv, 0, sizeof(tv));
+  setitimer(ITIMER_PROF, &tv, NULL);
+  sigaction(SIGPROF, &oldaction, NULL);
+  if (lua_gethook(prof.L) == hook)  /* armed but not fired yet */
+    lua_sethook(prof.L, NULL, 0, 0);
+  prof.dropped += skipped;
+  skipped = 0;
+}
+
+static int takepending (lua_State *L) {
+  int n = pending;
+  pending = 0;
+  prof.dropped += skipped;
+  skipped = 0;
+  lua_sethook(L, NULL, 0, 0);  /* disarm; only hookless threads are armed */
+  return n;
+}
+
+#else
+
+/*
+** no asynchronous timer: a count hook polls the clock, which makes
+** every instruction a little slower while the profiler runs
+*/
+
+#define PROFCOUNT	10000	/* instructions between clock checks */
+
+static clock_t interval, deadline;
+
+static int starttimer (lua_State *L, int hz) {
+  interval = CLOCKS_PER_SEC / hz;
+  if (interval == 0) interval = 1;
+  deadline = clock() + interval;
+  lua_sethook(L, hook, LUA_MASKCOUNT, PROFCOUNT);
+  return 1;
+}
+
+static void stoptimer (void) {
+  if (lua_gethook(prof.L) == hook)
+    lua_sethook(prof.L, prof.oldhook, prof.oldmask, prof.oldcount);
+}
+
+static int takepending (lua_State *L) {
+  clock_t now = clock();
+  int n;
+  (void)L;
+  if (now < deadline) return 0;
+  n = (int)((now - deadline) / interval) + 1;
+  deadline += n * interval;
+  return n;
+}
+
+#endif
+
+
+static void *grow (void *block, int *size, int n, size_t elem, int min) {
+  int newsize = *size;
+  void *nb;
+  while (newsize < n) newsize = newsize ? newsize * 2 : min;
+  if (newsize == *size) return block;
+  nb = prof.allocf(prof.ud, block, *size * elem, newsize * elem);
+  if (nb != NULL) *size = newsize;
+  return nb;
+}
+
+
+static unsigned int hashframe (const void *id, int line) {
+  size_t h = (size_t)id;
+  return (unsigned int)(h ^ (h >> 16)) * 2654435761u + (unsigned int)line;
+}
+
+
+static void buildlabel (lua_Debug *ar, char *buff) {
+  const char *name = ar->name;
+  char *p;
+  if (name == NULL)
+    name = (*ar->what == 'm') ? "main chunk" : "?";
+  if (*ar->what == 't')
+    strcpy(buff, "(tail call)");
+  else if (*ar->what == 'C')
+    sprintf(buff, "%.60s [C]", name);
+  else
+    sprintf(buff, "%.40s (%.60s:%d)", name, ar->short_src, ar->linedefined);
+  for (p = buff; *p; p++)  /* `;' separates frames in the output */
+    if (*p == ';') *p = ':';
+}
+
+
+static int rehashframes (void) {
+  int size = prof.sizeframehash ? prof.sizeframehash * 2 : 256;
+  int *h = (int *)prof.allocf(prof.ud, NULL, 0, size * sizeof(int));
+  int i;
+  if (h == NULL) return 0;
+  memset(h, 0, size * sizeof(int));
+  for (i = 0; i < prof.nframes; i++) {
+    unsigned int k = hashframe(prof.frames[i].id, prof.frames[i].line);
+    while (h[k & (size - 1)]) k++;
+    h[k & (size - 1)] = i + 1;
+  }
+  prof.allocf(prof.ud, prof.framehash, prof.sizeframehash * sizeof(int), 0);
+  prof.framehash = h;
+  prof.sizeframehash = size;
+  return 1;
+}
+
+
+static int setlabel (lua_State *L, lua_Debug *ar, Frame *f) {
+  char buff[MAXLABEL + 40];
+  char *label;
+  lua_getinfo(L, "n", ar);
+  buildlabel(ar, buff);
+  label = (char *)prof.allocf(prof.ud, NULL, 0, strlen(buff) + 1);
+  if (label == NULL) return 0;
+  strcpy(label, buff);
+  if (f->label != NULL)
+    prof.allocf(prof.ud, f->label, strlen(f->label) + 1, 0);
+  f->label = label;
+  f->named = (ar->name != NULL || *ar->what != 'L');
+  return 1;
+}
+
+
+/*
+** id of the function running at `ar'; the frame is created on first
+** sight.  Its name comes from the calling instruction, so a function
+** first seen through a tail call is named when seen from a call.
+*/
+static int frameid (lua_State *L, lua_Debug *ar) {
+  const void *id;
+  int line;
+  unsigned int k;
+  int i;
+  lua_getinfo(L, "Sf", ar);
+  if (*ar->what == 'C') {
+    id = (const void *)lua_tocfunction(L, -1);
+    line = -1;
+  }
+  else {
+    id = ar->source;
+    line = ar->linedefined;
+  }
+  lua_pop(L, 1);
+  if (2 * (prof.nframes + 1) > prof.sizeframehash && !rehashframes())
+    return -1;
+  for (k = hashframe(id, line);
+       (i = prof.framehash[k & (prof.sizeframehash - 1)]) != 0; k++) {
+    Frame *f = &prof.frames[i - 1];
+    if (f->id == id && f->line == line) {
+      if (!f->named) setlabel(L, ar, f);
+      return i - 1;
+    }
+  }
+  {
+    Frame *frames = (Frame *)grow(prof.frames, &prof.sizeframes,
+                                  prof.nframes + 1, sizeof(Frame), 64);
+    if (frames == NULL) return -1;
+    prof.frames = frames;
+    frames[prof.nframes].id = id;
+    frames[prof.nframes].line = line;
+    frames[prof.nframes].label = NULL;
+    if (!setlabel(L, ar, &frames[prof.nframes])) return -1;
+    prof.framehash[k & (prof.sizeframehash - 1)] = prof.nframes + 1;
+    return prof.nframes++;
+  }
+}
+
+
+static int rehashstacks (void) {
+  int size = prof.sizestacks ? prof.sizestacks * 2 : 256;
+  Stack *s = (Stack *)prof.allocf(prof.ud, NULL, 0, size * sizeof(Stack));
+  int i;
+  if (s == NULL) return 0;
+  memset(s, 0, size * sizeof(Stack));
+  for (i = 0; i < prof.sizestacks; i++) {
+    Stack *old = &prof.stacks[i];
+    if (old->count != 0) {
+      unsigned int k = old->hash;
+      while (s[k & (size - 1)].count != 0) k++;
+      s[k & (size - 1)] = *old;
+    }
+  }
+  prof.allocf(prof.ud, prof.stacks, prof.sizestacks * sizeof(Stack), 0);
+  prof.stacks = s;
+  prof.sizestacks = size;
+  return 1;
+}
+
+
+static void addstack (const int *ids, int depth, int weight) {
+  unsigned int h = 2166136261u;
+  unsigned int k;
+  int i;
+  Stack *s;
+  for (i = 0; i < depth; i++)
+    h = (h ^ (unsigned int)ids[i]) * 16777619u;
+  if (2 * (prof.nstacks + 1) > prof.sizestacks && !rehashstacks()) {
+    prof.dropped += weight;
+    return;
+  }
+  for (k = h; (s = &prof.stacks[k & (prof.sizestacks - 1)])->count != 0; k++) {
+    if (s->hash == h && s->depth == depth &&
+        memcmp(prof.ids + s->start, ids, depth * sizeof(int)) == 0) {
+      s->count += weight;
+      return;
+    }
+  }
+  {
+    int *pool = (int *)grow(prof.ids, &prof.sizeids, prof.nids + depth,
+                            sizeof(int), 1024);
+    if (pool == NULL) {
+      prof.dropped += weight;
+      return;
+    }
+    prof.ids = pool;
+    memcpy(pool + prof.nids, ids, depth * sizeof(int));
+    s->hash = h;
+    s->start = prof.nids;
+    s->depth = depth;
+    s->count = weight;
+    prof.nids += depth;
+    prof.nstacks++;
+  }
+}
+
+
+static void sample (lua_State *L, int weight) {
+  int ids[MAXDEPTH];
+  int depth = 0;
+  lua_Debug ar;
+  int level;
+  for (level = 0; depth < MAXDEPTH && lua_getstack(L, level, &ar); level++) {
+    int id = frameid(L, &ar);
+    if (id < 0) {
+      prof.dropped += weight;
+      return;
+    }
+    ids[depth++] = id;
+  }
+  for (level = 0; level < depth / 2; level++) {  /* root first */
+    int t = ids[level];
+    ids[level] = ids[depth - 1 - level];
+    ids[depth - 1 - level] = t;
+  }
+  prof.samples += weight;
+  addstack(ids, depth, weight);
+}
+
+
+static void hook (lua_State *L, lua_Debug *ar) {
+  int n;
+  (void)ar;
+  if (prof.L == NULL) {  /* stopped: thread inherited a stale hook */
+    lua_sethook(L, NULL, 0, 0);
+    return;
+  }
+  if ((n = takepending(L)) > 0)
+    sample(L, n);
+}
+
+
+static void freedata (void) {
+  int i;
+  for (i = 0; i < prof.nframes; i++)
+    prof.allocf(prof.ud, prof.frames[i].label,
+                strlen(prof.frames[i].label) + 1, 0);
+  prof.allocf(prof.ud, prof.frames, prof.sizeframes * sizeof(Frame), 0);
+  prof.allocf(prof.ud, prof.framehash, prof.sizeframehash * sizeof(int), 0);
+  prof.allocf(prof.ud, prof.stacks, prof.sizestacks * sizeof(Stack), 0);
+  prof.allocf(prof.ud, prof.ids, prof.sizeids * sizeof(int), 0);
+  prof.frames = NULL; prof.nframes = prof.sizeframes = 0;
+  prof.framehash = NULL; prof.sizeframehash = 0;
+  prof.stacks = NULL; prof.nstacks = prof.sizestacks = 0;
+  prof.ids = NULL; prof.nids = prof.sizeids = 0;
+  prof.samples = prof.dropped = 0;
+}
+
+
+static void stopprof (void) {
+  stoptimer();
+  prof.L = NULL;
+  prof.sentinel = NULL;
+}
+
+
+/*
+** the sentinel is only collected while it is `prof.sentinel' when its
+** state is closed, and the timer must not outlive that state
+*/
+static int running_gc (lua_State *L) {
+  if (prof.L != NULL && prof.sentinel == lua_touserdata(L, 1))
+    stopprof();
+  return 0;
+}
+
+
+/*
+** Start sampling the running thread (and coroutines it creates from
+** now on) `hz' times per second of CPU time.  Samples taken so far are
+** kept until luaL_profreset.  Returns 0 if the profiler is already
+** running for another state or the timer cannot be set.  The thread is
+** kept alive, and the profiler stopped when its state is closed, by a
+** sentinel in the registry.
+*/
+LUALIB_API int luaL_profstart (lua_State *L, int hz) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  void *sentinel;
+  if (prof.L != NULL || hz <= 0) return 0;
+  sentinel = lua_newuserdata(L, 1);
+  if (luaL_newmetatable(L, PROF_T)) {
+    lua_pushcfunction(L, running_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);  /* anchor `L' in the sentinel's environment */
+  lua_pushthread(L);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  if (prof.allocf != NULL && (prof.allocf != f || prof.ud != ud))
+    freedata();  /* samples of another state */
+  prof.allocf = f;
+  prof.ud = ud;
+  prof.hz = hz;
+  prof.oldhook = lua_gethook(L);
+  prof.oldmask = lua_gethookmask(L);
+  prof.oldcount = lua_gethookcount(L);
+  prof.L = L;
+  if (!starttimer(L, hz)) {
+    prof.L = NULL;
+    lua_pop(L, 1);
+    return 0;
+  }
+  prof.sentinel = sentinel;
+  lua_setfield(L, LUA_REGISTRYINDEX, PROF_T);
+  return 1;
+}
+
+
+LUALIB_API void luaL_profstop (lua_State *L) {
+  if (prof.L == NULL) return;
+  lua_getfield(L, LUA_REGISTRYINDEX, PROF_T);
+  if (lua_touserdata(L, -1) == prof.sentinel) {  /* release the thread */
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, PROF_T);
+  }
+  lua_pop(L, 1);
+  stopprof();
+}
+
+
+LUALIB_API void luaL_profreset (lua_State *L) {
+  (void)L;
+  if (prof.allocf != NULL)
+    freedata();
+}
+
+
+/*
+** push the samples taken so far in collapsed-stack format
+*/
+LUALIB_API void luaL_profdump (lua_State *L) {
+  luaL_Buffer b;
+  int i, j;
+  luaL_buffinit(L, &b);
+  for (i = 0; i < prof.sizestacks; i++) {
+    const Stack *s = &prof.stacks[i];
+    char num[32];
+    if (s->count == 0) continue;
+    for (j = 0; j < s->depth; j++) {
+      if (j > 0) luaL_addchar(&b, ';');
+      luaL_addstring(&b, prof.frames[prof.ids[s->start + j]].label);
+    }
+    sprintf(num, " %lu\n", s->count);
+    luaL_addstring(&b, num);
+  }
+  luaL_pushresult(&b);
+}
+
+
+/*
+** {======================================================
+** Allocation tracking
+** =======================================================
+*/
+
+/*
+** The core calls `trackhook' (see lua_setalloctrack) about once every
+** `rate' bytes of objects allocated, with a jittered distance so that
+** periodic allocation patterns are not aliased.  The sampled
+** allocation is charged to the innermost Lua function on the stack
+** and its current line, as `rate' bytes (or its own size, when
+** larger) and the number of objects of its size those bytes make.
+** Counters are cumulative; allocs() copies them into a snapshot and
+** allocdiff() compares two snapshots.
+*/
+
+#define ALLOCS_T	"profile-allocs"
+#define ALLOCRATE	65536
+
+
+typedef struct Site {
+  const void *source;  /* key: source of the function, ... */
+  int line;  /* ... current line ... */
+  int type;  /* ... and type of object */
+  char *label;
+  double bytes, count;
+  unsigned long samples;
+} Site;
+
+
+typedef struct Allocs {
+  lua_Alloc allocf;
+  void *ud;
+  size_t rate;  /* 0 if not tracking */
+  unsigned int seed;
+  Site *sites;
+  int nsites, sizesites;
+  int *hash;  /* open addressing, indices into `sites' + 1 */
+  int sizehash;
+} Allocs;
+
+
+static const char *const typenames[] = {
+  "other", "boolean", "lightuserdata", "number", "string", "table",
+  "function", "userdata", "thread", "proto", "upvalue"
+};
+
+
+static unsigned int hashsite (const void *source, int line, int type) {
+  size_t h = (size_t)source;
+  return ((unsigned int)(h ^ (h >> 16)) * 2654435761u) ^
+         ((unsigned int)line * 31u + (unsigned int)type);
+}
+
+
+static int rehashsites (Allocs *a) {
+  int size = a->sizehash ? a->sizehash * 2 : 256;
+  int *h = (int *)a->allocf(a->ud, NULL, 0, size * sizeof(int));
+  int i;
+  if (h == NULL) return 0;
+  memset(h, 0, size * sizeof(int));
+  for (i = 0; i < a->nsites; i++) {
+    Site *s = &a->sites[i];
+    unsigned int k = hashsite(s->source, s->line, s->type);
+    while (h[k & (size - 1)]) k++;
+    h[k & (size - 1)] = i + 1;
+  }
+  a->allocf(a->ud, a->hash, a->sizehash * sizeof(int), 0);
+  a->hash = h;
+  a->sizehash = size;
+  return 1;
+}
+
+
+static Site *findsite (lua_State *L, Allocs *a, lua_Debug *ar, int type) {
+  const void *source = ar ? (const void *)ar->source : NULL;
+  int line = ar ? ar->currentline : -1;
+  unsigned int k;
+  int i;
+  char buff[MAXLABEL + 40];
+  Site *s;
+  if (2 * (a->nsites + 1) > a->sizehash && !rehashsites(a))
+    return NULL;
+  for (k = hashsite(source, line, type);
+       (i = a->hash[k & (a->sizehash - 1)]) != 0; k++) {
+    s = &a->sites[i - 1];
+    if (s->source == source && s->line == line && s->type == type)
+      return s;
+  }
+  if (a->nsites == a->sizesites) {
+    int n = a->sizesites ? a->sizesites * 2 : 64;
+    Site *ns = (Site *)a->allocf(a->ud, a->sites, a->sizesites * sizeof(Site),
+                                 n * sizeof(Site));
+    if (ns == NULL) return NULL;
+    a->sites = ns;
+    a->sizesites = n;
+  }
+  if (ar == NULL)
+    strcpy(buff, "[C]");
+  else {
+    lua_getinfo(L, "n", ar);
+    sprintf(buff, "%.60s:%d (%.40s)", ar->short_src, line,
+            ar->name ? ar->name : (*ar->what == 'm') ? "main chunk" : "?");
+  }
+  s = &a->sites[a->nsites];
+  s->label = (char *)a->allocf(a->ud, NULL, 0, strlen(buff) + 1);
+  if (s->label == NULL) return NULL;
+  strcpy(s->label, buff);
+  s->source = source;
+  s->line = line;
+  s->type = type;
+  s->bytes = s->count = 0;
+  s->samples = 0;
+  a->hash[k & (a->sizehash - 1)] = ++a->nsites;
+  return s;
+}
+
+
+static size_t nextsample (Allocs *a) {
+  a->seed = a->seed * 1103515245u + 12345u;
+  return a->rate / 2 + (size_t)((a->seed >> 8) % (a->rate + 1));
+}
+
+
+static size_t trackhook (lua_State *L, void *ud, int type, size_t size) {
+  Allocs *a = (Allocs *)ud;
+  lua_Debug ar;
+  int level;
+  int found = 0;
+  double weight = (size > a->rate) ? (double)size : (double)a->rate;
+  Site *s;
+  for (level = 0; lua_getstack(L, level, &ar); level++) {
+    lua_getinfo(L, "Sl", &ar);
+    if (ar.currentline >= 0) {  /* innermost Lua function */
+      found = 1;
+      break;
+    }
+  }
+  if (type < 0 || type >= (int)(sizeof(typenames) / sizeof(typenames[0])))
+    type = 0;
+  s = findsite(L, a, found ? &ar : NULL, type);
+  if (s != NULL) {
+    s->bytes += weight;
+    s->count += weight / (double)size;
+    s->samples++;
+  }
+  return nextsample(a);
+}
+
+
+static void freesites (Allocs *a) {
+  int i;
+  for (i = 0; i < a->nsites; i++)
+    a->allocf(a->ud, a->sites[i].label, strlen(a->sites[i].label) + 1, 0);
+  a->allocf(a->ud, a->sites, a->sizesites * sizeof(Site), 0);
+  a->allocf(a->ud, a->hash, a->sizehash * sizeof(int), 0);
+  a->sites = NULL;
+  a->nsites = a->sizesites = 0;
+  a->hash = NULL;
+  a->sizehash = 0;
+}
+
+
+static Allocs *getallocs (lua_State *L) {
+  Allocs *a;
+  lua_getfield(L, LUA_REGISTRYINDEX, ALLOCS_T);
+  a = (Allocs *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (a == NULL) {
+    a = (Allocs *)lua_newuserdata(L, sizeof(Allocs));
+    memset(a, 0, sizeof(Allocs));
+    a->allocf = lua_getallocf(L, &a->ud);
+    a->seed = (unsigned int)(size_t)a;
+    luaL_getmetatable(L, ALLOCS_T);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, ALLOCS_T);
+  }
+  return a;
+}
+
+
+static int allocs_gc (lua_State *L) {
+  Allocs *a = (Allocs *)lua_touserdata(L, 1);
+  void *ud;
+  if (lua_getalloctrack(L, &ud) == trackhook && ud == a)
+    lua_setalloctrack(L, NULL, NULL, 0);
+  freesites(a);
+  return 0;
+}
+
+
+/*
+** Start charging allocations of `L's state to Lua call sites, sampling
+** about once every `rate' bytes.  Returns 0 if another tracker is
+** installed.
+*/
+LUALIB_API int luaL_allocstart (lua_State *L, size_t rate) {
+  Allocs *a = getallocs(L);
+  lua_AllocTrack f = lua_getalloctrack(L, NULL);
+  if (f != NULL && f != trackhook) return 0;
+  a->rate = rate > 0 ? rate : 1;
+  lua_setalloctrack(L, trackhook, a, nextsample(a));
+  return 1;
+}
+
+
+LUALIB_API void luaL_allocstop (lua_State *L) {
+  if (lua_getalloctrack(L, NULL) == trackhook)
+    lua_setalloctrack(L, NULL, NULL, 0);
+  getallocs(L)->rate = 0;
+}
+
+
+static void setrecord (lua_State *L, const char *site, const char *type,
+                       lua_Number bytes, lua_Number count, lua_Number samples) {
+  lua_createtable(L, 0, 5);
+  lua_pushstring(L, site);
+  lua_setfield(L, -2, "site");
+  lua_pushstring(L, type);
+  lua_setfield(L, -2, "type");
+  lua_pushnumber(L, bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, samples);
+  lua_setfield(L, -2, "samples");
+}
+
+
+static int bybytes (lua_State *L) {
+  lua_getfield(L, 1, "bytes");
+  lua_getfield(L, 2, "bytes");
+  lua_pushboolean(L, lua_tonumber(L, -2) > lua_tonumber(L, -1));
+  return 1;
+}
+
+
+/* sort the array at the top of the stack, largest `bytes' first */
+static void sortbybytes (lua_State *L) {
+  lua_getglobal(L, "table");
+  lua_getfield(L, -1, "sort");
+  lua_remove(L, -2);
+  if (lua_isfunction(L, -1)) {
+    lua_pushvalue(L, -2);
+    lua_pushcfunction(L, bybytes);
+    lua_call(L, 2, 0);
+  }
+  else
+    lua_pop(L, 1);
+}
+
+
+/*
+** snapshot of the counters: an array of {site, type, bytes, count,
+** samples}, largest first
+*/
+static int prof_allocs (lua_State *L) {
+  Allocs *a = getallocs(L);
+  int i;
+  lua_createtable(L, a->nsites, 0);
+  for (i = 0; i < a->nsites; i++) {
+    const Site *s = &a->sites[i];
+    setrecord(L, s->label, typenames[s->type], (lua_Number)(size_t)s->bytes,
+              (lua_Number)(size_t)(s->count + 0.5), (lua_Number)s->samples);
+    lua_rawseti(L, -2, i + 1);
+  }
+  sortbybytes(L);
+  return 1;
+}
+
+
+/*
+** allocdiff(old, new): what was allocated between two snapshots, per
+** site and type, largest first
+*/
+static int prof_allocdiff (lua_State *L) {
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_newtable(L);  /* 3: old records by "site|type" */
+  for (i = 1; lua_rawgeti(L, 1, i), !lua_isnil(L, -1); i++) {
+    lua_getfield(L, -1, "site");
+    lua_pushliteral(L, "|");
+    lua_getfield(L, -3, "type");
+    lua_concat(L, 3);
+    lua_insert(L, -2);
+    lua_rawset(L, 3);
+  }
+  lua_pop(L, 1);
+  lua_newtable(L);  /* 4: result */
+  n = 0;
+  for (i = 1; lua_rawgeti(L, 2, i), !lua_isnil(L, -1); i++) {
+    lua_Number bytes, count, samples;
+    int rec = lua_gettop(L);
+    lua_getfield(L, rec, "bytes");
+    lua_getfield(L, rec, "count");
+    lua_getfield(L, rec, "samples");
+    bytes = lua_tonumber(L, -3);
+    count = lua_tonumber(L, -2);
+    samples = lua_tonumber(L, -1);
+    lua_pop(L, 3);
+    lua_getfield(L, rec, "site");
+    lua_pushliteral(L, "|");
+    lua_getfield(L, rec, "type");
+    lua_concat(L, 3);
+    lua_rawget(L, 3);
+    if (lua_istable(L, -1)) {
+      lua_getfield(L, -1, "bytes");
+      lua_getfield(L, -2, "count");
+      lua_getfield(L, -3, "samples");
+      bytes -= lua_tonumber(L, -3);
+      count -= lua_tonumber(L, -2);
+      samples -= lua_tonumber(L, -1);
+      lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+    if (samples != 0) {
+      lua_getfield(L, rec, "site");
+      lua_getfield(L, rec, "type");
+      setrecord(L, lua_tostring(L, -2), lua_tostring(L, -1),
+                bytes, count, samples);
+      lua_rawseti(L, 4, ++n);
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  sortbybytes(L);
+  return 1;
+}
+
+
+static int prof_allocstart (lua_State *L) {
+  lua_Number rate = luaL_optnumber(L, 1, ALLOCRATE);
+  luaL_argcheck(L, rate >= 1, 1, "invalid rate");
+  lua_pushboolean(L, luaL_allocstart(L, (size_t)rate));
+  return 1;
+}
+
+
+static int prof_allocstop (lua_State *L) {
+  luaL_allocstop(L);
+  return 0;
+}
+
+
+static int prof_allocreset (lua_State *L) {
+  freesites(getallocs(L));
+  return 0;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Heap snapshots
+** =======================================================
+*/
+
+/*
+** snapshot() returns the heap as written by lua_heapsnapshot (see
+** lheap.c for the format).  heapdiff(old, new) finds the objects of
+** `new' that are not in `old' and charges everything new that each
+** one leads to (through new objects only) to the first new object on
+** the way from the roots.  Those are grouped by the shortest path that
+** reaches them, with numeric keys folded to [#] so that the entries
+** of one growing table add up.  Objects are known by address: a new
+** object allocated where an old one of the same type died is missed.
+*/
+
+#define HEAPSIGNATURE	"\033LHS"
+#define HEAPROOT	0xFF
+#define MAXPATH		16	/* longer paths keep both ends */
+
+
+typedef struct HeapLabel {
+  const char *s;
+  size_t len;
+} HeapLabel;
+
+
+typedef struct Heap {
+  int nobjs, nedges, nlabels;
+  size_t *id;
+  size_t *size;
+  unsigned char *type;
+  int *first;  /* first edge of each object; first[nobjs] == nedges */
+  size_t *target;
+  int *label;
+  HeapLabel *labels;
+  int *hash;  /* open addressing, indices into objects + 1 */
+  int sizehash;
+} Heap;
+
+
+typedef struct Reader {
+  lua_State *L;
+  const unsigned char *p, *end;
+} Reader;
+
+
+static size_t readnum (Reader *R) {
+  size_t x = 0;
+  int shift = 0;
+  for (;;) {
+    int c;
+    if (R->p >= R->end || shift >= (int)sizeof(size_t) * 8)
+      luaL_error(R->L, "malformed heap snapshot");
+    c = *R->p++;
+    x |= (size_t)(c & 0x7F) << shift;
+    if (!(c & 0x80)) return x;
+    shift += 7;
+  }
+}
+
+
+/* arrays are userdata left on the stack */
+static void *scratch (lua_State *L, size_t n) {
+  return lua_newuserdata(L, n ? n : 1);
+}
+
+
+static unsigned int hashid (size_t id) {
+  return (unsigned int)(id ^ (id >> 4) ^ (id >> 16)) * 2654435761u;
+}
+
+
+static int findobj (const Heap *H, size_t id) {
+  int mask = H->sizehash - 1;
+  int i = (int)(hashid(id) & (unsigned int)mask);
+  while (H->hash[i] != 0) {
+    if (H->id[H->hash[i] - 1] == id) return H->hash[i] - 1;
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+
+/* read the snapshot at `idx' into `H'; takes 10 stack slots */
+static void readheap (lua_State *L, int idx, Heap *H) {
+  size_t len;
+  const char *s = luaL_checklstring(L, idx, &len);
+  int pass, i;
+  if (len < 5 || memcmp(s, HEAPSIGNATURE, 4) != 0)
+    luaL_argerror(L, idx, "not a heap snapshot");
+  luaL_checkstack(L, 10, "too many snapshots");
+  memset(H, 0, sizeof(Heap));
+  for (pass = 0; pass < 2; pass++) {
+    Reader R;
+    int nobjs = 0, nedges = 0, nlabels = 0;
+    R.L = L;
+    R.p = (const unsigned char *)s + 5;
+    R.end = (const unsigned char *)s + len;
+    for (;;) {
+      int type, n;
+      size_t id, size;
+      if (R.p >= R.end) luaL_error(L, "malformed heap snapshot");
+      type = *R.p++;
+      if (type == 0) break;
+      id = readnum(&R);
+      size = readnum(&R);
+      if (pass) {
+        H->type[nobjs] = (unsigned char)type;
+        H->id[nobjs] = id;
+        H->size[nobjs] = size;
+        H->first[nobjs] = nedges;
+      }
+      for (n = (int)readnum(&R); n > 0; n--) {
+        size_t target = readnum(&R);
+        size_t l = readnum(&R);
+        if (l == (size_t)nlabels) {  /* new label */
+          size_t ll = readnum(&R);
+          if (ll > (size_t)(R.end - R.p))
+            luaL_error(L, "malformed heap snapshot");
+          if (pass) {
+            H->labels[nlabels].s = (const char *)R.p;
+            H->labels[nlabels].len = ll;
+          }
+          R.p += ll;
+          nlabels++;
+        }
+        else if (l > (size_t)nlabels)
+          luaL_error(L, "malformed heap snapshot");
+        if (pass) {
+          H->target[nedges] = target;
+          H->label[nedges] = (int)l;
+        }
+        nedges++;
+      }
+      nobjs++;
+    }
+    if (pass == 0) {
+      if (nobjs == 0)
+        luaL_error(L, "malformed heap snapshot");
+      H->nobjs = nobjs;
+      H->nedges = nedges;
+      H->nlabels = nlabels;
+      H->id = (size_t *)scratch(L, nobjs * sizeof(size_t));
+      H->size = (size_t *)scratch(L, nobjs * sizeof(size_t));
+      H->type = (unsigned char *)scratch(L, nobjs);
+      H->first = (int *)scratch(L, (nobjs + 1) * sizeof(int));
+      H->target = (size_t *)scratch(L, nedges * sizeof(size_t));
+      H->label = (int *)scratch(L, nedges * sizeof(int));
+      H->labels = (HeapLabel *)scratch(L, nlabels * sizeof(HeapLabel));
+    }
+    else
+      H->first[nobjs] = nedges;
+  }
+  if (H->type[0] != HEAPROOT)
+    luaL_error(L, "malformed heap snapshot");
+  for (H->sizehash = 64; H->sizehash < 2 * H->nobjs; H->sizehash *= 2) ;
+  H->hash = (int *)scratch(L, H->sizehash * sizeof(int));
+  memset(H->hash, 0, H->sizehash * sizeof(int));
+  for (i = 1; i < H->nobjs; i++) {  /* the root is never looked up */
+    int j = (int)(hashid(H->id[i]) & (unsigned int)(H->sizehash - 1));
+    while (H->hash[j] != 0) j = (j + 1) & (H->sizehash - 1);
+    H->hash[j] = i + 1;
+  }
+}
+
+
+static const char *heaptype (int type) {
+  return (type < (int)(sizeof(typenames) / sizeof(typenames[0]))) ?
+         typenames[type] : typenames[0];
+}
+
+
+static void addlabel (luaL_Buffer *b, const HeapLabel *lb, int first) {
+  if (lb->len > 1 && lb->s[0] == '[' &&
+      (lb->s[1] == '-' || (lb->s[1] >= '0' && lb->s[1] <= '9'))) {
+    luaL_addstring(b, "[#]");  /* fold numeric keys */
+    return;
+  }
+  if (!first && lb->s[0] != '[')
+    luaL_addchar(b, '.');
+  luaL_addlstring(b, lb->s, lb->len);
+}
+
+
+/* push the path from the roots to object `o' */
+static void pushpath (lua_State *L, const Heap *H, const int *parent,
+                      const int *via, int o) {
+  int edges[MAXPATH];
+  int depth = 0, pos, i;
+  luaL_Buffer b;
+  for (i = o; i != 0; i = parent[i]) depth++;
+  for (i = o, pos = depth - 1; i != 0; i = parent[i], pos--) {
+    if (depth <= MAXPATH || pos < MAXPATH / 2)
+      edges[pos] = via[i];
+    else if (pos >= depth - MAXPATH / 2)
+      edges[pos - (depth - MAXPATH)] = via[i];
+  }
+  luaL_buffinit(L, &b);
+  if (depth <= MAXPATH) {
+    for (i = 0; i < depth; i++)
+      addlabel(&b, &H->labels[H->label[edges[i]]], i == 0);
+  }
+  else {
+    for (i = 0; i < MAXPATH / 2; i++)
+      addlabel(&b, &H->labels[H->label[edges[i]]], i == 0);
+    luaL_addstring(&b, " ... ");
+    for (; i < MAXPATH; i++)
+      addlabel(&b, &H->labels[H->label[edges[i]]], i == MAXPATH / 2);
+  }
+  luaL_pushresult(&b);
+}
+
+
+static void setheaprecord (lua_State *L, const char *type, lua_Number count,
+                           lua_Number bytes) {
+  lua_pushstring(L, type);
+  lua_setfield(L, -2, "type");
+  lua_pushnumber(L, count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, bytes);
+  lua_setfield(L, -2, "bytes");
+}
+
+
+static int heapwriter (lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)ud, (const char *)p, sz);
+  return 0;
+}
+
+
+static int filewriter (lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  return fwrite(p, 1, sz, (FILE *)ud) != sz;
+}
+
+
+/* snapshot([file]): the snapshot as a string, or written to `file' */
+static int prof_snapshot (lua_State *L) {
+  const char *name = luaL_optstring(L, 1, NULL);
+  if (name != NULL) {
+    FILE *f = fopen(name, "wb");
+    int status;
+    if (f == NULL)
+      return luaL_error(L, "cannot open " LUA_QS, name);
+    status = lua_heapsnapshot(L, filewriter, f);
+    if (fclose(f) != 0 || status != 0)
+      return luaL_error(L, "cannot write " LUA_QS, name);
+    lua_pushboolean(L, 1);
+  }
+  else {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    lua_heapsnapshot(L, heapwriter, &b);
+    luaL_pushresult(&b);
+  }
+  return 1;
+}
+
+
+/* heapstats(snapshot): an array of {type, count, bytes}, largest first */
+static int prof_heapstats (lua_State *L) {
+  lua_Number count[256], bytes[256];
+  Heap H;
+  int i, n = 0;
+  readheap(L, 1, &H);
+  for (i = 0; i < 256; i++) count[i] = bytes[i] = 0;
+  for (i = 1; i < H.nobjs; i++) {
+    count[H.type[i]]++;
+    bytes[H.type[i]] += (lua_Number)H.size[i];
+  }
+  lua_newtable(L);
+  for (i = 0; i < 256; i++) {
+    if (count[i] == 0) continue;
+    lua_createtable(L, 0, 3);
+    setheaprecord(L, heaptype(i), count[i], bytes[i]);
+    lua_rawseti(L, -2, ++n);
+  }
+  sortbybytes(L);
+  return 1;
+}
+
+
+/*
+** heapdiff(old, new): an array of {path, type, count, bytes} for the
+** objects only in `new', largest first
+*/
+static int prof_heapdiff (lua_State *L) {
+  Heap A, B;
+  int *parent, *via, *order;
+  lua_Number *count, *bytes;
+  char *isnew;
+  int head, tail, i, n = 0;
+  readheap(L, 1, &A);
+  readheap(L, 2, &B);
+  parent = (int *)scratch(L, B.nobjs * sizeof(int));
+  via = (int *)scratch(L, B.nobjs * sizeof(int));
+  order = (int *)scratch(L, B.nobjs * sizeof(int));
+  count = (lua_Number *)scratch(L, B.nobjs * sizeof(lua_Number));
+  bytes = (lua_Number *)scratch(L, B.nobjs * sizeof(lua_Number));
+  isnew = (char *)scratch(L, B.nobjs);
+  for (i = 0; i < B.nobjs; i++) {
+    int a = findobj(&A, B.id[i]);
+    parent[i] = -1;
+    count[i] = bytes[i] = 0;
+    isnew[i] = (i != 0 && (a < 0 || A.type[a] != B.type[i]));
+  }
+  parent[0] = 0;
+  order[0] = 0;
+  for (head = 0, tail = 1; head < tail; head++) {  /* shortest paths */
+    int o = order[head], e;
+    for (e = B.first[o]; e < B.first[o + 1]; e++) {
+      int t = findobj(&B, B.target[e]);
+      if (t > 0 && parent[t] < 0) {
+        parent[t] = o;
+        via[t] = e;
+        order[tail++] = t;
+      }
+    }
+  }
+  for (i = tail - 1; i > 0; i--) {  /* charge new objects to the first */
+    int o = order[i];
+    if (!isnew[o]) continue;
+    count[o] += 1;
+    bytes[o] += (lua_Number)B.size[o];
+    if (isnew[parent[o]]) {
+      count[parent[o]] += count[o];
+      bytes[parent[o]] += bytes[o];
+    }
+  }
+  lua_newtable(L);  /* groups by "path|type" */
+  lua_newtable(L);  /* result */
+  for (i = 1; i < tail; i++) {
+    int o = order[i];
+    if (!isnew[o] || isnew[parent[o]]) continue;
+    pushpath(L, &B, parent, via, o);
+    lua_pushvalue(L, -1);
+    lua_pushliteral(L, "|");
+    lua_pushstring(L, heaptype(B.type[o]));
+    lua_concat(L, 3);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -5);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 4);
+      lua_pushvalue(L, -3);
+      lua_setfield(L, -2, "path");
+      setheaprecord(L, heaptype(B.type[o]), 0, 0);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -5, ++n);
+      lua_pushvalue(L, -2);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -7);
+    }
+    lua_getfield(L, -1, "count");
+    lua_pushnumber(L, lua_tonumber(L, -1) + count[o]);
+    lua_setfield(L, -3, "count");
+    lua_getfield(L, -2, "bytes");
+    lua_pushnumber(L, lua_tonumber(L, -1) + bytes[o]);
+    lua_setfield(L, -4, "bytes");
+    lua_pop(L, 5);
+  }
+  sortbybytes(L);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+static int prof_start (lua_State *L) {
+  int hz = luaL_optint(L, 1, 1000);
+  luaL_argcheck(L, hz > 0 && hz <= 100000, 1, "invalid frequency");
+  lua_pushboolean(L, luaL_profstart(L, hz));
+  return 1;
+}
+
+
+static int prof_stop (lua_State *L) {
+  luaL_profstop(L);
+  return 0;
+}
+
+
+static int prof_reset (lua_State *L) {
+  luaL_profreset(L);
+  return 0;
+}
+
+
+static int prof_dump (lua_State *L) {
+  const char *name = luaL_optstring(L, 1, NULL);
+  luaL_profdump(L);
+  if (name != NULL) {  /* write to a file */
+    size_t len;
+    const char *s = lua_tolstring(L, -1, &len);
+    FILE *f = fopen(name, "wb");
+    if (f == NULL)
+      return luaL_error(L, "cannot open " LUA_QS, name);
+    fwrite(s, 1, len, f);
+    fclose(f);
+    lua_pushboolean(L, 1);
+  }
+  return 1;
+}
+
+
+static int prof_stats (lua_State *L) {
+  lua_createtable(L, 0, 5);
+  lua_pushboolean(L, prof.L != NULL);
+  lua_setfield(L, -2, "running");
+  lua_pushinteger(L, prof.hz);
+  lua_setfield(L, -2, "hz");
+  lua_pushnumber(L, (lua_Number)prof.samples);
+  lua_setfield(L, -2, "samples");
+  lua_pushnumber(L, (lua_Number)prof.dropped);
+  lua_setfield(L, -2, "dropped");
+  lua_pushinteger(L, prof.nstacks);
+  lua_setfield(L, -2, "stacks");
+  return 1;
+}
+
+
+/*
+** vmstats([reset]): execution counters of an interpreter built with
+** LUAI_VMSTATS (see lua_vmstats), or nil
+*/
+static int prof_vmstats (lua_State *L) {
+  if (!lua_vmstats(L, lua_toboolean(L, 1)))
+    lua_pushnil(L);
+  return 1;
+}
+
+
+static const luaL_Reg proflib[] = {
+  {"allocdiff", prof_allocdiff},
+  {"allocreset", prof_allocreset},
+  {"allocs", prof_allocs},
+  {"allocstart", prof_allocstart},
+  {"allocstop", prof_allocstop},
+  {"dump", prof_dump},
+  {"heapdiff", prof_heapdiff},
+  {"heapstats", prof_heapstats},
+  {"reset", prof_reset},
+  {"snapshot", prof_snapshot},
+  {"start", prof_start},
+  {"stats", prof_stats},
+  {"stop", prof_stop},
+  {"vmstats", prof_vmstats},
+  {NULL, NULL}
+};
+
+
+/*
+** Open profile library
+*/
+LUALIB_API int luaopen_profile (lua_State *L) {
+  luaL_newmetatable(L, ALLOCS_T);
+  lua_pushcfunction(L, allocs_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  lua_pushvalue(L, LUA_ENVIRONINDEX);
+  luaL_register(L, NULL, proflib);
+  return 1;
+}
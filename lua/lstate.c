@@ -6,6 +6,7 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
 #define lstate_c
 #define LUA_CORE
@@ -91,6 +92,11 @@ static void preinit_state (lua_State *L, global_State *g) {
   L->basehookcount = 0;
   L->allowhook = 1;
   resethookcount(L);
+  L->onbudget = 0;
+  L->budgetmode = LUA_BUDGETERROR;
+  L->budgetcount = L->budgetslice = 0;
+  L->budget = MAX_LMEM;
+  L->deadline = 0;
   L->openupval = NULL;
   L->size_ci = 0;
   L->nCcalls = L->baseCcalls = 0;
@@ -106,6 +112,7 @@ static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeall(L);  /* collect all objects */
+  luaM_release(L, 0);  /* and give back what the sweep deferred */
   lua_assert(g->rootgc == obj2gco(L));
   lua_assert(g->strt.nuse == 0);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString *);
@@ -117,7 +124,8 @@ static void close_state (lua_State *L) {
 
 
 lua_State *luaE_newthread (lua_State *L) {
-  lua_State *L1 = tostate(luaM_malloc(L, state_size(lua_State)));
+  lua_State *L1 = tostate(luaM_newobject(L, LUA_TTHREAD,
+                                         state_size(lua_State)));
   luaC_link(L, obj2gco(L1), LUA_TTHREAD);
   preinit_state(L1, G(L));
   stack_init(L1, L);  /* init stack */
@@ -159,6 +167,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
+  g->running = L;
   g->uvhead.u.l.prev = &g->uvhead;
   g->uvhead.u.l.next = &g->uvhead;
   g->GCthreshold = 0;  /* mark it as unfinished state */
@@ -169,6 +178,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   luaZ_initbuffer(L, &g->buff);
   g->panic = NULL;
   g->gcstate = GCSpause;
+  g->lazyparse = 0;
   g->rootgc = obj2gco(L);
   g->sweepstrgc = 0;
   g->sweepgc = &g->rootgc;
@@ -180,6 +190,18 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
   g->gcdept = 0;
+  g->deferred = NULL;
+  g->deferbytes = 0;
+  g->deferlimit = 0;
+  g->softlimit = g->hardlimit = 0;
+  g->softhits = g->hardhits = 0;
+  g->gcemergency = 0;
+  g->alloctrack = NULL;
+  g->alloctrackud = NULL;
+  g->allocleft = 0;
+#if defined(LUAI_VMSTATS)
+  memset(&g->vmstats, 0, sizeof(g->vmstats));
+#endif
   for (i=0; i<NUM_TAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != 0) {
     /* memory allocation error: free partial state */
@@ -197,6 +219,16 @@ LUA_API lua_State *lua_host (lua_State *L) {
 }
 
 
+/*
+** thread of `L's state that is executing now (a resumed coroutine,
+** or the main thread); it only reads a pointer, so it may be called
+** from a signal handler
+*/
+LUA_API lua_State *lua_current (lua_State *L) {
+  return G(L)->running;
+}
+
+
 LUA_API void *lua_getrefers (lua_State *L) {
   return L->host->refers;
 }
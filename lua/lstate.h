@@ -18,6 +18,36 @@
 struct lua_longjmp;  /* defined in ldo.c */
 
 
+#if defined(LUAI_VMSTATS)
+
+#include "lopcodes.h"
+
+/* paths of table accesses */
+#define VMS_ARRAY	0	/* found in the array part */
+#define VMS_HASH	1	/* found in the hash part */
+#define VMS_MISS	2	/* absent key (new key, for writes) */
+#define VMS_META	3	/* table with a metamethod for the key */
+#define VMS_OTHER	4	/* not a table */
+#define VMS_NACCESS	5
+
+/* kinds of called values */
+#define VMS_LUA		0
+#define VMS_C		1
+#define VMS_LUAEX	2	/* luaEX trampoline around a C function */
+#define VMS_CALLTM	3	/* not a function (`__call') */
+#define VMS_NCALL	4
+
+typedef struct VMStats {
+  lu_mem op[NUM_OPCODES];
+  lu_mem pair[NUM_OPCODES][NUM_OPCODES];  /* [previous][next] */
+  lu_mem get[VMS_NACCESS];
+  lu_mem set[VMS_NACCESS];
+  lu_mem call[VMS_NCALL];
+} VMStats;
+
+#endif
+
+
 /* table of globals */
 #define gt(L)	(&L->l_gt)
 
@@ -71,6 +101,7 @@ typedef struct global_State {
   void *ud;         /* auxiliary data to `frealloc' */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
+  lu_byte lazyparse;  /* compile nested functions on their first call */
   int sweepstrgc;  /* position of sweep in `strt' */
   GCObject *rootgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* position of sweep in `rootgc' */
@@ -83,14 +114,29 @@ typedef struct global_State {
   lu_mem totalbytes;  /* number of bytes currently allocated */
   lu_mem estimate;  /* an estimate of number of bytes actually in use */
   lu_mem gcdept;  /* how much GC is `behind schedule' */
+  void *deferred;  /* swept blocks not yet released (see lmem.c) */
+  lu_mem deferbytes;  /* number of bytes held in `deferred' */
+  lu_mem deferlimit;  /* 0, or most bytes `deferred' may hold */
+  lu_mem softlimit;  /* 0, or size that triggers an emergency collection */
+  lu_mem hardlimit;  /* 0, or size past which allocations fail */
+  lu_int32 softhits;  /* number of emergency collections */
+  lu_int32 hardhits;  /* number of allocations refused by `hardlimit' */
+  lu_byte gcemergency;  /* full collection due at the next GC check */
+  lua_AllocTrack alloctrack;  /* allocation tracker (see lmem.c) */
+  void *alloctrackud;  /* auxiliary data to `alloctrack' */
+  l_mem allocleft;  /* bytes to allocate before calling `alloctrack' */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC `granularity' */
   lua_CFunction panic;  /* to be called in unprotected errors */
   TValue l_registry;
   struct lua_State *mainthread;
+  struct lua_State *running;  /* thread being executed */
   UpVal uvhead;  /* head of double-linked list of all open upvalues */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
   TString *tmname[TM_N];  /* array with tag-method names */
+#if defined(LUAI_VMSTATS)
+  VMStats vmstats;  /* execution counters (see lvm.c) */
+#endif
 } global_State;
 
 
@@ -118,6 +164,12 @@ struct lua_State {
   int basehookcount;
   int hookcount;
   lua_Hook hook;
+  lu_byte onbudget;  /* runs on an execution budget */
+  lu_byte budgetmode;  /* LUA_BUDGETERROR or LUA_BUDGETYIELD */
+  int budgetcount;  /* instructions to go before the next budget check */
+  int budgetslice;  /* instructions in the current slice */
+  l_mem budget;  /* instructions left when the slice started */
+  lua_Number deadline;  /* clock time to stop at; 0 for none */
   TValue l_gt;  /* table of globals */
   TValue env;  /* temporary place for environments */
   GCObject *openupval;  /* list of open upvalues in this stack */
@@ -6,6 +6,7 @@
 
 
 #include <ctype.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -148,10 +149,13 @@ static int writer (lua_State *L, const void* b, size_t size, void* B) {
 
 static int str_dump (lua_State *L) {
   luaL_Buffer b;
+  int flags = 0;
   luaL_checktype(L, 1, LUA_TFUNCTION);
+  if (lua_toboolean(L, 2)) flags |= LUA_DUMPSTRIP;
+  if (lua_toboolean(L, 3)) flags |= LUA_DUMPOPTIMIZE;
   lua_settop(L, 1);
   luaL_buffinit(L,&b);
-  if (lua_dump(L, writer, &b) != 0)
+  if (lua_dumpx(L, writer, &b, flags) != 0)
     luaL_error(L, "unable to dump given function");
   luaL_pushresult(&b);
   return 1;
@@ -177,26 +181,57 @@ enum {
   ST_PK_STR = 0x03,
 };
 
+/* varints of one or two bytes are the common case: write them unrolled */
 static void pack_uint(luaL_Buffer *buffer, unsigned int u)
 {
-  while (u > 127) {
-    luaL_addchar(buffer, (u & 0xff) | 0x80);
-    u >>= 7;
+  char *p;
+  if (buffer->p + 5 > buffer->buffer + LUAL_BUFFERSIZE)
+    luaL_prepbuffer(buffer);
+  p = buffer->p;
+  if (u < 0x80) {
+    *p++ = (char)u;
+  }
+  else if (u < 0x4000) {
+    p[0] = (char)(u | 0x80);
+    p[1] = (char)(u >> 7);
+    p += 2;
+  }
+  else {
+    while (u > 127) {
+      *p++ = (char)((u & 0xff) | 0x80);
+      u >>= 7;
+    }
+    *p++ = (char)u;
   }
-  luaL_addchar(buffer, u & 0xff);
+  buffer->p = p;
 }
 
+/* a varint always ends before the '\0' that terminates its string */
 static unsigned int unpack_uint(const char *str, size_t *len)
 {
-  size_t l = *len;
-  unsigned int u = 0;
-  unsigned int c;
-  int bytes = 0;
-  while ((c = (unsigned char)str[l++]) > 127) {
-    u |= (c & 0x7f) << (bytes++ * 7);
+  const unsigned char *s = (const unsigned char *)str + *len;
+  unsigned int u;
+  int bytes;
+  if (s[0] < 0x80) {
+    *len += 1;
+    return s[0];
   }
-  u |= c << (bytes++ * 7);
-  *len = l;
+  if (s[1] < 0x80) {
+    *len += 2;
+    return (s[0] & 0x7f) | ((unsigned int)s[1] << 7);
+  }
+  if (s[2] < 0x80) {
+    *len += 3;
+    return (s[0] & 0x7f) | ((unsigned int)(s[1] & 0x7f) << 7) | ((unsigned int)s[2] << 14);
+  }
+  u = (s[0] & 0x7f) | ((unsigned int)(s[1] & 0x7f) << 7) | ((unsigned int)(s[2] & 0x7f) << 14);
+  for (bytes = 3; s[bytes] > 127; ++bytes) {
+    if (bytes < 5)  /* bits past 32 are dropped */
+      u |= (unsigned int)(s[bytes] & 0x7f) << (bytes * 7);
+  }
+  if (bytes < 5)
+    u |= (unsigned int)s[bytes] << (bytes * 7);
+  *len += bytes + 1;
   return u;
 }
 
@@ -217,15 +252,6 @@ static void pack_string(luaL_Buffer *buffer, const char *s, size_t l)
   luaL_addlstring(buffer, s, l);
 }
 
-static const char * unpack_string(const char *str, size_t *len, size_t *l)
-{
-  const char *s;
-  *l = (size_t)unpack_uint(str, len);
-  s = str + *len;
-  *len += *l;
-  return s;
-}
-
 static void pack_float(luaL_Buffer *buffer, double f)
 {
   I64 i64;
@@ -246,101 +272,155 @@ static void pack_float(luaL_Buffer *buffer, double f)
   pack_num(buffer, e);
 }
 
-static double unpack_float(const char *str, size_t *len)
+/* a mantissa that leaves no room for the exponent moves `*len' past `end' */
+static double unpack_float(const char *str, size_t *len, size_t end)
 {
   size_t l = *len;
   unsigned I64 u = 0;
   unsigned I64 c;
-  int bytes = 0;
-  while ((c = (unsigned char)str[l++]) > 127) {
-    u |= (c & 0x7f) << (bytes++ * 7);
+  int bytes;
+  for (bytes = 0; (c = (unsigned char)str[l++]) > 127; ++bytes) {
+    if (bytes < 10)  /* bits past 64 are dropped */
+      u |= (c & 0x7f) << (bytes * 7);
+  }
+  if (bytes < 10)
+    u |= c << (bytes * 7);
+  if (l >= end) {
+    *len = end + 1;
+    return 0;
   }
-  u |= c << (bytes++ * 7);
   *len = l;
   return ldexp(u & 1 ? -(double)((u + 1) >> 1) : (double)(u >> 1), unpack_num(str, len));
 }
 
 
-static int str_pack(lua_State *L)
+static const char *const pack_typenames[] = {NULL, "number", "number", "string"};
+
+/* reads the next item of a format: its type, repeated `*count' times */
+static int pack_item(lua_State *L, const char **fmt, int *count)
 {
-  static char typeskey;
+  const char *f = *fmt;
+  int type;
+  switch (*f++)
+  {
+  case 'i':
+  case 'I':
+    type = ST_PK_NUM;
+    break;
+  case 'n':
+  case 'N':
+    type = ST_PK_FLOAT;
+    break;
+  case 's':
+  case 'S':
+    type = ST_PK_STR;
+    break;
+  default:
+    return luaL_error(L, "invalid format (must be 'i|n|s')");
+  }
+  *count = 1;
+  if (isdigit(uchar(*f))) {
+    *count = 0;
+    do {
+      *count = 10 * *count + (*f) - '0';
+      if (*count > LUAI_MAXCSTACK)
+        return luaL_error(L, "invalid format (repeat count too large)");
+    } while (isdigit(uchar(*++f)));
+  }
+  *fmt = f;
+  return type;
+}
 
-  int arg = 1;
+/* packs the value at `idx' as `type'; returns 0 if it is not of that type */
+static int pack_value(lua_State *L, luaL_Buffer *buffer, int type, int idx)
+{
+  switch (type)
+  {
+  case ST_PK_NUM:
+    if (!lua_isnumber(L, idx))
+      return 0;
+    pack_num(buffer, (int)lua_tointeger(L, idx));
+    break;
+  case ST_PK_FLOAT:
+    if (!lua_isnumber(L, idx))
+      return 0;
+    pack_float(buffer, lua_tonumber(L, idx));
+    break;
+  default: {
+      size_t l;
+      const char *s = lua_tolstring(L, idx, &l);
+      if (s == NULL)
+        return 0;
+      pack_string(buffer, s, l);
+    }
+    break;
+  }
+  return 1;
+}
+
+/*
+** pushes the value of `type' at `*pos'; raises an error if `str' ends first.
+** A varint running into the terminating '\0' leaves `*pos' at `len' + 1,
+** so callers check it after their last value.
+*/
+static void unpack_value(lua_State *L, const char *str, size_t len, size_t *pos, int type)
+{
+  if (*pos >= len)
+    luaL_error(L, "overflow");
+
+  switch (type)
+  {
+  case ST_PK_NUM:
+    lua_pushinteger(L, unpack_num(str, pos));
+    break;
+  case ST_PK_FLOAT:
+    lua_pushnumber(L, unpack_float(str, pos, len));
+    break;
+  default: {
+      size_t l = unpack_uint(str, pos);
+      if (*pos > len || l > len - *pos)
+        luaL_error(L, "overflow");
+      lua_pushlstring(L, str + *pos, l);
+      *pos += l;
+    }
+    break;
+  }
+}
+
+static int str_pack(lua_State *L)
+{
+  const char *fmt = luaL_checkstring(L, 1);
+  const char *f;
   int top = lua_gettop(L);
-  const char *fmt = luaL_checkstring(L, arg++);
-  char *types;
-  int typeidx = 0;
+  int arg = 2;
+  int count, type;
+  unsigned int bits = 0;
   luaL_Buffer b;
   luaL_buffinit(L, &b);
-  lua_pushlightuserdata(L, &typeskey);
-  lua_gettable(L, LUA_REGISTRYINDEX);
-  if (lua_isnil(L, -1)) {
-    void *buf;
-    lua_pop(L, 1);
-    buf = lua_newuserdata(L, LUAI_MAXCSTACK / 4);
-    memset(buf, 0, LUAI_MAXCSTACK / 4);
-    lua_pushlightuserdata(L, &typeskey);
-    lua_pushvalue(L, -2);
-    lua_settable(L, LUA_REGISTRYINDEX);
-  }
-  types = (char *)lua_touserdata(L, -1);
-  lua_pop(L, 1);
-  while (*fmt != 0) {
-    char c = *fmt++;
-    int N = 1;
-    if (isdigit(*fmt)) {
-      N = 0;
-      do {
-        N = 10 * N + (*fmt) - '0';
-      } while (isdigit(*++fmt));
-    }
-    while (N--) {
-      if (arg > top)
-        return luaL_argerror(L, arg, "overflow");
-
-      switch (c)
-      {
-      case 'i':
-      case 'I': {
-          pack_num(&b, luaL_checkint(L, arg++));
-          types[typeidx >> 2] |= ST_PK_NUM << ((typeidx & (4 - 1)) << 1);
-          ++typeidx;
-        }
-        break;
-      case 'n':
-      case 'N': {
-          pack_float(&b, luaL_checknumber(L, arg++));
-          types[typeidx >> 2] |= ST_PK_FLOAT << ((typeidx & (4 - 1)) << 1);
-          ++typeidx;
-        }
-        break;
-      case 's':
-      case 'S': {
-          size_t l;
-          const char *s = luaL_checklstring(L, arg++, &l);
-          pack_string(&b, s, l);
-          types[typeidx >> 2] |= ST_PK_STR << ((typeidx & (4 - 1)) << 1);
-          ++typeidx;
-        }
-        break;
-      default:
-        return luaL_error(L, "invalid format (must be 'i|n|s')");
+  /* the type header depends on the format alone, so it goes out first */
+  for (f = fmt; *f != 0; ) {
+    type = pack_item(L, &f, &count);
+    if (count > top - arg + 1)
+      return luaL_argerror(L, top + 1, "overflow");
+
+    while (count--) {
+      bits |= type << (((arg - 2) & (4 - 1)) << 1);
+      if ((++arg - 2) % 4 == 0) {
+        luaL_addchar(&b, (char)bits);
+        bits = 0;
       }
     }
   }
-  luaL_pushresult(&b);
-  types[typeidx >> 2] |= ST_PK_NONE << ((typeidx & (4 - 1)) << 1);
-  ++typeidx;
-  if (typeidx & (4 - 1)) {
-    int i;
-    for (i = typeidx & (4 - 1); i < 4; ++i) {
-      types[typeidx >> 2] |= ST_PK_NONE << (i << 1);
+  luaL_addchar(&b, (char)bits);  /* ends with a ST_PK_NONE */
+  for (f = fmt, arg = 2; *f != 0; ) {
+    type = pack_item(L, &f, &count);
+    while (count--) {
+      if (!pack_value(L, &b, type, arg))
+        luaL_typerror(L, arg, pack_typenames[type]);
+      ++arg;
     }
   }
-  lua_pushlstring(L, types, (typeidx + 4 - 1) >> 2);
-  memset(types, 0, (typeidx + 4 - 1) >> 2);
-  lua_insert(L, -2);
-  lua_concat(L, 2);
+  luaL_pushresult(&b);
   return 1;
 }
 
@@ -372,45 +452,638 @@ static int str_unpack(lua_State *L)
     return 0;
   }
   content = (typeidx + 4) >> 2;
+  if (end > LUA_MINSTACK)
+    luaL_checkstack(L, end, "too many values to unpack");
+
   while (cursor < end) {
     if (cursor >= typeidx) {
       lua_pushnil(L);
     }
     else {
-      if (content >= len)
-        return luaL_error(L, "overflow");
-
-      switch ((str[cursor >> 2] >> ((cursor & (4 - 1)) << 1)) & (4 - 1))
-      {
-      case ST_PK_NUM: {
-          int n = unpack_num(str, &content);
-          if (cursor + 1 >= start) {
-            lua_pushinteger(L, n);
-          }
-        }
-        break;
-      case ST_PK_FLOAT: {
-          double d = unpack_float(str, &content);
-          if (cursor + 1 >= start) {
-            lua_pushnumber(L, d);
-          }
-        }
-        break;
-      case ST_PK_STR: {
-          size_t l;
-          const char *s = unpack_string(str, &content, &l);
-          if (cursor + 1 >= start) {
-            lua_pushlstring(L, s, l);
-          }
-        }
-        break;
-      }
+      unpack_value(L, str, len, &content,
+                   (str[cursor >> 2] >> ((cursor & (4 - 1)) << 1)) & (4 - 1));
+      if (cursor + 1 < start)
+        lua_pop(L, 1);
     }
     ++cursor;
   }
+  if (content > len)
+    return luaL_error(L, "overflow");
+
   return end - start + 1;
 }
 
+
+/*
+** compile(fmt) parses a format once; the packer it returns writes and reads
+** the same strings as pack/unpack with that format.  packarray(list [, n])
+** writes records list[1..n] (arrays of the format's values) as the type
+** header, the varint n and then the values of each record in turn; only
+** unpackarray reads that back.
+*/
+
+#define PACKER_T	"string-packer"
+
+typedef struct Packer {
+  int nvalues;
+  int nheader;
+  char types[1];  /* `nvalues' types, then the `nheader' bytes of the header */
+} Packer;
+
+#define packheader(p)	((p)->types + (p)->nvalues)
+
+/* the methods keep the metatable as upvalue, which spares a registry lookup */
+static Packer * checkpacker(lua_State *L)
+{
+  Packer *p = (Packer *)lua_touserdata(L, 1);
+  if (p == NULL || !lua_getmetatable(L, 1) || !lua_rawequal(L, -1, lua_upvalueindex(1)))
+    luaL_typerror(L, 1, PACKER_T);
+
+  lua_pop(L, 1);
+  return p;
+}
+
+/* the string at 2, which must start with the packer's type header */
+static const char * checkpacked(lua_State *L, Packer *p, size_t *len)
+{
+  const char *str = luaL_checklstring(L, 2, len);
+  if (*len < (size_t)p->nheader || memcmp(str, packheader(p), p->nheader) != 0)
+    luaL_argerror(L, 2, "data does not match the format");
+
+  return str;
+}
+
+static int str_compile(lua_State *L)
+{
+  const char *fmt = luaL_checkstring(L, 1);
+  const char *f;
+  int n = 0;
+  int count, type, i;
+  Packer *p;
+  for (f = fmt; *f != 0; n += count) {
+    pack_item(L, &f, &count);
+    if (count > LUAI_MAXCSTACK - n)
+      return luaL_error(L, "invalid format (too many values)");
+  }
+  p = (Packer *)lua_newuserdata(L, sizeof(Packer) + n + ((n + 4) >> 2));
+  p->nvalues = n;
+  p->nheader = (n + 4) >> 2;
+  memset(packheader(p), 0, p->nheader);
+  for (f = fmt, i = 0; *f != 0; ) {
+    type = pack_item(L, &f, &count);
+    while (count--) {
+      p->types[i] = (char)type;
+      packheader(p)[i >> 2] |= type << ((i & (4 - 1)) << 1);
+      ++i;
+    }
+  }
+  luaL_getmetatable(L, PACKER_T);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int packer_pack(lua_State *L)
+{
+  Packer *p = checkpacker(L);
+  int i;
+  luaL_Buffer b;
+  if (lua_gettop(L) - 1 < p->nvalues)
+    return luaL_argerror(L, lua_gettop(L) + 1, "overflow");
+
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, packheader(p), p->nheader);
+  for (i = 0; i < p->nvalues; ++i) {
+    if (!pack_value(L, &b, p->types[i], i + 2))
+      luaL_typerror(L, i + 2, pack_typenames[(int)p->types[i]]);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int packer_unpack(lua_State *L)
+{
+  Packer *p = checkpacker(L);
+  size_t len;
+  const char *str = checkpacked(L, p, &len);
+  size_t pos = p->nheader;
+  int i;
+  if (p->nvalues > LUA_MINSTACK)
+    luaL_checkstack(L, p->nvalues, "too many values to unpack");
+
+  for (i = 0; i < p->nvalues; ++i) {
+    unpack_value(L, str, len, &pos, p->types[i]);
+  }
+  if (pos > len)
+    return luaL_error(L, "overflow");
+
+  return p->nvalues;
+}
+
+static int packer_packarray(lua_State *L)
+{
+  Packer *p = checkpacker(L);
+  int n, i, j;
+  luaL_Buffer b;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = luaL_optint(L, 3, (int)lua_objlen(L, 2));
+  luaL_argcheck(L, n >= 0, 3, "negative count");
+  if (p->nvalues == 0)
+    return luaL_error(L, "format has no values");
+
+  lua_settop(L, 2);
+  lua_pushnil(L);  /* 3: record being packed */
+  lua_pushnil(L);  /* 4: value being packed, kept below the buffer */
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, packheader(p), p->nheader);
+  pack_uint(&b, (unsigned int)n);
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 2, i);
+    lua_replace(L, 3);
+    if (!lua_istable(L, 3))
+      return luaL_error(L, "record %d is not a table", i);
+
+    for (j = 0; j < p->nvalues; ++j) {
+      lua_rawgeti(L, 3, j + 1);
+      lua_replace(L, 4);
+      if (!pack_value(L, &b, p->types[j], 4))
+        return luaL_error(L, "bad value #%d in record %d (%s expected, got %s)",
+                          j + 1, i, pack_typenames[(int)p->types[j]], luaL_typename(L, 4));
+    }
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int packer_unpackarray(lua_State *L)
+{
+  Packer *p = checkpacker(L);
+  size_t len;
+  const char *str = checkpacked(L, p, &len);
+  size_t pos = p->nheader;
+  unsigned int n, i;
+  int j;
+  if (p->nvalues == 0)
+    return luaL_error(L, "format has no values");
+
+  n = pos < len ? unpack_uint(str, &pos) : 0;
+  /* every value takes a byte at least */
+  if (pos > len || n > (len - pos) / p->nvalues)
+    return luaL_error(L, "overflow");
+
+  lua_createtable(L, (int)n, 0);
+  for (i = 1; i <= n; ++i) {
+    lua_createtable(L, p->nvalues, 0);
+    for (j = 0; j < p->nvalues; ++j) {
+      unpack_value(L, str, len, &pos, p->types[j]);
+      lua_rawseti(L, -2, j + 1);
+    }
+    lua_rawseti(L, -2, (int)i);
+  }
+  if (pos > len)
+    return luaL_error(L, "overflow");
+
+  return 1;
+}
+
+static int packer_len(lua_State *L)
+{
+  lua_pushinteger(L, checkpacker(L)->nvalues);
+  return 1;
+}
+
+static const luaL_Reg packerlib[] = {
+  {"pack", packer_pack},
+  {"unpack", packer_unpack},
+  {"packarray", packer_packarray},
+  {"unpackarray", packer_unpackarray},
+  {NULL, NULL}
+};
+
+
+/*
+** {======================================================
+** VALUE SERIALIZATION
+** =======================================================
+*/
+
+/*
+** serialize(v) writes SER_MAGIC and then value v as
+**   SER_NIL | SER_FALSE | SER_TRUE
+**   SER_INT zigzag          (numbers with an exact 64-bit integer value)
+**   SER_FLOAT 8 bytes       (other numbers, little endian)
+**   SER_STR length bytes
+**   SER_TABLE narray nhash array-values key value ... key value
+**   SER_FUNC length bytecode nups upvalue-values
+**   SER_REF id
+** where integers are LEB128 varints.  Strings, tables and functions get
+** ids 1, 2, ... as they first appear and are written as SER_REF after
+** that, so shared values stay shared, cycles survive and each string is
+** stored once.  Metatables are not kept.
+*/
+
+#define SER_MAGIC	"\033LV\1"
+#define SER_MAGICLEN	(sizeof(SER_MAGIC) - 1)
+
+enum {
+  SER_NIL, SER_FALSE, SER_TRUE, SER_INT, SER_FLOAT,
+  SER_STR, SER_TABLE, SER_FUNC, SER_REF
+};
+
+typedef struct SerState {
+  lua_State *L;
+  char *b;  /* output, in the userdata at `buf' */
+  size_t n, size;
+  int buf;
+  int seen;  /* table of ids of strings, tables and functions */
+  int nextid;
+  int functions, strip;
+  int depth;
+} SerState;
+
+
+static void ser_grow (SerState *S, size_t extra) {
+  if (S->size - S->n < extra) {
+    size_t size = S->size * 2;
+    char *b;
+    while (size - S->n < extra) size *= 2;
+    b = (char *)lua_newuserdata(S->L, size);
+    memcpy(b, S->b, S->n);
+    lua_replace(S->L, S->buf);
+    S->b = b;
+    S->size = size;
+  }
+}
+
+static void ser_byte (SerState *S, int c) {
+  ser_grow(S, 1);
+  S->b[S->n++] = (char)c;
+}
+
+static size_t ser_putvarint (char *p, unsigned I64 u) {
+  size_t n = 0;
+  while (u > 127) {
+    p[n++] = (char)((u & 0x7f) | 0x80);
+    u >>= 7;
+  }
+  p[n++] = (char)u;
+  return n;
+}
+
+static void ser_varint (SerState *S, unsigned I64 u) {
+  ser_grow(S, 10);
+  S->n += ser_putvarint(S->b + S->n, u);
+}
+
+static void ser_bytes (SerState *S, const char *s, size_t l) {
+  ser_grow(S, l);
+  memcpy(S->b + S->n, s, l);
+  S->n += l;
+}
+
+static void ser_number (SerState *S, lua_Number d) {
+  static const lua_Number zero = 0;
+  union { double d; unsigned I64 u; } v;
+  if (d == floor(d) && d >= -9223372036854775808.0 &&
+      d < 9223372036854775808.0 &&
+      (d != 0 || memcmp(&d, &zero, sizeof(d)) == 0)) {  /* not -0 */
+    I64 i = (I64)d;
+    ser_byte(S, SER_INT);
+    ser_varint(S, i < 0 ? (~(unsigned I64)i << 1) | 1 : (unsigned I64)i << 1);
+  }
+  else {
+    int i;
+    v.d = d;
+    ser_byte(S, SER_FLOAT);
+    ser_grow(S, 8);
+    for (i = 0; i < 8; i++)
+      S->b[S->n++] = (char)((v.u >> (8 * i)) & 0xff);
+  }
+}
+
+/* write a reference if the value at `idx' has an id, else give it one */
+static int ser_seen (SerState *S, int idx) {
+  lua_State *L = S->L;
+  lua_pushvalue(L, idx);
+  lua_rawget(L, S->seen);
+  if (!lua_isnil(L, -1)) {
+    ser_byte(S, SER_REF);
+    ser_varint(S, (unsigned I64)lua_tointeger(L, -1));
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_pop(L, 1);
+  lua_pushvalue(L, idx);
+  lua_pushinteger(L, ++S->nextid);
+  lua_rawset(L, S->seen);
+  return 0;
+}
+
+static void ser_value (SerState *S, int idx);
+
+/* is the key on top one of the array items written before the hash? */
+static int ser_inarray (lua_State *L, int n) {
+  lua_Number d;
+  if (lua_type(L, -1) != LUA_TNUMBER) return 0;
+  d = lua_tonumber(L, -1);
+  return d >= 1 && d <= n && d == floor(d);
+}
+
+static void ser_table (SerState *S, int idx) {
+  lua_State *L = S->L;
+  int n, i, nhash = 0;
+  size_t pos;
+  if (ser_seen(S, idx)) return;
+  if (++S->depth > LUAI_MAXCCALLS)
+    luaL_error(L, "value too deep to serialize");
+  luaL_checkstack(L, 4, "value too deep to serialize");
+  n = (int)lua_objlen(L, idx);
+  ser_byte(S, SER_TABLE);
+  ser_varint(S, n);
+  pos = S->n;
+  ser_byte(S, 0);  /* room for nhash, which is known only at the end */
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, idx, i);
+    ser_value(S, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    lua_pushvalue(L, -2);
+    if (!ser_inarray(L, n)) {
+      ser_value(S, lua_gettop(L));
+      ser_value(S, lua_gettop(L) - 1);
+      nhash++;
+    }
+    lua_pop(L, 2);
+  }
+  if (nhash < 128)
+    S->b[pos] = (char)nhash;
+  else {  /* move the entries to make room for a longer count */
+    char count[10];
+    size_t l = ser_putvarint(count, (unsigned I64)nhash);
+    ser_grow(S, l - 1);
+    memmove(S->b + pos + l, S->b + pos + 1, S->n - pos - 1);
+    memcpy(S->b + pos, count, l);
+    S->n += l - 1;
+  }
+  S->depth--;
+}
+
+static void ser_function (SerState *S, int idx) {
+  lua_State *L = S->L;
+  luaL_Buffer b;
+  const char *s;
+  size_t l;
+  int i, nups;
+  if (!S->functions)
+    luaL_error(L, "cannot serialize a function (functions not enabled)");
+  if (lua_iscfunction(L, idx))
+    luaL_error(L, "cannot serialize a C function");
+  if (ser_seen(S, idx)) return;
+  if (++S->depth > LUAI_MAXCCALLS)
+    luaL_error(L, "value too deep to serialize");
+  luaL_checkstack(L, 4, "value too deep to serialize");
+  lua_pushvalue(L, idx);
+  luaL_buffinit(L, &b);
+  if (lua_dumpx(L, writer, &b, S->strip ? LUA_DUMPSTRIP : 0) != 0)
+    luaL_error(L, "unable to dump given function");
+  luaL_pushresult(&b);
+  s = lua_tolstring(L, -1, &l);
+  ser_byte(S, SER_FUNC);
+  ser_varint(S, l);
+  ser_bytes(S, s, l);
+  lua_pop(L, 2);
+  for (nups = 0; lua_getupvalue(L, idx, nups + 1) != NULL; nups++)
+    lua_pop(L, 1);
+  ser_varint(S, nups);
+  for (i = 1; i <= nups; i++) {
+    lua_getupvalue(L, idx, i);
+    ser_value(S, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  S->depth--;
+}
+
+static void ser_value (SerState *S, int idx) {
+  lua_State *L = S->L;
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      ser_byte(S, SER_NIL);
+      break;
+    case LUA_TBOOLEAN:
+      ser_byte(S, lua_toboolean(L, idx) ? SER_TRUE : SER_FALSE);
+      break;
+    case LUA_TNUMBER:
+      ser_number(S, lua_tonumber(L, idx));
+      break;
+    case LUA_TSTRING: {
+      size_t l;
+      const char *s;
+      if (ser_seen(S, idx)) break;
+      s = lua_tolstring(L, idx, &l);
+      ser_byte(S, SER_STR);
+      ser_varint(S, l);
+      ser_bytes(S, s, l);
+      break;
+    }
+    case LUA_TTABLE:
+      ser_table(S, idx);
+      break;
+    case LUA_TFUNCTION:
+      ser_function(S, idx);
+      break;
+    default:
+      luaL_error(L, "cannot serialize a %s", luaL_typename(L, idx));
+  }
+}
+
+
+/* serialize(v [, functions [, strip]]) */
+static int str_serialize (lua_State *L) {
+  SerState S;
+  luaL_checkany(L, 1);
+  S.L = L;
+  S.functions = lua_toboolean(L, 2);
+  S.strip = lua_toboolean(L, 3);
+  lua_settop(L, 1);
+  lua_newtable(L);
+  S.seen = 2;
+  S.size = 256;
+  S.b = (char *)lua_newuserdata(L, S.size);
+  S.buf = 3;
+  S.n = 0;
+  S.nextid = 0;
+  S.depth = 0;
+  ser_bytes(&S, SER_MAGIC, SER_MAGICLEN);
+  ser_value(&S, 1);
+  lua_pushlstring(L, S.b, S.n);
+  return 1;
+}
+
+
+typedef struct DesState {
+  lua_State *L;
+  const char *p, *end;
+  int refs;  /* values by id */
+  int nextid;
+  int functions;
+  int depth;
+} DesState;
+
+
+static void des_error (DesState *D, const char *msg) {
+  luaL_error(D->L, "malformed serialized value (%s)", msg);
+}
+
+static unsigned I64 des_varint (DesState *D) {
+  unsigned I64 u = 0;
+  int shift = 0;
+  for (;;) {
+    unsigned int c;
+    if (D->p >= D->end) des_error(D, "truncated");
+    c = (unsigned char)*D->p++;
+    u |= (unsigned I64)(c & 0x7f) << shift;
+    if (c < 128) return u;
+    shift += 7;
+    if (shift > 63) des_error(D, "bad integer");
+  }
+}
+
+/* a length or count: each of its items takes at least one more byte */
+static size_t des_size (DesState *D) {
+  unsigned I64 u = des_varint(D);
+  if (u > (unsigned I64)(D->end - D->p)) des_error(D, "truncated");
+  return (size_t)u;
+}
+
+static void des_register (DesState *D) {
+  lua_pushvalue(D->L, -1);
+  lua_rawseti(D->L, D->refs, ++D->nextid);
+}
+
+static void des_value (DesState *D);
+
+static void des_table (DesState *D) {
+  lua_State *L = D->L;
+  size_t narray = des_size(D);
+  size_t nhash = des_size(D);
+  size_t i;
+  if (++D->depth > LUAI_MAXCCALLS) des_error(D, "too deep");
+  luaL_checkstack(L, 4, "serialized value too deep");
+  lua_createtable(L, narray > INT_MAX ? 0 : (int)narray,
+                     nhash > INT_MAX ? 0 : (int)nhash);
+  des_register(D);
+  for (i = 1; i <= narray; i++) {
+    des_value(D);
+    lua_rawseti(L, -2, (int)i);
+  }
+  for (i = 0; i < nhash; i++) {
+    des_value(D);
+    if (lua_isnil(L, -1)) des_error(D, "nil key");
+    des_value(D);
+    lua_rawset(L, -3);
+  }
+  D->depth--;
+}
+
+static void des_function (DesState *D) {
+  lua_State *L = D->L;
+  size_t l = des_size(D);
+  size_t i, nups;
+  if (!D->functions)
+    luaL_error(L, "serialized value holds functions (functions not enabled)");
+  if (l == 0 || *D->p != *LUA_SIGNATURE) des_error(D, "bad function");
+  if (++D->depth > LUAI_MAXCCALLS) des_error(D, "too deep");
+  luaL_checkstack(L, 4, "serialized value too deep");
+  if (luaL_loadbuffer(L, D->p, l, "=deserialize") != 0)
+    lua_error(L);
+  D->p += l;
+  des_register(D);
+  nups = des_size(D);
+  for (i = 1; i <= nups; i++) {
+    des_value(D);
+    if (lua_setupvalue(L, -2, (int)i) == NULL)
+      des_error(D, "bad upvalue");
+  }
+  D->depth--;
+}
+
+static void des_value (DesState *D) {
+  lua_State *L = D->L;
+  int tag;
+  if (D->p >= D->end) des_error(D, "truncated");
+  tag = (unsigned char)*D->p++;
+  switch (tag) {
+    case SER_NIL:
+      lua_pushnil(L);
+      break;
+    case SER_FALSE:
+    case SER_TRUE:
+      lua_pushboolean(L, tag == SER_TRUE);
+      break;
+    case SER_INT: {
+      unsigned I64 u = des_varint(D);
+      lua_pushnumber(L, (lua_Number)(u & 1 ? ~(I64)(u >> 1) : (I64)(u >> 1)));
+      break;
+    }
+    case SER_FLOAT: {
+      union { double d; unsigned I64 u; } v;
+      int i;
+      if (D->end - D->p < 8) des_error(D, "truncated");
+      v.u = 0;
+      for (i = 0; i < 8; i++)
+        v.u |= (unsigned I64)(unsigned char)*D->p++ << (8 * i);
+      lua_pushnumber(L, v.d);
+      break;
+    }
+    case SER_STR: {
+      size_t l = des_size(D);
+      lua_pushlstring(L, D->p, l);
+      D->p += l;
+      des_register(D);
+      break;
+    }
+    case SER_TABLE:
+      des_table(D);
+      break;
+    case SER_FUNC:
+      des_function(D);
+      break;
+    case SER_REF: {
+      unsigned I64 id = des_varint(D);
+      if (id == 0 || id > (unsigned I64)D->nextid) des_error(D, "bad reference");
+      lua_rawgeti(L, D->refs, (int)id);
+      break;
+    }
+    default:
+      des_error(D, "bad tag");
+  }
+}
+
+
+/* deserialize(s [, functions]) */
+static int str_deserialize (lua_State *L) {
+  DesState D;
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  if (l < SER_MAGICLEN || memcmp(s, SER_MAGIC, SER_MAGICLEN) != 0)
+    return luaL_argerror(L, 1, "not a serialized value");
+  D.L = L;
+  D.p = s + SER_MAGICLEN;
+  D.end = s + l;
+  D.functions = lua_toboolean(L, 2);
+  D.nextid = 0;
+  D.depth = 0;
+  lua_settop(L, 1);
+  lua_newtable(L);
+  D.refs = 2;
+  des_value(&D);
+  if (D.p != D.end) des_error(&D, "extra bytes");
+  return 1;
+}
+
+/* }====================================================== */
+
 #undef I64
 
 /*
@@ -423,10 +1096,14 @@ static int str_unpack(lua_State *L)
 #define CAP_UNFINISHED	(-1)
 #define CAP_POSITION	(-2)
 
+struct Pattern;
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end (`\0') of source string */
   lua_State *L;
+  const struct Pattern *pat;  /* compiled pattern */
+  const char *p;  /* pattern text, for the interpreter */
   int level;  /* total number of captures (finished or unfinished) */
   struct {
     const char *init;
@@ -719,6 +1396,461 @@ static const char *lmemfind (const char *s1, size_t l1,
 }
 
 
+/*
+** {======================================================
+** COMPILED PATTERNS
+** =======================================================
+*/
+
+/*
+** A pattern is compiled once into a list of items, with every single
+** character class expanded into a 256-bit set, and kept in a small
+** per-state cache keyed by the pattern string.  Runs of plain characters
+** become one string item and a pattern made only of them is searched for
+** with `lmemfind'.  Patterns that would raise an error while being
+** matched are left to the interpreter above, so errors are reported at
+** the same point as before.  Class sets follow the C locale in effect
+** when the pattern is compiled.
+*/
+
+#define SETSIZE		32
+#define inset(set,c)	((set)[uchar(c) >> 3] & (1 << (uchar(c) & 7)))
+
+#define PATCACHE	32  /* number of cached patterns */
+
+/* pattern items */
+enum {
+  P_END, P_STR, P_SET, P_OPEN, P_POSITION, P_CLOSE,
+  P_BALANCE, P_FRONTIER, P_BACKREF, P_EOS
+};
+
+/* pattern flags */
+#define PF_INTERP	1  /* matched by the interpreter */
+#define PF_ANCHOR	2  /* starts with `^' */
+#define PF_LITERAL	4  /* a plain string */
+#define PF_EOS		8  /* plain string ending with `$' */
+
+typedef struct PatItem {
+  unsigned char op;
+  unsigned char rep;  /* `?', `*', `+', `-' or 0 */
+  unsigned short a, b;  /* string span, set, balance pair or capture */
+} PatItem;
+
+typedef struct Pattern {
+  int flags;
+  int firstc;  /* character every match starts with, or -1 */
+  const unsigned char *first;  /* characters a match can start with */
+  const PatItem *item;
+  const unsigned char *set;
+  const char *lit;
+  size_t nlit;
+} Pattern;
+
+typedef struct PatCache {
+  const char *key[PATCACHE];  /* pattern strings, kept in the environment */
+  const Pattern *pat[PATCACHE];
+  unsigned int used[PATCACHE];  /* clock of last use */
+  unsigned int clock;
+} PatCache;
+
+
+static const Pattern interpreted = {PF_INTERP, -1, NULL, NULL, NULL, NULL, 0};
+
+
+/* like `classend', but returns NULL instead of raising an error */
+static const char *itemend (const char *p) {
+  switch (*p++) {
+    case L_ESC: {
+      return (*p == '\0') ? NULL : p+1;
+    }
+    case '[': {
+      if (*p == '^') p++;
+      do {
+        if (*p == '\0') return NULL;
+        if (*(p++) == L_ESC && *p != '\0')
+          p++;
+      } while (*p != ']');
+      return p+1;
+    }
+    default: {
+      return p;
+    }
+  }
+}
+
+
+static const Pattern *compile (lua_State *L, const char *p) {
+  size_t l = strlen(p);
+  size_t nitem = 0, nset = 0, nlit = 0;
+  int flags = 0;
+  int level = 0;
+  char open[LUA_MAXCAPTURES];
+  PatItem *item;
+  unsigned char *set;
+  char *lit;
+  Pattern *pat;
+  size_t i;
+  if (*p == '^') {
+    flags |= PF_ANCHOR;
+    p++; l--;
+  }
+  if (l >= USHRT_MAX) goto interp;
+  /* scratch space for the worst case, kept on the stack while in use */
+  item = (PatItem *)lua_newuserdata(L, (l+2)*sizeof(PatItem) + l*SETSIZE + l);
+  set = (unsigned char *)(item + l+2);
+  lit = (char *)(set + l*SETSIZE);
+  memset(item, 0, (l+2)*sizeof(PatItem));
+  while (*p != '\0') {
+    const char *ep;
+    int c, rep, n, last = 0;
+    switch (*p) {
+      case '(': {
+        if (level >= LUA_MAXCAPTURES) goto fail;
+        item[nitem].op = (*(p+1) == ')') ? P_POSITION : P_OPEN;
+        open[level++] = (item[nitem++].op == P_OPEN);
+        p += (*(p+1) == ')') ? 2 : 1;
+        continue;
+      }
+      case ')': {
+        for (n = level-1; n >= 0 && !open[n]; n--) ;
+        if (n < 0) goto fail;
+        open[n] = 0;
+        item[nitem++].op = P_CLOSE;
+        p++;
+        continue;
+      }
+      case '$': {
+        if (*(p+1) != '\0') break;
+        item[nitem++].op = P_EOS;
+        p++;
+        continue;
+      }
+      case L_ESC: {
+        if (*(p+1) == 'b') {
+          if (*(p+2) == '\0' || *(p+3) == '\0') goto fail;
+          item[nitem].op = P_BALANCE;
+          item[nitem].a = uchar(*(p+2));
+          item[nitem++].b = uchar(*(p+3));
+          p += 4;
+          continue;
+        }
+        if (*(p+1) == 'f') {
+          p += 2;
+          if (*p != '[' || (ep = itemend(p)) == NULL) goto fail;
+          memset(set + nset*SETSIZE, 0, SETSIZE);
+          for (c = 0; c <= UCHAR_MAX; c++)
+            if (matchbracketclass(c, p, ep-1))
+              set[nset*SETSIZE + (c >> 3)] |= 1 << (c & 7);
+          item[nitem].op = P_FRONTIER;
+          item[nitem++].a = (unsigned short)nset++;
+          p = ep;
+          continue;
+        }
+        if (isdigit(uchar(*(p+1)))) {
+          n = *(p+1) - '1';
+          if (n < 0 || n >= level || open[n]) goto fail;
+          item[nitem].op = P_BACKREF;
+          item[nitem++].a = (unsigned short)n;
+          p += 2;
+          continue;
+        }
+        break;
+      }
+    }
+    /* single character class, possibly repeated */
+    if ((ep = itemend(p)) == NULL) goto fail;
+    rep = (*ep == '?' || *ep == '*' || *ep == '+' || *ep == '-') ? *ep : 0;
+    memset(set + nset*SETSIZE, 0, SETSIZE);
+    for (c = 0, n = 0; c <= UCHAR_MAX; c++)
+      if (singlematch(c, p, ep)) {
+        set[nset*SETSIZE + (c >> 3)] |= 1 << (c & 7);
+        last = c;
+        n++;
+      }
+    if (rep == 0 && n == 1) {  /* a plain character */
+      if (nitem > 0 && item[nitem-1].op == P_STR)
+        item[nitem-1].b++;
+      else {
+        item[nitem].op = P_STR;
+        item[nitem].a = (unsigned short)nlit;
+        item[nitem++].b = 1;
+      }
+      lit[nlit++] = (char)last;
+    }
+    else {
+      item[nitem].op = P_SET;
+      item[nitem].rep = (unsigned char)rep;
+      item[nitem++].a = (unsigned short)nset++;
+    }
+    p = rep ? ep+1 : ep;
+  }
+  item[nitem++].op = P_END;
+  pat = (Pattern *)lua_newuserdata(L, sizeof(Pattern) + nitem*sizeof(PatItem) +
+                                      nset*SETSIZE + nlit);
+  memcpy((PatItem *)(pat + 1), item, nitem*sizeof(PatItem));
+  pat->item = (PatItem *)(pat + 1);
+  memcpy((unsigned char *)(pat->item + nitem), set, nset*SETSIZE);
+  pat->set = (const unsigned char *)(pat->item + nitem);
+  memcpy((char *)(pat->set + nset*SETSIZE), lit, nlit);
+  pat->lit = (const char *)(pat->set + nset*SETSIZE);
+  pat->nlit = nlit;
+  lua_remove(L, -2);  /* scratch space */
+  item = (PatItem *)pat->item;
+  if (item[0].op == P_STR && (item[1].op == P_END ||
+      (item[1].op == P_EOS && item[2].op == P_END)))
+    flags |= (item[1].op == P_EOS) ? PF_LITERAL|PF_EOS : PF_LITERAL;
+  /* find what a match must start with */
+  pat->firstc = -1;
+  pat->first = NULL;
+  for (i = 0; item[i].op == P_OPEN || item[i].op == P_POSITION ||
+              item[i].op == P_CLOSE; i++) ;
+  if (item[i].op == P_STR)
+    pat->firstc = uchar(pat->lit[item[i].a]);
+  else if (item[i].op == P_BALANCE)
+    pat->firstc = item[i].a;
+  else if (item[i].op == P_SET && (item[i].rep == 0 || item[i].rep == '+'))
+    pat->first = pat->set + item[i].a*SETSIZE;
+  pat->flags = flags;
+  return pat;
+ fail:
+  lua_pop(L, 1);  /* scratch space */
+ interp:
+  pat = (Pattern *)lua_newuserdata(L, sizeof(Pattern));
+  *pat = interpreted;
+  pat->flags |= flags;
+  return pat;
+}
+
+
+/*
+** Get the compiled form of the pattern at `arg' from the cache in the
+** first upvalue.  The result stays alive until the cache entry is
+** replaced, which only another pattern function can do.
+*/
+static const Pattern *getpattern (lua_State *L, int arg) {
+  PatCache *cache = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *p = lua_tostring(L, arg);
+  const Pattern *pat;
+  int i, lru = 0;
+  for (i = 0; i < PATCACHE; i++) {
+    if (cache->key[i] == p) {
+      cache->used[i] = ++cache->clock;
+      return cache->pat[i];
+    }
+    if (cache->used[i] < cache->used[lru]) lru = i;
+  }
+  pat = compile(L, p);
+  lua_getfenv(L, lua_upvalueindex(1));
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, -2, 2*lru + 1);
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, 2*lru + 2);
+  lua_pop(L, 2);
+  cache->key[lru] = p;
+  cache->pat[lru] = pat;
+  cache->used[lru] = ++cache->clock;
+  return pat;
+}
+
+
+/* push the userdata holding the cached pattern at `arg' */
+static void pushpattern (lua_State *L, int arg) {
+  PatCache *cache = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *p = lua_tostring(L, arg);
+  int i;
+  for (i = 0; cache->key[i] != p; i++) ;
+  lua_getfenv(L, lua_upvalueindex(1));
+  lua_rawgeti(L, -1, 2*i + 2);
+  lua_remove(L, -2);
+}
+
+
+static const char *domatch (MatchState *ms, const char *s, const PatItem *p);
+
+
+/* quick test whether item `p' can possibly match at `s' */
+static int canstart (MatchState *ms, const char *s, const PatItem *p) {
+  switch (p->op) {
+    case P_STR:
+      return s < ms->src_end && *s == ms->pat->lit[p->a];
+    case P_SET:
+      return (p->rep != 0 && p->rep != '+') ||
+             (s < ms->src_end && inset(ms->pat->set + p->a*SETSIZE, *s));
+    case P_EOS:
+      return s == ms->src_end;
+    default:
+      return 1;
+  }
+}
+
+
+static const char *set_max_expand (MatchState *ms, const char *s,
+                                   const unsigned char *set,
+                                   const PatItem *p) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  while ((s+i)<ms->src_end && inset(set, *(s+i)))
+    i++;
+  if (p->op == P_END) return s+i;
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    if (canstart(ms, s+i, p)) {
+      const char *res = domatch(ms, (s+i), p);
+      if (res) return res;
+    }
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+
+static const char *set_min_expand (MatchState *ms, const char *s,
+                                   const unsigned char *set,
+                                   const PatItem *p) {
+  for (;;) {
+    const char *res = canstart(ms, s, p) ? domatch(ms, s, p) : NULL;
+    if (res != NULL)
+      return res;
+    else if (s<ms->src_end && inset(set, *s))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *domatch (MatchState *ms, const char *s, const PatItem *p) {
+  init: /* using goto's to optimize tail recursion */
+  switch (p->op) {
+    case P_STR: {
+      if ((size_t)(ms->src_end - s) < p->b ||
+          memcmp(s, ms->pat->lit + p->a, p->b) != 0) return NULL;
+      s += p->b; p++; goto init;
+    }
+    case P_SET: {
+      const unsigned char *set = ms->pat->set + p->a*SETSIZE;
+      int m = s<ms->src_end && inset(set, *s);
+      switch (p->rep) {
+        case '?': {  /* optional */
+          const char *res;
+          if (m && ((res=domatch(ms, s+1, p+1)) != NULL))
+            return res;
+          p++; goto init;
+        }
+        case '*': {  /* 0 or more repetitions */
+          return set_max_expand(ms, s, set, p+1);
+        }
+        case '+': {  /* 1 or more repetitions */
+          return (m ? set_max_expand(ms, s+1, set, p+1) : NULL);
+        }
+        case '-': {  /* 0 or more repetitions (minimum) */
+          return set_min_expand(ms, s, set, p+1);
+        }
+        default: {
+          if (!m) return NULL;
+          s++; p++; goto init;
+        }
+      }
+    }
+    case P_OPEN:
+    case P_POSITION: {  /* start capture */
+      const char *res;
+      int level = ms->level;
+      ms->capture[level].init = s;
+      ms->capture[level].len = (p->op == P_POSITION) ? CAP_POSITION
+                                                      : CAP_UNFINISHED;
+      ms->level = level+1;
+      if ((res=domatch(ms, s, p+1)) == NULL)  /* match failed? */
+        ms->level--;  /* undo capture */
+      return res;
+    }
+    case P_CLOSE: {  /* end capture */
+      int l = capture_to_close(ms);
+      const char *res;
+      ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+      if ((res = domatch(ms, s, p+1)) == NULL)  /* match failed? */
+        ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+      return res;
+    }
+    case P_BALANCE: {
+      int cont = 1;
+      if (s >= ms->src_end || uchar(*s) != p->a) return NULL;
+      while (++s < ms->src_end) {
+        if (uchar(*s) == p->b) {
+          if (--cont == 0) break;
+        }
+        else if (uchar(*s) == p->a) cont++;
+      }
+      if (cont != 0) return NULL;  /* string ends out of balance */
+      s++; p++; goto init;
+    }
+    case P_FRONTIER: {
+      const unsigned char *set = ms->pat->set + p->a*SETSIZE;
+      char previous = (s == ms->src_init) ? '\0' : *(s-1);
+      if (inset(set, previous) || !inset(set, *s)) return NULL;
+      p++; goto init;
+    }
+    case P_BACKREF: {
+      s = match_capture(ms, s, '1' + p->a);
+      if (s == NULL) return NULL;
+      p++; goto init;
+    }
+    case P_EOS: {
+      return (s == ms->src_end) ? s : NULL;
+    }
+    default: {  /* end of pattern */
+      return s;  /* match succeeded */
+    }
+  }
+}
+
+
+/*
+** Find the first match starting at `s' or, unless `anchor', after it.
+** Returns its start and sets `*e' to its end.
+*/
+static const char *pat_find (MatchState *ms, const char *s, const char **e,
+                             int anchor) {
+  const Pattern *pat = ms->pat;
+  if (pat->flags & PF_LITERAL) {
+    const char *f;
+    if (pat->flags & PF_EOS) {  /* only the tail of the subject can match */
+      f = ms->src_end - pat->nlit;
+      if (f < s || (anchor && f != s) || memcmp(f, pat->lit, pat->nlit) != 0)
+        return NULL;
+    }
+    else if (anchor) {
+      if ((size_t)(ms->src_end - s) < pat->nlit ||
+          memcmp(s, pat->lit, pat->nlit) != 0) return NULL;
+      f = s;
+    }
+    else if ((f = lmemfind(s, ms->src_end - s, pat->lit, pat->nlit)) == NULL)
+      return NULL;
+    ms->level = 0;
+    *e = f + pat->nlit;
+    return f;
+  }
+  for (;;) {
+    if (!anchor) {  /* skip positions where no match can start */
+      if (pat->firstc >= 0) {
+        s = (const char *)memchr(s, pat->firstc, ms->src_end - s);
+        if (s == NULL) return NULL;
+      }
+      else if (pat->first != NULL) {
+        while (s < ms->src_end && !inset(pat->first, *s)) s++;
+        if (s == ms->src_end) return NULL;
+      }
+    }
+    ms->level = 0;
+    *e = (pat->flags & PF_INTERP) ? match(ms, s, ms->p)
+                                  : domatch(ms, s, pat->item);
+    if (*e != NULL) return s;
+    if (anchor || s >= ms->src_end) return NULL;
+    s++;
+  }
+}
+
+/* }====================================================== */
+
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -767,24 +1899,22 @@ static int str_find_aux (lua_State *L, int find) {
   }
   else {
     MatchState ms;
-    int anchor = (*p == '^') ? (p++, 1) : 0;
-    const char *s1=s+init;
+    const char *s1, *res;
     ms.L = L;
     ms.src_init = s;
     ms.src_end = s+l1;
-    do {
-      const char *res;
-      ms.level = 0;
-      if ((res=match(&ms, s1, p)) != NULL) {
-        if (find) {
-          lua_pushinteger(L, s1-s+1);  /* start */
-          lua_pushinteger(L, res-s);   /* end */
-          return push_captures(&ms, NULL, 0) + 2;
-        }
-        else
-          return push_captures(&ms, s1, res);
+    ms.pat = getpattern(L, 2);
+    ms.p = (*p == '^') ? p+1 : p;
+    s1 = pat_find(&ms, s+init, &res, ms.pat->flags & PF_ANCHOR);
+    if (s1 != NULL) {
+      if (find) {
+        lua_pushinteger(L, s1-s+1);  /* start */
+        lua_pushinteger(L, res-s);   /* end */
+        return push_captures(&ms, NULL, 0) + 2;
       }
-    } while (s1++ < ms.src_end && !anchor);
+      else
+        return push_captures(&ms, s1, res);
+    }
   }
   lua_pushnil(L);  /* not found */
   return 1;
@@ -805,23 +1935,19 @@ static int gmatch_aux (lua_State *L) {
   MatchState ms;
   size_t ls;
   const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
-  const char *p = lua_tostring(L, lua_upvalueindex(2));
-  const char *src;
+  const char *src, *e;
   ms.L = L;
   ms.src_init = s;
   ms.src_end = s+ls;
-  for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
-       src <= ms.src_end;
-       src++) {
-    const char *e;
-    ms.level = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
-      lua_Integer newstart = e-s;
-      if (e == src) newstart++;  /* empty match? go at least one position */
-      lua_pushinteger(L, newstart);
-      lua_replace(L, lua_upvalueindex(3));
-      return push_captures(&ms, src, e);
-    }
+  ms.pat = (const Pattern *)lua_touserdata(L, lua_upvalueindex(4));
+  ms.p = lua_tostring(L, lua_upvalueindex(2));
+  src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
+  if (src <= ms.src_end && (src = pat_find(&ms, src, &e, 0)) != NULL) {
+    lua_Integer newstart = e-s;
+    if (e == src) newstart++;  /* empty match? go at least one position */
+    lua_pushinteger(L, newstart);
+    lua_replace(L, lua_upvalueindex(3));
+    return push_captures(&ms, src, e);
   }
   return 0;  /* not found */
 }
@@ -832,7 +1958,11 @@ static int gmatch (lua_State *L) {
   luaL_checkstring(L, 2);
   lua_settop(L, 2);
   lua_pushinteger(L, 0);
-  lua_pushcclosure(L, gmatch_aux, 3);
+  if (getpattern(L, 2)->flags & PF_ANCHOR)  /* `^' is not an anchor here */
+    lua_pushlightuserdata(L, (void *)&interpreted);
+  else
+    pushpattern(L, 2);
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -897,30 +2027,39 @@ static int str_gsub (lua_State *L) {
   const char *p = luaL_checkstring(L, 2);
   int  tr = lua_type(L, 3);
   int max_s = luaL_optint(L, 4, srcl+1);
-  int anchor = (*p == '^') ? (p++, 1) : 0;
+  int anchor;
   int n = 0;
   MatchState ms;
   luaL_Buffer b;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
-  luaL_buffinit(L, &b);
   ms.L = L;
   ms.src_init = src;
   ms.src_end = src+srcl;
+  ms.pat = getpattern(L, 2);
+  ms.p = (*p == '^') ? p+1 : p;
+  anchor = ms.pat->flags & PF_ANCHOR;
+  if (tr == LUA_TFUNCTION || tr == LUA_TTABLE)
+    pushpattern(L, 2);  /* replacements may run other patterns */
+  luaL_buffinit(L, &b);
   while (n < max_s) {
     const char *e;
-    ms.level = 0;
-    e = match(&ms, src, p);
-    if (e) {
-      n++;
-      add_value(&ms, &b, src, e);
-    }
-    if (e && e>src) /* non empty match? */
+    const char *s1 = pat_find(&ms, src, &e, anchor);
+    if (s1 == NULL) break;
+    luaL_addlstring(&b, src, s1-src);  /* text before the match */
+    n++;
+    add_value(&ms, &b, s1, e);
+    if (e>s1) /* non empty match? */
       src = e;  /* skip it */
-    else if (src < ms.src_end)
-      luaL_addchar(&b, *src++);
-    else break;
+    else if (s1 < ms.src_end) {
+      luaL_addchar(&b, *s1);
+      src = s1+1;
+    }
+    else {
+      src = s1;
+      break;
+    }
     if (anchor) break;
   }
   luaL_addlstring(&b, src, ms.src_end-src);
@@ -1104,6 +2243,24 @@ static void addintlen (char *form) {
 }
 
 
+/* plain `%d' without flags, width or precision, formatted by hand */
+static size_t fmtint (char *buff, LUA_INTFRM_T n) {
+  char tmp[sizeof(LUA_INTFRM_T) * 3 + 1];
+  unsigned LUA_INTFRM_T u = (unsigned LUA_INTFRM_T)n;
+  size_t l = 0, i = 0;
+  if (n < 0) {
+    buff[i++] = '-';
+    u = 0 - u;
+  }
+  do {
+    tmp[l++] = (char)('0' + (int)(u % 10));
+    u /= 10;
+  } while (u != 0);
+  while (l > 0) buff[i++] = tmp[--l];
+  return i;
+}
+
+
 static int str_format (lua_State *L) {
   int top = lua_gettop(L);
   int arg = 1;
@@ -1129,6 +2286,11 @@ static int str_format (lua_State *L) {
           break;
         }
         case 'd':  case 'i': {
+          if (form[2] == '\0') {  /* no modifiers */
+            luaL_addlstring(&b, buff,
+                fmtint(buff, (LUA_INTFRM_T)luaL_checknumber(L, arg)));
+            continue;  /* skip the `addsize' at the end */
+          }
           addintlen(form);
           sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
           break;
@@ -1179,23 +2341,64 @@ static const luaL_Reg strlib[] = {
   {"byte", str_byte},
   {"char", str_char},
   {"dump", str_dump},
-  {"find", str_find},
   {"format", str_format},
-  {"gmatch", gmatch},
-  {"gsub", str_gsub},
   {"len", str_len},
   {"lower", str_lower},
-  {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
   {"upper", str_upper},
   {"pack", str_pack},
   {"unpack", str_unpack},
+  {"compile", str_compile},
+  {"serialize", str_serialize},
+  {"deserialize", str_deserialize},
+  {NULL, NULL}
+};
+
+
+/* functions sharing the pattern cache */
+static const luaL_Reg patlib[] = {
+  {"find", str_find},
+  {"gmatch", gmatch},
+  {"gsub", str_gsub},
+  {"match", str_match},
   {NULL, NULL}
 };
 
 
+static void createpatlib (lua_State *L) {
+  const luaL_Reg *l;
+  PatCache *cache = (PatCache *)lua_newuserdata(L, sizeof(PatCache));
+  memset(cache, 0, sizeof(PatCache));
+  lua_createtable(L, 2*PATCACHE, 0);  /* keeps cached entries alive */
+  lua_setfenv(L, -2);
+  for (l = patlib; l->name; l++) {
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, l->func, 1);
+    lua_setfield(L, -3, l->name);
+  }
+  lua_pop(L, 1);  /* cache */
+}
+
+
+static void createpackermeta (lua_State *L) {
+  const luaL_Reg *l;
+  luaL_newmetatable(L, PACKER_T);
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, packer_len, 1);
+  lua_setfield(L, -2, "__len");
+  lua_newtable(L);
+  for (l = packerlib; l->name; l++) {
+    lua_pushvalue(L, -2);
+    lua_pushcclosure(L, l->func, 1);
+    lua_setfield(L, -2, l->name);
+  }
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+}
+
+
 static void createmetatable (lua_State *L) {
   lua_createtable(L, 0, 1);  /* create metatable for strings */
   lua_pushliteral(L, "");  /* dummy string */
@@ -1214,6 +2417,8 @@ static void createmetatable (lua_State *L) {
 LUALIB_API int luaopen_string (lua_State *L) {
   lua_pushvalue(L, LUA_ENVIRONINDEX);
   luaL_register(L, NULL, strlib);
+  createpatlib(L);
+  createpackermeta(L);
   createmetatable(L);
   return 1;
 }
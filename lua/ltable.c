@@ -134,6 +134,13 @@ static int arrayindex (const TValue *key) {
 ** elements in the array part, then elements in the hash part. The
 ** beginning of a traversal is signalled by -1.
 */
+/* key may be dead already, but it is ok to use it in `next' */
+#define samekey(n,key) \
+  (luaO_rawequalObj(key2tval(n), key) || \
+   (ttype(gkey(n)) == LUA_TDEADKEY && iscollectable(key) && \
+    gcvalue(gkey(n)) == gcvalue(key)))
+
+
 static int findindex (lua_State *L, Table *t, StkId key) {
   int i;
   if (ttisnil(key)) return -1;  /* first iteration */
@@ -141,12 +148,14 @@ static int findindex (lua_State *L, Table *t, StkId key) {
   if (0 < i && i <= t->sizearray)  /* is `key' inside array part? */
     return i-1;  /* yes; that's the index (corrected to C) */
   else {
-    Node *n = mainposition(t, key);
+    Node *n;
+    /* usually `key' is the element returned by the previous `next' */
+    i = t->lastnext - 1 - t->sizearray;
+    if (0 <= i && i < sizenode(t) && samekey(gnode(t, i), key))
+      return i + t->sizearray;
+    n = mainposition(t, key);
     do {  /* check whether `key' is somewhere in the chain */
-      /* key may be dead already, but it is ok to use it in `next' */
-      if (luaO_rawequalObj(key2tval(n), key) ||
-            (ttype(gkey(n)) == LUA_TDEADKEY && iscollectable(key) &&
-             gcvalue(gkey(n)) == gcvalue(key))) {
+      if (samekey(n, key)) {
         i = cast_int(n - gnode(t, 0));  /* key index in hash table */
         /* hash elements are numbered after array ones */
         return i + t->sizearray;
@@ -159,26 +168,38 @@ static int findindex (lua_State *L, Table *t, StkId key) {
 }
 
 
-int luaH_next (lua_State *L, Table *t, StkId key) {
-  int i = findindex(L, t, key);  /* find original element */
-  for (i++; i < t->sizearray; i++) {  /* try first array part */
+/*
+** puts the first non-nil element at or after traversal position `i'
+** into `key' and `key+1'; returns the position after it, or 0 when
+** there are no more elements
+*/
+int luaH_nextindex (lua_State *L, Table *t, int i, StkId key) {
+  UNUSED(L);  /* only used by the checks in setobj2s */
+  for (; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
       setnvalue(key, cast_num(i+1));
       setobj2s(L, key+1, &t->array[i]);
-      return 1;
+      return i+1;
     }
   }
   for (i -= t->sizearray; i < sizenode(t); i++) {  /* then hash part */
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
       setobj2s(L, key, key2tval(gnode(t, i)));
       setobj2s(L, key+1, gval(gnode(t, i)));
-      return 1;
+      return i+1 + t->sizearray;
     }
   }
   return 0;  /* no more elements */
 }
 
 
+int luaH_next (lua_State *L, Table *t, StkId key) {
+  int i = findindex(L, t, key);  /* find original element */
+  t->lastnext = luaH_nextindex(L, t, i+1, key);
+  return t->lastnext != 0;
+}
+
+
 /*
 ** {=============================================================
 ** Rehash
@@ -262,7 +283,8 @@ static int numusehash (const Table *t, int *nums, int *pnasize) {
 
 static void setarrayvector (lua_State *L, Table *t, int size) {
   int i;
-  luaM_reallocvector(L, t->array, t->sizearray, size, TValue);
+  t->array = cast(TValue *, luaM_reallocvt(L, t->array, t->sizearray, size,
+                                            sizeof(TValue), LUA_TTABLE));
   for (i=t->sizearray; i<size; i++)
      setnilvalue(&t->array[i]);
   t->sizearray = size;
@@ -281,7 +303,8 @@ static void setnodevector (lua_State *L, Table *t, int size) {
     if (lsize > MAXBITS)
       luaG_runerror(L, "table overflow");
     size = twoto(lsize);
-    t->node = luaM_newvector(L, size, Node);
+    t->node = cast(Node *, luaM_reallocvt(L, NULL, 0, size, sizeof(Node),
+                                          LUA_TTABLE));
     for (i=0; i<size; i++) {
       Node *n = gnode(t, i);
       gnext(n) = NULL;
@@ -356,13 +379,14 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
 
 
 Table *luaH_new (lua_State *L, int narray, int nhash) {
-  Table *t = luaM_new(L, Table);
+  Table *t = cast(Table *, luaM_newobject(L, LUA_TTABLE, sizeof(Table)));
   luaC_link(L, obj2gco(t), LUA_TTABLE);
   t->metatable = NULL;
   t->flags = cast_byte(~0);
   /* temporary values (kept only if some malloc fails) */
   t->array = NULL;
   t->sizearray = 0;
+  t->lastnext = 0;
   t->lsizenode = 0;
   t->node = cast(Node *, dummynode);
   setarrayvector(L, t, narray);
@@ -373,8 +397,8 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
 
 void luaH_free (lua_State *L, Table *t) {
   if (t->node != dummynode)
-    luaM_freearray(L, t->node, sizenode(t), Node);
-  luaM_freearray(L, t->array, t->sizearray, TValue);
+    luaM_deferarray(L, t->node, sizenode(t), Node);
+  luaM_deferarray(L, t->array, t->sizearray, TValue);
   luaM_free(L, t);
 }
 
@@ -28,6 +28,7 @@ LUAI_FUNC Table *luaH_new (lua_State *L, int narray, int lnhash);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
+LUAI_FUNC int luaH_nextindex (lua_State *L, Table *t, int i, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
 
 
@@ -6,6 +6,7 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
 #define ltablib_c
 #define LUA_LIB
@@ -37,17 +38,17 @@ static int foreachi (lua_State *L) {
 
 
 static int foreach (lua_State *L) {
+  int i = 0;
   luaL_checktype(L, 1, LUA_TTABLE);
   luaL_checktype(L, 2, LUA_TFUNCTION);
-  lua_pushnil(L);  /* first key */
-  while (lua_next(L, 1)) {
+  while ((i = lua_nextindex(L, 1, i)) != 0) {
     lua_pushvalue(L, 2);  /* function */
     lua_pushvalue(L, -3);  /* key */
     lua_pushvalue(L, -3);  /* value */
     lua_call(L, 2, 1);
     if (!lua_isnil(L, -1))
       return 1;
-    lua_pop(L, 2);  /* remove value and result */
+    lua_pop(L, 3);  /* remove key, value and result */
   }
   return 0;
 }
@@ -55,14 +56,14 @@ static int foreach (lua_State *L) {
 
 static int maxn (lua_State *L) {
   lua_Number max = 0;
+  int i = 0;
   luaL_checktype(L, 1, LUA_TTABLE);
-  lua_pushnil(L);  /* first key */
-  while (lua_next(L, 1)) {
-    lua_pop(L, 1);  /* remove value */
-    if (lua_type(L, -1) == LUA_TNUMBER) {
-      lua_Number v = lua_tonumber(L, -1);
+  while ((i = lua_nextindex(L, 1, i)) != 0) {
+    if (lua_type(L, -2) == LUA_TNUMBER) {
+      lua_Number v = lua_tonumber(L, -2);
       if (v > max) max = v;
     }
+    lua_pop(L, 2);  /* remove key and value */
   }
   lua_pushnumber(L, max);
   return 1;
@@ -118,36 +119,343 @@ static int tremove (lua_State *L) {
 }
 
 
-static void addfield (lua_State *L, luaL_Buffer *b, int i) {
+/* pushes t[i], which must be a string or a number */
+static const char *getfield (lua_State *L, int i, size_t *l) {
+  const char *s;
   lua_rawgeti(L, 1, i);
-  if (!lua_isstring(L, -1))
+  s = lua_tolstring(L, -1, l);
+  if (s == NULL)
     luaL_error(L, "invalid value (%s) at index %d in table for "
                   LUA_QL("concat"), luaL_typename(L, -1), i);
-    luaL_addvalue(b);
+  return s;
 }
 
 
 static int tconcat (lua_State *L) {
   luaL_Buffer b;
-  size_t lsep;
-  int i, last;
+  size_t lsep, l, total = 0;
+  int i, k, last;
+  const char *s;
+  char *out, *p;
   const char *sep = luaL_optlstring(L, 2, "", &lsep);
   luaL_checktype(L, 1, LUA_TTABLE);
   i = luaL_optint(L, 3, 1);
   last = luaL_opt(L, luaL_checkint, 4, (int)lua_objlen(L, 1));
+  if (i > last) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
   luaL_buffinit(L, &b);
-  for (; i < last; i++) {
-    addfield(L, &b, i);
+  for (k = i; ; k++) {  /* while the result fits the buffer, in one pass */
+    s = getfield(L, k, &l);
+    total += l + (k < last ? lsep : 0);
+    if (total > LUAL_BUFFERSIZE) break;
+    luaL_addlstring(&b, s, l);
+    lua_pop(L, 1);
+    if (k == last) {
+      luaL_pushresult(&b);
+      return 1;
+    }
     luaL_addlstring(&b, sep, lsep);
   }
-  if (i == last)  /* add last value (if interval was not empty) */
-    addfield(L, &b, i);
-  luaL_pushresult(&b);
+  lua_pop(L, 1);
+  /* too big: measure the rest and build it in a single block */
+  for (i = k + 1; i <= last; i++) {
+    getfield(L, i, &l);
+    lua_pop(L, 1);
+    total += l + (i < last ? lsep : 0);
+  }
+  out = (char *)lua_newuserdata(L, total);
+  p = out;
+  memcpy(p, b.buffer, b.p - b.buffer);  /* nothing left the buffer yet */
+  p += b.p - b.buffer;
+  for (; ; k++) {
+    s = getfield(L, k, &l);
+    memcpy(p, s, l);
+    p += l;
+    lua_pop(L, 1);
+    if (k == last) break;
+    memcpy(p, sep, lsep);
+    p += lsep;
+  }
+  lua_pushlstring(L, out, total);
   return 1;
 }
 
 
 
+/*
+** {======================================================
+** Native sort of homogeneous arrays
+** Without an order function, an array holding only numbers or only
+** strings is copied out, sorted natively and written back; anything
+** else goes through the generic quicksort below.
+** =======================================================
+*/
+
+
+#define SORT_MIN	12	/* ranges this small are insertion sorted */
+#define SORT_RADIX	64	/* number arrays this big are radix sorted */
+
+
+#if defined(LUA_NUMBER_DOUBLE)
+
+/* a double mapped to an unsigned key with the same order */
+typedef struct SortKey {
+  LUAI_UINT32 hi, lo;
+} SortKey;
+
+
+static int hiword (void) {
+  double one = 1.0;
+  LUAI_UINT32 w[2];
+  memcpy(w, &one, sizeof(w));
+  return (w[1] == 0x3ff00000);
+}
+
+
+static void tokey (lua_Number v, int hw, SortKey *k) {
+  LUAI_UINT32 w[2];
+  memcpy(w, &v, sizeof(w));
+  k->hi = w[hw];
+  k->lo = w[!hw];
+  if (k->hi & 0x80000000) {  /* negative: reverse the order */
+    k->hi = ~k->hi;
+    k->lo = ~k->lo;
+  }
+  else
+    k->hi |= 0x80000000;
+}
+
+
+static lua_Number fromkey (const SortKey *k, int hw) {
+  LUAI_UINT32 w[2];
+  lua_Number v;
+  if (k->hi & 0x80000000) {
+    w[hw] = k->hi & 0x7fffffff;
+    w[!hw] = k->lo;
+  }
+  else {
+    w[hw] = ~k->hi;
+    w[!hw] = ~k->lo;
+  }
+  memcpy(&v, w, sizeof(v));
+  return v;
+}
+
+
+#define keyless(a,b)	((a)->hi < (b)->hi || ((a)->hi == (b)->hi && (a)->lo < (b)->lo))
+#define keydigit(k,p)	(((p) < 4 ? (k)->lo >> (8*(p)) : (k)->hi >> (8*(p)-32)) & 0xff)
+
+
+static void radixsort (SortKey *a, SortKey *tmp, int n) {
+  int count[8][256];
+  SortKey *from = a, *to = tmp;
+  int i, p;
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {
+    for (p = 0; p < 8; p++)
+      count[p][keydigit(&a[i], p)]++;
+  }
+  for (p = 0; p < 8; p++) {
+    int *c = count[p];
+    int d, sum = 0;
+    if (c[keydigit(&from[0], p)] == n) continue;  /* all share this digit */
+    for (d = 0; d < 256; d++) {
+      int t = c[d];
+      c[d] = sum;
+      sum += t;
+    }
+    for (i = 0; i < n; i++)
+      to[c[keydigit(&from[i], p)]++] = from[i];
+    to = from;
+    from = (from == a) ? tmp : a;
+  }
+  if (from != a) memcpy(a, from, n * sizeof(SortKey));
+}
+
+
+static int numsort (lua_State *L, int n) {
+  SortKey *a, *tmp;
+  int i, hw = hiword();
+  if ((size_t)n > ((size_t)-1) / (2 * sizeof(SortKey)))
+    return 0;
+  a = (SortKey *)lua_newuserdata(L, 2 * n * sizeof(SortKey));
+  tmp = a + n;
+  for (i = 0; i < n; i++) {
+    lua_Number v;
+    lua_rawgeti(L, 1, i + 1);
+    v = lua_tonumber(L, -1);
+    if (lua_type(L, -1) != LUA_TNUMBER || v != v) {  /* not a number or NaN */
+      lua_pop(L, 2);
+      return 0;
+    }
+    lua_pop(L, 1);
+    tokey(v, hw, &a[i]);
+  }
+  if (n >= SORT_RADIX)
+    radixsort(a, tmp, n);
+  else {
+    for (i = 1; i < n; i++) {
+      SortKey k = a[i];
+      int j;
+      for (j = i; j > 0 && keyless(&k, &a[j - 1]); j--)
+        a[j] = a[j - 1];
+      a[j] = k;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    lua_pushnumber(L, fromkey(&a[i], hw));
+    lua_rawseti(L, 1, i + 1);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+#endif
+
+
+typedef struct SortStr {
+  const char *s;
+  size_t l;
+  int i;  /* original position */
+} SortStr;
+
+
+/* same order as `l_strcmp' in lvm.c */
+static int strless (const SortStr *a, const SortStr *b) {
+  const char *l = a->s;
+  size_t ll = a->l;
+  const char *r = b->s;
+  size_t lr = b->l;
+  for (;;) {
+    int temp = strcoll(l, r);
+    if (temp != 0) return (temp < 0);
+    else {  /* strings are equal up to a `\0' */
+      size_t len = strlen(l);
+      if (len == lr) return 0;  /* r is finished */
+      else if (len == ll) return 1;  /* l is finished */
+      len++;
+      l += len; ll -= len; r += len; lr -= len;
+    }
+  }
+}
+
+
+static void strswap (SortStr *a, int i, int j) {
+  SortStr t = a[i];
+  a[i] = a[j];
+  a[j] = t;
+}
+
+
+static void strsift (SortStr *a, int i, int n) {
+  for (;;) {
+    int c = 2*i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && strless(&a[c], &a[c + 1])) c++;
+    if (!strless(&a[i], &a[c])) break;
+    strswap(a, i, c);
+    i = c;
+  }
+}
+
+
+static void strheapsort (SortStr *a, int n) {
+  int i;
+  for (i = n/2 - 1; i >= 0; i--)
+    strsift(a, i, n);
+  for (i = n - 1; i > 0; i--) {
+    strswap(a, 0, i);
+    strsift(a, 0, i);
+  }
+}
+
+
+/* quicksort as in `auxsort', turning to heapsort when too deep */
+static void strintrosort (SortStr *a, int l, int u, int depth) {
+  int i, j;
+  while (u - l >= SORT_MIN) {
+    int m = l + (u - l)/2;
+    SortStr p;
+    if (depth-- == 0) {
+      strheapsort(a + l, u - l + 1);
+      return;
+    }
+    if (strless(&a[u], &a[l])) strswap(a, l, u);
+    if (strless(&a[m], &a[l])) strswap(a, m, l);
+    else if (strless(&a[u], &a[m])) strswap(a, m, u);
+    strswap(a, m, u - 1);
+    p = a[u - 1];
+    i = l; j = u - 1;
+    for (;;) {  /* invariant: a[l..i] <= P <= a[j..u] */
+      while (strless(&a[++i], &p)) ;
+      while (strless(&p, &a[--j])) ;
+      if (j < i) break;
+      strswap(a, i, j);
+    }
+    strswap(a, u - 1, i);
+    if (i - l < u - i) {
+      strintrosort(a, l, i - 1, depth);
+      l = i + 1;
+    }
+    else {
+      strintrosort(a, i + 1, u, depth);
+      u = i - 1;
+    }
+  }
+  for (i = l + 1; i <= u; i++) {  /* insertion sort for the rest */
+    SortStr t = a[i];
+    for (j = i; j > l && strless(&t, &a[j - 1]); j--)
+      a[j] = a[j - 1];
+    a[j] = t;
+  }
+}
+
+
+static int strsort (lua_State *L, int n) {
+  SortStr *a;
+  int i, depth = 0;
+  if ((size_t)n > ((size_t)-1) / sizeof(SortStr))
+    return 0;
+  a = (SortStr *)lua_newuserdata(L, n * sizeof(SortStr));
+  lua_createtable(L, n, 0);  /* holds the values while `t' is rewritten */
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING) {
+      lua_pop(L, 3);
+      return 0;
+    }
+    a[i].s = lua_tolstring(L, -1, &a[i].l);
+    a[i].i = i + 1;
+    lua_rawseti(L, -2, i + 1);
+  }
+  for (i = n; i > 0; i >>= 1) depth += 2;
+  strintrosort(a, 0, n - 1, depth);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, -1, a[i].i);
+    lua_rawseti(L, 1, i + 1);
+  }
+  lua_pop(L, 2);
+  return 1;
+}
+
+
+static int fastsort (lua_State *L, int n) {
+  int t;
+  lua_rawgeti(L, 1, 1);
+  t = lua_type(L, -1);
+  lua_pop(L, 1);
+#if defined(LUA_NUMBER_DOUBLE)
+  if (t == LUA_TNUMBER) return numsort(L, n);
+#endif
+  if (t == LUA_TSTRING) return strsort(L, n);
+  return 0;
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** Quicksort
@@ -245,6 +553,8 @@ static int sort (lua_State *L) {
   if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
     luaL_checktype(L, 2, LUA_TFUNCTION);
   lua_settop(L, 2);  /* make sure there is two arguments */
+  if (lua_isnil(L, 2) && n > 1 && fastsort(L, n))
+    return 0;
   auxsort(L, 1, n);
   return 0;
 }
@@ -0,0 +1,457 @@
+/*
+** $Id: ltextlib.c $
+** Byte-level text kernels: delimiter sets, line counts and UTF-8
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stddef.h>
+#include <string.h>
+
+#define ltextlib_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** Every kernel scans the subject a block at a time when the compiler
+** targets SSE2 or AVX2, turning each block into a bit mask with one bit
+** per byte, and falls back to plain byte loops otherwise.  Results are
+** returned as positions or counts; substrings are only created when the
+** caller asks for them.
+*/
+
+
+#define uchar(c)	((unsigned char)(c))
+
+/* sets of up to this many bytes are matched with vector compares */
+#define SETVEC		8
+
+#define SPACES		" \t\n\v\f\r"
+
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define TEXT_BLOCK	32
+#define FULLMASK	0xFFFFFFFFu
+typedef __m256i Block;
+#define loadblock(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define splat(c)	_mm256_set1_epi8((char)(c))
+#define bor(a,b)	_mm256_or_si256(a, b)
+#define beq(a,b)	_mm256_cmpeq_epi8(a, b)
+#define bmask(b)	((unsigned int)_mm256_movemask_epi8(b))
+/* leave the AVX state clean for SSE code outside the kernels */
+#define bdone()		_mm256_zeroupper()
+
+#elif defined(__SSE2__) || defined(_M_X64) || \
+      (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+#define TEXT_BLOCK	16
+#define FULLMASK	0xFFFFu
+typedef __m128i Block;
+#define loadblock(p)	_mm_loadu_si128((const __m128i *)(p))
+#define splat(c)	_mm_set1_epi8((char)(c))
+#define bor(a,b)	_mm_or_si128(a, b)
+#define beq(a,b)	_mm_cmpeq_epi8(a, b)
+#define bmask(b)	((unsigned int)_mm_movemask_epi8(b))
+#define bdone()		((void)0)
+
+#endif
+
+
+#if defined(TEXT_BLOCK)
+
+static int lowbit (unsigned int x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  while ((x & 1) == 0) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+
+static int popcount (unsigned int x) {
+#if defined(__GNUC__)
+  return __builtin_popcount(x);
+#else
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  return (int)((((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#endif
+}
+
+#endif
+
+
+/*
+** {======================================================
+** Byte sets
+** =======================================================
+*/
+
+
+typedef struct CharSet {
+  unsigned char bits[32];
+  int n;  /* number of distinct bytes, or SETVEC+1 if more */
+  unsigned char c[SETVEC];  /* the first SETVEC of them */
+#if defined(TEXT_BLOCK)
+  Block v[SETVEC];
+#endif
+} CharSet;
+
+
+#define inset(cs,c)	((cs)->bits[uchar(c) >> 3] & (1 << (uchar(c) & 7)))
+
+
+static void makeset (CharSet *cs, const char *set, size_t l) {
+  size_t i;
+  memset(cs->bits, 0, sizeof(cs->bits));
+  cs->n = 0;
+  for (i = 0; i < l; i++) {
+    if (inset(cs, set[i])) continue;
+    cs->bits[uchar(set[i]) >> 3] |= 1 << (uchar(set[i]) & 7);
+    if (cs->n < SETVEC) {
+      cs->c[cs->n] = uchar(set[i]);
+#if defined(TEXT_BLOCK)
+      cs->v[cs->n] = splat(set[i]);
+#endif
+    }
+    if (cs->n <= SETVEC) cs->n++;
+  }
+}
+
+
+static void checkset (lua_State *L, int arg, CharSet *cs) {
+  size_t l;
+  const char *set = luaL_checklstring(L, arg, &l);
+  makeset(cs, set, l);
+}
+
+
+#if defined(TEXT_BLOCK)
+
+/* bit mask of the bytes of the block at `p' that are in the set */
+static unsigned int setmask (const CharSet *cs, const char *p) {
+  Block b = loadblock(p);
+  Block m = beq(b, cs->v[0]);
+  int i;
+  for (i = 1; i < cs->n; i++)
+    m = bor(m, beq(b, cs->v[i]));
+  return bmask(m);
+}
+
+#endif
+
+
+/* first byte of [s, e) in the set (or, if `neg', not in it), or `e' */
+static const char *findset (const CharSet *cs, const char *s, const char *e,
+                            int neg) {
+  if (cs->n == 0)
+    return neg ? s : e;
+  if (cs->n == 1 && !neg) {
+    s = (const char *)memchr(s, cs->c[0], e - s);
+    return (s == NULL) ? e : s;
+  }
+#if defined(TEXT_BLOCK)
+  if (cs->n <= SETVEC) {
+    unsigned int flip = neg ? FULLMASK : 0;
+    for (; e - s >= TEXT_BLOCK; s += TEXT_BLOCK) {
+      unsigned int m = setmask(cs, s) ^ flip;
+      if (m != 0) {
+        bdone();
+        return s + lowbit(m);
+      }
+    }
+    bdone();
+  }
+#endif
+  for (; s < e; s++)
+    if ((inset(cs, *s) != 0) != neg) break;
+  return s;
+}
+
+
+/* number of bytes of [s, e) in the set */
+static size_t countset (const CharSet *cs, const char *s, const char *e) {
+  size_t n = 0;
+  if (cs->n == 0) return 0;
+#if defined(TEXT_BLOCK)
+  if (cs->n <= SETVEC) {
+    for (; e - s >= TEXT_BLOCK; s += TEXT_BLOCK)
+      n += popcount(setmask(cs, s));
+    bdone();
+  }
+#endif
+  for (; s < e; s++)
+    if (inset(cs, *s)) n++;
+  return n;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** UTF-8
+** =======================================================
+*/
+
+
+/* length of the valid sequence at `s', or 0 */
+static size_t utf8seq (const unsigned char *s, const unsigned char *e) {
+  unsigned int c = s[0];
+  if (c < 0x80) return 1;
+  else if (c < 0xC2) return 0;  /* continuation or overlong */
+  else if (c < 0xE0) {
+    if (e - s < 2 || (s[1] & 0xC0) != 0x80) return 0;
+    return 2;
+  }
+  else if (c < 0xF0) {
+    if (e - s < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 ||
+        (c == 0xE0 && s[1] < 0xA0) ||  /* overlong */
+        (c == 0xED && s[1] >= 0xA0))  /* surrogate */
+      return 0;
+    return 3;
+  }
+  else if (c < 0xF5) {
+    if (e - s < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 ||
+        (s[3] & 0xC0) != 0x80 ||
+        (c == 0xF0 && s[1] < 0x90) ||  /* overlong */
+        (c == 0xF4 && s[1] >= 0x90))  /* above U+10FFFF */
+      return 0;
+    return 4;
+  }
+  return 0;
+}
+
+
+/*
+** Count the code points of [s, e).  Returns NULL, or the first invalid
+** sequence with `*count' holding the code points before it.
+*/
+static const char *utf8scan (const char *s, const char *e, size_t *count) {
+  size_t n = 0;
+  while (s < e) {
+    size_t l;
+#if defined(TEXT_BLOCK)
+    if (e - s >= TEXT_BLOCK) {  /* skip the ASCII prefix of the block */
+      unsigned int m = bmask(loadblock(s));
+      bdone();
+      if (m == 0) {
+        s += TEXT_BLOCK;
+        n += TEXT_BLOCK;
+        continue;
+      }
+      s += lowbit(m);
+      n += lowbit(m);
+    }
+#endif
+    if ((l = utf8seq((const unsigned char *)s, (const unsigned char *)e)) == 0)
+      break;
+    s += l;
+    n++;
+  }
+  *count = n;
+  return (s < e) ? s : NULL;
+}
+
+/* }====================================================== */
+
+
+static ptrdiff_t posrelat (ptrdiff_t pos, size_t len) {
+  /* relative string position: negative means back from end */
+  if (pos < 0) pos += (ptrdiff_t)len + 1;
+  return (pos >= 0) ? pos : 0;
+}
+
+
+/* range [i, j] of the subject given by arguments `arg' and `arg'+1 */
+static const char *checkrange (lua_State *L, int arg, const char **e) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  ptrdiff_t i = posrelat(luaL_optinteger(L, arg, 1), l);
+  ptrdiff_t j = posrelat(luaL_optinteger(L, arg+1, -1), l);
+  if (i < 1) i = 1;
+  if (j > (ptrdiff_t)l) j = (ptrdiff_t)l;
+  *e = s + j;
+  return (i > j) ? *e : s + i - 1;
+}
+
+
+static int text_find (lua_State *L, int neg) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  ptrdiff_t init = posrelat(luaL_optinteger(L, 3, 1), l) - 1;
+  const char *p;
+  CharSet cs;
+  checkset(L, 2, &cs);
+  if (init < 0) init = 0;
+  if ((size_t)init >= l) return 0;
+  p = findset(&cs, s + init, s + l, neg);
+  if (p == s + l) return 0;
+  lua_pushinteger(L, p - s + 1);
+  return 1;
+}
+
+
+static int text_findset (lua_State *L) {
+  return text_find(L, 0);
+}
+
+
+static int text_findnot (lua_State *L) {
+  return text_find(L, 1);
+}
+
+
+static int text_count (lua_State *L) {
+  const char *e;
+  const char *s = checkrange(L, 3, &e);
+  CharSet cs;
+  checkset(L, 2, &cs);
+  lua_pushinteger(L, (lua_Integer)countset(&cs, s, e));
+  return 1;
+}
+
+
+static int text_lines (lua_State *L) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  CharSet cs;
+  size_t n;
+  makeset(&cs, "\n", 1);
+  n = countset(&cs, s, s + l);
+  if (l > 0 && s[l-1] != '\n') n++;  /* last line has no newline */
+  lua_pushinteger(L, (lua_Integer)n);
+  return 1;
+}
+
+
+static int text_trim (lua_State *L) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *e = s + l;
+  const char *p;
+  CharSet cs;
+  if (lua_isnoneornil(L, 2))
+    makeset(&cs, SPACES, sizeof(SPACES) - 1);
+  else
+    checkset(L, 2, &cs);
+  p = findset(&cs, s, e, 1);
+  while (e > p && inset(&cs, *(e-1))) e--;
+  if (p == s && e == s + l)
+    lua_settop(L, 1);  /* nothing to trim; keep the original string */
+  else
+    lua_pushlstring(L, p, e - p);
+  return 1;
+}
+
+
+/*
+** Fields of the subject separated by any byte of the set.  With `spans'
+** only their positions are collected, as pairs of first and last index.
+*/
+static int split (lua_State *L, int spans) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *e = s + l;
+  const char *p = s;
+  int skip = lua_toboolean(L, 3);
+  int n = 0;
+  CharSet cs;
+  checkset(L, 2, &cs);
+  lua_createtable(L, spans ? 16 : 8, 0);
+  for (;;) {
+    const char *q = findset(&cs, p, e, 0);
+    if (q > p || !skip) {
+      if (spans) {
+        lua_pushinteger(L, p - s + 1);
+        lua_rawseti(L, -2, ++n);
+        lua_pushinteger(L, q - s);
+      }
+      else
+        lua_pushlstring(L, p, q - p);
+      lua_rawseti(L, -2, ++n);
+    }
+    if (q == e) break;
+    p = q + 1;
+  }
+  return 1;
+}
+
+
+static int text_split (lua_State *L) {
+  return split(L, 0);
+}
+
+
+static int text_spans (lua_State *L) {
+  return split(L, 1);
+}
+
+
+static int text_utf8valid (lua_State *L) {
+  const char *e;
+  const char *s = checkrange(L, 2, &e);
+  const char *bad;
+  size_t n;
+  if ((bad = utf8scan(s, e, &n)) == NULL) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_pushboolean(L, 0);
+  lua_pushinteger(L, bad - lua_tostring(L, 1) + 1);
+  return 2;
+}
+
+
+static int text_utf8len (lua_State *L) {
+  const char *e;
+  const char *s = checkrange(L, 2, &e);
+  const char *bad;
+  size_t n;
+  if ((bad = utf8scan(s, e, &n)) == NULL) {
+    lua_pushinteger(L, (lua_Integer)n);
+    return 1;
+  }
+  lua_pushnil(L);
+  lua_pushinteger(L, bad - lua_tostring(L, 1) + 1);
+  return 2;
+}
+
+
+static const luaL_Reg textlib[] = {
+  {"count", text_count},
+  {"findnot", text_findnot},
+  {"findset", text_findset},
+  {"lines", text_lines},
+  {"spans", text_spans},
+  {"split", text_split},
+  {"trim", text_trim},
+  {"utf8len", text_utf8len},
+  {"utf8valid", text_utf8valid},
+  {NULL, NULL}
+};
+
+
+/*
+** Open text library
+*/
+LUALIB_API int luaopen_text (lua_State *L) {
+  lua_pushvalue(L, LUA_ENVIRONINDEX);
+  luaL_register(L, NULL, textlib);
+  return 1;
+}
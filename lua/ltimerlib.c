@@ -0,0 +1,604 @@
+/*
+** $Id: ltimerlib.c $
+** Monotonic clock and timer wheels
+** See Copyright Notice in lua.h
+*/
+
+
+#include <math.h>
+#include <string.h>
+
+#define ltimerlib_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** A wheel keeps its timers in NLEVELS rings of WHEELSIZE slots: level
+** n holds the timers due within WHEELSIZE^(n+1) ticks, in the slot
+** given by the n-th digit of their expiry tick.  Each tick moves the
+** level-0 slot of the new tick to the list of due timers and, when a
+** level wraps around, spreads the next slot of the level above over
+** the levels below (a cascade).  Timers are nodes of one array linked
+** by index, so adding and cancelling one are O(1); a timer id holds
+** its index and a generation count, so stale ids are harmless.
+**
+** The coroutine a timer resumes (as coroutine.resume would) or the
+** function it calls (in protected mode) is kept in the wheel's
+** environment table at the timer's index, and its extra arguments at
+** minus that index.
+*/
+
+
+#define WHEEL_T		"timer-wheel"
+
+#define WHEELBITS	8
+#define WHEELSIZE	(1 << WHEELBITS)
+#define WHEELMASK	(WHEELSIZE - 1)
+#define NLEVELS		4
+#define DUE		(NLEVELS * WHEELSIZE)	/* list of due timers */
+#define NLISTS		(DUE + 1)	/* nodes below this are list heads */
+
+#define MAXTICKS	0x7FFFFFFFu	/* longest delay, in ticks */
+#define IDBASE		16777216.0	/* ids are gen * IDBASE + index */
+#define MAXNODES	16777216
+
+
+/*
+** {======================================================
+** Clock
+** =======================================================
+*/
+
+/*
+** nanoseconds of the monotonic clock (see lua_clock) since the first
+** call, so that they stay exact integers for a hundred days
+*/
+static double nanoclock (void) {
+  static int started = 0;
+  static unsigned long sec0, nsec0;
+  unsigned long sec, nsec;
+  if (!started) {
+    lua_clock(&sec0, &nsec0);
+    started = 1;
+  }
+  lua_clock(&sec, &nsec);
+  return (double)(sec - sec0) * 1e9 + ((double)nsec - (double)nsec0);
+}
+
+/* }====================================================== */
+
+
+typedef struct Node {
+  int next, prev;  /* circular lists, headed by nodes below NLISTS */
+  int list;  /* list the node is in, or -1 if free */
+  unsigned int expire;  /* tick it is due at */
+  unsigned int gen;
+} Node;
+
+
+typedef struct Wheel {
+  lua_Alloc allocf;
+  void *ud;
+  Node *nodes;
+  int sizenodes;
+  int free;  /* first free node (linked by `next'), or 0 */
+  int count[NLEVELS + 1];  /* timers in each level and in DUE */
+  unsigned int current;  /* current tick */
+  double tick;  /* nanoseconds per tick */
+  double origin;  /* clock at tick 0 */
+  double fired, dropped, ticks, cascades;
+  double tickcost, maxtickcost, runcost;  /* nanoseconds */
+} Wheel;
+
+
+static void link (Wheel *W, int list, int i) {
+  Node *n = W->nodes;
+  n[i].prev = n[list].prev;
+  n[i].next = list;
+  n[n[list].prev].next = i;
+  n[list].prev = i;
+  n[i].list = list;
+  W->count[list / WHEELSIZE]++;
+}
+
+
+static void unlink (Wheel *W, int i) {
+  Node *n = W->nodes;
+  n[n[i].prev].next = n[i].next;
+  n[n[i].next].prev = n[i].prev;
+  W->count[n[i].list / WHEELSIZE]--;
+  n[i].list = -1;
+}
+
+
+/* link timer `i' in the slot for its expiry */
+static void place (Wheel *W, int i) {
+  unsigned int expire = W->nodes[i].expire;
+  unsigned int delta = expire - W->current;
+  int level;
+  if (delta == 0 || delta > MAXTICKS)  /* due (or overdue)? */
+    link(W, DUE, i);
+  else {
+    for (level = 0; level < NLEVELS - 1; level++) {
+      if (delta < (1u << (WHEELBITS * (level + 1))))
+        break;
+    }
+    link(W, level * WHEELSIZE +
+            (int)((expire >> (WHEELBITS * level)) & WHEELMASK), i);
+  }
+}
+
+
+/* spread slot of `level' for the current tick over the levels below */
+static void cascade (Wheel *W, int level) {
+  int slot = (int)((W->current >> (WHEELBITS * level)) & WHEELMASK);
+  int head = level * WHEELSIZE + slot;
+  if (slot == 0 && level < NLEVELS - 1)
+    cascade(W, level + 1);
+  while (W->nodes[head].next != head) {
+    int i = W->nodes[head].next;
+    unlink(W, i);
+    place(W, i);
+  }
+  W->cascades++;
+}
+
+
+static void tickone (Wheel *W) {
+  int head;
+  W->current++;
+  if ((W->current & WHEELMASK) == 0)
+    cascade(W, 1);
+  head = (int)(W->current & WHEELMASK);
+  while (W->nodes[head].next != head) {  /* move the slot to DUE */
+    int i = W->nodes[head].next;
+    unlink(W, i);
+    link(W, DUE, i);
+  }
+  W->ticks++;
+}
+
+
+static void advance (Wheel *W, unsigned int target) {
+  while ((int)(target - W->current) > 0) {
+    int waiting = W->count[0] + W->count[1] + W->count[2] + W->count[3];
+    if (waiting == 0) {  /* nothing to move */
+      W->current = target;
+      break;
+    }
+    if (W->count[0] == 0 && (W->current & WHEELMASK) != WHEELMASK) {
+      unsigned int skip = W->current | WHEELMASK;  /* to the next wrap */
+      W->current = ((int)(target - skip) > 0) ? skip : target;
+      continue;
+    }
+    tickone(W);
+  }
+}
+
+
+static unsigned int tickat (Wheel *W, double now) {
+  double t = floor((now - W->origin) / W->tick);
+  return (unsigned int)fmod(t, 4294967296.0);
+}
+
+
+static int newnode (lua_State *L, Wheel *W) {
+  int i;
+  if (W->free == 0) {  /* grow the array */
+    int size = W->sizenodes * 2;
+    Node *n;
+    if (size > MAXNODES)
+      luaL_error(L, "too many timers");
+    n = (Node *)W->allocf(W->ud, W->nodes, W->sizenodes * sizeof(Node),
+                          size * sizeof(Node));
+    if (n == NULL)
+      luaL_error(L, "not enough memory");
+    W->nodes = n;
+    for (i = size - 1; i >= W->sizenodes; i--) {
+      n[i].next = W->free;
+      n[i].list = -1;
+      n[i].gen = 0;
+      W->free = i;
+    }
+    W->sizenodes = size;
+  }
+  i = W->free;
+  W->free = W->nodes[i].next;
+  return i;
+}
+
+
+static void freenode (Wheel *W, int i) {
+  W->nodes[i].gen++;
+  W->nodes[i].next = W->free;
+  W->free = i;
+}
+
+
+static Wheel *checkwheel (lua_State *L) {
+  return (Wheel *)luaL_checkudata(L, 1, WHEEL_T);
+}
+
+
+/* timer of `id', or 0 if it is not pending */
+static int findtimer (Wheel *W, lua_Number id) {
+  double gen = floor(id / IDBASE);
+  int i = (int)(id - gen * IDBASE);
+  if (id < 0 || i < NLISTS || i >= W->sizenodes ||
+      W->nodes[i].list < 0 || (double)W->nodes[i].gen != gen)
+    return 0;
+  return i;
+}
+
+
+/*
+** add a timer firing `delay' seconds from now for the value at `t',
+** with the `nargs' values on top as arguments; returns its id
+*/
+static lua_Number addtimer (lua_State *L, Wheel *W, lua_Number delay,
+                            int t, int nargs) {
+  double ticks = ceil(delay * 1e9 / W->tick);
+  int i;
+  luaL_argcheck(L, ticks < MAXTICKS, 2, "delay too long");
+  i = newnode(L, W);
+  W->nodes[i].expire = tickat(W, nanoclock()) +
+                       (unsigned int)(ticks > 0 ? ticks : 0);
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, t);
+  lua_rawseti(L, -2, i);
+  if (nargs > 0) {
+    int a;
+    lua_createtable(L, nargs, 0);
+    for (a = 1; a <= nargs; a++) {
+      lua_pushvalue(L, -2 - nargs - 1 + a);
+      lua_rawseti(L, -2, a);
+    }
+    lua_rawseti(L, -2, -i);
+  }
+  lua_pop(L, 1 + nargs);
+  place(W, i);
+  return (lua_Number)W->nodes[i].gen * IDBASE + i;
+}
+
+
+/* forget the values of timer `i' */
+static void cleartimer (lua_State *L, int i) {
+  lua_getfenv(L, 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, i);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, -i);
+  lua_pop(L, 1);
+}
+
+
+/* is `co' dead (1), suspended (0) or running (-1)? as costatus does */
+static int codead (lua_State *L, lua_State *co) {
+  lua_Debug ar;
+  if (L == co) return -1;
+  switch (lua_status(co)) {
+    case LUA_YIELD:
+      return 0;
+    case 0:
+      if (lua_getstack(co, 0, &ar) > 0)  /* does it have frames? */
+        return -1;
+      return (lua_gettop(co) == 0);
+    default:  /* some error occured */
+      return 1;
+  }
+}
+
+
+/*
+** resume `co' with the `nargs' values on top, as coroutine.resume
+** does, dropping what it returns; returns 1 with an error message on
+** top if it failed.  Timers of dead coroutines are dropped silently.
+*/
+static int resumeco (lua_State *L, Wheel *W, lua_State *co, int nargs) {
+  int status = codead(L, co);
+  if (status != 0) {
+    lua_pop(L, nargs);
+    if (status > 0) {
+      W->dropped++;
+      return 0;
+    }
+    lua_pushliteral(L, "cannot resume non-suspended coroutine");
+    return 1;
+  }
+  if (!lua_checkstack(co, nargs))
+    luaL_error(L, "too many arguments to resume");
+  lua_xmove(L, co, nargs);
+  lua_setlevel(L, co);
+  status = lua_resume(co, nargs);
+  if (status == 0 || status == LUA_YIELD) {
+    lua_settop(co, 0);  /* drop yielded values */
+    return 0;
+  }
+  lua_xmove(co, L, 1);  /* move error message */
+  return 1;
+}
+
+
+/* run due timer `i'; returns 1 with an error message on top if it failed */
+static int fire (lua_State *L, Wheel *W, int i) {
+  int nargs = 0;
+  int failed;
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, i);  /* what to run */
+  lua_rawgeti(L, -2, -i);  /* its arguments */
+  lua_remove(L, -3);
+  cleartimer(L, i);
+  unlink(W, i);
+  freenode(W, i);
+  if (lua_istable(L, -1)) {
+    int n = (int)lua_objlen(L, -1);
+    int a;
+    luaL_checkstack(L, n, "too many arguments");
+    for (a = 1; a <= n; a++)
+      lua_rawgeti(L, -a, a);
+    lua_remove(L, -n - 1);
+    nargs = n;
+  }
+  else
+    lua_pop(L, 1);
+  W->fired++;
+  if (lua_isthread(L, -nargs - 1)) {
+    lua_State *co = lua_tothread(L, -nargs - 1);
+    failed = resumeco(L, W, co, nargs);
+    if (failed) lua_remove(L, -2);  /* keep only the message */
+    else lua_pop(L, 1);
+  }
+  else {
+    failed = (lua_pcall(L, nargs, 0, 0) != 0);
+  }
+  return failed;
+}
+
+
+static int timer_now (lua_State *L) {
+  lua_pushnumber(L, (lua_Number)nanoclock());
+  return 1;
+}
+
+
+/* wheel([tick]): a wheel with `tick' seconds per tick (0.001) */
+static int timer_wheel (lua_State *L) {
+  lua_Number tick = luaL_optnumber(L, 1, 0.001);
+  Wheel *W;
+  int i;
+  luaL_argcheck(L, tick >= 1e-6, 1, "tick too short");
+  W = (Wheel *)lua_newuserdata(L, sizeof(Wheel));
+  memset(W, 0, sizeof(Wheel));
+  W->allocf = lua_getallocf(L, &W->ud);
+  W->tick = tick * 1e9;
+  W->origin = nanoclock();
+  luaL_getmetatable(L, WHEEL_T);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setfenv(L, -2);
+  W->sizenodes = NLISTS + 16;
+  W->nodes = (Node *)W->allocf(W->ud, NULL, 0, W->sizenodes * sizeof(Node));
+  if (W->nodes == NULL) {
+    W->sizenodes = 0;
+    return luaL_error(L, "not enough memory");
+  }
+  for (i = 0; i < NLISTS; i++) {
+    W->nodes[i].next = W->nodes[i].prev = i;
+    W->nodes[i].list = -1;
+  }
+  for (i = W->sizenodes - 1; i >= NLISTS; i--) {
+    W->nodes[i].next = W->free;
+    W->nodes[i].list = -1;
+    W->nodes[i].gen = 0;
+    W->free = i;
+  }
+  return 1;
+}
+
+
+static int wheel_gc (lua_State *L) {
+  Wheel *W = (Wheel *)lua_touserdata(L, 1);
+  W->allocf(W->ud, W->nodes, W->sizenodes * sizeof(Node), 0);
+  W->nodes = NULL;
+  W->sizenodes = 0;
+  return 0;
+}
+
+
+static int wheel_len (lua_State *L) {
+  Wheel *W = checkwheel(L);
+  int i, n = 0;
+  for (i = 0; i <= NLEVELS; i++) n += W->count[i];
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+
+/*
+** after(delay, f, ...): resume coroutine `f' (or call function `f')
+** with the extra arguments `delay' seconds from now; returns an id
+*/
+static int wheel_after (lua_State *L) {
+  Wheel *W = checkwheel(L);
+  lua_Number delay = luaL_checknumber(L, 2);
+  luaL_argcheck(L, lua_isthread(L, 3) || lua_isfunction(L, 3), 3,
+                "coroutine or function expected");
+  lua_pushnumber(L, addtimer(L, W, delay, 3, lua_gettop(L) - 3));
+  return 1;
+}
+
+
+/* sleep(delay): suspend the running coroutine for `delay' seconds */
+static int wheel_sleep (lua_State *L) {
+  Wheel *W = checkwheel(L);
+  lua_Number delay = luaL_checknumber(L, 2);
+  if (lua_pushthread(L))
+    return luaL_error(L, "attempt to sleep outside a coroutine");
+  addtimer(L, W, delay, lua_gettop(L), 0);
+  lua_settop(L, 0);
+  return lua_yield(L, 0);
+}
+
+
+static int wheel_cancel (lua_State *L) {
+  Wheel *W = checkwheel(L);
+  int i = findtimer(W, luaL_checknumber(L, 2));
+  if (i != 0) {
+    cleartimer(L, i);
+    unlink(W, i);
+    freenode(W, i);
+  }
+  lua_pushboolean(L, i != 0);
+  return 1;
+}
+
+
+/*
+** update([now]): move the wheel to `now' (timer.now() by default) and
+** run the timers that are due; returns how many ran.  An error of one
+** goes to the handler set with onerror, or is raised (the remaining
+** due timers run on the next update).
+*/
+static int wheel_update (lua_State *L) {
+  Wheel *W = checkwheel(L);
+  double start = nanoclock();
+  double now = luaL_optnumber(L, 2, start);
+  double cost;
+  int n, ran = 0;
+  advance(W, tickat(W, now));
+  cost = nanoclock() - start;
+  W->tickcost += cost;
+  if (cost > W->maxtickcost) W->maxtickcost = cost;
+  lua_settop(L, 1);
+  for (n = W->count[NLEVELS]; n > 0 && W->count[NLEVELS] > 0; n--) {
+    double t0 = nanoclock();
+    int failed = fire(L, W, W->nodes[DUE].next);
+    W->runcost += nanoclock() - t0;
+    ran++;
+    if (failed) {
+      lua_getfenv(L, 1);
+      lua_getfield(L, -1, "onerror");
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        return lua_error(L);
+      }
+      lua_insert(L, -3);
+      lua_pop(L, 1);
+      lua_call(L, 1, 0);
+    }
+  }
+  lua_pushinteger(L, ran);
+  return 1;
+}
+
+
+/* next(): seconds until the wheel needs an update, or nil if empty */
+static int wheel_next (lua_State *L) {
+  Wheel *W = checkwheel(L);
+  unsigned int ticks = 0;
+  unsigned int cascade = WHEELSIZE - (W->current & WHEELMASK);
+  int upper = W->count[1] + W->count[2] + W->count[3] > 0;
+  double wake;
+  int k;
+  if (W->count[NLEVELS] > 0)
+    ticks = 0;
+  else if (W->count[0] > 0) {
+    for (k = 1; k <= WHEELSIZE; k++) {
+      int head = (int)((W->current + k) & WHEELMASK);
+      if (W->nodes[head].next != head) break;
+    }
+    ticks = (unsigned int)k;
+    /* the next cascade may bring down a timer due before that slot */
+    if (upper && cascade < ticks)
+      ticks = cascade;
+  }
+  else if (upper)
+    ticks = cascade;
+  else {
+    lua_pushnil(L);
+    return 1;
+  }
+  wake = W->origin + ((double)W->current + ticks) * W->tick;
+  wake -= nanoclock();
+  lua_pushnumber(L, wake > 0 ? wake / 1e9 : 0);
+  return 1;
+}
+
+
+/* onerror(f): call f(message) for timers that fail during update */
+static int wheel_onerror (lua_State *L) {
+  checkwheel(L);
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "onerror");
+  return 0;
+}
+
+
+static int wheel_stats (lua_State *L) {
+  Wheel *W = checkwheel(L);
+  wheel_len(L);
+  lua_createtable(L, 0, 9);
+  lua_pushvalue(L, -2);
+  lua_setfield(L, -2, "timers");
+  lua_pushnumber(L, W->fired);
+  lua_setfield(L, -2, "fired");
+  lua_pushnumber(L, W->dropped);
+  lua_setfield(L, -2, "dropped");
+  lua_pushnumber(L, W->ticks);
+  lua_setfield(L, -2, "ticks");
+  lua_pushnumber(L, W->cascades);
+  lua_setfield(L, -2, "cascades");
+  lua_pushnumber(L, W->tickcost);
+  lua_setfield(L, -2, "tickcost");
+  lua_pushnumber(L, W->maxtickcost);
+  lua_setfield(L, -2, "maxtickcost");
+  lua_pushnumber(L, W->runcost);
+  lua_setfield(L, -2, "runcost");
+  return 1;
+}
+
+
+static const luaL_Reg wheellib[] = {
+  {"after", wheel_after},
+  {"cancel", wheel_cancel},
+  {"next", wheel_next},
+  {"onerror", wheel_onerror},
+  {"sleep", wheel_sleep},
+  {"stats", wheel_stats},
+  {"update", wheel_update},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg timerlib[] = {
+  {"now", timer_now},
+  {"wheel", timer_wheel},
+  {NULL, NULL}
+};
+
+
+/*
+** Open timer library
+*/
+LUALIB_API int luaopen_timer (lua_State *L) {
+  luaL_newmetatable(L, WHEEL_T);
+  lua_pushcfunction(L, wheel_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, wheel_len);
+  lua_setfield(L, -2, "__len");
+  lua_newtable(L);
+  luaL_register(L, NULL, wheellib);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  nanoclock();  /* set its origin */
+  lua_pushvalue(L, LUA_ENVIRONINDEX);
+  luaL_register(L, NULL, timerlib);
+  return 1;
+}
@@ -17,7 +17,11 @@ LUAI_FUNC Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* n
 LUAI_FUNC void luaU_header (char* h);
 
 /* dump one chunk; from ldump.c */
-LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip);
+LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int flags);
+
+/* optimize a copy of one function for dumping; from lopt.c */
+LUAI_FUNC int luaU_optimize (lua_State* L, const Proto* f, Proto* o);
+LUAI_FUNC void luaU_freeopt (lua_State* L, const Proto* f, Proto* o);
 
 #ifdef luac_c
 /* print one chunk; from print.c */
@@ -32,6 +32,132 @@
 #define MAXTAGLOOP	100
 
 
+
+/*
+** {======================================================
+** Execution counters
+** =======================================================
+*/
+
+#if defined(LUAI_VMSTATS)
+
+/*
+** An access is counted once, by the path of its first lookup: a hit
+** in the array or hash part, a missing key with no metamethod to
+** try, or a metamethod (of a table or of another type).  Calls are
+** counted by the kind of value called.
+*/
+
+#define vmstats(L)	(&G(L)->vmstats)
+
+#define countop(L,o)	{ VMStats *vs_ = vmstats(L); \
+	vs_->op[o]++; \
+	if (lastop < NUM_OPCODES) vs_->pair[lastop][o]++; \
+	lastop = (o); }
+
+#define countaccess(L,w,h,res) \
+	(vmstats(L)->w[ttisnil(res) ? VMS_MISS : \
+	  ((res) >= (h)->array && (res) < (h)->array + (h)->sizearray) ? \
+	  VMS_ARRAY : VMS_HASH]++)
+
+#define countmeta(L,w,t) \
+	(vmstats(L)->w[ttistable(t) ? VMS_META : VMS_OTHER]++)
+
+
+static const char *const accessnames[VMS_NACCESS] = {
+  "array", "hash", "miss", "meta", "other"
+};
+
+static const char *const callnames[VMS_NCALL] = {
+  "lua", "c", "luaex", "meta"
+};
+
+
+/*
+** luaEX trampolines (see export/luaex.cpp) are C closures whose only
+** upvalue is what they forward to: a C function kept as a light
+** userdata, or a C closure
+*/
+static int istrampoline (const CClosure *c) {
+  const TValue *u = &c->upvalue[0];
+  return c->nupvalues == 1 &&
+         (ttislightuserdata(u) || (ttisfunction(u) && clvalue(u)->c.isC));
+}
+
+
+static void countcall (lua_State *L, const TValue *func) {
+  int kind;
+  if (!ttisfunction(func))
+    kind = VMS_CALLTM;
+  else if (!clvalue(func)->c.isC)
+    kind = VMS_LUA;
+  else if (istrampoline(&clvalue(func)->c))
+    kind = VMS_LUAEX;
+  else
+    kind = VMS_C;
+  vmstats(L)->call[kind]++;
+}
+
+
+static void setcount (lua_State *L, Table *t, const char *name, lu_mem n) {
+  if (n != 0)
+    setnvalue(luaH_setstr(L, t, luaS_new(L, name)), cast_num(n));
+}
+
+
+static Table *newcounts (lua_State *L, Table *t, const char *name,
+                         const lu_mem *counts, const char *const names[],
+                         int n) {
+  Table *s = luaH_new(L, 0, 0);
+  int i;
+  sethvalue(L, luaH_setstr(L, t, luaS_new(L, name)), s);
+  for (i = 0; i < n && counts != NULL; i++)
+    setcount(L, s, names[i], counts[i]);
+  return s;
+}
+
+
+/*
+** push a table with the counters: `ops' and `pairs' (keyed "OP1 OP2")
+** of opcodes, `get' and `set' by access path, `calls' by kind
+*/
+void luaV_pushstats (lua_State *L, int reset) {
+  VMStats *vs = vmstats(L);
+  Table *t = luaH_new(L, 0, 5);
+  Table *pairs;
+  char buff[32];
+  int i, j;
+  sethvalue(L, L->top, t);
+  incr_top(L);
+  newcounts(L, t, "ops", vs->op, luaP_opnames, NUM_OPCODES);
+  pairs = newcounts(L, t, "pairs", NULL, NULL, 0);
+  for (i = 0; i < NUM_OPCODES; i++) {
+    for (j = 0; j < NUM_OPCODES; j++) {
+      if (vs->pair[i][j] != 0) {
+        sprintf(buff, "%s %s", luaP_opnames[i], luaP_opnames[j]);
+        setcount(L, pairs, buff, vs->pair[i][j]);
+      }
+    }
+  }
+  newcounts(L, t, "get", vs->get, accessnames, VMS_NACCESS);
+  newcounts(L, t, "set", vs->set, accessnames, VMS_NACCESS);
+  newcounts(L, t, "calls", vs->call, callnames, VMS_NCALL);
+  if (reset)
+    memset(vs, 0, sizeof(VMStats));
+}
+
+#else
+
+#define countop(L,o)		((void)0)
+#define countaccess(L,w,h,res)	((void)0)
+#define countmeta(L,w,t)	((void)0)
+#define countcall(L,f)		((void)0)
+
+#endif
+
+/* }====================================================== */
+
+
 const TValue *luaV_tonumber (const TValue *obj, TValue *n) {
   lua_Number num;
   if (ttisnumber(obj)) return obj;
@@ -50,8 +176,8 @@ int luaV_tostring (lua_State *L, StkId obj) {
   else {
     char s[LUAI_MAXNUMBER2STR];
     lua_Number n = nvalue(obj);
-    lua_number2str(s, n);
-    setsvalue2s(L, obj, luaS_new(L, s));
+    int len = luaO_num2str(s, n);
+    setsvalue2s(L, obj, luaS_newlstr(L, s, len));
     return 1;
   }
 }
@@ -114,6 +240,7 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
       const TValue *res = luaH_get(h, key); /* do a primitive get */
       if (!ttisnil(res) ||  /* result is no nil? */
           (tm = fasttm(L, h->metatable, TM_INDEX)) == NULL) { /* or no TM? */
+        if (loop == 0) countaccess(L, get, h, res);
         setobj2s(L, val, res);
         return;
       }
@@ -121,6 +248,7 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
     }
     else if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_INDEX)))
       luaG_typeerror(L, t, "index");
+    if (loop == 0) countmeta(L, get, t);
     if (ttisfunction(tm)) {
       callTMres(L, val, tm, t, key);
       return;
@@ -141,6 +269,7 @@ void luaV_settable (lua_State *L, const TValue *t, TValue *key, StkId val) {
       TValue *oldval = luaH_set(L, h, key); /* do a primitive set */
       if (!ttisnil(oldval) ||  /* result is no nil? */
           (tm = fasttm(L, h->metatable, TM_NEWINDEX)) == NULL) { /* or no TM? */
+        if (loop == 0) countaccess(L, set, h, oldval);
         setobj2t(L, oldval, val);
         h->flags = 0;
         luaC_barriert(L, h, val);
@@ -150,6 +279,7 @@ void luaV_settable (lua_State *L, const TValue *t, TValue *key, StkId val) {
     }
     else if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_NEWINDEX)))
       luaG_typeerror(L, t, "index");
+    if (loop == 0) countmeta(L, set, t);
     if (ttisfunction(tm)) {
       callTM(L, tm, t, key, val);
       return;
@@ -379,6 +509,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
   StkId base;
   TValue *k;
   const Instruction *pc;
+#if defined(LUAI_VMSTATS)
+  int lastop = NUM_OPCODES;  /* none yet */
+#endif
  reentry:  /* entry point */
   lua_assert(isLua(L->ci));
   pc = L->savedpc;
@@ -389,20 +522,30 @@ void luaV_execute (lua_State *L, int nexeccalls) {
   for (;;) {
     const Instruction i = *pc++;
     StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      traceexec(L, pc);
-      if (L->status == LUA_YIELD) {  /* did hook yield? */
-        L->savedpc = pc - 1;
-        return;
+    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) | L->onbudget) {
+      if (L->onbudget && --L->budgetcount == 0) {
+        L->savedpc = pc;
+        if (luaD_budget(L)) {  /* preempted? */
+          L->savedpc = pc - 1;
+          return;
+        }
+      }
+      if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
+          (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
+        traceexec(L, pc);
+        if (L->status == LUA_YIELD) {  /* did hook yield? */
+          L->savedpc = pc - 1;
+          return;
+        }
+        base = L->base;
       }
-      base = L->base;
     }
     /* warning!! several calls may realloc the stack and invalidate `ra' */
     ra = RA(i);
     lua_assert(base == L->base && L->base == L->ci->base);
     lua_assert(base <= L->top && L->top <= L->stack + L->stacksize);
     lua_assert(L->top == L->ci->top || luaG_checkopenop(i));
+    countop(L, GET_OPCODE(i));
     switch (GET_OPCODE(i)) {
       case OP_MOVE: {
         setobjs2s(L, ra, RB(i));
@@ -461,6 +604,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
       case OP_NEWTABLE: {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
+        L->savedpc = pc;  /* allocation trackers read the current line */
         sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
         Protect(luaC_checkGC(L));
         continue;
@@ -588,6 +732,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
+        countcall(L, ra);
         switch (luaD_precall(L, ra, nresults)) {
           case PCRLUA: {
             nexeccalls++;
@@ -608,6 +753,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
+        countcall(L, ra);
         lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
         switch (luaD_precall(L, ra, LUA_MULTRET)) {
           case PCRLUA: {
@@ -704,6 +850,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           L->top = L->ci->top;
         }
         if (c == 0) c = cast_int(*pc++);
+        L->savedpc = pc;
         runtime_check(L, ttistable(ra));
         h = hvalue(ra);
         last = ((c-1)*LFIELDS_PER_FLUSH) + n;
@@ -726,6 +873,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         int nup, j;
         p = cl->p->p[GETARG_Bx(i)];
         nup = p->nups;
+        L->savedpc = pc;
         ncl = luaF_newLclosure(L, nup, cl->env);
         ncl->l.p = p;
         for (j=0; j<nup; j++, pc++) {
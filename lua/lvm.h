@@ -32,5 +32,8 @@ LUAI_FUNC void luaV_settable (lua_State *L, const TValue *t, TValue *key,
                                             StkId val);
 LUAI_FUNC void luaV_execute (lua_State *L, int nexeccalls);
 LUAI_FUNC void luaV_concat (lua_State *L, int total, int last);
+#if defined(LUAI_VMSTATS)
+LUAI_FUNC void luaV_pushstats (lua_State *L, int reset);
+#endif
 
 #endif
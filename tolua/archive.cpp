@@ -112,6 +112,14 @@ namespace external
 		}
 		const char *path = luaL_checkstring(L, 2);
 		unsigned int len = ext_archive_length(*ptr, path);
+		ByteBuffer *buffer = tobuffer(L, 3);
+		if (buffer != NULL)
+		{
+			char *end = growbuffer(L, buffer, len);
+			buffer->len += ext_archive_read(*ptr, path, end, len);
+			lua_settop(L, 3);
+			return 1;
+		}
 		void *output = malloc(len);
 		len = ext_archive_read(*ptr, path, output, len);
 		lua_pushlstring(L, (const char *)output, len);
@@ -129,7 +137,7 @@ namespace external
 		}
 		const char *path = luaL_checkstring(L, 2);
 		size_t len;
-		const char *input = luaL_checklstring(L, 3, &len);
+		const char *input = checkbytes(L, 3, &len);
 		ext_archive_write(*ptr, path, input, (unsigned int)len);
 		return 0;
 	}
@@ -156,6 +164,17 @@ namespace external
 		return 1;
 	}
 
+	Archive * checkarchive(lua_State *L, int idx)
+	{
+		Archive **ptr = (Archive **)checkudata(L, idx, &metakey, "archive");
+		if (*ptr == NULL)
+		{
+			luaL_error(L, "attempt to use a closed archive");
+			return NULL;
+		}
+		return *ptr;
+	}
+
 	int archive_tolua(lua_State *L)
 	{
 		static const luaL_Reg libs[] = {
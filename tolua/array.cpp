@@ -0,0 +1,802 @@
+#define UTIL_CORE
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include "config.h"
+#include "loaders.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ARRAY_SSE2
+#endif
+
+namespace
+{
+	const char *const typenames[] = {"float64", "float32", "int32", "int64", "uint8", NULL};
+	const size_t typesizes[] = {sizeof(double), sizeof(float), sizeof(int), sizeof(i64), sizeof(unsigned char)};
+
+	/* integers are truncated toward zero and saturate at the element range; NaN becomes 0 */
+	template <typename T>
+	inline T convert(double d)
+	{
+		if (d != d)
+		{
+			return 0;
+		}
+		if (d <= (double)std::numeric_limits<T>::min())
+		{
+			return std::numeric_limits<T>::min();
+		}
+		if (d >= (double)std::numeric_limits<T>::max())
+		{
+			return std::numeric_limits<T>::max();
+		}
+		return (T)d;
+	}
+
+	template <>
+	inline double convert<double>(double d)
+	{
+		return d;
+	}
+
+	template <>
+	inline float convert<float>(double d)
+	{
+		return (float)d;
+	}
+
+	/* NaN sorts after every number */
+	template <typename T>
+	struct Less
+	{
+		bool operator()(T a, T b) const
+		{
+			return a < b || (b != b && a == a);
+		}
+	};
+
+	template <typename T>
+	struct Greater
+	{
+		bool operator()(T a, T b) const
+		{
+			return b < a || (b != b && a == a);
+		}
+	};
+
+	template <typename T>
+	double sum(const T *p, size_t n)
+	{
+		double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			s0 += p[i];
+			s1 += p[i + 1];
+			s2 += p[i + 2];
+			s3 += p[i + 3];
+		}
+		for (; i < n; ++i)
+		{
+			s0 += p[i];
+		}
+		return (s0 + s1) + (s2 + s3);
+	}
+
+	template <typename T>
+	double dot(const T *p, const T *q, size_t n)
+	{
+		double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			s0 += (double)p[i] * q[i];
+			s1 += (double)p[i + 1] * q[i + 1];
+			s2 += (double)p[i + 2] * q[i + 2];
+			s3 += (double)p[i + 3] * q[i + 3];
+		}
+		for (; i < n; ++i)
+		{
+			s0 += (double)p[i] * q[i];
+		}
+		return (s0 + s1) + (s2 + s3);
+	}
+
+	/* index of the first element that is not NaN, or of the last one */
+	template <typename T>
+	size_t firstnumber(const T *p, size_t n)
+	{
+		size_t i = 0;
+		while (i + 1 < n && p[i] != p[i])
+		{
+			++i;
+		}
+		return i;
+	}
+
+	/* NaNs are skipped, as SQL skips NULL; all NaN gives NaN */
+	template <typename T>
+	void minmax(const T *p, size_t n, double *lo, double *hi)
+	{
+		size_t i = firstnumber(p, n);
+		T l = p[i], h = p[i];
+		for (++i; i < n; ++i)
+		{
+			l = p[i] < l ? p[i] : l;
+			h = p[i] > h ? p[i] : h;
+		}
+		*lo = (double)l;
+		*hi = (double)h;
+	}
+
+#if defined(ARRAY_SSE2)
+	template <>
+	double sum<double>(const double *p, size_t n)
+	{
+		__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			s0 = _mm_add_pd(s0, _mm_loadu_pd(p + i));
+			s1 = _mm_add_pd(s1, _mm_loadu_pd(p + i + 2));
+		}
+		double r[2];
+		_mm_storeu_pd(r, _mm_add_pd(s0, s1));
+		double s = r[0] + r[1];
+		for (; i < n; ++i)
+		{
+			s += p[i];
+		}
+		return s;
+	}
+
+	template <>
+	double sum<float>(const float *p, size_t n)
+	{
+		/* accumulate in double so long arrays keep their precision */
+		__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 v = _mm_loadu_ps(p + i);
+			s0 = _mm_add_pd(s0, _mm_cvtps_pd(v));
+			s1 = _mm_add_pd(s1, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+		}
+		double r[2];
+		_mm_storeu_pd(r, _mm_add_pd(s0, s1));
+		double s = r[0] + r[1];
+		for (; i < n; ++i)
+		{
+			s += p[i];
+		}
+		return s;
+	}
+
+	template <>
+	double dot<double>(const double *p, const double *q, size_t n)
+	{
+		__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(p + i), _mm_loadu_pd(q + i)));
+			s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(p + i + 2), _mm_loadu_pd(q + i + 2)));
+		}
+		double r[2];
+		_mm_storeu_pd(r, _mm_add_pd(s0, s1));
+		double s = r[0] + r[1];
+		for (; i < n; ++i)
+		{
+			s += p[i] * q[i];
+		}
+		return s;
+	}
+
+	template <>
+	void minmax<double>(const double *p, size_t n, double *lo, double *hi)
+	{
+		size_t i = firstnumber(p, n);
+		double l = p[i], h = p[i];
+		if (l == l && n - i >= 2)
+		{
+			/* min/max return their second operand when either is NaN, which keeps the number */
+			__m128d vl = _mm_set1_pd(l), vh = vl;
+			for (; i + 2 <= n; i += 2)
+			{
+				__m128d v = _mm_loadu_pd(p + i);
+				vl = _mm_min_pd(v, vl);
+				vh = _mm_max_pd(v, vh);
+			}
+			double r[2];
+			_mm_storeu_pd(r, vl);
+			l = r[0] < r[1] ? r[0] : r[1];
+			_mm_storeu_pd(r, vh);
+			h = r[0] > r[1] ? r[0] : r[1];
+		}
+		for (; i < n; ++i)
+		{
+			l = p[i] < l ? p[i] : l;
+			h = p[i] > h ? p[i] : h;
+		}
+		*lo = l;
+		*hi = h;
+	}
+
+	template <>
+	void minmax<float>(const float *p, size_t n, double *lo, double *hi)
+	{
+		size_t i = firstnumber(p, n);
+		float l = p[i], h = p[i];
+		if (l == l && n - i >= 4)
+		{
+			__m128 vl = _mm_set1_ps(l), vh = vl;
+			for (; i + 4 <= n; i += 4)
+			{
+				__m128 v = _mm_loadu_ps(p + i);
+				vl = _mm_min_ps(v, vl);
+				vh = _mm_max_ps(v, vh);
+			}
+			float r[4];
+			_mm_storeu_ps(r, vl);
+			l = std::min(std::min(r[0], r[1]), std::min(r[2], r[3]));
+			_mm_storeu_ps(r, vh);
+			h = std::max(std::max(r[0], r[1]), std::max(r[2], r[3]));
+		}
+		for (; i < n; ++i)
+		{
+			l = p[i] < l ? p[i] : l;
+			h = p[i] > h ? p[i] : h;
+		}
+		*lo = (double)l;
+		*hi = (double)h;
+	}
+#endif
+
+	enum
+	{
+		OP_ADD,
+		OP_SUB,
+		OP_MUL,
+		OP_DIV,
+	};
+
+	/* element arithmetic; integers wrap, computed unsigned so overflow stays defined */
+	template <typename T>
+	struct Ops
+	{
+		static T add(T a, T b)
+		{
+			return a + b;
+		}
+
+		static T sub(T a, T b)
+		{
+			return a - b;
+		}
+
+		static T mul(T a, T b)
+		{
+			return a * b;
+		}
+	};
+
+	template <typename T, typename U>
+	struct WrapOps
+	{
+		static T add(T a, T b)
+		{
+			return (T)((U)a + (U)b);
+		}
+
+		static T sub(T a, T b)
+		{
+			return (T)((U)a - (U)b);
+		}
+
+		static T mul(T a, T b)
+		{
+			return (T)((U)a * (U)b);
+		}
+	};
+
+	template <> struct Ops<int> : WrapOps<int, unsigned int> {};
+	template <> struct Ops<i64> : WrapOps<i64, u64> {};
+	template <> struct Ops<unsigned char> : WrapOps<unsigned char, unsigned int> {};
+
+	template <typename T>
+	void arith(T *p, size_t n, int op, const T *q, double x)
+	{
+		switch (op)
+		{
+		case OP_ADD:
+			for (size_t i = 0; i < n; ++i)
+			{
+				p[i] = q != NULL ? Ops<T>::add(p[i], q[i]) : convert<T>(p[i] + x);
+			}
+			break;
+		case OP_SUB:
+			for (size_t i = 0; i < n; ++i)
+			{
+				p[i] = q != NULL ? Ops<T>::sub(p[i], q[i]) : convert<T>(p[i] - x);
+			}
+			break;
+		case OP_MUL:
+			for (size_t i = 0; i < n; ++i)
+			{
+				p[i] = q != NULL ? Ops<T>::mul(p[i], q[i]) : convert<T>(p[i] * x);
+			}
+			break;
+		default:
+			for (size_t i = 0; i < n; ++i)
+			{
+				p[i] = q != NULL ? convert<T>((double)p[i] / q[i]) : convert<T>(p[i] / x);
+			}
+			break;
+		}
+	}
+}
+
+/* call `fn<T>(args)' with the element type of `array' */
+#define ARRAY_DISPATCH(array, fn, args) \
+	switch ((array)->type) \
+	{ \
+	case NA_FLOAT64: fn<double> args; break; \
+	case NA_FLOAT32: fn<float> args; break; \
+	case NA_INT32: fn<int> args; break; \
+	case NA_INT64: fn<i64> args; break; \
+	default: fn<unsigned char> args; break; \
+	}
+
+namespace external
+{
+	static char metakey;
+
+	template <typename T>
+	static void set(NumArray *array, size_t i, double d)
+	{
+		((T *)array->data)[i] = convert<T>(d);
+	}
+
+	template <typename T>
+	static void get(NumArray *array, size_t i, double *d)
+	{
+		*d = (double)((T *)array->data)[i];
+	}
+
+	template <typename T>
+	static void setint(NumArray *array, size_t i, i64 l)
+	{
+		((T *)array->data)[i] = (T)l;
+	}
+
+	NumArray * toarray(lua_State *L, int idx)
+	{
+		if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+		{
+			return NULL;
+		}
+		lua_pushlightuserdata(L, &metakey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		bool result = lua_rawequal(L, -1, -2) != 0;
+		lua_pop(L, 2);
+		return result ? (NumArray *)lua_touserdata(L, idx) : NULL;
+	}
+
+	static NumArray * checkarray(lua_State *L, int idx)
+	{
+		return (NumArray *)checkudata(L, idx, &metakey, "array");
+	}
+
+	static void resizearray(lua_State *L, NumArray *array, size_t len)
+	{
+		if (len > array->cap)
+		{
+			size_t cap = array->cap < 16 ? 16 : array->cap;
+			while (cap < len)
+			{
+				cap *= 2;
+			}
+			if (cap > (size_t)-1 / typesizes[array->type])
+			{
+				luaL_error(L, "array too large");
+			}
+			void *data = realloc(array->data, cap * typesizes[array->type]);
+			if (data == NULL)
+			{
+				luaL_error(L, "not enough memory");
+			}
+			array->data = data;
+			array->cap = cap;
+		}
+		if (len > array->len)
+		{
+			memset((char *)array->data + array->len * typesizes[array->type], 0,
+				(len - array->len) * typesizes[array->type]);
+		}
+		array->len = len;
+	}
+
+	void arrayappend(lua_State *L, NumArray *array, double d)
+	{
+		resizearray(L, array, array->len + 1);
+		ARRAY_DISPATCH(array, set, (array, array->len - 1, d));
+	}
+
+	void arrayappendint(lua_State *L, NumArray *array, i64 l)
+	{
+		resizearray(L, array, array->len + 1);
+		ARRAY_DISPATCH(array, setint, (array, array->len - 1, l));
+	}
+
+	static NumArray * newarray(lua_State *L, int type, size_t len)
+	{
+		NumArray *array = (NumArray *)lua_newuserdata(L, sizeof(NumArray));
+		array->type = type;
+		array->len = 0;
+		array->cap = 0;
+		array->data = NULL;
+		lua_pushlightuserdata(L, &metakey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		lua_setmetatable(L, -2);
+		resizearray(L, array, len);
+		return array;
+	}
+
+	static size_t checkindex(lua_State *L, NumArray *array, int idx)
+	{
+		lua_Integer i = luaL_checkinteger(L, idx);
+		if (i < 1 || (size_t)i > array->len)
+		{
+			luaL_error(L, "array index %d out of range", (int)i);
+		}
+		return (size_t)i - 1;
+	}
+
+	static int new_tolua(lua_State *L)
+	{
+		int type = luaL_checkoption(L, 1, NULL, typenames);
+		lua_Integer len = luaL_optinteger(L, 2, 0);
+		NumArray *array = newarray(L, type, len > 0 ? (size_t)len : 0);
+		if (!lua_isnoneornil(L, 3))
+		{
+			double d = luaL_checknumber(L, 3);
+			for (size_t i = 0; i < array->len; ++i)
+			{
+				ARRAY_DISPATCH(array, set, (array, i, d));
+			}
+		}
+		return 1;
+	}
+
+	static int from_tolua(lua_State *L)
+	{
+		int type = luaL_checkoption(L, 1, NULL, typenames);
+		luaL_checktype(L, 2, LUA_TTABLE);
+		size_t len = lua_objlen(L, 2);
+		NumArray *array = newarray(L, type, len);
+		for (size_t i = 0; i < len; ++i)
+		{
+			lua_rawgeti(L, 2, (int)i + 1);
+			if (lua_type(L, -1) != LUA_TNUMBER)
+			{
+				return luaL_error(L, "number expected at index %d, got %s", (int)i + 1, luaL_typename(L, -1));
+			}
+			ARRAY_DISPATCH(array, set, (array, i, lua_tonumber(L, -1)));
+			lua_pop(L, 1);
+		}
+		return 1;
+	}
+
+	static int type_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		lua_pushstring(L, typenames[array->type]);
+		return 1;
+	}
+
+	static int len_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		lua_pushinteger(L, (lua_Integer)array->len);
+		return 1;
+	}
+
+	static int index_tolua(lua_State *L)
+	{
+		NumArray *array = (NumArray *)lua_touserdata(L, 1);
+		if (lua_type(L, 2) == LUA_TNUMBER)
+		{
+			lua_Number n = lua_tonumber(L, 2);
+			/* range first: the cast is undefined for NaN and out-of-range values */
+			if (n >= 1 && n <= (lua_Number)array->len && n == floor(n))
+			{
+				double d;
+				ARRAY_DISPATCH(array, get, (array, (size_t)n - 1, &d));
+				lua_pushnumber(L, d);
+				return 1;
+			}
+			return 0;
+		}
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		return 1;
+	}
+
+	static int newindex_tolua(lua_State *L)
+	{
+		NumArray *array = (NumArray *)lua_touserdata(L, 1);
+		size_t i = checkindex(L, array, 2);
+		ARRAY_DISPATCH(array, set, (array, i, luaL_checknumber(L, 3)));
+		return 0;
+	}
+
+	static int push_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		int top = lua_gettop(L);
+		for (int i = 2; i <= top; ++i)
+		{
+			arrayappend(L, array, luaL_checknumber(L, i));
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int resize_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		lua_Integer len = luaL_checkinteger(L, 2);
+		resizearray(L, array, len > 0 ? (size_t)len : 0);
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int fill_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		double d = luaL_checknumber(L, 2);
+		lua_Integer i = luaL_optinteger(L, 3, 1);
+		lua_Integer j = luaL_optinteger(L, 4, (lua_Integer)array->len);
+		if (i < 1)
+		{
+			i = 1;
+		}
+		if (j > (lua_Integer)array->len)
+		{
+			j = (lua_Integer)array->len;
+		}
+		for (; i <= j; ++i)
+		{
+			ARRAY_DISPATCH(array, set, (array, (size_t)i - 1, d));
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	template <typename T>
+	static void sumof(NumArray *array, double *result)
+	{
+		*result = sum((const T *)array->data, array->len);
+	}
+
+	static int sum_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		double result;
+		ARRAY_DISPATCH(array, sumof, (array, &result));
+		lua_pushnumber(L, result);
+		return 1;
+	}
+
+	static int mean_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		if (array->len == 0)
+		{
+			return 0;
+		}
+		double result;
+		ARRAY_DISPATCH(array, sumof, (array, &result));
+		lua_pushnumber(L, result / array->len);
+		return 1;
+	}
+
+	template <typename T>
+	static void minmaxof(NumArray *array, double *lo, double *hi)
+	{
+		minmax((const T *)array->data, array->len, lo, hi);
+	}
+
+	static int minmax_tolua(lua_State *L, bool max)
+	{
+		NumArray *array = checkarray(L, 1);
+		if (array->len == 0)
+		{
+			return 0;
+		}
+		double lo, hi;
+		ARRAY_DISPATCH(array, minmaxof, (array, &lo, &hi));
+		lua_pushnumber(L, max ? hi : lo);
+		return 1;
+	}
+
+	static int min_tolua(lua_State *L)
+	{
+		return minmax_tolua(L, false);
+	}
+
+	static int max_tolua(lua_State *L)
+	{
+		return minmax_tolua(L, true);
+	}
+
+	static NumArray * checkpeer(lua_State *L, NumArray *array, int idx)
+	{
+		NumArray *other = checkarray(L, idx);
+		luaL_argcheck(L, other->type == array->type, idx, "array types differ");
+		luaL_argcheck(L, other->len == array->len, idx, "array lengths differ");
+		return other;
+	}
+
+	template <typename T>
+	static void dotof(NumArray *array, NumArray *other, double *result)
+	{
+		*result = dot((const T *)array->data, (const T *)other->data, array->len);
+	}
+
+	static int dot_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		NumArray *other = checkpeer(L, array, 2);
+		double result;
+		ARRAY_DISPATCH(array, dotof, (array, other, &result));
+		lua_pushnumber(L, result);
+		return 1;
+	}
+
+	template <typename T>
+	static void arithof(NumArray *array, int op, NumArray *other, double x)
+	{
+		arith((T *)array->data, array->len, op, other != NULL ? (const T *)other->data : (const T *)NULL, x);
+	}
+
+	static int arith_tolua(lua_State *L, int op)
+	{
+		NumArray *array = checkarray(L, 1);
+		if (lua_type(L, 2) == LUA_TNUMBER)
+		{
+			ARRAY_DISPATCH(array, arithof, (array, op, (NumArray *)NULL, lua_tonumber(L, 2)));
+		}
+		else
+		{
+			NumArray *other = checkpeer(L, array, 2);
+			ARRAY_DISPATCH(array, arithof, (array, op, other, 0));
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int add_tolua(lua_State *L)
+	{
+		return arith_tolua(L, OP_ADD);
+	}
+
+	static int sub_tolua(lua_State *L)
+	{
+		return arith_tolua(L, OP_SUB);
+	}
+
+	static int mul_tolua(lua_State *L)
+	{
+		return arith_tolua(L, OP_MUL);
+	}
+
+	static int div_tolua(lua_State *L)
+	{
+		return arith_tolua(L, OP_DIV);
+	}
+
+	template <typename T>
+	static void sortof(NumArray *array, bool desc)
+	{
+		T *p = (T *)array->data;
+		if (desc)
+		{
+			std::sort(p, p + array->len, Greater<T>());
+		}
+		else
+		{
+			std::sort(p, p + array->len, Less<T>());
+		}
+	}
+
+	static int sort_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		bool desc = lua_toboolean(L, 2) != 0;
+		ARRAY_DISPATCH(array, sortof, (array, desc));
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int totable_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		lua_createtable(L, (int)array->len, 0);
+		for (size_t i = 0; i < array->len; ++i)
+		{
+			double d;
+			ARRAY_DISPATCH(array, get, (array, i, &d));
+			lua_pushnumber(L, d);
+			lua_rawseti(L, -2, (int)i + 1);
+		}
+		return 1;
+	}
+
+	static int copy_tolua(lua_State *L)
+	{
+		NumArray *array = checkarray(L, 1);
+		NumArray *copy = newarray(L, array->type, array->len);
+		memcpy(copy->data, array->data, array->len * typesizes[array->type]);
+		return 1;
+	}
+
+	static int gc_tolua(lua_State *L)
+	{
+		NumArray *array = (NumArray *)lua_touserdata(L, 1);
+		free(array->data);
+		array->data = NULL;
+		array->len = 0;
+		array->cap = 0;
+		return 0;
+	}
+
+	int array_tolua(lua_State *L)
+	{
+		static const luaL_Reg libs[] = {
+			{"new", new_tolua},
+			{"from", from_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg methods[] = {
+			{"type", type_tolua},
+			{"len", len_tolua},
+			{"push", push_tolua},
+			{"resize", resize_tolua},
+			{"fill", fill_tolua},
+			{"sum", sum_tolua},
+			{"mean", mean_tolua},
+			{"min", min_tolua},
+			{"max", max_tolua},
+			{"dot", dot_tolua},
+			{"add", add_tolua},
+			{"sub", sub_tolua},
+			{"mul", mul_tolua},
+			{"div", div_tolua},
+			{"sort", sort_tolua},
+			{"totable", totable_tolua},
+			{"copy", copy_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg metas[] = {
+			{"__gc", gc_tolua},
+			{"__len", len_tolua},
+			{"__newindex", newindex_tolua},
+			{NULL, NULL}
+		};
+		lua_pushvalue(L, LUA_ENVIRONINDEX);
+		luaL_register(L, NULL, libs);
+		lua_pushlightuserdata(L, &metakey);
+		lua_createtable(L, 0, sizeof(metas) / sizeof(metas[0]));
+		luaL_register(L, NULL, metas);
+		lua_createtable(L, 0, sizeof(methods) / sizeof(methods[0]));
+		luaL_register(L, NULL, methods);
+		lua_pushcclosure(L, index_tolua, 1);
+		lua_setfield(L, -2, "__index");
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		return 1;
+	}
+}
@@ -0,0 +1,661 @@
+#define UTIL_CORE
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <cfloat>
+#include "config.h"
+#include "loaders.h"
+
+namespace
+{
+	enum
+	{
+		PK_NONE = 0x00,
+		PK_NUM = 0x01,
+		PK_FLOAT = 0x02,
+		PK_STR = 0x03,
+	};
+
+	size_t posrelat(lua_Integer pos, size_t len)
+	{
+		if (pos < 0)
+		{
+			pos += (lua_Integer)len + 1;
+		}
+		return pos < 0 ? 0 : (size_t)pos;
+	}
+
+	/* same encoding as string.pack */
+	char * pack_uint(char *p, unsigned int u)
+	{
+		while (u > 127)
+		{
+			*p++ = (char)((u & 0xff) | 0x80);
+			u >>= 7;
+		}
+		*p++ = (char)(u & 0xff);
+		return p;
+	}
+
+	char * pack_num(char *p, int i)
+	{
+		return pack_uint(p, i < 0 ? (((unsigned int)-i) << 1) - 1 : ((unsigned int)i) << 1);
+	}
+
+	char * pack_float(char *p, double f)
+	{
+		int e;
+		double d = frexp(f, &e);
+		while (fabs(d - floor(d + 0.5)) >= DBL_EPSILON)
+		{
+			d = d * 2;
+			--e;
+		}
+		i64 i = (i64)floor(d + 0.5);
+		u64 u = i < 0 ? (((u64)-i) << 1) - 1 : ((u64)i) << 1;
+		while (u > 127)
+		{
+			*p++ = (char)((u & 0xff) | 0x80);
+			u >>= 7;
+		}
+		*p++ = (char)(u & 0xff);
+		return pack_num(p, e);
+	}
+
+	int formatcount(const char **fmt)
+	{
+		const char *f = *fmt;
+		if (!isdigit((unsigned char)*f))
+		{
+			return 1;
+		}
+		int N = 0;
+		do
+		{
+			N = 10 * N + (*f) - '0';
+		} while (isdigit((unsigned char)*++f));
+		*fmt = f;
+		return N;
+	}
+
+	bool unpack_uint(const char *str, size_t len, size_t *pos, u64 *u)
+	{
+		u64 c;
+		int bytes = 0;
+		*u = 0;
+		do
+		{
+			if (*pos >= len || bytes > 9)
+			{
+				return false;
+			}
+			c = (unsigned char)str[(*pos)++];
+			*u |= (c & 0x7f) << (bytes++ * 7);
+		} while (c > 127);
+		return true;
+	}
+}
+
+namespace external
+{
+	struct ByteView
+	{
+		ByteBuffer *buffer;
+		size_t offset;
+		size_t len;
+	};
+
+	struct ByteReader
+	{
+		size_t pos;
+	};
+
+	static char buffermetakey;
+	static char viewmetakey;
+	static char readermetakey;
+
+	static bool ismeta(lua_State *L, void *meta)
+	{
+		lua_pushlightuserdata(L, meta);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		bool result = lua_rawequal(L, -1, -2) != 0;
+		lua_pop(L, 1);
+		return result;
+	}
+
+	ByteBuffer * tobuffer(lua_State *L, int idx)
+	{
+		if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+		{
+			return NULL;
+		}
+		bool result = ismeta(L, &buffermetakey);
+		lua_pop(L, 1);
+		return result ? (ByteBuffer *)lua_touserdata(L, idx) : NULL;
+	}
+
+	const char * tobytes(lua_State *L, int idx, size_t *len)
+	{
+		switch (lua_type(L, idx))
+		{
+		case LUA_TSTRING:
+		case LUA_TNUMBER:
+			return lua_tolstring(L, idx, len);
+		case LUA_TUSERDATA:
+			if (lua_getmetatable(L, idx))
+			{
+				if (ismeta(L, &buffermetakey))
+				{
+					lua_pop(L, 1);
+					ByteBuffer *buffer = (ByteBuffer *)lua_touserdata(L, idx);
+					*len = buffer->len;
+					return buffer->data != NULL ? buffer->data : "";
+				}
+				if (ismeta(L, &viewmetakey))
+				{
+					lua_pop(L, 1);
+					ByteView *view = (ByteView *)lua_touserdata(L, idx);
+					ByteBuffer *buffer = view->buffer;
+					size_t offset = view->offset < buffer->len ? view->offset : buffer->len;
+					*len = buffer->len - offset < view->len ? buffer->len - offset : view->len;
+					return buffer->data != NULL ? buffer->data + offset : "";
+				}
+				lua_pop(L, 1);
+			}
+			break;
+		}
+		return NULL;
+	}
+
+	const char * checkbytes(lua_State *L, int idx, size_t *len)
+	{
+		const char *bytes = tobytes(L, idx, len);
+		if (bytes == NULL)
+		{
+			luaL_typerror(L, idx, "string or buffer");
+		}
+		return bytes;
+	}
+
+	char * growbuffer(lua_State *L, ByteBuffer *buffer, size_t len)
+	{
+		if (buffer->cap - buffer->len < len)
+		{
+			if (len > (size_t)-1 - buffer->len)
+			{
+				luaL_error(L, "buffer too large");
+			}
+			size_t cap = buffer->cap < 64 ? 64 : buffer->cap;
+			while (cap - buffer->len < len)
+			{
+				cap = cap * 2 > cap ? cap * 2 : buffer->len + len;
+			}
+			char *data = (char *)realloc(buffer->data, cap);
+			if (data == NULL)
+			{
+				luaL_error(L, "not enough memory");
+			}
+			buffer->data = data;
+			buffer->cap = cap;
+		}
+		return buffer->data + buffer->len;
+	}
+
+	static ByteBuffer * checkbuffer(lua_State *L, int idx)
+	{
+		return (ByteBuffer *)checkudata(L, idx, &buffermetakey, "buffer");
+	}
+
+	static ByteBuffer * newbuffer(lua_State *L, size_t cap)
+	{
+		ByteBuffer *buffer = (ByteBuffer *)lua_newuserdata(L, sizeof(ByteBuffer));
+		buffer->data = NULL;
+		buffer->len = 0;
+		buffer->cap = 0;
+		lua_pushlightuserdata(L, &buffermetakey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		lua_setmetatable(L, -2);
+		if (cap > 0)
+		{
+			growbuffer(L, buffer, cap);
+		}
+		return buffer;
+	}
+
+	static int new_tolua(lua_State *L)
+	{
+		lua_Integer cap = luaL_optinteger(L, 1, 0);
+		newbuffer(L, cap > 0 ? (size_t)cap : 0);
+		return 1;
+	}
+
+	static int append_tolua(lua_State *L)
+	{
+		ByteBuffer *buffer = checkbuffer(L, 1);
+		int top = lua_gettop(L);
+		for (int i = 2; i <= top; ++i)
+		{
+			size_t len;
+			checkbytes(L, i, &len);
+			char *output = growbuffer(L, buffer, len);
+			/* the source may live in this buffer and move while growing */
+			memcpy(output, tobytes(L, i, &len), len);
+			buffer->len += len;
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int pack_tolua(lua_State *L)
+	{
+		ByteBuffer *buffer = checkbuffer(L, 1);
+		const char *fmt = luaL_checkstring(L, 2);
+		int top = lua_gettop(L);
+		int count = 0;
+		for (const char *f = fmt; *f != 0; )
+		{
+			char c = *f++;
+			if (c != 'i' && c != 'I' && c != 'n' && c != 'N' && c != 's' && c != 'S')
+			{
+				return luaL_error(L, "invalid format (must be 'i|n|s')");
+			}
+			count += formatcount(&f);
+		}
+		if (count > top - 2)
+		{
+			return luaL_argerror(L, top + 1, "overflow");
+		}
+		/* written past the end and committed once every value is checked */
+		size_t header = (count + 4) >> 2;
+		char *types = growbuffer(L, buffer, header);
+		memset(types, 0, header);
+		size_t pos = buffer->len + header;
+		int arg = 3;
+		int idx = 0;
+		while (*fmt != 0)
+		{
+			char c = *fmt++;
+			for (int N = formatcount(&fmt); N > 0; --N)
+			{
+				int type;
+				switch (c)
+				{
+				case 'i':
+				case 'I':
+					{
+						int i = luaL_checkint(L, arg++);
+						growbuffer(L, buffer, pos - buffer->len + 5);
+						pos = pack_num(buffer->data + pos, i) - buffer->data;
+						type = PK_NUM;
+					}
+					break;
+				case 'n':
+				case 'N':
+					{
+						double d = luaL_checknumber(L, arg++);
+						growbuffer(L, buffer, pos - buffer->len + 15);
+						pos = pack_float(buffer->data + pos, d) - buffer->data;
+						type = PK_FLOAT;
+					}
+					break;
+				default:
+					{
+						size_t len;
+						checkbytes(L, arg, &len);
+						growbuffer(L, buffer, pos - buffer->len + len + 5);
+						char *output = pack_uint(buffer->data + pos, (unsigned int)len);
+						memcpy(output, tobytes(L, arg++, &len), len);
+						pos = output + len - buffer->data;
+						type = PK_STR;
+					}
+					break;
+				}
+				buffer->data[buffer->len + (idx >> 2)] |= (char)(type << ((idx & (4 - 1)) << 1));
+				++idx;
+			}
+		}
+		buffer->len = pos;
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int len_tolua(lua_State *L)
+	{
+		size_t len;
+		checkbytes(L, 1, &len);
+		lua_pushinteger(L, (lua_Integer)len);
+		return 1;
+	}
+
+	/* contents in place, for lpeg.match and other byte consumers */
+	static int bytes_tolua(lua_State *L)
+	{
+		size_t len;
+		const char *bytes = checkbytes(L, 1, &len);
+		lua_pushlightuserdata(L, (void *)bytes);
+		lua_pushnumber(L, (lua_Number)len);
+		return 2;
+	}
+
+	static int tostring_tolua(lua_State *L)
+	{
+		size_t len;
+		const char *bytes = checkbytes(L, 1, &len);
+		size_t i = posrelat(luaL_optinteger(L, 2, 1), len);
+		size_t j = posrelat(luaL_optinteger(L, 3, -1), len);
+		if (i < 1)
+		{
+			i = 1;
+		}
+		if (j > len)
+		{
+			j = len;
+		}
+		if (i <= j)
+		{
+			lua_pushlstring(L, bytes + i - 1, j - i + 1);
+		}
+		else
+		{
+			lua_pushliteral(L, "");
+		}
+		return 1;
+	}
+
+	static int clear_tolua(lua_State *L)
+	{
+		ByteBuffer *buffer = checkbuffer(L, 1);
+		buffer->len = 0;
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int reserve_tolua(lua_State *L)
+	{
+		ByteBuffer *buffer = checkbuffer(L, 1);
+		lua_Integer len = luaL_checkinteger(L, 2);
+		if (len > 0)
+		{
+			growbuffer(L, buffer, (size_t)len);
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int view_tolua(lua_State *L)
+	{
+		size_t len;
+		ByteBuffer *buffer = tobuffer(L, 1);
+		bool isview = buffer == NULL;
+		size_t offset = 0;
+		if (isview)
+		{
+			ByteView *view = (ByteView *)checkudata(L, 1, &viewmetakey, "buffer");
+			buffer = view->buffer;
+			offset = view->offset;
+		}
+		checkbytes(L, 1, &len);
+		size_t i = posrelat(luaL_optinteger(L, 2, 1), len);
+		size_t j = posrelat(luaL_optinteger(L, 3, -1), len);
+		if (i < 1)
+		{
+			i = 1;
+		}
+		if (j > len)
+		{
+			j = len;
+		}
+		ByteView *view = (ByteView *)lua_newuserdata(L, sizeof(ByteView));
+		view->buffer = buffer;
+		view->offset = offset + i - 1;
+		view->len = i <= j ? j - i + 1 : 0;
+		lua_pushlightuserdata(L, &viewmetakey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		lua_setmetatable(L, -2);
+		/* the view keeps its buffer alive */
+		lua_createtable(L, 1, 0);
+		if (isview)
+		{
+			lua_getfenv(L, 1);
+			lua_rawgeti(L, -1, 1);
+			lua_remove(L, -2);
+		}
+		else
+		{
+			lua_pushvalue(L, 1);
+		}
+		lua_rawseti(L, -2, 1);
+		lua_setfenv(L, -2);
+		return 1;
+	}
+
+	static int reader_tolua(lua_State *L)
+	{
+		size_t len;
+		checkbytes(L, 1, &len);
+		size_t pos = posrelat(luaL_optinteger(L, 2, 1), len);
+		ByteReader *reader = (ByteReader *)lua_newuserdata(L, sizeof(ByteReader));
+		reader->pos = pos > 0 ? pos - 1 : 0;
+		lua_pushlightuserdata(L, &readermetakey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		lua_setmetatable(L, -2);
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, 1);
+		lua_setfenv(L, -2);
+		return 1;
+	}
+
+	static const char * checkreader(lua_State *L, ByteReader **reader, size_t *len)
+	{
+		*reader = (ByteReader *)checkudata(L, 1, &readermetakey, "buffer.reader");
+		lua_getfenv(L, 1);
+		lua_rawgeti(L, -1, 1);
+		lua_replace(L, -2);
+		const char *bytes = tobytes(L, -1, len);
+		lua_pop(L, 1);
+		if ((*reader)->pos > *len)
+		{
+			(*reader)->pos = *len;
+		}
+		return bytes;
+	}
+
+	static int read_tolua(lua_State *L)
+	{
+		ByteReader *reader;
+		size_t len;
+		const char *bytes = checkreader(L, &reader, &len);
+		lua_Integer n = luaL_optinteger(L, 2, (lua_Integer)(len - reader->pos));
+		if (n < 0 || (size_t)n > len - reader->pos)
+		{
+			return 0;
+		}
+		lua_pushlstring(L, bytes + reader->pos, (size_t)n);
+		reader->pos += (size_t)n;
+		return 1;
+	}
+
+	static int skip_tolua(lua_State *L)
+	{
+		ByteReader *reader;
+		size_t len;
+		checkreader(L, &reader, &len);
+		lua_Integer n = luaL_checkinteger(L, 2);
+		if (n < 0 || (size_t)n > len - reader->pos)
+		{
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		reader->pos += (size_t)n;
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	static int tell_tolua(lua_State *L)
+	{
+		ByteReader *reader;
+		size_t len;
+		checkreader(L, &reader, &len);
+		lua_pushinteger(L, (lua_Integer)reader->pos + 1);
+		return 1;
+	}
+
+	static int seek_tolua(lua_State *L)
+	{
+		ByteReader *reader;
+		size_t len;
+		checkreader(L, &reader, &len);
+		size_t pos = posrelat(luaL_checkinteger(L, 2), len);
+		reader->pos = pos > 0 ? (pos > len ? len : pos - 1) : 0;
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int remaining_tolua(lua_State *L)
+	{
+		ByteReader *reader;
+		size_t len;
+		checkreader(L, &reader, &len);
+		lua_pushinteger(L, (lua_Integer)(len - reader->pos));
+		return 1;
+	}
+
+	/* decode one string.pack record at the reader position */
+	static int unpack_tolua(lua_State *L)
+	{
+		ByteReader *reader;
+		size_t len;
+		const char *bytes = checkreader(L, &reader, &len);
+		size_t start = reader->pos;
+		int count = 0;
+		for (;;)
+		{
+			size_t at = start + (count >> 2);
+			if (at >= len)
+			{
+				return luaL_error(L, "overflow");
+			}
+			if (((bytes[at] >> ((count & (4 - 1)) << 1)) & (4 - 1)) == PK_NONE)
+			{
+				break;
+			}
+			++count;
+		}
+		luaL_checkstack(L, count, "too many values");
+		size_t pos = start + ((count + 4) >> 2);
+		for (int idx = 0; idx < count; ++idx)
+		{
+			u64 u, e;
+			switch ((bytes[start + (idx >> 2)] >> ((idx & (4 - 1)) << 1)) & (4 - 1))
+			{
+			case PK_NUM:
+				if (!unpack_uint(bytes, len, &pos, &u))
+				{
+					return luaL_error(L, "overflow");
+				}
+				lua_pushinteger(L, u & 1 ? -(int)((unsigned int)(u + 1) >> 1) : (int)((unsigned int)u >> 1));
+				break;
+			case PK_FLOAT:
+				if (!unpack_uint(bytes, len, &pos, &u) || !unpack_uint(bytes, len, &pos, &e))
+				{
+					return luaL_error(L, "overflow");
+				}
+				lua_pushnumber(L, ldexp(u & 1 ? -(double)((u + 1) >> 1) : (double)(u >> 1),
+					e & 1 ? -(int)((unsigned int)(e + 1) >> 1) : (int)((unsigned int)e >> 1)));
+				break;
+			default:
+				if (!unpack_uint(bytes, len, &pos, &u) || u > len - pos)
+				{
+					return luaL_error(L, "overflow");
+				}
+				lua_pushlstring(L, bytes + pos, (size_t)u);
+				pos += (size_t)u;
+				break;
+			}
+		}
+		reader->pos = pos;
+		return count;
+	}
+
+	static int gc_tolua(lua_State *L)
+	{
+		ByteBuffer *buffer = (ByteBuffer *)lua_touserdata(L, 1);
+		free(buffer->data);
+		buffer->data = NULL;
+		buffer->len = 0;
+		buffer->cap = 0;
+		return 0;
+	}
+
+	static void registermeta(lua_State *L, void *meta, const luaL_Reg *libs, const luaL_Reg *metas)
+	{
+		lua_pushlightuserdata(L, meta);
+		lua_newtable(L);
+		luaL_register(L, NULL, metas);
+		lua_newtable(L);
+		luaL_register(L, NULL, libs);
+		lua_setfield(L, -2, "__index");
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+
+	int buffer_tolua(lua_State *L)
+	{
+		static const luaL_Reg libs[] = {
+			{"new", new_tolua},
+			{"view", view_tolua},
+			{"reader", reader_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg bufferlibs[] = {
+			{"append", append_tolua},
+			{"pack", pack_tolua},
+			{"len", len_tolua},
+			{"tostring", tostring_tolua},
+			{"clear", clear_tolua},
+			{"reserve", reserve_tolua},
+			{"view", view_tolua},
+			{"reader", reader_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg buffermetas[] = {
+			{"__gc", gc_tolua},
+			{"__len", len_tolua},
+			{"__tostring", tostring_tolua},
+			{"__bytes", bytes_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg viewlibs[] = {
+			{"len", len_tolua},
+			{"tostring", tostring_tolua},
+			{"view", view_tolua},
+			{"reader", reader_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg viewmetas[] = {
+			{"__len", len_tolua},
+			{"__tostring", tostring_tolua},
+			{"__bytes", bytes_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg readerlibs[] = {
+			{"read", read_tolua},
+			{"unpack", unpack_tolua},
+			{"skip", skip_tolua},
+			{"tell", tell_tolua},
+			{"seek", seek_tolua},
+			{"remaining", remaining_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg readermetas[] = {
+			{NULL, NULL}
+		};
+		lua_pushvalue(L, LUA_ENVIRONINDEX);
+		luaL_register(L, NULL, libs);
+		registermeta(L, &buffermetakey, bufferlibs, buffermetas);
+		registermeta(L, &viewmetakey, viewlibs, viewmetas);
+		registermeta(L, &readermetakey, readerlibs, readermetas);
+		return 1;
+	}
+}
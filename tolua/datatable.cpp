@@ -0,0 +1,429 @@
+#define UTIL_CORE
+#include <cstdlib>
+#include "datatable.h"
+#include "loaders.h"
+
+namespace
+{
+	struct DataNode
+	{
+		DataTable *table;
+		unsigned int value;
+	};
+
+	bool WriteValue(lua_State *L, int idx, int filled, DataTableWriter *writer)
+	{
+		switch (lua_type(L, idx))
+		{
+		case LUA_TNIL:
+			return ext_datatable_write_null(writer) != 0;
+		case LUA_TBOOLEAN:
+			return ext_datatable_write_bool(writer, lua_toboolean(L, idx)) != 0;
+		case LUA_TNUMBER:
+			return ext_datatable_write_double(writer, lua_tonumber(L, idx)) != 0;
+		case LUA_TSTRING:
+			{
+				size_t len;
+				const char *str = lua_tolstring(L, idx, &len);
+				return ext_datatable_write_string(writer, str, (unsigned int)len) != 0;
+			}
+		case LUA_TTABLE:
+			{
+				lua_pushvalue(L, idx);
+				lua_rawget(L, filled);
+				if (!lua_isnil(L, -1))
+				{
+					lua_pop(L, 1);
+					lua_pushstring(L, "Cycle table.");
+					return false;
+				}
+				lua_pop(L, 1);
+				lua_pushvalue(L, idx);
+				lua_pushboolean(L, 1);
+				lua_rawset(L, filled);
+				size_t count = lua_objlen(L, idx);
+				if (count == 0)
+				{
+					ext_datatable_write_newobject(writer);
+					for (int i = 0; (i = lua_nextindex(L, idx, i)) != 0; )
+					{
+						if (lua_type(L, -2) != LUA_TSTRING)
+						{
+							lua_pushfstring(L, "Unexpected '%s' key", luaL_typename(L, -2));
+							return false;
+						}
+						size_t len;
+						const char *str = lua_tolstring(L, -2, &len);
+						ext_datatable_write_key(writer, str, (unsigned int)len);
+						if (!WriteValue(L, lua_gettop(L), filled, writer))
+						{
+							return false;
+						}
+						lua_pop(L, 2);
+					}
+					ext_datatable_write_closeobject(writer);
+				}
+				else
+				{
+					/* arrays cannot hold the hash part of a mixed table */
+					for (int i = 0; (i = lua_nextindex(L, idx, i)) != 0; )
+					{
+						lua_Number n = lua_tonumber(L, -2);
+						if (lua_type(L, -2) != LUA_TNUMBER || n < 1 || n > (lua_Number)count || n != (lua_Number)(size_t)n)
+						{
+							lua_pushstring(L, "Mixed table.");
+							return false;
+						}
+						lua_pop(L, 2);
+					}
+					ext_datatable_write_newarray(writer);
+					for (size_t i = 1; i <= count; ++i)
+					{
+						lua_rawgeti(L, idx, (int)i);
+						if (!WriteValue(L, lua_gettop(L), filled, writer))
+						{
+							return false;
+						}
+						lua_pop(L, 1);
+					}
+					ext_datatable_write_closearray(writer);
+				}
+				lua_pushvalue(L, idx);
+				lua_pushnil(L);
+				lua_rawset(L, filled);
+			}
+			return true;
+		default:
+			lua_pushfstring(L, "Unexpected '%s'", luaL_typename(L, idx));
+			return false;
+		}
+	}
+}
+
+namespace external
+{
+	static char ownermetakey;
+	static char nodemetakey;
+
+	static void pushnode(lua_State *L, int owner, DataTable *table, unsigned int value)
+	{
+		switch (ext_datatable_type(table, value))
+		{
+		case DT_FALSE:
+			lua_pushboolean(L, 0);
+			break;
+		case DT_TRUE:
+			lua_pushboolean(L, 1);
+			break;
+		case DT_NUMBER:
+			lua_pushnumber(L, ext_datatable_tonumber(table, value));
+			break;
+		case DT_STRING:
+			{
+				unsigned int len = 0;
+				const char *str = ext_datatable_tostring(table, value, &len);
+				lua_pushlstring(L, str, len);
+			}
+			break;
+		case DT_ARRAY:
+		case DT_OBJECT:
+			{
+				DataNode *node = (DataNode *)lua_newuserdata(L, sizeof(DataNode));
+				node->table = table;
+				node->value = value;
+				lua_pushlightuserdata(L, &nodemetakey);
+				lua_rawget(L, LUA_REGISTRYINDEX);
+				lua_setmetatable(L, -2);
+				lua_pushvalue(L, owner);
+				lua_setfenv(L, -2);
+			}
+			break;
+		default:
+			lua_pushnil(L);
+		}
+	}
+
+	static int pushroot(lua_State *L, DataTable *table)
+	{
+		if (table == NULL)
+		{
+			lua_pushnil(L);
+			lua_pushliteral(L, "invalid data table");
+			return 2;
+		}
+		DataTable **ptr = (DataTable **)lua_newuserdata(L, sizeof(DataTable *));
+		*ptr = table;
+		lua_pushlightuserdata(L, &ownermetakey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		lua_setmetatable(L, -2);
+		pushnode(L, lua_gettop(L), table, ext_datatable_root(table));
+		return 1;
+	}
+
+	static DataNode * checknode(lua_State *L, int idx)
+	{
+		return (DataNode *)checkudata(L, idx, &nodemetakey, "datatable");
+	}
+
+	static int compile_tolua(lua_State *L)
+	{
+		luaL_checkany(L, 1);
+		DataTableWriter *writer = ext_datatable_writer();
+		if (lua_type(L, 1) == LUA_TSTRING)
+		{
+			size_t len;
+			const char *content = lua_tolstring(L, 1, &len);
+			const char *error = NULL;
+			if (!ext_datatable_write_json(writer, content, (unsigned int)len, &error))
+			{
+				ext_datatable_writer_close(writer);
+				lua_pushnil(L);
+				lua_pushstring(L, error);
+				return 2;
+			}
+		}
+		else
+		{
+			lua_settop(L, 1);
+			lua_newtable(L);
+			if (!WriteValue(L, 1, 2, writer))
+			{
+				ext_datatable_writer_close(writer);
+				lua_pushnil(L);
+				lua_insert(L, -2);
+				return 2;
+			}
+		}
+		unsigned int len = ext_datatable_writer_length(writer);
+		char *output = (char *)malloc(len);
+		len = ext_datatable_writer_flush(writer, output, len);
+		ext_datatable_writer_close(writer);
+		lua_pushlstring(L, output, len);
+		free(output);
+		return 1;
+	}
+
+	static int open_tolua(lua_State *L)
+	{
+		if (lua_type(L, 1) == LUA_TSTRING)
+		{
+			return pushroot(L, ext_datatable_open(lua_tostring(L, 1)));
+		}
+		Archive *archive = checkarchive(L, 1);
+		const char *path = luaL_checkstring(L, 2);
+		return pushroot(L, ext_datatable_archive(archive, path));
+	}
+
+	static int load_tolua(lua_State *L)
+	{
+		size_t len;
+		const char *input = luaL_checklstring(L, 1, &len);
+		return pushroot(L, ext_datatable_load(input, (unsigned int)len));
+	}
+
+	static int type_tolua(lua_State *L)
+	{
+		DataNode *node = checknode(L, 1);
+		if (ext_datatable_type(node->table, node->value) == DT_ARRAY)
+		{
+			lua_pushliteral(L, "array");
+		}
+		else
+		{
+			lua_pushliteral(L, "object");
+		}
+		return 1;
+	}
+
+	static int count_tolua(lua_State *L)
+	{
+		DataNode *node = checknode(L, 1);
+		lua_pushnumber(L, ext_datatable_count(node->table, node->value));
+		return 1;
+	}
+
+	static int pairs_iter_tolua(lua_State *L)
+	{
+		DataNode *node = (DataNode *)lua_touserdata(L, lua_upvalueindex(1));
+		unsigned int index = (unsigned int)lua_tointeger(L, lua_upvalueindex(2));
+		if (index >= ext_datatable_count(node->table, node->value))
+		{
+			return 0;
+		}
+		lua_pushinteger(L, index + 1);
+		lua_replace(L, lua_upvalueindex(2));
+		if (ext_datatable_type(node->table, node->value) == DT_ARRAY)
+		{
+			lua_pushinteger(L, index + 1);
+		}
+		else
+		{
+			unsigned int len = 0;
+			const char *key = ext_datatable_key(node->table, node->value, index, &len);
+			if (key == NULL)
+			{
+				return luaL_error(L, "corrupt data table");
+			}
+			lua_pushlstring(L, key, len);
+		}
+		lua_getfenv(L, lua_upvalueindex(1));
+		pushnode(L, lua_gettop(L), node->table, ext_datatable_index(node->table, node->value, index));
+		lua_remove(L, -2);
+		return 2;
+	}
+
+	static int pairs_tolua(lua_State *L)
+	{
+		checknode(L, 1);
+		lua_settop(L, 1);
+		lua_pushinteger(L, 0);
+		lua_pushcclosure(L, pairs_iter_tolua, 2);
+		return 1;
+	}
+
+	static void totable(lua_State *L, int owner, DataTable *table, unsigned int value)
+	{
+		int type = ext_datatable_type(table, value);
+		if (type != DT_ARRAY && type != DT_OBJECT)
+		{
+			pushnode(L, owner, table, value);
+			return;
+		}
+		luaL_checkstack(L, 3, "data table too deep");
+		unsigned int count = ext_datatable_count(table, value);
+		if (type == DT_ARRAY)
+		{
+			lua_createtable(L, (int)count, 0);
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				totable(L, owner, table, ext_datatable_index(table, value, i));
+				lua_rawseti(L, -2, (int)i + 1);
+			}
+		}
+		else
+		{
+			lua_createtable(L, 0, (int)count);
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				unsigned int len = 0;
+				const char *key = ext_datatable_key(table, value, i, &len);
+				if (key == NULL)
+				{
+					luaL_error(L, "corrupt data table");
+				}
+				lua_pushlstring(L, key, len);
+				totable(L, owner, table, ext_datatable_index(table, value, i));
+				lua_rawset(L, -3);
+			}
+		}
+	}
+
+	static int totable_tolua(lua_State *L)
+	{
+		DataNode *node = checknode(L, 1);
+		lua_settop(L, 1);
+		lua_getfenv(L, 1);
+		totable(L, 2, node->table, node->value);
+		return 1;
+	}
+
+	static int index_tolua(lua_State *L)
+	{
+		DataNode *node = (DataNode *)lua_touserdata(L, 1);
+		unsigned int value = 0;
+		switch (lua_type(L, 2))
+		{
+		case LUA_TNUMBER:
+			if (ext_datatable_type(node->table, node->value) == DT_ARRAY)
+			{
+				lua_Number n = lua_tonumber(L, 2);
+				int i = (int)n;
+				if (i >= 1 && (lua_Number)i == n)
+				{
+					value = ext_datatable_index(node->table, node->value, (unsigned int)(i - 1));
+				}
+			}
+			break;
+		case LUA_TSTRING:
+			{
+				size_t len;
+				const char *key = lua_tolstring(L, 2, &len);
+				value = ext_datatable_field(node->table, node->value, key, (unsigned int)len);
+			}
+			break;
+		}
+		if (value == 0)
+		{
+			lua_pushnil(L);
+			return 1;
+		}
+		lua_getfenv(L, 1);
+		pushnode(L, lua_gettop(L), node->table, value);
+		return 1;
+	}
+
+	static int newindex_tolua(lua_State *L)
+	{
+		return luaL_error(L, "attempt to modify a read-only data table");
+	}
+
+	static int len_tolua(lua_State *L)
+	{
+		DataNode *node = (DataNode *)lua_touserdata(L, 1);
+		if (ext_datatable_type(node->table, node->value) == DT_ARRAY)
+		{
+			lua_pushnumber(L, ext_datatable_count(node->table, node->value));
+		}
+		else
+		{
+			lua_pushnumber(L, 0);
+		}
+		return 1;
+	}
+
+	static int gc_tolua(lua_State *L)
+	{
+		DataTable **ptr = (DataTable **)lua_touserdata(L, 1);
+		if (*ptr != NULL)
+		{
+			ext_datatable_close(*ptr);
+			*ptr = NULL;
+		}
+		return 0;
+	}
+
+	int datatable_tolua(lua_State *L)
+	{
+		static const luaL_Reg libs[] = {
+			{"compile", compile_tolua},
+			{"open", open_tolua},
+			{"load", load_tolua},
+			{"type", type_tolua},
+			{"count", count_tolua},
+			{"pairs", pairs_tolua},
+			{"totable", totable_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg metas[] = {
+			{"__index", index_tolua},
+			{"__newindex", newindex_tolua},
+			{"__len", len_tolua},
+			{NULL, NULL}
+		};
+		static const luaL_Reg ownermetas[] = {
+			{"__gc", gc_tolua},
+			{NULL, NULL}
+		};
+		lua_pushvalue(L, LUA_ENVIRONINDEX);
+		luaL_register(L, NULL, libs);
+		lua_pushlightuserdata(L, &nodemetakey);
+		lua_createtable(L, 0, sizeof(metas));
+		luaL_register(L, NULL, metas);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		lua_pushlightuserdata(L, &ownermetakey);
+		lua_createtable(L, 0, sizeof(ownermetas));
+		luaL_register(L, NULL, ownermetas);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		return 1;
+	}
+}
@@ -4,6 +4,7 @@
 #include "base64.h"
 #include "rc4.h"
 #include "loaders.h"
+#include "metrics.h"
 
 namespace
 {
@@ -51,7 +52,7 @@ namespace external
 	static int md5_tolua(lua_State *L)
 	{
 		size_t len;
-		const char *input = luaL_checklstring(L, 1, &len);
+		const char *input = checkbytes(L, 1, &len);
 		unsigned char output[16];
 		ext_md5calc(output, input, (unsigned int)len);
 		lua_pushlstring(L, (const char *)output, sizeof(output));
@@ -61,7 +62,7 @@ namespace external
 	static int xxhash_tolua(lua_State *L)
 	{
 		size_t len;
-		const char *input = luaL_checklstring(L, 1, &len);
+		const char *input = checkbytes(L, 1, &len);
 		double seed = luaL_checknumber(L, 2);
 		if (seed > 0 && seed < 1)
 		{
@@ -86,7 +87,7 @@ namespace external
 	static int base64_encode_tolua(lua_State *L)
 	{
 		size_t len;
-		const char *input = luaL_checklstring(L, 1, &len);
+		const char *input = checkbytes(L, 1, &len);
 		unsigned int outlen = ext_base64_encode(NULL, input, (unsigned int)len);
 		mempool *pool = (mempool *)lua_touserdata(L, lua_upvalueindex(1));
 		char *output = (char *)pool->alloc(outlen);
@@ -99,7 +100,7 @@ namespace external
 	static int base64_decode_tolua(lua_State *L)
 	{
 		size_t len;
-		const char *input = luaL_checklstring(L, 1, &len);
+		const char *input = checkbytes(L, 1, &len);
 		unsigned int outlen = ext_base64_decode(NULL, input, (unsigned int)len);
 		mempool *pool = (mempool *)lua_touserdata(L, lua_upvalueindex(1));
 		char *output = (char *)pool->alloc(outlen);
@@ -112,7 +113,7 @@ namespace external
 	static int rc4_create_tolua(lua_State *L)
 	{
 		size_t len;
-		const char *input = luaL_checklstring(L, 1, &len);
+		const char *input = checkbytes(L, 1, &len);
 		rc4key **ptr = (rc4key **)lua_newuserdata(L, sizeof(rc4key *));
 		lua_pushlightuserdata(L, &rc4metakey);
 		lua_gettable(L, LUA_REGISTRYINDEX);
@@ -125,7 +126,7 @@ namespace external
 	{
 		rc4key **ptr = (rc4key **)checkudata(L, 1, &rc4metakey, "rc4");
 		size_t len;
-		const char *input = luaL_checklstring(L, 2, &len);
+		const char *input = checkbytes(L, 2, &len);
 		if (len == 0)
 		{
 			lua_pushliteral(L, "");
@@ -135,6 +136,7 @@ namespace external
 			mempool *pool = (mempool *)lua_touserdata(L, lua_upvalueindex(1));
 			char *output = (char *)pool->alloc(len);
 			ext_rc4_encode(*ptr, output, input, (unsigned int)len);
+			EXT_COUNT("rc4.encrypted.bytes", len);
 			lua_pushlstring(L, output, len);
 			pool->reduce();
 		}
@@ -145,7 +147,7 @@ namespace external
 	{
 		rc4key **ptr = (rc4key **)checkudata(L, 1, &rc4metakey, "rc4");
 		size_t len;
-		const char *input = luaL_checklstring(L, 2, &len);
+		const char *input = checkbytes(L, 2, &len);
 		if (len == 0)
 		{
 			lua_pushliteral(L, "");
@@ -155,6 +157,7 @@ namespace external
 			mempool *pool = (mempool *)lua_touserdata(L, lua_upvalueindex(1));
 			char *output = (char *)pool->alloc(len);
 			ext_rc4_decode(*ptr, output, input, (unsigned int)len);
+			EXT_COUNT("rc4.decrypted.bytes", len);
 			lua_pushlstring(L, output, len);
 			pool->reduce();
 		}
@@ -8,6 +8,7 @@
 #include "rapidjson/prettywriter.h"
 #include "rapidjson/error/en.h"
 #include "loaders.h"
+#include "metrics.h"
 
 using namespace rapidjson;
 
@@ -124,6 +125,94 @@ namespace
 	};
 }
 
+namespace
+{
+	/* appends a flat array of numbers to a typed array */
+	class ArrayHandler
+	{
+	protected:
+		lua_State *L;
+		external::NumArray *array;
+		int depth;
+
+	public:
+		const char *error;
+
+	public:
+		ArrayHandler(lua_State *L, external::NumArray *array)
+		{
+			this->L = L;
+			this->array = array;
+			this->depth = 0;
+			this->error = NULL;
+		}
+		bool Number(double d)
+		{
+			if (depth != 1)
+			{
+				error = "array of numbers expected";
+				return false;
+			}
+			external::arrayappend(L, array, d);
+			return true;
+		}
+		bool Null()
+		{
+			error = "unexpected null in array";
+			return false;
+		}
+		bool Bool(bool b)
+		{
+			error = "unexpected boolean in array";
+			return false;
+		}
+		bool Int(int i)
+		{
+			return Number(i);
+		}
+		bool Uint(unsigned u)
+		{
+			return Number(u);
+		}
+		bool Double(double d)
+		{
+			return Number(d);
+		}
+		bool String(const char* str, SizeType length, bool copy)
+		{
+			error = "unexpected string in array";
+			return false;
+		}
+		bool StartObject()
+		{
+			error = "unexpected object in array";
+			return false;
+		}
+		bool Key(const char* str, SizeType length, bool copy)
+		{
+			return false;
+		}
+		bool EndObject(SizeType memberCount)
+		{
+			return false;
+		}
+		bool StartArray()
+		{
+			if (++depth != 1)
+			{
+				error = "unexpected nested array";
+				return false;
+			}
+			return true;
+		}
+		bool EndArray(SizeType elementCount)
+		{
+			--depth;
+			return true;
+		}
+	};
+}
+
 namespace
 {
 	struct EscapeUTF8 : public UTF8<>
@@ -209,8 +298,7 @@ namespace
 						return false;
 					}
 					int count = 0;
-					lua_pushnil(L);
-					while (lua_next(L, idx) != 0)
+					for (int i = 0; (i = lua_nextindex(L, idx, i)) != 0; )
 					{
 						if (lua_type(L, -2) == LUA_TSTRING)
 						{
@@ -223,7 +311,7 @@ namespace
 								return false;
 							}
 						}
-						lua_pop(L, 1);
+						lua_pop(L, 2);
 					}
 					if (!writer.EndObject((SizeType)count))
 					{
@@ -265,6 +353,60 @@ namespace
 	}
 }
 
+namespace
+{
+	/* rapidjson output stream appending to a byte buffer */
+	class BufferStream
+	{
+	public:
+		typedef char Ch;
+
+		BufferStream(lua_State *L, external::ByteBuffer *buffer)
+		{
+			this->L = L;
+			this->buffer = buffer;
+		}
+		void Put(Ch c)
+		{
+			if (buffer->len == buffer->cap)
+			{
+				external::growbuffer(L, buffer, 1);
+			}
+			buffer->data[buffer->len++] = c;
+		}
+		void Flush()
+		{
+		}
+
+	private:
+		lua_State *L;
+		external::ByteBuffer *buffer;
+	};
+
+	template <class Stream>
+	bool PrintValue(lua_State *L, Stream &stream, bool pretty, bool escape)
+	{
+		int filled = lua_gettop(L);
+		if (pretty)
+		{
+			if (escape)
+			{
+				PrettyWriter<Stream, UTF8<>, EscapeUTF8> writer(stream);
+				return WriteValue(L, 1, filled, writer);
+			}
+			PrettyWriter<Stream> writer(stream);
+			return WriteValue(L, 1, filled, writer);
+		}
+		if (escape)
+		{
+			Writer<Stream, UTF8<>, EscapeUTF8> writer(stream);
+			return WriteValue(L, 1, filled, writer);
+		}
+		Writer<Stream> writer(stream);
+		return WriteValue(L, 1, filled, writer);
+	}
+}
+
 namespace external
 {
 	static int parse_tolua(lua_State *L)
@@ -273,9 +415,24 @@ namespace external
 		const char *content = luaL_checklstring(L, 1, &len);
 		MemoryStream mstream(content, len);
 		Reader reader;
+		NumArray *array = toarray(L, 2);
+		lua_settop(L, array != NULL ? 2 : 1);
 		int top = lua_gettop(L);
-        TableHandler handle = TableHandler(L);
-		reader.Parse(mstream, handle);
+		const char *error = NULL;
+		EXT_TIMER(start);
+		if (array != NULL)
+		{
+			ArrayHandler handle = ArrayHandler(L, array);
+			reader.Parse(mstream, handle);
+			error = handle.error;
+		}
+		else
+		{
+			TableHandler handle = TableHandler(L);
+			reader.Parse(mstream, handle);
+		}
+		EXT_ELAPSED("json.parse.ns", start);
+		EXT_COUNT("json.parse.bytes", len);
 		if (reader.HasParseError())
 		{
 			lua_settop(L, top);
@@ -293,7 +450,7 @@ namespace external
 					++column;
 				}
 			}
-			lua_pushfstring(L, "(%d, %d):%s", row, column, GetParseError_En(reader.GetParseErrorCode()));
+			lua_pushfstring(L, "(%d, %d):%s", row, column, error != NULL ? error : GetParseError_En(reader.GetParseErrorCode()));
 			return 2;
 		}
 		return 1;
@@ -304,53 +461,34 @@ namespace external
 		luaL_checkany(L, 1);
 		bool pretty = lua_toboolean(L, 2) != 0;
 		bool escape = lua_toboolean(L, 3) != 0;
+		ByteBuffer *output = NULL;
+		if (!lua_isnoneornil(L, 4))
+		{
+			output = tobuffer(L, 4);
+			luaL_argcheck(L, output != NULL, 4, "buffer expected");
+		}
+		lua_settop(L, 4);
 		lua_newtable(L);
-		StringBuffer buffer;
-		if (pretty)
+		if (output != NULL)
 		{
-			if (escape)
+			size_t len = output->len;
+			BufferStream stream(L, output);
+			if (!PrintValue(L, stream, pretty, escape))
 			{
-				PrettyWriter<StringBuffer, UTF8<>, EscapeUTF8> writer(buffer);
-				if (!WriteValue(L, 1, lua_gettop(L), writer))
-				{
-					lua_pushnil(L);
-					lua_insert(L, -2);
-					return 2;
-				}
-			}
-			else
-			{
-				PrettyWriter<StringBuffer> writer(buffer);
-				if (!WriteValue(L, 1, lua_gettop(L), writer))
-				{
-					lua_pushnil(L);
-					lua_insert(L, -2);
-					return 2;
-				}
+				output->len = len;
+				lua_pushnil(L);
+				lua_insert(L, -2);
+				return 2;
 			}
+			lua_pushvalue(L, 4);
+			return 1;
 		}
-		else
+		StringBuffer buffer;
+		if (!PrintValue(L, buffer, pretty, escape))
 		{
-			if (escape)
-			{
-				Writer<StringBuffer, UTF8<>, EscapeUTF8> writer(buffer);
-				if (!WriteValue(L, 1, lua_gettop(L), writer))
-				{
-					lua_pushnil(L);
-					lua_insert(L, -2);
-					return 2;
-				}
-			}
-			else
-			{
-				Writer<StringBuffer> writer(buffer);
-				if (!WriteValue(L, 1, lua_gettop(L), writer))
-				{
-					lua_pushnil(L);
-					lua_insert(L, -2);
-					return 2;
-				}
-			}
+			lua_pushnil(L);
+			lua_insert(L, -2);
+			return 2;
 		}
 		lua_pushlstring(L, buffer.GetString(), buffer.GetSize());
 		return 1;
@@ -4,10 +4,52 @@
 
 namespace external
 {
+	class Archive;
+
+	struct ByteBuffer
+	{
+		char *data;
+		size_t len;
+		size_t cap;
+	};
+
+	enum
+	{
+		NA_FLOAT64,
+		NA_FLOAT32,
+		NA_INT32,
+		NA_INT64,
+		NA_UINT8,
+	};
+
+	struct NumArray
+	{
+		int type;
+		size_t len;
+		size_t cap;
+		void *data;
+	};
+
 	int archive_tolua(lua_State *L);
 	int encrypt_tolua(lua_State *L);
 	int json_tolua(lua_State *L);
 	int sqlite_tolua(lua_State *L);
+	int datatable_tolua(lua_State *L);
+	int buffer_tolua(lua_State *L);
+	int array_tolua(lua_State *L);
+	int metrics_tolua(lua_State *L);
+	int trace_tolua(lua_State *L);
 
 	void * checkudata(lua_State *L, int idx, void *meta, const char *name);
+	Archive * checkarchive(lua_State *L, int idx);
+	/* strings, numbers, buffers and buffer views */
+	const char * tobytes(lua_State *L, int idx, size_t *len);
+	const char * checkbytes(lua_State *L, int idx, size_t *len);
+	ByteBuffer * tobuffer(lua_State *L, int idx);
+	/* make room for len more bytes and return the end of the buffer */
+	char * growbuffer(lua_State *L, ByteBuffer *buffer, size_t len);
+	NumArray * toarray(lua_State *L, int idx);
+	/* append one element, converted to the element type of the array */
+	void arrayappend(lua_State *L, NumArray *array, double d);
+	void arrayappendint(lua_State *L, NumArray *array, long long l);
 }
\ No newline at end of file
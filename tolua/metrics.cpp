@@ -0,0 +1,162 @@
+#define UTIL_CORE
+#include <cstring>
+#include "metrics.h"
+#include "loaders.h"
+
+namespace external
+{
+	static const char *kindnames[] = {"counter", "gauge", "histogram"};
+
+	static ext_metric * checkmetric(lua_State *L, int idx, int kind)
+	{
+		const char *name = luaL_checkstring(L, idx);
+		ext_metric *metric = ext_metrics_get(name, kind);
+		if (metric == NULL)
+		{
+			luaL_error(L, "metric '%s' is not a %s", name, kindnames[kind]);
+		}
+		return metric;
+	}
+
+	/* counters and gauges as numbers, histograms as tables */
+	static void pushmetric(lua_State *L, ext_metric *metric)
+	{
+		if (ext_metrics_kind(metric) != EXT_HISTOGRAM)
+		{
+			lua_pushnumber(L, (lua_Number)ext_metrics_value(metric));
+			return;
+		}
+		static const struct { const char *name; double p; } percentiles[] = {
+			{"p50", 50}, {"p90", 90}, {"p99", 99}, {"p999", 99.9},
+		};
+		ext_histogram histogram;
+		ext_metrics_histogram(metric, &histogram);
+		lua_createtable(L, 0, 9);
+		lua_pushnumber(L, (lua_Number)histogram.count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, (lua_Number)histogram.sum);
+		lua_setfield(L, -2, "sum");
+		lua_pushnumber(L, (lua_Number)histogram.min);
+		lua_setfield(L, -2, "min");
+		lua_pushnumber(L, (lua_Number)histogram.max);
+		lua_setfield(L, -2, "max");
+		lua_pushnumber(L, histogram.count == 0 ? 0 : (lua_Number)histogram.sum / (lua_Number)histogram.count);
+		lua_setfield(L, -2, "mean");
+		for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i)
+		{
+			lua_pushnumber(L, (lua_Number)ext_metrics_percentile(metric, percentiles[i].p));
+			lua_setfield(L, -2, percentiles[i].name);
+		}
+	}
+
+	static ext_metric * findmetric(const char *name)
+	{
+		for (ext_metric *metric = ext_metrics_next(NULL); metric != NULL; metric = ext_metrics_next(metric))
+		{
+			if (strcmp(ext_metrics_name(metric), name) == 0)
+			{
+				return metric;
+			}
+		}
+		return NULL;
+	}
+
+	static int snapshot_tolua(lua_State *L)
+	{
+		lua_newtable(L);
+		for (ext_metric *metric = ext_metrics_next(NULL); metric != NULL; metric = ext_metrics_next(metric))
+		{
+			pushmetric(L, metric);
+			lua_setfield(L, -2, ext_metrics_name(metric));
+		}
+		return 1;
+	}
+
+	static int get_tolua(lua_State *L)
+	{
+		ext_metric *metric = findmetric(luaL_checkstring(L, 1));
+		if (metric == NULL)
+		{
+			return 0;
+		}
+		pushmetric(L, metric);
+		lua_pushstring(L, kindnames[ext_metrics_kind(metric)]);
+		return 2;
+	}
+
+	static int percentile_tolua(lua_State *L)
+	{
+		ext_metric *metric = checkmetric(L, 1, EXT_HISTOGRAM);
+		lua_Number p = luaL_checknumber(L, 2);
+		luaL_argcheck(L, p >= 0 && p <= 100, 2, "percentile out of range");
+		lua_pushnumber(L, (lua_Number)ext_metrics_percentile(metric, p));
+		return 1;
+	}
+
+	static int add_tolua(lua_State *L)
+	{
+		ext_metric *metric = checkmetric(L, 1, EXT_COUNTER);
+		ext_metrics_add(metric, (i64)luaL_optnumber(L, 2, 1));
+		return 0;
+	}
+
+	static int set_tolua(lua_State *L)
+	{
+		ext_metric *metric = checkmetric(L, 1, EXT_GAUGE);
+		ext_metrics_set(metric, (i64)luaL_checknumber(L, 2));
+		return 0;
+	}
+
+	static int record_tolua(lua_State *L)
+	{
+		ext_metric *metric = checkmetric(L, 1, EXT_HISTOGRAM);
+		lua_Number value = luaL_checknumber(L, 2);
+		ext_metrics_record(metric, value > 0 ? (u64)value : 0);
+		return 0;
+	}
+
+	static int reset_tolua(lua_State *L)
+	{
+		if (lua_isnoneornil(L, 1))
+		{
+			ext_metrics_reset(NULL);
+			return 0;
+		}
+		ext_metric *metric = findmetric(luaL_checkstring(L, 1));
+		if (metric != NULL)
+		{
+			ext_metrics_reset(metric);
+		}
+		return 0;
+	}
+
+	static int clock_tolua(lua_State *L)
+	{
+		lua_pushnumber(L, (lua_Number)ext_metrics_clock());
+		return 1;
+	}
+
+	int metrics_tolua(lua_State *L)
+	{
+		static const luaL_Reg libs[] = {
+			{"snapshot", snapshot_tolua},
+			{"get", get_tolua},
+			{"percentile", percentile_tolua},
+			{"add", add_tolua},
+			{"set", set_tolua},
+			{"record", record_tolua},
+			{"reset", reset_tolua},
+			{"clock", clock_tolua},
+			{NULL, NULL}
+		};
+		lua_pushvalue(L, LUA_ENVIRONINDEX);
+		luaL_register(L, NULL, libs);
+#if defined(LUA_USE_METRICS)
+		lua_pushboolean(L, 1);
+#else
+		lua_pushboolean(L, 0);
+#endif
+		lua_setfield(L, -2, "enabled");
+		return 1;
+	}
+}
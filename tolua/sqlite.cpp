@@ -2,11 +2,14 @@
 #include "sqlite3.h"
 #include "loaders.h"
 #include "config.h"
+#include "metrics.h"
+#include "trace.h"
 #include <set>
 #include <vector>
 #include <string>
 #include <string.h>
 #include <float.h>
+#include <limits>
 
 namespace
 {
@@ -191,6 +194,20 @@ namespace
 		lua_settop(L, top);
 		return result ? 0 : 1;
 	}
+
+	int step(sqlite3_stmt *stmt)
+	{
+		EXT_TIMER(start);
+		EXT_SPAN("sqlite", "step");
+		int result = sqlite3_step(stmt);
+		EXT_SPAN_END("step");
+		EXT_ELAPSED("sqlite.step.ns", start);
+		if (result == SQLITE_ROW)
+		{
+			EXT_COUNT("sqlite.rows", 1);
+		}
+		return result;
+	}
 }
 
 namespace external
@@ -392,7 +409,7 @@ namespace external
 			lua_pushliteral(L, "attempt to step a halted statement");
 			return 2;
 		}
-		int result = sqlite3_step(ptr->stmt);
+		int result = step(ptr->stmt);
 		if (result == SQLITE_ROW)
 		{
 			int col = sqlite3_column_count(ptr->stmt);
@@ -479,7 +496,7 @@ namespace external
 	static int rows_iter(lua_State *L)
 	{
 		SQLiteLuaStmt *ptr = (SQLiteLuaStmt *)lua_touserdata(L, lua_upvalueindex(1));
-		int result = sqlite3_step(ptr->stmt);
+		int result = step(ptr->stmt);
 		if (result == SQLITE_ROW)
 		{
 			int col = sqlite3_column_count(ptr->stmt);
@@ -592,6 +609,72 @@ namespace external
 		return 1;
 	}
 
+	static int fill_tolua(lua_State *L)
+	{
+		SQLiteLuaStmt *ptr = (SQLiteLuaStmt *)checkudata(L, 1, &stmtmetakey, "sqlite.stmt");
+		int top = lua_gettop(L);
+		std::vector<NumArray *> arrays;
+		for (int i = 2; i <= top; ++i)
+		{
+			NumArray *array = toarray(L, i);
+			luaL_argcheck(L, array != NULL || lua_isnil(L, i), i, "array expected");
+			arrays.push_back(array);
+		}
+		if (ptr->stmt == NULL)
+		{
+			lua_pushnil(L);
+			lua_pushliteral(L, "closed database");
+			return 2;
+		}
+		if (ptr->iseof)
+		{
+			lua_pushnil(L);
+			lua_pushliteral(L, "attempt to step a halted statement");
+			return 2;
+		}
+		int col = sqlite3_column_count(ptr->stmt);
+		if ((int)arrays.size() > col)
+		{
+			arrays.resize(col);
+		}
+		lua_Integer count = 0;
+		int result;
+		while ((result = step(ptr->stmt)) == SQLITE_ROW)
+		{
+			for (size_t i = 0; i < arrays.size(); ++i)
+			{
+				NumArray *array = arrays[i];
+				if (array == NULL)
+				{
+					continue;
+				}
+				switch (sqlite3_column_type(ptr->stmt, (int)i))
+				{
+				case SQLITE_INTEGER:
+					arrayappendint(L, array, sqlite3_column_int64(ptr->stmt, (int)i));
+					break;
+				case SQLITE_NULL:
+					/* keep the rows aligned: NaN for floats, zero for integers */
+					arrayappend(L, array, array->type == NA_FLOAT64 || array->type == NA_FLOAT32 ? std::numeric_limits<double>::quiet_NaN() : 0);
+					break;
+				default:
+					arrayappend(L, array, sqlite3_column_double(ptr->stmt, (int)i));
+					break;
+				}
+			}
+			++count;
+		}
+		if (result == SQLITE_OK || result == SQLITE_DONE)
+		{
+			ptr->iseof = true;
+			lua_pushinteger(L, count);
+			return 1;
+		}
+		lua_pushnil(L);
+		lua_pushstring(L, sqlite3_errmsg(ptr->root->sqlite));
+		return 2;
+	}
+
 	static int reset_tolua(lua_State *L)
 	{
 		SQLiteLuaStmt *ptr = (SQLiteLuaStmt *)checkudata(L, 1, &stmtmetakey, "sqlite.stmt");
@@ -641,7 +724,7 @@ namespace external
 			lua_pushliteral(L, "closed database");
 			return 2;
 		}
-		switch (lua_type(L, 2))
+		switch (lua_type(L, 3))
 		{
 		case LUA_TNONE:
 		case LUA_TNIL:
@@ -715,8 +798,23 @@ namespace external
 				}
 			}
 			break;
+		case LUA_TUSERDATA:
+			{
+				size_t len;
+				const char *bytes = tobytes(L, 3, &len);
+				if (bytes == NULL)
+				{
+					luaL_argerror(L, 3, "only one of the following types(nil boolean number string buffer)");
+				}
+				if (SQLITE_OK == sqlite3_bind_blob(ptr->stmt, N, bytes, (int)len, SQLITE_TRANSIENT))
+				{
+					lua_pushboolean(L, 1);
+					return 1;
+				}
+			}
+			break;
 		default:
-			luaL_argerror(L, 3, "only one of the following types(nil boolean number string)");
+			luaL_argerror(L, 3, "only one of the following types(nil boolean number string buffer)");
 		}
 		lua_pushboolean(L, 0);
 		lua_pushstring(L, sqlite3_errmsg(ptr->root->sqlite));
@@ -801,6 +899,7 @@ namespace external
 			{"column", column_tolua},
 			{"step", step_tolua},
 			{"rows", rows_tolua},
+			{"fill", fill_tolua},
 			{"reset", reset_tolua},
 			{"clear", clear_tolua},
 			{"bind", bind_tolua},
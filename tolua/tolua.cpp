@@ -35,6 +35,11 @@ void ext_loadlualibs(lua_State *L)
 		{"encrypt",	encrypt_tolua},
 		{"sqlite",	sqlite_tolua},
 		{"json",	json_tolua},
+		{"datatable",	datatable_tolua},
+		{"buffer",	buffer_tolua},
+		{"array",	array_tolua},
+		{"metrics",	metrics_tolua},
+		{"trace",	trace_tolua},
 		{NULL, NULL}
 	};
 	luaL_findtable(L, LUA_REGISTRYINDEX, "_PRELOAD", 0);
@@ -0,0 +1,85 @@
+#define UTIL_CORE
+#include "trace.h"
+#include "loaders.h"
+
+namespace external
+{
+	static int start_tolua(lua_State *L)
+	{
+		lua_Number capacity = luaL_optnumber(L, 1, 65536);
+		luaL_argcheck(L, capacity >= 1 && capacity <= 16777216, 1, "capacity out of range");
+		ext_trace_start((unsigned int)capacity);
+		return 0;
+	}
+
+	static int stop_tolua(lua_State *L)
+	{
+		ext_trace_stop();
+		return 0;
+	}
+
+	static int active_tolua(lua_State *L)
+	{
+		lua_pushboolean(L, ext_trace_active());
+		return 1;
+	}
+
+	static int begin_tolua(lua_State *L)
+	{
+		ext_trace_begin("lua", luaL_checkstring(L, 1));
+		return 0;
+	}
+
+	static int finish_tolua(lua_State *L)
+	{
+		ext_trace_end(luaL_checkstring(L, 1));
+		return 0;
+	}
+
+	/* span(name, f, ...): call f inside a span, which ends even if f raises an error */
+	static int span_tolua(lua_State *L)
+	{
+		const char *name = luaL_checkstring(L, 1);
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		ext_trace_begin("lua", name);
+		int status = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+		ext_trace_end(name);
+		if (status != 0)
+		{
+			return lua_error(L);
+		}
+		return lua_gettop(L) - 1;
+	}
+
+	static void writebuffer(void *ud, const char *data, size_t len)
+	{
+		luaL_addlstring((luaL_Buffer *)ud, data, len);
+	}
+
+	static int flush_tolua(lua_State *L)
+	{
+		luaL_Buffer buffer;
+		luaL_buffinit(L, &buffer);
+		size_t count = ext_trace_flush(writebuffer, &buffer);
+		luaL_pushresult(&buffer);
+		lua_pushnumber(L, (lua_Number)count);
+		return 2;
+	}
+
+	int trace_tolua(lua_State *L)
+	{
+		static const luaL_Reg libs[] = {
+			{"start", start_tolua},
+			{"stop", stop_tolua},
+			{"active", active_tolua},
+			{"begin", begin_tolua},
+			{"finish", finish_tolua},
+			{"span", span_tolua},
+			{"flush", flush_tolua},
+			{NULL, NULL}
+		};
+		lua_pushvalue(L, LUA_ENVIRONINDEX);
+		luaL_register(L, NULL, libs);
+		return 1;
+	}
+}